@@ -0,0 +1,154 @@
+// OmniNative front-end throughput: compiles generated C programs of
+// 10k-100k lines and reports source lines per second.
+//
+//   compile_bench [--lines 10000,50000,100000] [--runs 3] [--opt 0] [--min-lps N]
+//
+// With --min-lps the exit status is 1 when any size compiles slower than N
+// lines per second (best of the runs), so a build can hold the front-end
+// to a target.
+#include "common.h"
+#include "compiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+    // Deterministic pseudo-random numbers for the generator
+    struct Rng {
+        uint64_t state;
+        uint32_t next(uint32_t bound) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            return (uint32_t)(state >> 33) % bound;
+        }
+    };
+
+    // A program of about `lines` lines in the style of student code: many
+    // small functions with locals, loops, arrays, calls to earlier
+    // functions, globals, macros and string literals. Identifiers are long
+    // and share prefixes, as real ones do.
+    std::string generate(size_t lines) {
+        Rng rng{lines};
+        std::string src;
+        src += "#define LIMIT_VALUE 100\n#define SCALE_FACTOR 3\n";
+        size_t count = 0;
+        for (int g = 0; g < 64; g++) {
+            src += "int global_counter_" + std::to_string(g) + " = " + std::to_string(g) + ";\n";
+            count++;
+        }
+        src += "double global_ratio = 1.5;\nchar global_message[32] = \"generated\";\n";
+        count += 4;
+
+        int functions = 0;
+        while (count + 20 < lines) {
+            std::string f = "compute_value_" + std::to_string(functions);
+            src += "int " + f + "(int input_value, int other_value) {\n";
+            src += "    int accumulator_total = input_value;\n";
+            src += "    int loop_index;\n";
+            src += "    int scratch_buffer[16];\n";
+            src += "    double running_average = 0.0;\n";
+            count += 5;
+            int body = 6 + (int)rng.next(10);
+            for (int s = 0; s < body; s++) {
+                switch (rng.next(6)) {
+                    case 0:
+                        src += "    for (loop_index = 0; loop_index < 16; loop_index++) {\n";
+                        src += "        scratch_buffer[loop_index] = loop_index * SCALE_FACTOR + accumulator_total;\n";
+                        src += "    }\n";
+                        count += 3;
+                        break;
+                    case 1:
+                        src += "    if (accumulator_total > LIMIT_VALUE && other_value != 0) {\n";
+                        src += "        accumulator_total = accumulator_total % LIMIT_VALUE + other_value;\n";
+                        src += "    } else {\n";
+                        src += "        accumulator_total += global_counter_" + std::to_string(rng.next(64)) + ";\n";
+                        src += "    }\n";
+                        count += 5;
+                        break;
+                    case 2:
+                        if (functions > 0) {
+                            src += "    accumulator_total += compute_value_" + std::to_string(rng.next(functions)) +
+                                   "(accumulator_total, loop_index);\n";
+                        } else {
+                            src += "    accumulator_total = accumulator_total * 2 + 1;\n";
+                        }
+                        count++;
+                        break;
+                    case 3:
+                        src += "    running_average = (running_average + accumulator_total) / 2.0 * global_ratio;\n";
+                        count++;
+                        break;
+                    case 4:
+                        src += "    while (other_value > 0) { other_value = other_value - 1; accumulator_total ^= other_value << 1; }\n";
+                        count++;
+                        break;
+                    default:
+                        src += "    if (accumulator_total < 0) printf(\"negative %d in " + f + "\\n\", accumulator_total);\n";
+                        count++;
+                        break;
+                }
+            }
+            src += "    return accumulator_total + (int)running_average + scratch_buffer[3];\n}\n\n";
+            count += 3;
+            functions++;
+        }
+        src += "int main() {\n    int result = 0;\n";
+        for (int i = 0; i < std::min(functions, 8); i++) {
+            src += "    result += compute_value_" + std::to_string(i) + "(" + std::to_string(i) + ", 2);\n";
+        }
+        src += "    printf(\"%d\\n\", result);\n    return 0;\n}\n";
+        return src;
+    }
+
+    std::vector<size_t> parseSizes(const char* list) {
+        std::vector<size_t> sizes;
+        for (const char* s = list; *s;) {
+            sizes.push_back((size_t)std::strtoull(s, nullptr, 10));
+            const char* comma = std::strchr(s, ',');
+            if (!comma) break;
+            s = comma + 1;
+        }
+        return sizes;
+    }
+
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes = {10000, 25000, 50000, 100000};
+    int runs = 3;
+    double minLps = 0;
+    OmniNative::CompileOptions options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!std::strcmp(argv[i], "--lines")) sizes = parseSizes(argv[i + 1]);
+        else if (!std::strcmp(argv[i], "--runs")) runs = std::max(1, std::atoi(argv[i + 1]));
+        else if (!std::strcmp(argv[i], "--opt")) options.optLevel = std::atoi(argv[i + 1]);
+        else if (!std::strcmp(argv[i], "--min-lps")) minLps = std::atof(argv[i + 1]);
+        else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    bool slow = false;
+    std::printf("%10s %10s %12s %14s\n", "lines", "bytes", "best ms", "lines/s");
+    for (size_t target : sizes) {
+        std::string src = generate(target);
+        size_t lines = (size_t)std::count(src.begin(), src.end(), '\n');
+        double best = 1e300;
+        for (int r = 0; r < runs; r++) {
+            auto started = std::chrono::steady_clock::now();
+            OmniNative::Program prog = OmniNative::compileSource(src, options);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+            best = std::min(best, ms);
+        }
+        double lps = lines / (best / 1000.0);
+        std::printf("%10zu %10zu %12.2f %14.0f\n", lines, src.size(), best, lps);
+        if (minLps > 0 && lps < minLps) slow = true;
+    }
+    if (slow) std::printf("below the target of %.0f lines/s\n", minLps);
+    return slow ? 1 : 0;
+}
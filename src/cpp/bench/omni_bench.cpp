@@ -0,0 +1,383 @@
+// Native benchmarks for the three WASM modules: OmniDiff on generated
+// corpora of growing size and edit density, OmniMath expression
+// evaluation and solve suites, and OmniNative compiling and running VM
+// program kernels. Each case reports its throughput, per-call latency
+// percentiles and the process's peak RSS so far.
+//
+//   omni_bench [--filter text] [--min-time 0.5] [--save file] [--compare file] [--tolerance 0.15]
+//
+// --save writes each case's throughput to `file`. --compare reads such a
+// file and exits 1 when a case is slower than it by more than the
+// tolerance, so a build can stop a regression before it is deployed.
+#include "common.h"
+#include "compiler.h"
+#include "vm.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+namespace OmniMath {
+    struct SolveStats;
+    struct IntegrateStats;
+}
+
+// The C API of the modules, as JS calls it
+extern "C" {
+    const char* compute_diff(const char* oldText, const char* newText);
+    double solve_equation(const char* eq_ptr);
+    double integrate_expression(const char* expression, double a, double b, double tolerance,
+                                OmniMath::IntegrateStats* stats);
+    int solve_sweep(const char* expression, const char* param, const double* values, int n, double* out);
+}
+
+namespace {
+
+    // Deterministic pseudo-random numbers for the generators
+    struct Rng {
+        uint64_t state;
+        uint32_t next(uint32_t bound) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            return (uint32_t)(state >> 33) % bound;
+        }
+        double unit() { return next(1u << 30) / (double)(1u << 30); }
+    };
+
+    // One benchmark: each call of `run` is timed as one sample and returns
+    // the work it did, in `unit`s
+    struct Case {
+        std::string name;
+        std::string unit;
+        std::function<double()> run;
+    };
+
+    struct Result {
+        std::string name;
+        std::string unit;
+        double throughput = 0;      // Units per second
+        double p50 = 0, p90 = 0, p99 = 0;   // Milliseconds per call
+        size_t samples = 0;
+        long peakRssKb = 0;
+    };
+
+    long peakRssKb() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;   // Kilobytes on Linux
+    }
+
+    double percentile(const std::vector<double>& sorted, double p) {
+        size_t rank = (size_t)(p * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    // One untimed call, then samples until `minTime` seconds have passed
+    // (at least 5 and at most 100000 of them)
+    Result measure(const Case& c, double minTime) {
+        using Clock = std::chrono::steady_clock;
+        c.run();
+        std::vector<double> latencies;
+        double units = 0, total = 0;
+        while ((total < minTime || latencies.size() < 5) && latencies.size() < 100000) {
+            auto started = Clock::now();
+            units += c.run();
+            double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+            latencies.push_back(seconds * 1000.0);
+            total += seconds;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        Result r;
+        r.name = c.name;
+        r.unit = c.unit;
+        r.throughput = total > 0 ? units / total : 0;
+        r.p50 = percentile(latencies, 0.50);
+        r.p90 = percentile(latencies, 0.90);
+        r.p99 = percentile(latencies, 0.99);
+        r.samples = latencies.size();
+        r.peakRssKb = peakRssKb();
+        return r;
+    }
+
+    // ---------- OmniDiff ----------
+
+    std::string sourceLine(Rng& rng) {
+        static const char* const verbs[] = {"compute", "update", "render", "parse", "merge", "flush"};
+        return "    " + std::string(verbs[rng.next(6)]) + "_value_" + std::to_string(rng.next(500)) + "(state, " +
+               std::to_string(rng.next(1000)) + ");  // step " + std::to_string(rng.next(100));
+    }
+
+    // A text of `lines` lines and an edited copy in which about `density`
+    // of the lines were changed, deleted or followed by a new one
+    std::pair<std::string, std::string> diffCorpus(size_t lines, double density) {
+        Rng rng{lines * 31 + (uint64_t)(density * 1000)};
+        std::string before, after;
+        for (size_t i = 0; i < lines; i++) {
+            std::string line = sourceLine(rng);
+            before += line + "\n";
+            if (rng.unit() >= density) {
+                after += line + "\n";
+                continue;
+            }
+            switch (rng.next(3)) {
+                case 0: after += sourceLine(rng) + "\n"; break;
+                case 1: break;
+                default: after += line + "\n" + sourceLine(rng) + "\n"; break;
+            }
+        }
+        return {before, after};
+    }
+
+    void addDiffCases(std::vector<Case>& cases) {
+        for (size_t lines : {200, 1000, 2500}) {
+            for (double density : {0.01, 0.1, 0.5}) {
+                auto corpus = std::make_shared<std::pair<std::string, std::string>>(diffCorpus(lines, density));
+                double work = (double)(std::count(corpus->first.begin(), corpus->first.end(), '\n') +
+                                       std::count(corpus->second.begin(), corpus->second.end(), '\n'));
+                char name[64];
+                std::snprintf(name, sizeof(name), "diff/%zu-lines/%g%%-edits", lines, density * 100);
+                cases.push_back({name, "lines", [corpus, work] {
+                    const char* out = compute_diff(corpus->first.c_str(), corpus->second.c_str());
+                    std::free((void*)out);
+                    return work;
+                }});
+            }
+        }
+    }
+
+    // ---------- OmniMath ----------
+
+    // A sum of `terms` generated terms in x, for the evaluation suite
+    std::string expression(size_t terms) {
+        static const char* const functions[] = {"sin", "cos", "exp", "sqrt", "log"};
+        Rng rng{terms};
+        std::string e;
+        for (size_t i = 0; i < terms; i++) {
+            if (i > 0) e += rng.next(2) ? " + " : " - ";
+            char coef[32];
+            std::snprintf(coef, sizeof(coef), "%.2f", 0.1 + rng.unit());
+            switch (rng.next(3)) {
+                case 0: e += std::string(coef) + "*x^" + std::to_string(1 + rng.next(4)); break;
+                case 1: e += std::string(coef) + "*" + functions[rng.next(5)] + "(x + " + std::to_string(1 + rng.next(9)) + ")"; break;
+                default: e += "(" + std::string(coef) + " + x) / (x + " + std::to_string(2 + rng.next(7)) + ")"; break;
+            }
+        }
+        return e;
+    }
+
+    void addMathCases(std::vector<Case>& cases) {
+        // Evaluation: adaptive quadrature calls the expression thousands
+        // of times, so this is dominated by evaluating it
+        for (size_t terms : {4, 32, 256}) {
+            auto e = std::make_shared<std::string>(expression(terms));
+            cases.push_back({"math/eval/" + std::to_string(terms) + "-terms", "integrals", [e] {
+                volatile double v = integrate_expression(e->c_str(), 0.0, 4.0, 1e-8, nullptr);
+                (void)v;
+                return 1.0;
+            }});
+        }
+
+        static const char* const equations[] = {
+            "x^3 - 2*x - 5 = 0", "sin(x) = 0.5", "exp(x) = 10", "x^2 = 2", "log(x) = 1",
+            "cos(x) = x", "x^5 - x - 1 = 0", "sqrt(x) + x = 6", "x*exp(x) = 3", "tan(x) = 1",
+            "x^4 - 10*x^2 + 9 = 0", "(x - 1)/(x + 2) = 0.25", "exp(-x) = x", "x^3 + x^2 + x = 100"
+        };
+        cases.push_back({"math/solve", "solves", [] {
+            volatile double sum = 0;
+            for (const char* eq : equations) sum = sum + solve_equation(eq);
+            return (double)(sizeof(equations) / sizeof(equations[0]));
+        }});
+
+        auto values = std::make_shared<std::vector<double>>();
+        for (int i = 0; i < 4096; i++) values->push_back(1.0 + i * 0.01);
+        cases.push_back({"math/sweep", "roots", [values] {
+            std::vector<double> roots(values->size());
+            solve_sweep("x^3 + a*x - 10 = 0", "a", values->data(), (int)values->size(), roots.data());
+            return (double)roots.size();
+        }});
+    }
+
+    // ---------- OmniNative ----------
+
+    struct Kernel {
+        const char* name;
+        const char* source;
+    };
+
+    const Kernel KERNELS[] = {
+        {"fib", R"(
+int fib(int n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+int main() { printf("%d\n", fib(24)); return 0; }
+)"},
+        {"sieve", R"(
+char composite[200001];
+int main() {
+    int count = 0;
+    for (int i = 2; i <= 200000; i++) {
+        if (composite[i]) continue;
+        count++;
+        for (int j = i + i; j <= 200000; j += i) composite[j] = 1;
+    }
+    printf("%d\n", count);
+    return 0;
+}
+)"},
+        {"matmul", R"(
+double a[48][48];
+double b[48][48];
+double c[48][48];
+int main() {
+    for (int i = 0; i < 48; i++)
+        for (int j = 0; j < 48; j++) { a[i][j] = i + j * 0.5; b[i][j] = i - j; }
+    for (int i = 0; i < 48; i++)
+        for (int j = 0; j < 48; j++) {
+            double sum = 0;
+            for (int k = 0; k < 48; k++) sum += a[i][k] * b[k][j];
+            c[i][j] = sum;
+        }
+    printf("%f\n", c[47][47]);
+    return 0;
+}
+)"},
+        {"sort", R"(
+int data[4000];
+void quicksort(int lo, int hi) {
+    if (lo >= hi) return;
+    int pivot = data[(lo + hi) / 2];
+    int i = lo, j = hi;
+    while (i <= j) {
+        while (data[i] < pivot) i++;
+        while (data[j] > pivot) j--;
+        if (i <= j) { int t = data[i]; data[i] = data[j]; data[j] = t; i++; j--; }
+    }
+    quicksort(lo, j);
+    quicksort(i, hi);
+}
+int main() {
+    int seed = 12345;
+    for (int i = 0; i < 4000; i++) { seed = (seed * 1103515245 + 12345) % 2147483647; data[i] = seed % 100000; }
+    quicksort(0, 3999);
+    printf("%d %d\n", data[0], data[3999]);
+    return 0;
+}
+)"},
+        {"heap", R"(
+int main() {
+    int* blocks[256];
+    long total = 0;
+    for (int round = 0; round < 40; round++) {
+        for (int i = 0; i < 256; i++) {
+            blocks[i] = malloc((i % 32 + 1) * 8);
+            blocks[i][0] = i + round;
+        }
+        for (int i = 0; i < 256; i++) { total += blocks[i][0]; free(blocks[i]); }
+    }
+    printf("%ld\n", total);
+    return 0;
+}
+)"},
+        {"print", R"(
+int main() {
+    for (int i = 0; i < 3000; i++) printf("line %d: value %d, ratio %.3f\n", i, i * i, i / 7.0);
+    return 0;
+}
+)"},
+    };
+
+    void addVmCases(std::vector<Case>& cases) {
+        OmniNative::CompileOptions options;
+        auto vm = std::make_shared<OmniNative::VirtualMachine>();
+        for (const Kernel& k : KERNELS) {
+            std::string source = k.source;
+            double lines = (double)std::count(source.begin(), source.end(), '\n');
+            cases.push_back({std::string("vm/compile/") + k.name, "lines", [source, options, lines] {
+                OmniNative::Program prog = OmniNative::compileSource(source, options);
+                return lines;
+            }});
+
+            auto prog = std::make_shared<OmniNative::Program>(OmniNative::compileSource(source, options));
+            vm->run(*prog);
+            std::string out = vm->getOutput();
+            if (out.empty() || out.find("[ERROR]") != std::string::npos) {
+                std::fprintf(stderr, "kernel %s failed: %s\n", k.name, out.c_str());
+                std::exit(2);
+            }
+            cases.push_back({std::string("vm/run/") + k.name, "instructions", [vm, prog] {
+                vm->run(*prog);
+                return (double)vm->getCycles();
+            }});
+        }
+    }
+
+    std::map<std::string, double> readBaseline(const char* path) {
+        std::map<std::string, double> baseline;
+        std::ifstream in(path);
+        std::string name;
+        double throughput;
+        while (in >> name >> throughput) baseline[name] = throughput;
+        return baseline;
+    }
+
+}
+
+int main(int argc, char** argv) {
+    const char* filter = "";
+    const char* savePath = nullptr;
+    const char* comparePath = nullptr;
+    double minTime = 0.5;
+    double tolerance = 0.15;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!std::strcmp(argv[i], "--filter")) filter = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--min-time")) minTime = std::atof(argv[i + 1]);
+        else if (!std::strcmp(argv[i], "--save")) savePath = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--compare")) comparePath = argv[i + 1];
+        else if (!std::strcmp(argv[i], "--tolerance")) tolerance = std::atof(argv[i + 1]);
+        else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    // Smallest footprint first, as peak RSS only ever rises
+    std::vector<Case> cases;
+    addVmCases(cases);
+    addMathCases(cases);
+    addDiffCases(cases);
+
+    std::map<std::string, double> baseline;
+    if (comparePath) baseline = readBaseline(comparePath);
+
+    std::vector<Result> results;
+    bool regressed = false;
+    std::printf("%-28s %16s %-12s %9s %9s %9s %8s %10s\n", "case", "throughput", "unit/s", "p50 ms", "p90 ms",
+                "p99 ms", "samples", "peak RSS");
+    for (const Case& c : cases) {
+        if (!std::strstr(c.name.c_str(), filter)) continue;
+        Result r = measure(c, minTime);
+        std::printf("%-28s %16.0f %-12s %9.3f %9.3f %9.3f %8zu %7.1f MB", r.name.c_str(), r.throughput,
+                    r.unit.c_str(), r.p50, r.p90, r.p99, r.samples, r.peakRssKb / 1024.0);
+        auto base = baseline.find(r.name);
+        if (base != baseline.end() && base->second > 0) {
+            double change = r.throughput / base->second - 1.0;
+            bool slow = change < -tolerance;
+            std::printf("  %+6.1f%%%s", change * 100, slow ? "  REGRESSED" : "");
+            regressed |= slow;
+        }
+        std::printf("\n");
+        std::fflush(stdout);
+        results.push_back(r);
+    }
+
+    if (savePath) {
+        std::ofstream out(savePath);
+        for (const Result& r : results) out << r.name << " " << r.throughput << "\n";
+    }
+    if (regressed) std::printf("slower than %s by more than %.0f%%\n", comparePath, tolerance * 100);
+    return regressed ? 1 : 0;
+}
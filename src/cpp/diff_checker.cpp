@@ -1,12 +1,15 @@
 #include <algorithm>
 #include <cstdlib>
 #include <cstring>
-#include <emscripten.h>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+
 // Myers Diff Algorithm for WASM
 // Returns a JSON-like string with diff operations
 
@@ -1,18 +1,31 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <queue>
 #include <sstream>
 #include <string>
 #include <vector>
 
+// Worker threads are only available natively or in pthread-enabled WASM builds
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define OMNIMATH_THREADS 1
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
 namespace OmniMath {
 
 enum TokenType {
   NUMBER,
   VARIABLE,
+  PARAM,
   PLUS,
   MINUS,
   MULTIPLY,
@@ -39,9 +52,11 @@ struct Token {
 class Lexer {
   std::string input;
   size_t pos = 0;
+  std::vector<std::string> params; // Named parameters, lexed as PARAM tokens
 
 public:
-  Lexer(const std::string &text) : input(text) {}
+  Lexer(const std::string &text, const std::vector<std::string> &names = {})
+      : input(text), params(names) {}
 
   Token next() {
     while (pos < input.length() && std::isspace(input[pos]))
@@ -61,7 +76,8 @@ public:
 
     if (std::isalpha(c)) {
       size_t start = pos; // Note: 'pos' is member variable
-      while (pos < input.length() && std::isalpha(input[pos]))
+      while (pos < input.length() &&
+             (std::isalnum(input[pos]) || input[pos] == '_'))
         pos++;
       std::string id = input.substr(start, pos - start);
       if (id == "sin")
@@ -76,6 +92,9 @@ public:
         return {FUNC_EXP, id, 0};
       if (id == "sqrt")
         return {FUNC_SQRT, id, 0};
+      for (size_t i = 0; i < params.size(); ++i)
+        if (id == params[i])
+          return {PARAM, id, (double)i};
       return {VARIABLE, id, 0};
     }
 
@@ -103,19 +122,50 @@ public:
 };
 
 // --- AST ---
+// Batched evaluation walks the tree once per block of points instead of once
+// per point; nodes work on fixed-size chunks so no heap scratch is needed.
+const size_t BATCH_CHUNK = 32;
+
 struct Node {
   virtual ~Node() = default;
-  virtual double evaluate(double x) const = 0;
+  // `params` holds the current values of named parameters (may be null
+  // when the expression was parsed without any)
+  virtual double evaluate(double x, const double *params) const = 0;
+  virtual void evaluateBatch(const double *xs, double *out, size_t n,
+                             const double *params) const {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = evaluate(xs[i], params);
+  }
 };
 
 struct NumberNode : Node {
   double val;
   NumberNode(double v) : val(v) {}
-  double evaluate(double) const override { return val; }
+  double evaluate(double, const double *) const override { return val; }
+  void evaluateBatch(const double *, double *out, size_t n,
+                     const double *) const override {
+    std::fill(out, out + n, val);
+  }
 };
 
 struct VariableNode : Node {
-  double evaluate(double x) const override { return x; }
+  double evaluate(double x, const double *) const override { return x; }
+  void evaluateBatch(const double *xs, double *out, size_t n,
+                     const double *) const override {
+    std::copy(xs, xs + n, out);
+  }
+};
+
+struct ParamNode : Node {
+  size_t index;
+  ParamNode(size_t i) : index(i) {}
+  double evaluate(double, const double *params) const override {
+    return params ? params[index] : 0;
+  }
+  void evaluateBatch(const double *, double *out, size_t n,
+                     const double *params) const override {
+    std::fill(out, out + n, params ? params[index] : 0);
+  }
 };
 
 struct BinaryNode : Node {
@@ -126,9 +176,7 @@ struct BinaryNode : Node {
     delete left;
     delete right;
   }
-  double evaluate(double x) const override {
-    double l = left->evaluate(x);
-    double r = right->evaluate(x);
+  static double apply(TokenType op, double l, double r) {
     switch (op) {
     case PLUS:
       return l + r;
@@ -144,15 +192,51 @@ struct BinaryNode : Node {
       return 0;
     }
   }
+  double evaluate(double x, const double *params) const override {
+    double l = left->evaluate(x, params);
+    double r = right->evaluate(x, params);
+    return apply(op, l, r);
+  }
+  void evaluateBatch(const double *xs, double *out, size_t n,
+                     const double *params) const override {
+    double rhs[BATCH_CHUNK];
+    for (size_t base = 0; base < n; base += BATCH_CHUNK) {
+      size_t m = std::min(BATCH_CHUNK, n - base);
+      left->evaluateBatch(xs + base, out + base, m, params);
+      right->evaluateBatch(xs + base, rhs, m, params);
+      double *o = out + base;
+      switch (op) {
+      case PLUS:
+        for (size_t i = 0; i < m; ++i)
+          o[i] += rhs[i];
+        break;
+      case MINUS:
+        for (size_t i = 0; i < m; ++i)
+          o[i] -= rhs[i];
+        break;
+      case MULTIPLY:
+        for (size_t i = 0; i < m; ++i)
+          o[i] *= rhs[i];
+        break;
+      case DIVIDE:
+        for (size_t i = 0; i < m; ++i)
+          o[i] /= rhs[i];
+        break;
+      default:
+        for (size_t i = 0; i < m; ++i)
+          o[i] = apply(op, o[i], rhs[i]);
+        break;
+      }
+    }
+  }
 };
 
 struct FuncNode : Node {
   Node *arg;
   TokenType func;
-  FuncNode(TokenType f, Node *a) : func(f), arg(a) {}
+  FuncNode(TokenType f, Node *a) : arg(a), func(f) {}
   ~FuncNode() { delete arg; }
-  double evaluate(double x) const override {
-    double v = arg->evaluate(x);
+  static double apply(TokenType func, double v) {
     switch (func) {
     case FUNC_SIN:
       return std::sin(v);
@@ -170,6 +254,15 @@ struct FuncNode : Node {
       return 0;
     }
   }
+  double evaluate(double x, const double *params) const override {
+    return apply(func, arg->evaluate(x, params));
+  }
+  void evaluateBatch(const double *xs, double *out, size_t n,
+                     const double *params) const override {
+    arg->evaluateBatch(xs, out, n, params);
+    for (size_t i = 0; i < n; ++i)
+      out[i] = apply(func, out[i]);
+  }
 };
 
 class Parser {
@@ -177,7 +270,10 @@ class Parser {
   Token current;
 
 public:
-  Parser(const std::string &text) : lexer(text) { current = lexer.next(); }
+  Parser(const std::string &text, const std::vector<std::string> &params = {})
+      : lexer(text, params) {
+    current = lexer.next();
+  }
 
   Node *parseExpression() {
     Node *lhs = parseTerm();
@@ -217,6 +313,11 @@ public:
       current = lexer.next();
       return new VariableNode();
     }
+    if (current.type == PARAM) {
+      Node *n = new ParamNode((size_t)current.numValue);
+      current = lexer.next();
+      return n;
+    }
     if (current.type >= FUNC_SIN && current.type <= FUNC_SQRT) {
       TokenType fn = current.type;
       current = lexer.next();
@@ -239,35 +340,458 @@ public:
   }
 };
 
-// Newton-Raphson Solver
-double solve(const std::string &equation) {
-  Parser parser(equation);
-  Node *ast = parser.parseExpression();
+// Newton-Raphson tuning knobs (tune these from SolveStats data)
+const int MAX_ITER = 100;
+const double EPSILON = 1e-7;
+const double DERIV_STEP = 1e-5;
+const double MIN_DERIVATIVE = 1e-9;
+
+// Why the Newton loop stopped
+enum ConvergenceReason : int32_t {
+  REASON_CONVERGED = 0,
+  REASON_ZERO_DERIVATIVE = 1,
+  REASON_MAX_ITERATIONS = 2,
+  REASON_NAN = 3
+};
+
+// Solver telemetry. Plain-old-data with a fixed layout so JS can read it
+// straight out of the WASM heap (doubles first, then 32-bit ints).
+struct SolveStats {
+  double residual;    // |f(x)| at the returned root
+  double wallTimeMs;  // Parse + solve time
+  int32_t iterations; // Newton steps taken
+  int32_t functionEvals;
+  int32_t derivativeEvals; // Each numerical derivative costs one extra f eval
+  int32_t reason;          // ConvergenceReason
+  int32_t traceLength;     // Entries written to the trace buffer
+  int32_t reserved;
+};
+
+// One Newton iterate, recorded when a trace buffer is supplied
+struct TracePoint {
+  double x;
+  double fx;
+};
 
-  // Newton method
-  double x = 1.0; // Initial guess
-  const int MAX_ITER = 100;
-  const double EPSILON = 1e-7;
+// Newton-Raphson iteration from x0. Accumulates into `st` (iterations,
+// evaluations, reason, residual); timing is left to the caller.
+double newton(const Node *ast, double x, const double *params, SolveStats &st,
+              TracePoint *trace = nullptr, int traceCapacity = 0) {
+  st.reason = REASON_MAX_ITERATIONS;
+  double fx = 0;
+  bool haveFx = false;
 
   for (int i = 0; i < MAX_ITER; ++i) {
-    double fx = ast->evaluate(x);
-    if (std::abs(fx) < EPSILON)
+    fx = ast->evaluate(x, params);
+    st.functionEvals++;
+    haveFx = true;
+
+    if (trace && st.traceLength < traceCapacity)
+      trace[st.traceLength++] = {x, fx};
+
+    if (std::isnan(fx) || !std::isfinite(x)) {
+      st.reason = REASON_NAN;
       break;
+    }
+    if (std::abs(fx) < EPSILON) {
+      st.reason = REASON_CONVERGED;
+      break;
+    }
 
     // Numerical derivative
-    double h = 1e-5;
-    double fxh = ast->evaluate(x + h);
-    double dfx = (fxh - fx) / h;
+    double fxh = ast->evaluate(x + DERIV_STEP, params);
+    st.derivativeEvals++;
+    double dfx = (fxh - fx) / DERIV_STEP;
 
-    if (std::abs(dfx) < 1e-9)
-      break; // Zero derivative
+    if (std::isnan(dfx)) {
+      st.reason = REASON_NAN;
+      break;
+    }
+    if (std::abs(dfx) < MIN_DERIVATIVE) {
+      st.reason = REASON_ZERO_DERIVATIVE;
+      break;
+    }
 
     x = x - fx / dfx;
+    st.iterations++;
+    haveFx = false;
+  }
+
+  // The last step moved x without re-evaluating; measure the real residual
+  if (!haveFx) {
+    fx = ast->evaluate(x, params);
+    st.functionEvals++;
+    if (std::isnan(fx))
+      st.reason = REASON_NAN;
+  }
+  st.residual = std::abs(fx);
+  return x;
+}
+
+// Newton-Raphson Solver
+// `stats` and `trace` are optional; the trace is bounded by `traceCapacity`
+double solve(const std::string &equation, SolveStats *stats = nullptr,
+             TracePoint *trace = nullptr, int traceCapacity = 0) {
+  auto start = std::chrono::steady_clock::now();
+
+  Parser parser(equation);
+  Node *ast = parser.parseExpression();
+
+  SolveStats local = {};
+  double x = newton(ast, 1.0, nullptr, local, trace, traceCapacity);
+
+  if (stats) {
+    local.wallTimeMs = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    *stats = local;
   }
 
   delete ast;
   return x;
 }
+
+// --- Parallel helpers ---
+inline unsigned workerCount() {
+#ifdef OMNIMATH_THREADS
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+#else
+  return 1;
+#endif
+}
+
+// Runs fn(begin, end) over [0, n) split into contiguous chunks, one per
+// worker. Falls back to a single call when threads are unavailable or the
+// work is too small to amortise thread start-up.
+template <typename Fn>
+void parallelChunks(size_t n, size_t minPerWorker, Fn fn) {
+  size_t workers = std::min<size_t>(workerCount(), n / std::max<size_t>(minPerWorker, 1));
+#ifdef OMNIMATH_THREADS
+  if (workers > 1) {
+    std::vector<std::thread> pool;
+    size_t chunk = (n + workers - 1) / workers;
+    for (size_t begin = chunk; begin < n; begin += chunk)
+      pool.emplace_back(fn, begin, std::min(n, begin + chunk));
+    fn(0, std::min(n, chunk));
+    for (auto &t : pool)
+      t.join();
+    return;
+  }
+#endif
+  (void)workers;
+  fn(0, n);
+}
+
+// Helper threads that split each run() call with the caller. They start on
+// the first run() and live as long as the group, so a loop of small batches
+// pays for thread start-up once.
+class WorkerGroup {
+public:
+  explicit WorkerGroup(size_t count) {
+#ifdef OMNIMATH_THREADS
+    helpers = count;
+#else
+    (void)count;
+#endif
+  }
+
+  ~WorkerGroup() {
+#ifdef OMNIMATH_THREADS
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads)
+      t.join();
+#endif
+  }
+
+  // Runs fn(begin, end) over [0, n) in contiguous chunks, the first on the
+  // calling thread, and returns once every chunk is done
+  void run(size_t n, const std::function<void(size_t, size_t)> &fn) {
+#ifdef OMNIMATH_THREADS
+    if (helpers > 0 && n > 1) {
+      for (size_t i = threads.size(); i < helpers; ++i)
+        threads.emplace_back([this, i] { serve(i + 1); });
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        jobSize = n;
+        chunk = (n + threads.size()) / (threads.size() + 1);
+        pending = threads.size();
+        generation++;
+      }
+      wake.notify_all();
+      fn(0, std::min(n, chunk));
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [&] { return pending == 0; });
+      return;
+    }
+#endif
+    fn(0, n);
+  }
+
+private:
+#ifdef OMNIMATH_THREADS
+  void serve(size_t index) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      size_t begin = std::min(jobSize, index * chunk);
+      size_t end = std::min(jobSize, begin + chunk);
+      const std::function<void(size_t, size_t)> *fn = job;
+      lock.unlock();
+      if (begin < end)
+        (*fn)(begin, end);
+      lock.lock();
+      if (--pending == 0)
+        finished.notify_one();
+    }
+  }
+
+  size_t helpers = 0;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake, finished;
+  const std::function<void(size_t, size_t)> *job = nullptr;
+  size_t jobSize = 0, chunk = 0, pending = 0;
+  uint64_t generation = 0;
+  bool stopping = false;
+#endif
+};
+
+// --- Adaptive Gauss-Kronrod (G7/K15) quadrature ---
+// Kronrod abscissae on [-1, 1]; odd indices are the embedded Gauss points
+const double XGK[8] = {0.991455371120812639206854697526329,
+                       0.949107912342758524526189684047851,
+                       0.864864423359769072789712788640926,
+                       0.741531185599394439863864773280788,
+                       0.586087235467691130294144845693013,
+                       0.405845151377397166906606412076961,
+                       0.207784955007898467600689403773245,
+                       0.000000000000000000000000000000000};
+const double WGK[8] = {0.022935322010529224963732008058970,
+                       0.063092092629978553290700663189204,
+                       0.104790010322250183839876322541518,
+                       0.140653259715525918745189590510238,
+                       0.169004726639267902826583426598550,
+                       0.190350578064785409913256402421014,
+                       0.204432940075298892414161999234649,
+                       0.209482141084727828012999174891714};
+const double WG[4] = {0.129484966168869693270611432679082,
+                      0.279705391489276667901467771423780,
+                      0.381830050505118944950369775488975,
+                      0.417959183673469387755102040816327};
+
+const int MAX_SEGMENTS = 4096;
+const size_t SEGMENTS_PER_WORKER = 4;
+
+struct Segment {
+  double a, b;
+  double result; // K15 estimate
+  double error;  // |K15 - G7|
+  bool operator<(const Segment &o) const { return error < o.error; }
+};
+
+// Evaluates all 15 Kronrod nodes of [seg.a, seg.b] in one batched tree pass
+void integrateSegment(const Node *ast, Segment &seg) {
+  double center = 0.5 * (seg.a + seg.b);
+  double half = 0.5 * (seg.b - seg.a);
+
+  double xs[15], fx[15];
+  for (int j = 0; j < 7; ++j) {
+    xs[2 * j] = center - half * XGK[j];
+    xs[2 * j + 1] = center + half * XGK[j];
+  }
+  xs[14] = center;
+  ast->evaluateBatch(xs, fx, 15, nullptr);
+
+  double kronrod = fx[14] * WGK[7];
+  double gauss = fx[14] * WG[3];
+  for (int j = 0; j < 7; ++j) {
+    double pair = fx[2 * j] + fx[2 * j + 1];
+    kronrod += WGK[j] * pair;
+    if (j % 2 == 1)
+      gauss += WG[j / 2] * pair;
+  }
+
+  seg.result = kronrod * half;
+  seg.error = std::abs((kronrod - gauss) * half);
+  if (!std::isfinite(seg.result))
+    seg.error = INFINITY;
+}
+
+struct IntegrateStats {
+  double errorEstimate;
+  int32_t segments;
+  int32_t functionEvals;
+  int32_t converged; // 1 if the tolerance was met
+  int32_t reserved;
+};
+
+// Integrates the expression over [a, b] by repeatedly bisecting the worst
+// segments. Each round refines a batch of segments across worker threads,
+// started once per call.
+double integrate(const std::string &expression, double a, double b,
+                 double tolerance, IntegrateStats *stats = nullptr) {
+  Parser parser(expression);
+  Node *ast = parser.parseExpression();
+
+  double sign = 1.0;
+  if (a > b) {
+    std::swap(a, b);
+    sign = -1.0;
+  }
+  if (tolerance <= 0)
+    tolerance = EPSILON;
+
+  std::priority_queue<Segment> heap;
+  Segment root = {a, b, 0, 0};
+  integrateSegment(ast, root);
+  heap.push(root);
+
+  int evals = 15;
+  double total = root.result;
+  double totalError = root.error;
+  size_t batchSize = workerCount() * SEGMENTS_PER_WORKER;
+  std::vector<Segment> children;
+  WorkerGroup workers(workerCount() - 1);
+  auto converged = [&] {
+    // inf <= inf holds, so a divergent integral has to be ruled out first
+    return std::isfinite(total) && std::isfinite(totalError) &&
+           totalError <= std::max(tolerance, tolerance * std::abs(total));
+  };
+
+  while (!converged() && (int)heap.size() < MAX_SEGMENTS &&
+         std::isfinite(totalError)) {
+    children.clear();
+    bool refined = false;
+    while (!heap.empty() && children.size() < 2 * batchSize) {
+      Segment worst = heap.top();
+      heap.pop();
+      double mid = 0.5 * (worst.a + worst.b);
+      if (mid <= worst.a || mid >= worst.b) {
+        // Cannot bisect further in double precision; keep it as is
+        children.push_back(worst);
+        continue;
+      }
+      children.push_back({worst.a, mid, 0, -1});
+      children.push_back({mid, worst.b, 0, -1});
+      evals += 30;
+      refined = true;
+    }
+
+    workers.run(children.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i)
+        if (children[i].error < 0)
+          integrateSegment(ast, children[i]);
+    });
+
+    for (const Segment &c : children)
+      heap.push(c);
+
+    // Re-sum from scratch so rounding drift cannot stall convergence
+    std::vector<Segment> all;
+    all.reserve(heap.size());
+    total = 0;
+    totalError = 0;
+    double compensation = 0;
+    while (!heap.empty()) {
+      all.push_back(heap.top());
+      heap.pop();
+    }
+    for (const Segment &s : all) {
+      double y = s.result - compensation;
+      double t = total + y;
+      compensation = (t - total) - y;
+      total = t;
+      totalError += s.error;
+    }
+    heap = std::priority_queue<Segment>(all.begin(), all.end());
+    if (!refined)
+      break;
+  }
+
+  if (stats) {
+    stats->errorEstimate = totalError;
+    stats->segments = (int32_t)heap.size();
+    stats->functionEvals = evals;
+    stats->converged = converged();
+  }
+
+  delete ast;
+  return sign * total;
+}
+// --- Parametric continuation ---
+const double COLD_START = 1.0;
+const size_t SWEEP_PER_WORKER = 256;
+
+// Solves f(x; param = values[i]) = 0 for every i. The expression is parsed
+// once; each chunk of the sweep runs on its own worker and warm-starts every
+// solve from a secant prediction through the previous two roots
+// (predictor-corrector continuation). Unconverged entries are written as NaN.
+// Returns the number of converged solves.
+int solveSweep(const std::string &equation, const std::string &param,
+               const double *values, size_t n, double *out) {
+  Parser parser(equation, {param});
+  Node *ast = parser.parseExpression();
+
+  std::atomic<int> total(0);
+
+  parallelChunks(n, SWEEP_PER_WORKER, [&](size_t begin, size_t end) {
+    int converged = 0;
+    bool havePrev = false, havePrev2 = false;
+    double prevA = 0, prevX = 0, prev2A = 0, prev2X = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+      double a = values[i];
+      SolveStats st = {};
+
+      // Predictor: secant through the last two roots, else last root
+      double guess = COLD_START;
+      if (havePrev2 && prevA != prev2A)
+        guess = prevX + (prevX - prev2X) / (prevA - prev2A) * (a - prevA);
+      else if (havePrev)
+        guess = prevX;
+
+      // Corrector: Newton, retrying from simpler starts if the warm start fails
+      double x = newton(ast, guess, &a, st);
+      if (st.reason != REASON_CONVERGED && havePrev2) {
+        st = {};
+        x = newton(ast, prevX, &a, st);
+      }
+      if (st.reason != REASON_CONVERGED && havePrev) {
+        st = {};
+        x = newton(ast, COLD_START, &a, st);
+      }
+
+      if (st.reason == REASON_CONVERGED) {
+        out[i] = x;
+        converged++;
+        havePrev2 = havePrev;
+        prev2A = prevA;
+        prev2X = prevX;
+        havePrev = true;
+        prevA = a;
+        prevX = x;
+      } else {
+        out[i] = NAN;
+        havePrev = havePrev2 = false;
+      }
+    }
+
+    total += converged;
+  });
+
+  delete ast;
+  return total;
+}
 } // namespace OmniMath
 
 extern "C" {
@@ -275,6 +799,33 @@ double solve_equation(const char *eq_ptr) {
   return OmniMath::solve(std::string(eq_ptr));
 }
 
+// Same as solve_equation, but fills `stats` and (optionally) up to
+// `trace_capacity` (x, f(x)) pairs in `trace` (interleaved doubles).
+double solve_equation_stats(const char *eq_ptr, OmniMath::SolveStats *stats,
+                            double *trace, int trace_capacity) {
+  OmniMath::SolveStats local = {};
+  return OmniMath::solve(std::string(eq_ptr), stats ? stats : &local,
+                         reinterpret_cast<OmniMath::TracePoint *>(trace),
+                         trace ? trace_capacity : 0);
+}
+
+// Definite integral of `expression` (in x) over [a, b]; `stats` is optional
+double integrate_expression(const char *expression, double a, double b,
+                            double tolerance,
+                            OmniMath::IntegrateStats *stats) {
+  return OmniMath::integrate(std::string(expression), a, b, tolerance, stats);
+}
+
+// Solves the equation for each value of the named parameter `param`,
+// writing one root per value into `out` (NaN where Newton did not converge)
+int solve_sweep(const char *expression, const char *param,
+                const double *values, int n, double *out) {
+  if (n <= 0)
+    return 0;
+  return OmniMath::solveSweep(std::string(expression), std::string(param),
+                              values, (size_t)n, out);
+}
+
 const char *get_version() { return "Equation Solver v1.0"; }
 
 void free_memory(char *ptr) {
@@ -0,0 +1,175 @@
+// OmniVM native built-in library. The string and memory functions work on
+// whole ranges of VM memory through the host's memchr/memcpy/memset/memcmp,
+// which are vectorised, instead of looping byte by byte in bytecode.
+#include "builtins.h"
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+
+namespace OmniNative {
+
+    namespace {
+
+        // Address 0 is NULL; nothing else below this is ever an object
+        const size_t FIRST_VALID_ADDR = 8;
+
+        struct Memory {
+            VmBytes& bytes;
+
+            bool valid(int64_t addr) const {
+                return addr >= (int64_t)FIRST_VALID_ADDR && (size_t)addr < bytes.size();
+            }
+
+            // `n` clipped to what is left of memory after `addr`
+            size_t clip(int64_t addr, int64_t n) const {
+                if (!valid(addr) || n <= 0) return 0;
+                return std::min((size_t)n, bytes.size() - (size_t)addr);
+            }
+
+            uint8_t* at(int64_t addr) { return bytes.data() + addr; }
+
+            // Length of the string at addr, stopping at the end of memory
+            size_t strlen(int64_t addr) {
+                if (!valid(addr)) return 0;
+                size_t avail = bytes.size() - (size_t)addr;
+                const void* nul = std::memchr(at(addr), 0, avail);
+                return nul ? (size_t)((const uint8_t*)nul - at(addr)) : avail;
+            }
+
+            std::string string(int64_t addr) { return std::string((const char*)at(addr), strlen(addr)); }
+        };
+
+        Slot ptr(int64_t addr) { return intSlot(addr); }
+        int64_t sign(int c) { return c < 0 ? -1 : c > 0 ? 1 : 0; }
+
+        Slot biStrcpy(Memory& m, const Slot* a) {
+            if (!m.valid(a[1].i)) return ptr(a[0].i);
+            int64_t len = (int64_t)m.strlen(a[1].i) + 1;
+            size_t n = std::min(m.clip(a[0].i, len), m.clip(a[1].i, len));
+            if (n) std::memmove(m.at(a[0].i), m.at(a[1].i), n);
+            return ptr(a[0].i);
+        }
+
+        Slot biStrncpy(Memory& m, const Slot* a) {
+            size_t n = m.clip(a[0].i, a[2].i);
+            size_t len = std::min(n, m.strlen(a[1].i));
+            if (len) std::memmove(m.at(a[0].i), m.at(a[1].i), len);
+            if (n > len) std::memset(m.at(a[0].i) + len, 0, n - len);
+            return ptr(a[0].i);
+        }
+
+        Slot biStrlen(Memory& m, const Slot* a) { return intSlot((int64_t)m.strlen(a[0].i)); }
+
+        int64_t compareStrings(Memory& m, int64_t x, int64_t y, size_t limit) {
+            size_t lx = m.strlen(x), ly = m.strlen(y);
+            // Include the shorter string's terminator so "ab" < "abc"
+            size_t n = std::min({lx + 1, ly + 1, limit});
+            n = std::min({n, m.clip(x, (int64_t)n), m.clip(y, (int64_t)n)});
+            return n ? sign(std::memcmp(m.at(x), m.at(y), n)) : 0;
+        }
+
+        Slot biStrcmp(Memory& m, const Slot* a) { return intSlot(compareStrings(m, a[0].i, a[1].i, SIZE_MAX)); }
+
+        Slot biStrncmp(Memory& m, const Slot* a) {
+            return intSlot(a[2].i > 0 ? compareStrings(m, a[0].i, a[1].i, (size_t)a[2].i) : 0);
+        }
+
+        Slot biStrcat(Memory& m, const Slot* a) {
+            int64_t end = a[0].i + (int64_t)m.strlen(a[0].i);
+            Slot args[2] = {intSlot(end), a[1]};
+            biStrcpy(m, args);
+            return ptr(a[0].i);
+        }
+
+        Slot biStrchr(Memory& m, const Slot* a) {
+            if (!m.valid(a[0].i)) return ptr(0);
+            size_t n = m.clip(a[0].i, (int64_t)m.strlen(a[0].i) + 1);
+            const void* hit = std::memchr(m.at(a[0].i), (int)(uint8_t)a[1].i, n);
+            return ptr(hit ? (int64_t)((const uint8_t*)hit - m.bytes.data()) : 0);
+        }
+
+        Slot biMemmove(Memory& m, const Slot* a) {
+            size_t n = std::min(m.clip(a[0].i, a[2].i), m.clip(a[1].i, a[2].i));
+            if (n) std::memmove(m.at(a[0].i), m.at(a[1].i), n);
+            return ptr(a[0].i);
+        }
+
+        Slot biMemcmp(Memory& m, const Slot* a) {
+            size_t n = std::min(m.clip(a[0].i, a[2].i), m.clip(a[1].i, a[2].i));
+            return intSlot(n ? sign(std::memcmp(m.at(a[0].i), m.at(a[1].i), n)) : 0);
+        }
+
+        Slot biMemset(Memory& m, const Slot* a) {
+            size_t n = m.clip(a[0].i, a[2].i);
+            if (n) std::memset(m.at(a[0].i), (int)(uint8_t)a[1].i, n);
+            return ptr(a[0].i);
+        }
+
+        Slot biSin(Memory&, const Slot* a) { return doubleSlot(std::sin(a[0].d)); }
+        Slot biCos(Memory&, const Slot* a) { return doubleSlot(std::cos(a[0].d)); }
+        Slot biTan(Memory&, const Slot* a) { return doubleSlot(std::tan(a[0].d)); }
+        Slot biSqrt(Memory&, const Slot* a) { return doubleSlot(std::sqrt(a[0].d)); }
+        Slot biPow(Memory&, const Slot* a) { return doubleSlot(std::pow(a[0].d, a[1].d)); }
+        Slot biExp(Memory&, const Slot* a) { return doubleSlot(std::exp(a[0].d)); }
+        Slot biLog(Memory&, const Slot* a) { return doubleSlot(std::log(a[0].d)); }
+        Slot biLog10(Memory&, const Slot* a) { return doubleSlot(std::log10(a[0].d)); }
+        Slot biAbs(Memory&, const Slot* a) { return intSlot(a[0].i < 0 ? (int64_t)(0 - (uint64_t)a[0].i) : a[0].i); }
+        Slot biFabs(Memory&, const Slot* a) { return doubleSlot(std::fabs(a[0].d)); }
+        Slot biFloor(Memory&, const Slot* a) { return doubleSlot(std::floor(a[0].d)); }
+        Slot biCeil(Memory&, const Slot* a) { return doubleSlot(std::ceil(a[0].d)); }
+
+        Slot biAtoi(Memory& m, const Slot* a) {
+            if (!m.valid(a[0].i)) return intSlot(0);
+            return intSlot(std::strtoll(m.string(a[0].i).c_str(), nullptr, 10));
+        }
+
+        Slot biAtof(Memory& m, const Slot* a) {
+            if (!m.valid(a[0].i)) return doubleSlot(0);
+            return doubleSlot(std::strtod(m.string(a[0].i).c_str(), nullptr));
+        }
+
+        // itoa(value, buf, base): base 2-36, a '-' only in base 10
+        Slot biItoa(Memory& m, const Slot* a) {
+            int64_t base = a[2].i;
+            if (base < 2 || base > 36) base = 10;
+            bool negative = base == 10 && a[0].i < 0;
+            uint64_t v = negative ? 0 - (uint64_t)a[0].i : (uint64_t)a[0].i;
+            std::string digits;
+            do {
+                digits += "0123456789abcdefghijklmnopqrstuvwxyz"[v % (uint64_t)base];
+                v /= (uint64_t)base;
+            } while (v);
+            if (negative) digits += '-';
+            std::reverse(digits.begin(), digits.end());
+            size_t n = m.clip(a[1].i, (int64_t)digits.size() + 1);
+            if (n) {
+                std::memcpy(m.at(a[1].i), digits.c_str(), n);
+                m.at(a[1].i)[n - 1] = 0;
+            }
+            return ptr(a[1].i);
+        }
+
+        // There is no input stream
+        Slot biGetchar(Memory&, const Slot*) { return intSlot(-1); }
+
+        typedef Slot (*BuiltinFn)(Memory&, const Slot*);
+
+        // Indexed by BuiltinId
+        const BuiltinFn FUNCTIONS[BUILTIN_COUNT] = {
+            biStrcpy, biStrncpy, biStrlen, biStrcmp, biStrncmp, biStrcat, biStrchr,
+            biMemmove, biMemmove, biMemcmp, biMemset,  // memcpy tolerates overlap
+            biSin, biCos, biTan, biSqrt, biPow, biExp, biLog, biLog10,
+            biAbs, biFabs, biFloor, biCeil,
+            biAtoi, biAtof, biItoa, biGetchar,
+        };
+
+    }
+
+    Slot callBuiltin(int id, VmBytes& memory, const Slot* args) {
+        Memory m{memory};
+        return FUNCTIONS[id](m, args);
+    }
+
+}
@@ -0,0 +1,16 @@
+// OmniVM native built-in library
+#pragma once
+#include "common.h"
+#include "memory.h"
+#include <vector>
+
+namespace OmniNative {
+
+    const int BUILTIN_MAX_ARGS = 3;
+
+    // Runs BUILTINS[id] on `args` (BUILTINS[id].argc() of them) against VM
+    // memory. Pointer arguments are bounds-checked: accesses are clipped to
+    // the end of memory and a NULL pointer makes the call a no-op.
+    Slot callBuiltin(int id, VmBytes& memory, const Slot* args);
+
+}
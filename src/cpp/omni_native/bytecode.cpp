@@ -0,0 +1,280 @@
+// OmniVM packed bytecode encoder
+#include "bytecode.h"
+#include <map>
+#include <algorithm>
+
+namespace OmniNative {
+
+    namespace {
+
+        class Packer {
+            Program& prog;
+            std::map<uint64_t, uint32_t> constantIndex;
+            std::map<std::string, uint32_t> stringIndex;
+
+            uint32_t constant(double v) {
+                Slot slot = doubleSlot(v);
+                uint64_t bits = (uint64_t)slot.i;
+                auto it = constantIndex.find(bits);
+                if (it != constantIndex.end()) return it->second;
+                uint32_t idx = (uint32_t)prog.constants.size();
+                prog.constants.push_back(slot);
+                constantIndex[bits] = idx;
+                return idx;
+            }
+
+            uint32_t string(const std::string& s) {
+                auto it = stringIndex.find(s);
+                if (it != stringIndex.end()) return it->second;
+                uint32_t idx = (uint32_t)prog.strings.size();
+                prog.strings.push_back(s);
+                stringIndex[s] = idx;
+                return idx;
+            }
+
+            // Writes one instruction; jump and call targets are resolved by
+            // the caller
+            void encode(const Instruction& instr, std::vector<uint8_t>& out, uint32_t target) {
+                OpCode op = instr.op;
+                out.push_back(op);
+                switch (operandKind(op)) {
+                    case OPND_NONE: break;
+                    case OPND_SVARINT: writeSVarint(out, doubleToInt(instr.immediate)); break;
+                    case OPND_VARINT:
+                        if (op == PUSH_CONST) writeVarint(out, constant(instr.immediate));
+                        else if (op == PRINT_FMT) writeVarint(out, string(instr.strValue));
+                        else writeVarint(out, (uint64_t)instr.immediate);
+                        break;
+                    case OPND_FLAG: out.push_back(instr.immediate != 0 ? 1 : 0); break;
+                    case OPND_TARGET: writeTarget(out, target); break;
+                    case OPND_CALL:
+                        writeTarget(out, target);
+                        writeVarint(out, (uint64_t)instr.immediate);
+                        break;
+                }
+            }
+
+        public:
+            explicit Packer(Program& p) : prog(p) {}
+
+            void pack() {
+                const auto& instrs = prog.instructions;
+                prog.code.clear();
+                prog.constants.clear();
+                prog.strings.clear();
+
+                // Pass 1: every operand except jump and call targets has a
+                // size that depends only on the instruction itself, and
+                // targets are a fixed 4 bytes, so offsets can be computed up
+                // front
+                std::vector<uint8_t> scratch;
+                prog.codeOffsets.assign(instrs.size() + 1, 0);
+                prog.lines.resize(instrs.size());
+                uint32_t offset = 0;
+                for (size_t i = 0; i < instrs.size(); i++) {
+                    prog.codeOffsets[i] = offset;
+                    prog.lines[i] = (uint32_t)instrs[i].line;
+                    scratch.clear();
+                    encode(instrs[i], scratch, 0);
+                    offset += (uint32_t)scratch.size();
+                }
+                prog.codeOffsets[instrs.size()] = offset;
+
+                // Pass 2: emit with jump targets and callees mapped to code
+                // offsets. An unknown callee links to the end of code, which
+                // the verifier rejects.
+                prog.code.reserve(offset);
+                for (const Instruction& instr : instrs) {
+                    uint32_t target = 0;
+                    if (operandKind(instr.op) == OPND_TARGET) {
+                        size_t idx = (size_t)instr.immediate;
+                        target = prog.codeOffsets[idx < instrs.size() ? idx : instrs.size()];
+                    } else if (instr.op == CALL) {
+                        auto fn = prog.functions.find(instr.strValue);
+                        target = prog.codeOffsets[fn != prog.functions.end() ? fn->second : instrs.size()];
+                    }
+                    encode(instr, prog.code, target);
+                }
+            }
+        };
+
+    }
+
+    void packProgram(Program& prog) {
+        Packer(prog).pack();
+    }
+
+    namespace {
+
+        class Verifier {
+            Program& prog;
+            std::string error;
+            std::vector<int> depthAt;        // -1 = not yet reached
+            std::vector<uint8_t> boundary;   // 1 where an instruction starts
+            std::vector<uint8_t> isEntry;    // 1 at function entries
+            std::vector<uint32_t> worklist;
+
+            bool fail(uint32_t at, const std::string& msg) {
+                error = "offset " + std::to_string(at) + ": " + msg;
+                return false;
+            }
+
+            // Records `depth` at `target`, queueing it on first visit
+            bool flow(uint32_t from, uint32_t target, int depth) {
+                if (target >= prog.code.size()) return fail(from, "control falls off the end of code");
+                if (depthAt[target] < 0) {
+                    depthAt[target] = depth;
+                    worklist.push_back(target);
+                } else if (depthAt[target] != depth) {
+                    return fail(target, "inconsistent stack depth at join");
+                }
+                return true;
+            }
+
+            // Marks instruction starts so jump targets can be checked
+            bool scanBoundaries() {
+                const uint8_t* code = prog.code.data();
+                size_t size = prog.code.size();
+                size_t ip = 0;
+                while (ip < size) {
+                    boundary[ip] = 1;
+                    uint8_t op = code[ip++];
+                    if (op >= OP_COUNT) return fail((uint32_t)ip - 1, "invalid opcode");
+                    // Make sure the operand itself is inside the stream
+                    switch (operandKind((OpCode)op)) {
+                        case OPND_NONE: break;
+                        case OPND_FLAG: ip += 1; break;
+                        case OPND_TARGET: ip += 4; break;
+                        case OPND_SVARINT: case OPND_VARINT: case OPND_CALL: {
+                            if (operandKind((OpCode)op) == OPND_CALL) ip += 4;
+                            int bytes = 0;
+                            while (ip < size && (code[ip] & 0x80)) { ip++; bytes++; }
+                            if (ip >= size || bytes >= 10) return fail((uint32_t)ip, "truncated operand");
+                            ip++;
+                            break;
+                        }
+                    }
+                    if (ip > size) return fail((uint32_t)size, "truncated operand");
+                }
+                return true;
+            }
+
+            bool walk(uint32_t entry, int& maxDepth) {
+                const uint8_t* code = prog.code.data();
+                if (!flow(entry, entry, 0)) return false;
+                while (!worklist.empty()) {
+                    uint32_t at = worklist.back();
+                    worklist.pop_back();
+                    int depth = depthAt[at];
+
+                    size_t ip = at;
+                    OpCode op = (OpCode)code[ip++];
+                    uint64_t operand = 0, argc = 0;
+                    uint32_t target = 0;
+                    switch (operandKind(op)) {
+                        case OPND_NONE: break;
+                        case OPND_SVARINT: readSVarint(code, ip); break;
+                        case OPND_VARINT: operand = readVarint(code, ip); break;
+                        case OPND_FLAG: operand = code[ip++]; break;
+                        case OPND_TARGET: target = readTarget(code, ip); break;
+                        case OPND_CALL:
+                            target = readTarget(code, ip);
+                            argc = readVarint(code, ip);
+                            break;
+                    }
+
+                    // Pool indices and call targets
+                    if (op == PUSH_CONST && operand >= prog.constants.size()) return fail(at, "constant index out of range");
+                    if (op == CALL_BUILTIN && operand >= BUILTIN_COUNT) return fail(at, "unknown built-in");
+                    if (op == PRINT_FMT && operand >= prog.strings.size()) return fail(at, "string index out of range");
+                    if (op == CALL && (target >= prog.code.size() || !isEntry[target])) {
+                        return fail(at, "call target is not a function entry");
+                    }
+                    if (operandKind(op) == OPND_TARGET && (target >= prog.code.size() || !boundary[target])) {
+                        return fail(at, "jump target is not an instruction boundary");
+                    }
+
+                    StackEffect effect = stackEffect(op, operand, argc);
+                    if (depth < effect.needs) return fail(at, "stack underflow");
+                    int next = depth + effect.delta;
+                    maxDepth = std::max(maxDepth, next);
+
+                    switch (op) {
+                        case HALT: break;
+                        case RET:
+                            if (depth != 1) return fail(at, "RET with extra values on the stack");
+                            break;
+                        case JMP:
+                            if (!flow(at, target, next)) return false;
+                            break;
+                        default:
+                            if (isConditionalJump(op)) {
+                                if (!flow(at, target, next) || !flow(at, (uint32_t)ip, next)) return false;
+                                break;
+                            }
+                            if (!flow(at, (uint32_t)ip, next)) return false;
+                            break;
+                    }
+                }
+                return true;
+            }
+
+        public:
+            explicit Verifier(Program& p) : prog(p) {}
+
+            bool run(std::string* out) {
+                size_t size = prog.code.size();
+                depthAt.assign(size, -1);
+                boundary.assign(size, 0);
+                isEntry.assign(size, 0);
+                prog.verified = false;
+
+                bool ok = scanBoundaries();
+
+                // Every function is verified from its own entry with an
+                // empty stack; depths are relative to that entry
+                std::vector<uint32_t> entries;
+                if (prog.entryPoint < prog.codeOffsets.size()) entries.push_back(prog.codeOffsets[prog.entryPoint]);
+                else ok = ok && fail(0, "entry point out of range");
+                for (const auto& fn : prog.functions) {
+                    if (fn.second >= prog.codeOffsets.size()) {
+                        ok = ok && fail(0, "function '" + fn.first + "' has no code");
+                        continue;
+                    }
+                    entries.push_back(prog.codeOffsets[fn.second]);
+                    if (entries.back() < size) isEntry[entries.back()] = 1;
+                }
+                if (entries.empty()) ok = ok && fail(0, "program has no entry point");
+
+                int maxDepth = 0;
+                for (uint32_t entry : entries) {
+                    if (!ok) break;
+                    if (entry >= size || !boundary[entry]) {
+                        ok = fail(entry, "entry point is not an instruction boundary");
+                        break;
+                    }
+                    // Already reached (e.g. two names for one entry)
+                    if (depthAt[entry] >= 0) {
+                        if (depthAt[entry] != 0) ok = fail(entry, "function entry reached with a non-empty stack");
+                        continue;
+                    }
+                    ok = walk(entry, maxDepth);
+                }
+
+                if (!ok) {
+                    if (out) *out = error;
+                    return false;
+                }
+                prog.maxStackDepth = (uint32_t)maxDepth;
+                prog.verified = true;
+                return true;
+            }
+        };
+
+    }
+
+    bool verifyProgram(Program& prog, std::string* error) {
+        return Verifier(prog).run(error);
+    }
+
+}
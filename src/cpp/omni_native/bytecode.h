@@ -0,0 +1,145 @@
+// OmniVM packed bytecode - 1-byte opcodes with variable-length operands
+#pragma once
+#include "common.h"
+#include <vector>
+#include <string>
+#include <cstring>
+
+namespace OmniNative {
+
+    // How the operand following each opcode is laid out in Program::code
+    enum OperandKind : uint8_t {
+        OPND_NONE,
+        OPND_SVARINT,   // Zigzag LEB128 integer (PUSH_IMM, ADD_IMM)
+        OPND_VARINT,    // LEB128 unsigned (pool index, address, frame offset, built-in)
+        OPND_FLAG,      // One byte (STORE keep flag, ALLOC zero flag)
+        OPND_TARGET,    // 4-byte little-endian code offset (jumps)
+        OPND_CALL       // 4-byte code offset of the callee (linked), LEB128 argc
+    };
+
+    inline OperandKind operandKind(OpCode op) {
+        switch (op) {
+            case PUSH_IMM: case ADD_IMM: return OPND_SVARINT;
+            case PUSH_CONST: case PUSH_STR: case ADDR_OF: case ENTER: case PRINT_FMT: case LOAD_LOCAL:
+            case CALL_BUILTIN:
+                return OPND_VARINT;
+            case STORE: case STORE_BYTE: case ALLOC: return OPND_FLAG;
+            case JMP: case JMP_IF: case JMP_IF_NOT:
+            case JMP_IF_NOT_IEQ: case JMP_IF_NOT_INEQ: case JMP_IF_NOT_ILT:
+            case JMP_IF_NOT_IGT: case JMP_IF_NOT_ILTE: case JMP_IF_NOT_IGTE:
+                return OPND_TARGET;
+            case CALL: return OPND_CALL;
+            default: return OPND_NONE;
+        }
+    }
+
+    // Jumps that can also fall through
+    inline bool isConditionalJump(OpCode op) {
+        return op == JMP_IF || op == JMP_IF_NOT || (op >= JMP_IF_NOT_IEQ && op <= JMP_IF_NOT_IGTE);
+    }
+
+    inline bool isJump(OpCode op) { return op == JMP || isConditionalJump(op); }
+
+    // The compare a fused JMP_IF_NOT_* performs
+    inline OpCode fusedCompare(OpCode op) { return (OpCode)(IEQ + (op - JMP_IF_NOT_IEQ)); }
+
+    inline void writeVarint(std::vector<uint8_t>& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back((uint8_t)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((uint8_t)v);
+    }
+
+    inline void writeSVarint(std::vector<uint8_t>& out, int64_t v) {
+        writeVarint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+    }
+
+    inline void writeTarget(std::vector<uint8_t>& out, uint32_t target) {
+        for (int i = 0; i < 4; i++) out.push_back((uint8_t)(target >> (8 * i)));
+    }
+
+    inline uint64_t readVarint(const uint8_t* code, size_t& ip) {
+        uint64_t v = code[ip++];
+        if (v < 0x80) return v;
+        v &= 0x7f;
+        for (int shift = 7;; shift += 7) {
+            uint8_t b = code[ip++];
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (b < 0x80) return v;
+        }
+    }
+
+    inline int64_t readSVarint(const uint8_t* code, size_t& ip) {
+        uint64_t v = readVarint(code, ip);
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    inline uint32_t readTarget(const uint8_t* code, size_t& ip) {
+        uint32_t v;
+        std::memcpy(&v, code + ip, 4);  // Little-endian hosts (x86, WASM)
+        ip += 4;
+        return v;
+    }
+
+    // Skips over the operand of `op` starting at ip
+    inline void skipOperand(OpCode op, const uint8_t* code, size_t& ip) {
+        switch (operandKind(op)) {
+            case OPND_NONE: break;
+            case OPND_SVARINT: case OPND_VARINT: readVarint(code, ip); break;
+            case OPND_FLAG: ip++; break;
+            case OPND_TARGET: ip += 4; break;
+            case OPND_CALL: ip += 4; readVarint(code, ip); break;
+        }
+    }
+
+    // Values an instruction pops (`needs`) and its net effect on depth.
+    // `operand` is the STORE keep flag or built-in index, `argc` the CALL
+    // argument count.
+    struct StackEffect { int needs; int delta; };
+
+    inline StackEffect stackEffect(OpCode op, uint64_t operand, uint64_t argc) {
+        switch (op) {
+            case PUSH_IMM: case PUSH_CONST: case PUSH_STR: case ADDR_OF: case LOAD_LOCAL: return {0, 1};
+            case POP: case FREE: case PRINT: case PRINT_CHAR: case PRINT_STR: case PRINT_FMT:
+            case JMP_IF: case JMP_IF_NOT:
+                return {1, -1};
+            case DUP: return {1, 1};
+            case ADD: case SUB: case MUL: case DIV: case MOD:
+            case IADD: case ISUB: case IMUL: case IDIV: case IMOD:
+            case BIT_AND: case BIT_OR: case BIT_XOR: case SHL: case SHR:
+            case EQ: case NEQ: case LT: case GT: case LTE: case GTE:
+            case IEQ: case INEQ: case ILT: case IGT: case ILTE: case IGTE:
+            case LOGICAL_AND: case LOGICAL_OR: case LOAD_ADD: case REALLOC:
+                return {2, -1};
+            case BIT_NOT: case LOGICAL_NOT: case LOAD: case LOAD_BYTE: case ALLOC: case DEREF:
+            case INT_TO_DOUBLE: case DOUBLE_TO_INT: case ADD_IMM:
+                return {1, 0};
+            case JMP_IF_NOT_IEQ: case JMP_IF_NOT_INEQ: case JMP_IF_NOT_ILT:
+            case JMP_IF_NOT_IGT: case JMP_IF_NOT_ILTE: case JMP_IF_NOT_IGTE:
+                return {2, -2};
+            case STORE: case STORE_BYTE: return {2, operand ? -1 : -2};
+            case CALL: return {(int)argc, 1 - (int)argc};
+            case CALL_BUILTIN: {
+                int n = operand < BUILTIN_COUNT ? BUILTINS[operand].argc() : 0;
+                return {n, 1 - n};
+            }
+            case RET: return {1, -1};
+            default: return {0, 0};  // HALT, NOOP, JMP, ENTER, LEAVE
+        }
+    }
+
+    // Encodes Program::instructions into Program::code plus the constant and
+    // string pools. Also the link step: jump targets and calls (by callee
+    // name) are resolved to code offsets, so the VM never looks up a name.
+    // Source lines go to the Program::lines table.
+    void packProgram(Program& prog);
+
+    // Load-time verifier. Walks every reachable path from the entry point and
+    // each function entry, checking operands, pool indices and jump targets
+    // (which must land on instruction boundaries, and for CALL on a function
+    // entry), that the eval stack never underflows, has the same depth
+    // wherever paths join, and holds exactly the return value at RET. On success sets maxStackDepth and verified.
+    bool verifyProgram(Program& prog, std::string* error = nullptr);
+
+}
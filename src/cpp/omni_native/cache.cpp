@@ -0,0 +1,154 @@
+// OmniVM compiled-program cache
+#include "cache.h"
+#include "compiler.h"
+#include "image.h"
+#include <atomic>
+#include <cstdio>
+
+#if OMNI_DISK_CACHE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace OmniNative {
+
+    namespace {
+
+        bool sameOptions(const CompileOptions& a, const CompileOptions& b) {
+            return a.mode == b.mode && a.peephole == b.peephole && a.optLevel == b.optLevel;
+        }
+
+    }
+
+    ProgramCache::ProgramCache(size_t capacity, const std::string& directory)
+        : capacity(capacity ? capacity : 1), directory(OMNI_DISK_CACHE ? directory : "") {}
+
+    // Moves a matching entry to the front; the caller holds the lock
+    std::shared_ptr<const Program> ProgramCache::find(uint64_t key, const std::string& source, const CompileOptions& options) {
+        auto range = index.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            Entry& e = *it->second;
+            if (e.source == source && sameOptions(e.options, options)) {
+                entries.splice(entries.begin(), entries, it->second);
+                return e.program;
+            }
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<const Program> ProgramCache::get(const std::string& source, const CompileOptions& options) {
+        uint64_t key = imageKey(source, options);
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (auto prog = find(key, source, options)) {
+                counters.hits++;
+                return prog;
+            }
+            counters.misses++;
+        }
+
+        std::shared_ptr<const Program> prog;
+        bool fromDisk = false, written = false;
+        if (!directory.empty()) prog = loadFromDisk(key, source, options);
+        if (prog) {
+            fromDisk = true;
+        } else {
+            auto compiled = std::make_shared<Program>(compileSource(source, options));
+            // The VM never looks at the compiler's instruction list
+            compiled->instructions.clear();
+            compiled->instructions.shrink_to_fit();
+            prog = compiled;
+            if (!directory.empty()) written = writeToDisk(key, *prog, source, options);
+        }
+
+        std::lock_guard<std::mutex> guard(mutex);
+        if (fromDisk) counters.diskHits++;
+        if (written) counters.diskWrites++;
+        // Another thread may have compiled it meanwhile
+        if (auto existing = find(key, source, options)) return existing;
+        entries.push_front(Entry{key, source, options, prog});
+        index.emplace(key, entries.begin());
+        while (entries.size() > capacity) {
+            auto last = std::prev(entries.end());
+            auto victims = index.equal_range(last->key);
+            for (auto it = victims.first; it != victims.second; ++it) {
+                if (it->second == last) {
+                    index.erase(it);
+                    break;
+                }
+            }
+            entries.pop_back();
+            counters.evictions++;
+        }
+        return prog;
+    }
+
+    void ProgramCache::clear() {
+        std::lock_guard<std::mutex> guard(mutex);
+        entries.clear();
+        index.clear();
+    }
+
+    std::string ProgramCache::imagePath(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.omni", (unsigned long long)key);
+        return directory + "/" + name;
+    }
+
+#if OMNI_DISK_CACHE
+
+    std::shared_ptr<const Program> ProgramCache::loadFromDisk(uint64_t key, const std::string& source, const CompileOptions& options) {
+        int fd = open(imagePath(key).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED) return nullptr;
+
+        auto prog = std::make_shared<Program>();
+        bool ok = loadImage((const uint8_t*)mapped, (size_t)st.st_size, source, options, *prog);
+        munmap(mapped, (size_t)st.st_size);
+        return ok ? prog : nullptr;
+    }
+
+    // Written to a temporary and renamed, so concurrent readers see either
+    // no file or a whole one
+    bool ProgramCache::writeToDisk(uint64_t key, const Program& prog, const std::string& source, const CompileOptions& options) {
+        static std::atomic<unsigned> temps(0);
+        std::vector<uint8_t> image = saveImage(prog, source, options);
+        std::string path = imagePath(key);
+        std::string temp = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(temps++);
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        size_t written = 0;
+        while (written < image.size()) {
+            ssize_t n = write(fd, image.data() + written, image.size() - written);
+            if (n <= 0) break;
+            written += (size_t)n;
+        }
+        close(fd);
+        if (written != image.size() || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+#else
+
+    std::shared_ptr<const Program> ProgramCache::loadFromDisk(uint64_t, const std::string&, const CompileOptions&) {
+        return nullptr;
+    }
+
+    bool ProgramCache::writeToDisk(uint64_t, const Program&, const std::string&, const CompileOptions&) {
+        return false;
+    }
+
+#endif
+
+}
@@ -0,0 +1,66 @@
+// OmniVM compiled-program cache - in-memory LRU with an optional disk tier
+#pragma once
+#include "common.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace OmniNative {
+
+    // Program images on disk need POSIX files and mmap
+    #if defined(__unix__) && !defined(__EMSCRIPTEN__)
+    #define OMNI_DISK_CACHE 1
+    #else
+    #define OMNI_DISK_CACHE 0
+    #endif
+
+    struct CacheStats {
+        size_t hits = 0;
+        size_t misses = 0;       // Lookups that had to load or compile
+        size_t diskHits = 0;     // Misses answered by an image on disk
+        size_t diskWrites = 0;
+        size_t evictions = 0;
+    };
+
+    // Compiled programs keyed by imageKey(source, options). Entries keep
+    // their source so a hash collision is a miss, never a wrong program.
+    // With a directory (native builds only), misses first try
+    // <directory>/<key>.omni and compiled programs are written there as
+    // images (see image.h). Compile errors propagate and are not cached.
+    // Safe to share between threads; compiling happens outside the lock.
+    class ProgramCache {
+    public:
+        explicit ProgramCache(size_t capacity, const std::string& directory = "");
+
+        std::shared_ptr<const Program> get(const std::string& source, const CompileOptions& options);
+
+        CacheStats stats() const {
+            std::lock_guard<std::mutex> guard(mutex);
+            return counters;
+        }
+        void clear();
+
+    private:
+        struct Entry {
+            uint64_t key;
+            std::string source;
+            CompileOptions options;
+            std::shared_ptr<const Program> program;
+        };
+
+        std::shared_ptr<const Program> find(uint64_t key, const std::string& source, const CompileOptions& options);
+        std::shared_ptr<const Program> loadFromDisk(uint64_t key, const std::string& source, const CompileOptions& options);
+        bool writeToDisk(uint64_t key, const Program& prog, const std::string& source, const CompileOptions& options);
+        std::string imagePath(uint64_t key) const;
+
+        size_t capacity;
+        std::string directory;
+        std::list<Entry> entries;   // Most recently used first
+        std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index;
+        CacheStats counters;
+        mutable std::mutex mutex;
+    };
+
+}
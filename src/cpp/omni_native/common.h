@@ -4,7 +4,9 @@
 #include <string>
 #include <cstdint>
 #include <map>
+#include <unordered_map>
 #include <cstring>
+#include <stdexcept>
 
 namespace OmniNative {
 
@@ -34,62 +36,214 @@ namespace OmniNative {
         }
     };
 
+    // One 8-byte VM value: an int/char/pointer or a double. Slots carry no
+    // tag; the compiler picks typed opcodes from each value's static type.
+    union Slot {
+        int64_t i;
+        double d;
+    };
+
+    inline Slot intSlot(int64_t v) { Slot s; s.i = v; return s; }
+    inline Slot doubleSlot(double v) { Slot s; s.d = v; return s; }
+
+    // (int64_t)v, saturating instead of undefined outside the int64 range
+    inline int64_t doubleToInt(double v) {
+        if (!(v == v)) return 0;
+        if (v >= 9223372036854775807.0) return INT64_MAX;
+        if (v <= -9223372036854775808.0) return INT64_MIN;
+        return (int64_t)v;
+    }
+
+    // Integer division and remainder as the VM defines them: wrapping, with
+    // a zero divisor giving 0 rather than trapping
+    inline int64_t intDiv(int64_t a, int64_t b) {
+        if (b == 0) return 0;
+        if (b == -1) return (int64_t)(0 - (uint64_t)a);
+        return a / b;
+    }
+
+    inline int64_t intMod(int64_t a, int64_t b) {
+        if (b == 0 || b == -1) return 0;
+        return a % b;
+    }
+
+    // Scans the printf conversion at fmt[start] == '%', in the form the VM
+    // formats: "%[flags][width][.precision][length]conv". Returns the index
+    // of the conversion character, or std::string::npos if there is none.
+    inline size_t printfConversion(const std::string& fmt, size_t start) {
+        size_t i = start + 1;
+        while (i < fmt.size() && std::strchr("-+ #0", fmt[i])) i++;
+        while (i < fmt.size() && fmt[i] >= '0' && fmt[i] <= '9') i++;
+        if (i < fmt.size() && fmt[i] == '.') {
+            i++;
+            while (i < fmt.size() && fmt[i] >= '0' && fmt[i] <= '9') i++;
+        }
+        while (i < fmt.size() && std::strchr("hlLzjt", fmt[i])) i++;
+        if (i >= fmt.size() || !std::strchr("diouxXcsfFeEgGaAp", fmt[i])) return std::string::npos;
+        return i;
+    }
+
+    // A whole string is one conversion, as Program::strings holds them
+    inline bool isPrintfSpec(const std::string& spec) {
+        return !spec.empty() && spec[0] == '%' && printfConversion(spec, 0) == spec.size() - 1;
+    }
+
     // Instruction Set Architecture (ISA) for OmniVM
     enum OpCode : uint8_t {
         HALT = 0x00,
         NOOP = 0x01,
 
         // Stack Operations
-        PUSH_IMM,   // Push immediate value (double)
+        PUSH_IMM,   // Push integer immediate
+        PUSH_CONST, // Push double immediate (constant pool entry once packed)
         PUSH_STR,   // Push string address
         POP,        // Pop value
         DUP,        // Duplicate top of stack
 
-        // Arithmetic
+        // Arithmetic (double)
         ADD, SUB, MUL, DIV, MOD,
 
-        // Bitwise
+        // Integer arithmetic (64-bit wrapping; division by zero gives 0)
+        IADD, ISUB, IMUL, IDIV, IMOD,
+
+        // Bitwise (integer)
         BIT_AND, BIT_OR, BIT_XOR, BIT_NOT, SHL, SHR,
 
-        // Comparison (pushes 0 or 1)
-        EQ, NEQ, LT, GT, LTE, GTE,
+        // Comparison (pushes integer 0 or 1)
+        EQ, NEQ, LT, GT, LTE, GTE,          // double operands
+        IEQ, INEQ, ILT, IGT, ILTE, IGTE,    // integer operands
         LOGICAL_AND, LOGICAL_OR, LOGICAL_NOT,
 
         // Memory Access
         LOAD,       // Load from address on stack
-        STORE,      // Store value to address
-        ALLOC,      // Allocate N bytes
+        STORE,      // Store value to address (immediate != 0 keeps the value)
+        LOAD_BYTE,  // Load signed char from address on stack
+        STORE_BYTE, // Store low byte of value (immediate != 0 keeps the value)
+        ALLOC,      // Allocate N bytes (immediate != 0 zeroes them)
+        REALLOC,    // Resize the block below to the size on top
         FREE,       // Free memory
 
         // Address operations
-        ADDR_OF,    // Get address of lvalue
+        ADDR_OF,    // Push frame pointer + immediate (address of a local)
         DEREF,      // Dereference pointer
 
         // Control Flow
         JMP,        // Unconditional jump
         JMP_IF,     // Jump if top is true (non-zero)
         JMP_IF_NOT, // Jump if top is false
-        CALL,       // Call function
+        CALL,       // Call function strValue with immediate args
+        CALL_BUILTIN, // Call native library function BUILTINS[immediate]
         RET,        // Return from function
-        ENTER,      // Enter function (setup stack frame)
+        ENTER,      // Enter function (reserve immediate bytes of frame)
         LEAVE,      // Leave function
 
         // I/O
-        PRINT,      // Print value on top of stack
+        PRINT,      // Print integer on top of stack
         PRINT_CHAR, // Print character
         PRINT_STR,  // Print null-terminated string
+        PRINT_FMT,  // Print top of stack using printf spec in strValue
 
         // Type conversions
         INT_TO_DOUBLE,
-        DOUBLE_TO_INT
+        DOUBLE_TO_INT,
+
+        // Superinstructions (peephole.h), all on integers
+        ADD_IMM,        // Add immediate to top (PUSH_IMM + IADD)
+        LOAD_LOCAL,     // Push value at fp + immediate (ADDR_OF + LOAD)
+        LOAD_ADD,       // Load from address on top, add to the value below (LOAD + IADD)
+        // Pop b, a; jump to immediate unless a cmp b (integer compare + JMP_IF_NOT)
+        JMP_IF_NOT_IEQ, JMP_IF_NOT_INEQ, JMP_IF_NOT_ILT, JMP_IF_NOT_IGT, JMP_IF_NOT_ILTE, JMP_IF_NOT_IGTE,
+
+        OP_COUNT    // Number of opcodes (not an instruction)
+    };
+
+    // Register ISA: three-address ops over a per-frame register window.
+    // Fields of RegInstr: a = destination, b/c = sources, x = immediate,
+    // frame offset, absolute address, pool index or branch target.
+    enum RegOpCode : uint8_t {
+        R_HALT = 0x00,
+        R_MOV,      // a = b
+        R_LOADI,    // a = (int)x
+        R_LOADK,    // a = constants[x]
+        R_ADDR,     // a = fp + x
+
+        // a = b op c, double
+        R_ADD, R_SUB, R_MUL, R_DIV, R_MOD,
+        R_EQ, R_NE, R_LT, R_GT, R_LE, R_GE,
+
+        // a = b op c, integer
+        R_IADD, R_ISUB, R_IMUL, R_IDIV, R_IMOD,
+        R_AND, R_OR, R_XOR, R_SHL, R_SHR,
+        R_IEQ, R_INE, R_ILT, R_IGT, R_ILE, R_IGE,
+        R_LAND, R_LOR,
+
+        // a = b op x, integer
+        R_IADDI, R_IMULI,
+
+        // a = op b
+        R_NOT, R_LNOT, R_I2D, R_D2I,
+        R_SEXT8,    // a = (signed char)b
+
+        // Memory
+        R_LOAD,     // a = mem[b]
+        R_STORE,    // mem[b] = c
+        R_LOADB,    // a = (signed char)mem[b]
+        R_STOREB,   // mem[b] = low byte of c
+        R_LOADL,    // a = mem[fp + x]
+        R_STOREL,   // mem[fp + x] = b
+        R_LOADG,    // a = mem[x]
+        R_STOREG,   // mem[x] = b
+        R_ALLOC,    // a = malloc(b), or calloc when x != 0
+        R_REALLOC,  // a = realloc(b, c)
+        R_FREE,     // free(b)
+
+        // Control flow
+        R_JMP,      // goto x
+        R_JT,       // if (b) goto x
+        R_JF,       // if (!b) goto x
+        // if (!(b cmp c)) goto x, integer
+        R_JFIEQ, R_JFINE, R_JFILT, R_JFIGT, R_JFILE, R_JFIGE,
+        // if (!(b cmp constants[c])) goto x, integer
+        R_JFIEQK, R_JFINEK, R_JFILTK, R_JFIGTK, R_JFILEK, R_JFIGEK,
+        R_ARG,      // Argument x of the next call = b
+        R_CALL,     // a = regFunctions[x](args)
+        R_CALLB,    // a = BUILTINS[x](args)
+        R_RET,      // Return b
+        R_ENTER,    // Reserve x bytes of frame
+
+        // I/O
+        R_PRINT, R_PRINTC, R_PRINTS,
+        R_PRINTF,   // Print b using printf spec strings[x]
+
+        R_OP_COUNT
+    };
+
+    struct RegInstr {
+        RegOpCode op;
+        uint8_t a, b, c;
+        int32_t x;
+    };
+
+    struct RegFunction {
+        uint32_t entry;     // Index into Program::regCode
+        uint32_t numRegs;   // Register window size
     };
 
     struct Instruction {
         OpCode op;
         double immediate;
         std::string strValue;  // For string immediates
+        int line = 0;          // Source line, 0 if unknown
 
         Instruction(OpCode o, double i = 0) : op(o), immediate(i) {}
+        Instruction(OpCode o, double i, const std::string& s) : op(o), immediate(i), strValue(s) {}
+    };
+
+    // Thrown by the front-end; carries the offending source line
+    struct CompileError : std::runtime_error {
+        int line;
+        CompileError(int l, const std::string& msg)
+            : std::runtime_error("line " + std::to_string(l) + ": " + msg), line(l) {}
     };
 
     // Symbol table entry
@@ -105,9 +259,65 @@ namespace OmniNative {
         Symbol(const std::string& n, const Type& t) : name(n), type(t) {}
     };
 
+    // Which VM instruction set a program is compiled for
+    enum ExecMode {
+        EXEC_STACK,
+        EXEC_REGISTER
+    };
+
+    struct CompileOptions {
+        ExecMode mode = EXEC_REGISTER;
+        bool peephole = true;
+        int optLevel = 0;             // SSA middle-end (ssa.h); 0 skips it
+    };
+
+    // What the peephole pass did to Program::instructions
+    struct PeepholeStats {
+        size_t instructionsBefore = 0;
+        size_t instructionsAfter = 0;
+        size_t noopsRemoved = 0;
+        size_t jumpsThreaded = 0;     // Retargeted past JMP chains
+        size_t jumpsRemoved = 0;      // Jumps to the next instruction
+        size_t addImm = 0;
+        size_t loadLocal = 0;
+        size_t loadAdd = 0;
+        size_t fusedBranches = 0;
+        size_t dupLoads = 0;          // ADDR_OF k; DUP; LOAD -> ADDR_OF k; LOAD_LOCAL k
+        size_t storePops = 0;         // STORE keep; POP -> STORE
+    };
+
+    // What the SSA middle-end did to Program::instructions
+    struct OptimizerStats {
+        size_t instructionsBefore = 0;
+        size_t instructionsAfter = 0;
+        size_t functionsOptimized = 0;
+        size_t functionsSkipped = 0;     // Used code the IR does not model
+        size_t localsPromoted = 0;       // Scalar locals turned into SSA values
+        size_t constantsFolded = 0;
+        size_t branchesFolded = 0;
+        size_t subexpressionsReused = 0;
+        size_t deadRemoved = 0;
+        size_t invariantsHoisted = 0;
+        size_t strengthReduced = 0;      // Induction products turned into adds
+    };
+
     // Executable program
     struct Program {
-        std::vector<Instruction> instructions;
+        std::vector<Instruction> instructions;   // Compiler output
+        // Packed form executed by the VM (see bytecode.h)
+        std::vector<uint8_t> code;
+        std::vector<Slot> constants;
+        std::vector<std::string> strings;        // printf specs
+        std::vector<uint32_t> codeOffsets;       // Instruction index -> code offset
+        std::vector<uint32_t> lines;             // Instruction index -> source line (0 = none)
+        uint32_t maxStackDepth = 0;              // Deepest eval stack of any function (verifier)
+        bool verified = false;
+        PeepholeStats peephole;
+        OptimizerStats optimizer;
+        // Register form (see regcode.h); empty when compiled for the stack VM
+        std::vector<RegInstr> regCode;
+        std::vector<RegFunction> regFunctions;   // [0] is the startup code
+        std::vector<uint32_t> regLines;          // regCode index -> source line
         std::vector<uint8_t> dataSegment;     // Static data
         std::map<std::string, size_t> functions;  // Function name -> instruction index
         std::map<std::string, Symbol> globals;   // Global variables
@@ -124,15 +334,60 @@ namespace OmniNative {
         "strcpy", "strncpy", "strlen", "strcmp", "strncmp", "strcat", "strchr",
         "memcpy", "memmove", "memcmp", "memset",
         "sin", "cos", "tan", "sqrt", "pow", "exp", "log", "log10", "abs",
+        "fabs", "floor", "ceil",
         "atoi", "atof", "itoa",
         "puts", "putchar", "gets", "getchar",
         nullptr
     };
 
     inline bool isBuiltin(const std::string& name) {
-        for (int i = 0; BUILT_INS[i]; i++) {
-            if (name == BUILT_INS[i]) return true;
-        }
-        return false;
+        static const std::unordered_map<std::string, int> names = [] {
+            std::unordered_map<std::string, int> m;
+            for (int i = 0; BUILT_INS[i]; i++) m.emplace(BUILT_INS[i], i);
+            return m;
+        }();
+        return names.count(name) != 0;
+    }
+
+    // Built-ins the VM implements natively (see builtins.h), called by index
+    // through CALL_BUILTIN. The rest of BUILT_INS are either lowered to
+    // opcodes by the compiler (printf, malloc, ...) or unsupported.
+    enum BuiltinId : uint8_t {
+        BI_STRCPY, BI_STRNCPY, BI_STRLEN, BI_STRCMP, BI_STRNCMP, BI_STRCAT, BI_STRCHR,
+        BI_MEMCPY, BI_MEMMOVE, BI_MEMCMP, BI_MEMSET,
+        BI_SIN, BI_COS, BI_TAN, BI_SQRT, BI_POW, BI_EXP, BI_LOG, BI_LOG10,
+        BI_ABS, BI_FABS, BI_FLOOR, BI_CEIL,
+        BI_ATOI, BI_ATOF, BI_ITOA, BI_GETCHAR,
+        BUILTIN_COUNT
+    };
+
+    // `signature` is the return type, '=', then one letter per parameter:
+    // i = int, d = double, s = char*, p = void*
+    struct BuiltinInfo {
+        const char* name;
+        const char* signature;
+
+        int argc() const { return (int)std::strlen(signature) - 2; }
+    };
+
+    inline const BuiltinInfo BUILTINS[BUILTIN_COUNT] = {
+        {"strcpy", "s=ss"}, {"strncpy", "s=ssi"}, {"strlen", "i=s"}, {"strcmp", "i=ss"},
+        {"strncmp", "i=ssi"}, {"strcat", "s=ss"}, {"strchr", "s=si"},
+        {"memcpy", "p=ppi"}, {"memmove", "p=ppi"}, {"memcmp", "i=ppi"}, {"memset", "p=pii"},
+        {"sin", "d=d"}, {"cos", "d=d"}, {"tan", "d=d"}, {"sqrt", "d=d"}, {"pow", "d=dd"},
+        {"exp", "d=d"}, {"log", "d=d"}, {"log10", "d=d"},
+        {"abs", "i=i"}, {"fabs", "d=d"}, {"floor", "d=d"}, {"ceil", "d=d"},
+        {"atoi", "i=s"}, {"atof", "d=s"}, {"itoa", "s=isi"}, {"getchar", "i="},
+    };
+
+    // BuiltinId for `name`, or -1
+    inline int builtinIndex(const std::string& name) {
+        static const std::unordered_map<std::string, int> index = [] {
+            std::unordered_map<std::string, int> m;
+            for (int i = 0; i < BUILTIN_COUNT; i++) m.emplace(BUILTINS[i].name, i);
+            return m;
+        }();
+        auto it = index.find(name);
+        return it == index.end() ? -1 : it->second;
     }
 }
@@ -1,12 +1,17 @@
 // OmniNative C Compiler - Learning Tool
-// Simplified C/C++ interpreter that works with real C syntax
-// Supports: variables, expressions, control flow, functions, basic I/O
+// Compiles a C subset to OmniVM bytecode (see common.h for the ISA)
+// Supports: int/char/double, pointers, arrays, functions, control flow, printf
 
-#include "common.h"
-#include <iostream>
-#include <sstream>
+#include "compiler.h"
+#include "bytecode.h"
+#include "regcode.h"
+#include "peephole.h"
+#include "ssa.h"
+#include "symbols.h"
 #include <vector>
 #include <map>
+#include <deque>
+#include <memory>
 #include <cstring>
 #include <cstdlib>
 #include <cmath>
@@ -15,195 +20,1834 @@ using namespace std;
 
 namespace OmniNative {
 
-    // Simple symbol table for variables
-    struct VarInfo {
-        int address;
-        bool isPointer;
-        bool isConst;
+    // ============== LEXER ==============
+    enum TokenKind { TOK_EOF, TOK_NUMBER, TOK_CHAR, TOK_STRING, TOK_IDENT, TOK_PUNCT };
+
+    struct Token {
+        TokenKind kind;
+        string text;        // Punctuator or decoded string
+        double number = 0;
+        bool isFloat = false;
+        int line = 0;
+        SymbolId sym = NO_SYMBOL;   // Identifiers and punctuators
+    };
+
+    // Names with fixed symbol ids. The type specifiers come first, so
+    // telling whether a token starts a type is one comparison.
+    enum ReservedWord : SymbolId {
+        W_INT, W_CHAR, W_DOUBLE, W_FLOAT, W_VOID, W_LONG, W_SHORT, W_UNSIGNED, W_SIGNED,
+        W_CONST, W_STATIC, W_EXTERN, W_REGISTER, W_VOLATILE, W_INLINE, W_BOOL, W__BOOL, W_SIZE_T,
+        TYPE_WORD_COUNT
     };
+    const char* const RESERVED_WORDS[] = {
+        "int", "char", "double", "float", "void", "long", "short", "unsigned", "signed",
+        "const", "static", "extern", "register", "volatile", "inline", "bool", "_Bool", "size_t",
+        nullptr
+    };
+    static_assert(sizeof(RESERVED_WORDS) / sizeof(RESERVED_WORDS[0]) == TYPE_WORD_COUNT + 1,
+                  "RESERVED_WORDS does not match ReservedWord");
+
+    // Tokenizes the whole source up front. Preprocessor lines are consumed
+    // here: object-like #defines are expanded, everything else is skipped.
+    class Lexer {
+        const string& src;
+        size_t pos = 0;
+        int line = 1;
+        Interner& symbols;
+        FlatMap<vector<Token>> macros;
+
+        char peek(size_t ahead = 0) { return pos + ahead < src.length() ? src[pos + ahead] : 0; }
 
-    // ============== INTERPRETER ==============
-    class CInterpreter {
-        string source;
-        size_t pos;
-        int lineNum;
-        map<string, VarInfo> locals;
-        map<string, VarInfo> globals;
-        int nextLocalAddr = 0;
-        int nextGlobalAddr = 0;
-        vector<double> memory;
-        vector<double> stack;
-        stringstream output;
-
-        char peek() { return pos < source.length() ? source[pos] : 0; }
-        char get() { return pos < source.length() ? source[pos++] : 0; }
-        void skipWhitespace() {
-            while (isspace(peek())) {
-                if (peek() == '\n') lineNum++;
-                get();
-            }
-        }
-
-        // Execute a single statement
-        void executeStatement(string code) {
-            // Simplified: handle common patterns
-            // printf("Hello")
-            if (code.find("printf") != string::npos) {
-                size_t start = code.find('"');
-                size_t end = code.rfind('"');
-                if (start != string::npos && end != string::npos && end > start) {
-                    string msg = code.substr(start + 1, end - start - 1);
-                    output << msg;
+        char readEscape() {
+            char c = src[pos++];
+            switch (c) {
+                case 'n': return '\n';
+                case 't': return '\t';
+                case 'r': return '\r';
+                case '0': return '\0';
+                case 'a': return '\a';
+                case 'b': return '\b';
+                case 'f': return '\f';
+                case 'v': return '\v';
+                case 'x': {
+                    int v = 0;
+                    while (isxdigit(peek())) v = v * 16 + (isdigit(peek()) ? src[pos++] - '0' : (tolower(src[pos++]) - 'a' + 10));
+                    return (char)v;
                 }
-                return;
+                default: return c;  // \\ \' \" \?
+            }
+        }
+
+        Token lexNumber() {
+            Token t{TOK_NUMBER, "", 0, false, line};
+            size_t start = pos;
+            if (peek() == '0' && (peek(1) == 'x' || peek(1) == 'X')) {
+                pos += 2;
+                while (isxdigit(peek())) pos++;
+                t.number = (double)strtoull(src.c_str() + start, nullptr, 16);
+            } else {
+                while (isdigit(peek())) pos++;
+                if (peek() == '.') { t.isFloat = true; pos++; while (isdigit(peek())) pos++; }
+                if (peek() == 'e' || peek() == 'E') {
+                    t.isFloat = true;
+                    pos++;
+                    if (peek() == '+' || peek() == '-') pos++;
+                    while (isdigit(peek())) pos++;
+                }
+                string digits = src.substr(start, pos - start);
+                if (t.isFloat) t.number = strtod(digits.c_str(), nullptr);
+                else if (digits.size() > 1 && digits[0] == '0') t.number = (double)strtoull(digits.c_str(), nullptr, 8);
+                else t.number = (double)strtoull(digits.c_str(), nullptr, 10);
             }
+            // Suffixes (u, l, f) do not change OmniVM semantics except f
+            while (isalpha(peek())) {
+                if (peek() == 'f' || peek() == 'F') t.isFloat = true;
+                pos++;
+            }
+            t.text = src.substr(start, pos - start);
+            return t;
+        }
 
-            // Variable assignments like "x = 5;"
-            size_t eqPos = code.find('=');
-            size_t semiPos = code.find(';');
-            if (eqPos != string::npos && semiPos != string::npos && eqPos < semiPos) {
-                string varName = code.substr(0, eqPos);
-                string expr = code.substr(eqPos + 1, semiPos);
+        void directive() {
+            // pos is just past '#'
+            size_t end = pos;
+            while (end < src.length() && src[end] != '\n') {
+                if (src[end] == '\\' && end + 1 < src.length() && src[end + 1] == '\n') end++;
+                end++;
+            }
+            string text = src.substr(pos, end - pos);
+            pos = end;
 
-                // Trim whitespace
-                size_t start = varName.find_first_not_of(" \t\n\r");
-                size_t end = varName.find_last_not_of(" \t\n\r");
-                if (start != string::npos) varName = varName.substr(start, end + 1);
+            size_t i = text.find_first_not_of(" \t");
+            if (i == string::npos || text.compare(i, 6, "define") != 0) return;
+            i = text.find_first_not_of(" \t", i + 6);
+            if (i == string::npos) return;
+            size_t nameEnd = i;
+            while (nameEnd < text.length() && (isalnum(text[nameEnd]) || text[nameEnd] == '_')) nameEnd++;
+            string name = text.substr(i, nameEnd - i);
+            if (nameEnd < text.length() && text[nameEnd] == '(') {
+                throw CompileError(line, "function-like macro '" + name + "' is not supported");
+            }
 
-                start = expr.find_first_not_of(" \t\n\r");
-                end = expr.find_last_not_of(" \t\n\r");
-                if (start != string::npos) expr = expr.substr(start, end + 1);
+            // Tokenize the replacement list with a nested lexer
+            string body = text.substr(nameEnd);
+            for (char& c : body) if (c == '\\' || c == '\n') c = ' ';
+            Lexer sub(body, symbols);
+            sub.line = line;
+            sub.macros = macros;
+            vector<Token> toks = sub.tokenize();
+            toks.pop_back();  // EOF
+            define(symbols.intern(name), toks);
+        }
 
-                double value = evaluateExpression(expr);
+        void define(SymbolId name, const vector<Token>& toks) {
+            if (vector<Token>* old = macros.find(name)) *old = toks;
+            else macros.insert(name, toks);
+        }
 
-                // Store variable
-                if (locals.find(varName) == locals.end()) {
-                    VarInfo info = {nextLocalAddr++, false, false};
-                    locals[varName] = info;
-                    while ((int)memory.size() <= nextLocalAddr) memory.push_back(0);
+        void expand(const Token& t, vector<Token>& out, vector<SymbolId>& active) {
+            if (t.kind == TOK_IDENT) {
+                const vector<Token>* body = macros.find(t.sym);
+                if (body) {
+                    for (SymbolId a : active) if (a == t.sym) { out.push_back(t); return; }
+                    active.push_back(t.sym);
+                    for (Token r : *body) {
+                        r.line = t.line;
+                        expand(r, out, active);
+                    }
+                    active.pop_back();
+                    return;
                 }
+            }
+            out.push_back(t);
+        }
 
-                if (locals.find(varName) != locals.end()) {
-                    memory[locals[varName].address] = value;
-                    output << varName << " = " << (int)value << "\n";
+    public:
+        Lexer(const string& source, Interner& names) : src(source), symbols(names) {
+            // Common library constants so student programs compile unchanged
+            auto num = [](double v) { Token t{TOK_NUMBER, "", v, false, 0}; return vector<Token>{t}; };
+            define(symbols.intern("NULL"), num(0));
+            define(symbols.intern("EOF"), num(-1));
+            define(symbols.intern("true"), num(1));
+            define(symbols.intern("false"), num(0));
+            define(symbols.intern("INT_MAX"), num(2147483647.0));
+            define(symbols.intern("INT_MIN"), num(-2147483648.0));
+            define(symbols.intern("RAND_MAX"), num(2147483647.0));
+            define(symbols.intern("EXIT_SUCCESS"), num(0));
+            define(symbols.intern("EXIT_FAILURE"), num(1));
+        }
+
+        vector<Token> tokenize() {
+            vector<Token> out;
+            out.reserve(src.size() / 4 + 16);
+            vector<SymbolId> active;
+            bool lineStart = true;
+
+            while (true) {
+                char c = peek();
+                if (c == 0) break;
+                if (c == '\n') { line++; pos++; lineStart = true; continue; }
+                if (isspace((unsigned char)c)) { pos++; continue; }
+                if (c == '/' && peek(1) == '/') {
+                    while (peek() && peek() != '\n') pos++;
+                    continue;
+                }
+                if (c == '/' && peek(1) == '*') {
+                    pos += 2;
+                    while (peek() && !(peek() == '*' && peek(1) == '/')) {
+                        if (peek() == '\n') line++;
+                        pos++;
+                    }
+                    if (!peek()) throw CompileError(line, "unterminated comment");
+                    pos += 2;
+                    continue;
+                }
+                if (c == '#' && lineStart) {
+                    pos++;
+                    directive();
+                    continue;
+                }
+                lineStart = false;
+
+                if (isdigit((unsigned char)c) || (c == '.' && isdigit((unsigned char)peek(1)))) {
+                    out.push_back(lexNumber());
+                    continue;
                 }
+                if (isalpha((unsigned char)c) || c == '_') {
+                    size_t start = pos;
+                    while (isalnum((unsigned char)peek()) || peek() == '_') pos++;
+                    Token t{TOK_IDENT, "", 0, false, line};
+                    t.sym = symbols.intern(string_view(src.data() + start, pos - start));
+                    expand(t, out, active);
+                    continue;
+                }
+                if (c == '"') {
+                    pos++;
+                    Token t{TOK_STRING, "", 0, false, line};
+                    while (peek() && peek() != '"') {
+                        if (peek() == '\n') throw CompileError(line, "unterminated string literal");
+                        if (peek() == '\\') { pos++; t.text += readEscape(); }
+                        else t.text += src[pos++];
+                    }
+                    if (!peek()) throw CompileError(line, "unterminated string literal");
+                    pos++;
+                    // Adjacent literals concatenate
+                    if (!out.empty() && out.back().kind == TOK_STRING) out.back().text += t.text;
+                    else out.push_back(t);
+                    continue;
+                }
+                if (c == '\'') {
+                    pos++;
+                    Token t{TOK_CHAR, "", 0, false, line};
+                    char v = peek() == '\\' ? (pos++, readEscape()) : src[pos++];
+                    if (peek() != '\'') throw CompileError(line, "unterminated character literal");
+                    pos++;
+                    t.number = (double)(int8_t)v;
+                    out.push_back(t);
+                    continue;
+                }
+
+                static const char* puncts[] = {
+                    "<<=", ">>=", "...", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=",
+                    "&&", "||", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", nullptr
+                };
+                Token t{TOK_PUNCT, "", 0, false, line};
+                for (int i = 0; puncts[i]; i++) {
+                    if (puncts[i][0] != c) continue;
+                    size_t len = strlen(puncts[i]);
+                    if (src.compare(pos, len, puncts[i]) == 0) { t.text = puncts[i]; break; }
+                }
+                if (t.text.empty()) {
+                    if (!strchr("+-*/%=<>!&|^~?:;,.(){}[]", c)) {
+                        throw CompileError(line, string("unexpected character '") + c + "'");
+                    }
+                    t.text = string(1, c);
+                }
+                pos += t.text.length();
+                t.sym = symbols.intern(t.text);
+                out.push_back(t);
+            }
+
+            out.push_back({TOK_EOF, "", 0, false, line});
+            return out;
+        }
+    };
+
+    // ============== AST ==============
+    enum ExprKind {
+        EX_NUM,      // num
+        EX_STR,      // num = data segment address
+        EX_VAR,      // sym
+        EX_UNARY,    // op lhs (SUB = negate, LOGICAL_NOT, BIT_NOT)
+        EX_BINARY,   // lhs op rhs
+        EX_LOGICAL,  // lhs &&/|| rhs (op = LOGICAL_AND / LOGICAL_OR)
+        EX_ASSIGN,   // lhs = rhs, or lhs op= rhs when op != NOOP
+        EX_COND,     // cond ? lhs : rhs
+        EX_CALL,     // name(args)
+        EX_DEREF,    // *lhs
+        EX_ADDR,     // &lhs
+        EX_CAST,     // (type)lhs
+        EX_INCDEC,   // ++/-- lhs, prefix or postfix
+        EX_COMMA     // lhs, rhs
+    };
+
+    struct Expr {
+        ExprKind kind;
+        int line = 0;
+        Type* type = nullptr;
+        OpCode op = NOOP;
+        double num = 0;
+        bool prefix = false;
+        bool increment = false;
+        Symbol* sym = nullptr;
+        string name;
+        unique_ptr<Expr> lhs, rhs, cond;
+        vector<unique_ptr<Expr>> args;
+
+        Expr(ExprKind k, int l) : kind(k), line(l) {}
+    };
+
+    enum StmtKind {
+        ST_EXPR, ST_BLOCK, ST_IF, ST_WHILE, ST_DO, ST_FOR, ST_RETURN,
+        ST_BREAK, ST_CONTINUE, ST_SWITCH, ST_CASE, ST_DEFAULT, ST_EMPTY
+    };
+
+    struct Stmt {
+        StmtKind kind;
+        int line = 0;
+        unique_ptr<Expr> expr;        // ST_EXPR, ST_RETURN, conditions
+        unique_ptr<Expr> step;        // ST_FOR
+        unique_ptr<Stmt> init;        // ST_FOR
+        unique_ptr<Stmt> body, elseBody;
+        vector<unique_ptr<Stmt>> stmts;  // ST_BLOCK
+        double caseValue = 0;         // ST_CASE
+        int tempSlot = 0;             // ST_SWITCH: frame offset of the scrutinee
+
+        Stmt(StmtKind k, int l) : kind(k), line(l) {}
+    };
+
+    struct Function {
+        string name;
+        Type* returnType = nullptr;
+        vector<Symbol*> params;
+        unique_ptr<Stmt> body;
+        int frameSize = 0;
+        int line = 0;
+        bool defined = false;
+    };
+
+    // ============== TYPES ==============
+    // Every scalar occupies one 8-byte VM slot except char, which is a byte
+    inline int sizeOf(const Type* t) {
+        switch (t->kind) {
+            case TYPE_CHAR: return 1;
+            case TYPE_ARRAY: return t->arraySize * sizeOf(t->base);
+            case TYPE_VOID: return 1;
+            default: return 8;
+        }
+    }
+    inline bool isIntegral(const Type* t) { return t->kind == TYPE_INT || t->kind == TYPE_CHAR; }
+    inline bool isPointer(const Type* t) { return t->kind == TYPE_PTR || t->kind == TYPE_ARRAY; }
+    inline bool isArithmetic(const Type* t) { return isIntegral(t) || t->kind == TYPE_DOUBLE; }
+
+    // ============== PARSER ==============
+    // Recursive-descent parser. Builds the AST and resolves names and types
+    // as it goes; globals and string literals are laid out in the data segment.
+    struct BinOp { const char* text; int prec; OpCode op; };
+
+    const BinOp BINARY_OPS[] = {
+        {"||", 1, LOGICAL_OR}, {"&&", 2, LOGICAL_AND},
+        {"|", 3, BIT_OR}, {"^", 4, BIT_XOR}, {"&", 5, BIT_AND},
+        {"==", 6, EQ}, {"!=", 6, NEQ},
+        {"<", 7, LT}, {">", 7, GT}, {"<=", 7, LTE}, {">=", 7, GTE},
+        {"<<", 8, SHL}, {">>", 8, SHR},
+        {"+", 9, ADD}, {"-", 9, SUB},
+        {"*", 10, MUL}, {"/", 10, DIV}, {"%", 10, MOD}
+    };
+
+    const pair<const char*, OpCode> ASSIGN_OPS[] = {
+        {"=", NOOP}, {"+=", ADD}, {"-=", SUB}, {"*=", MUL}, {"/=", DIV}, {"%=", MOD},
+        {"&=", BIT_AND}, {"|=", BIT_OR}, {"^=", BIT_XOR}, {"<<=", SHL}, {">>=", SHR}
+    };
+
+    class Parser {
+        Interner symbols{RESERVED_WORDS};
+        vector<Token> toks;
+        size_t p = 0;
+        Program& prog;
+
+        deque<Type> typePool;
+        deque<Symbol> symbolPool;
+        vector<FlatMap<Symbol*>> scopes;  // scopes[0] = globals
+        map<string, Function>& functions;
+        FlatMap<Function*> functionIndex;   // The same functions by symbol
+        FlatMap<const BinOp*> binaryOps;
+        FlatMap<OpCode> assignOps;
+        map<string, size_t> stringAddrs;
+
+        Function* currentFn = nullptr;
+        int frameOffset = 0;
+
+    public:
+        Type* intType;
+        Type* charType;
+        Type* doubleType;
+        Type* voidType;
+        vector<unique_ptr<Stmt>> globalInits;
+
+    private:
+        const Token& cur() { return toks[p]; }
+        bool is(const char* text) { return cur().kind == TOK_PUNCT && cur().text == text; }
+        bool isWord(const char* text) { return cur().kind == TOK_IDENT && symbols.name(cur().sym) == text; }
+        bool accept(const char* text) {
+            if (is(text) || isWord(text)) { p++; return true; }
+            return false;
+        }
+        void expect(const char* text) {
+            if (!accept(text)) {
+                string got = cur().kind == TOK_EOF ? "end of input" : "'" + spelling(cur()) + "'";
+                throw CompileError(cur().line, string("expected '") + text + "' before " + got);
             }
         }
+        SymbolId expectIdent() {
+            if (cur().kind != TOK_IDENT) throw CompileError(cur().line, "expected identifier");
+            return toks[p++].sym;
+        }
+        string nameOf(SymbolId id) { return string(symbols.name(id)); }
+        string spelling(const Token& t) { return t.kind == TOK_IDENT ? nameOf(t.sym) : t.text; }
+
+        Type* makeType(TypeKind kind, Type* base = nullptr, int arraySize = 0) {
+            typePool.push_back(Type{kind, base, false, arraySize});
+            return &typePool.back();
+        }
+        Type* pointerTo(Type* t) { return makeType(TYPE_PTR, t); }
+        Type* decay(Type* t) { return t->kind == TYPE_ARRAY ? pointerTo(t->base) : t; }
 
-        double evaluateExpression(string expr) {
-            // Handle simple arithmetic
-            // Number literals
-            if (expr.empty()) return 0;
+        bool isTypeStart() { return cur().kind == TOK_IDENT && cur().sym < TYPE_WORD_COUNT; }
 
-            // Try to parse as number
-            try {
-                size_t pos = 0;
-                while (pos < expr.length() && (isdigit(expr[pos]) || expr[pos] == '.')) pos++;
-                if (pos > 0) {
-                    return stod(expr.substr(0, pos));
+        // Parses declaration specifiers; returns the base type
+        Type* parseBaseType() {
+            Type* t = nullptr;
+            bool sawInt = false;
+            while (isTypeStart()) {
+                switch (toks[p++].sym) {
+                    case W_CHAR: t = charType; break;
+                    case W_DOUBLE: case W_FLOAT: t = doubleType; break;
+                    case W_VOID: t = voidType; break;
+                    case W_LONG:
+                        if (t == doubleType) break;  // long double
+                        sawInt = true;
+                        break;
+                    case W_INT: case W_SHORT: case W_UNSIGNED: case W_SIGNED:
+                    case W_BOOL: case W__BOOL: case W_SIZE_T:
+                        sawInt = true;
+                        break;
+                    default: break;  // const/static/extern/... do not affect OmniVM codegen
                 }
-            } catch (...) {}
+            }
+            if (!t) t = sawInt ? intType : nullptr;
+            if (!t) throw CompileError(cur().line, "expected type name");
+            return t;
+        }
 
-            // Variable lookup
-            if (locals.find(expr) != locals.end()) {
-                return memory[locals[expr].address];
+        Type* parsePointers(Type* t) {
+            while (accept("*")) {
+                t = pointerTo(t);
+                while (accept("const") || accept("volatile")) {}
             }
+            return t;
+        }
 
-            return 0;
+        Type* parseArraySuffix(Type* t) {
+            if (!accept("[")) return t;
+            int size = -1;  // Unsized: filled in from the initializer
+            if (!is("]")) {
+                unique_ptr<Expr> e = parseConditional();
+                if (e->kind != EX_NUM) throw CompileError(e->line, "array size must be a constant");
+                int64_t n = doubleToInt(e->num);
+                if (n <= 0) throw CompileError(e->line, "array size must be positive");
+                if (n > INT32_MAX) throw CompileError(e->line, "array is too large");
+                size = (int)n;
+            }
+            expect("]");
+            Type* elem = parseArraySuffix(t);
+            return makeType(TYPE_ARRAY, elem, size);
+        }
+
+        // Only the first dimension can be left to the initializer
+        bool innerDimensionMissing(const Type* t) {
+            if (t->kind != TYPE_ARRAY) return false;
+            for (t = t->base; t->kind == TYPE_ARRAY; t = t->base) {
+                if (t->arraySize < 0) return true;
+            }
+            return false;
+        }
+
+        Symbol* lookup(SymbolId id) {
+            for (size_t i = scopes.size(); i-- > 0;) {
+                if (Symbol** sym = scopes[i].find(id)) return *sym;
+            }
+            return nullptr;
+        }
+
+        Symbol* declare(SymbolId id, Type* type, int line) {
+            auto& scope = scopes.back();
+            string name = nameOf(id);
+            if (scope.find(id)) throw CompileError(line, "redefinition of '" + name + "'");
+            symbolPool.push_back(Symbol(name, *type));
+            Symbol* sym = &symbolPool.back();
+            sym->type.base = type->base;
+            sym->isGlobal = scopes.size() == 1;
+            int size = (sizeOf(type) + 7) & ~7;
+            if (sym->isGlobal) {
+                sym->address = allocData(size);
+                prog.globals[name] = *sym;
+            } else {
+                sym->address = frameOffset;
+                frameOffset += size;
+                if (frameOffset > currentFn->frameSize) currentFn->frameSize = frameOffset;
+            }
+            scope.insert(id, sym);
+            return sym;
+        }
+
+        int allocData(int size) {
+            int addr = ((int)prog.dataSegment.size() + 7) & ~7;
+            prog.dataSegment.resize(addr + size, 0);
+            prog.nextGlobalAddr = (int)prog.dataSegment.size();
+            return addr;
         }
 
     public:
-        CInterpreter(string src) : source(src), pos(0), lineNum(1), memory(10000, 0) {
-            // Initialize standard variables
-            globals["INT_MAX"] = {2147483647, false, false};
+        size_t internString(const string& s) {
+            auto it = stringAddrs.find(s);
+            if (it != stringAddrs.end()) return it->second;
+            size_t addr = prog.dataSegment.size();
+            prog.dataSegment.insert(prog.dataSegment.end(), s.begin(), s.end());
+            prog.dataSegment.push_back(0);
+            prog.nextStringAddr = (int)prog.dataSegment.size();
+            stringAddrs[s] = addr;
+            return addr;
+        }
+
+    private:
+        // ---------- Expressions ----------
+        unique_ptr<Expr> make(ExprKind k, int line, Type* type) {
+            auto e = make_unique<Expr>(k, line);
+            e->type = type;
+            return e;
+        }
+
+        unique_ptr<Expr> number(double v, Type* type, int line) {
+            auto e = make(EX_NUM, line, type);
+            e->num = v;
+            return e;
+        }
+
+        bool isLvalue(const Expr* e) {
+            return (e->kind == EX_VAR || e->kind == EX_DEREF) && e->type->kind != TYPE_ARRAY;
+        }
+
+        unique_ptr<Expr> parseExpression() {
+            auto e = parseAssignment();
+            while (is(",")) {
+                int line = toks[p++].line;
+                auto rhs = parseAssignment();
+                auto c = make(EX_COMMA, line, rhs->type);
+                c->lhs = move(e);
+                c->rhs = move(rhs);
+                e = move(c);
+            }
+            return e;
+        }
+
+        unique_ptr<Expr> parseAssignment() {
+            auto lhs = parseConditional();
+            const OpCode* op = cur().kind == TOK_PUNCT ? assignOps.find(cur().sym) : nullptr;
+            if (!op) return lhs;
+            int line = toks[p++].line;
+            if (!isLvalue(lhs.get())) throw CompileError(line, "expression is not assignable");
+            auto e = make(EX_ASSIGN, line, lhs->type);
+            e->op = *op;
+            e->rhs = parseAssignment();
+            if (e->rhs->type->kind == TYPE_VOID) throw CompileError(line, "void value not ignored");
+            e->lhs = move(lhs);
+            return e;
+        }
+
+        unique_ptr<Expr> parseConditional() {
+            auto c = parseBinary(0);
+            if (!is("?")) return c;
+            int line = toks[p++].line;
+            auto a = parseExpression();
+            expect(":");
+            auto b = parseConditional();
+            Type* t = a->type;
+            if (a->type->kind == TYPE_DOUBLE || b->type->kind == TYPE_DOUBLE) t = doubleType;
+            else if (isPointer(a->type)) t = decay(a->type);
+            else if (isPointer(b->type)) t = decay(b->type);
+            auto e = make(EX_COND, line, t);
+            e->cond = move(c);
+            e->lhs = move(a);
+            e->rhs = move(b);
+            return e;
+        }
+
+        unique_ptr<Expr> parseBinary(int minPrec) {
+            auto lhs = parseUnary();
+            while (true) {
+                const BinOp* const* op = cur().kind == TOK_PUNCT ? binaryOps.find(cur().sym) : nullptr;
+                const BinOp* found = op ? *op : nullptr;
+                if (!found || found->prec <= minPrec) return lhs;
+                int line = toks[p++].line;
+                auto rhs = parseBinary(found->prec);
+                lhs = binary(found->op, move(lhs), move(rhs), line);
+            }
+        }
+
+        // Type-checks a binary operation and folds integer/double constants
+        unique_ptr<Expr> binary(OpCode op, unique_ptr<Expr> a, unique_ptr<Expr> b, int line) {
+            if (a->type->kind == TYPE_VOID || b->type->kind == TYPE_VOID) {
+                throw CompileError(line, "invalid use of void expression");
+            }
+            if (op == LOGICAL_AND || op == LOGICAL_OR) {
+                auto e = make(EX_LOGICAL, line, intType);
+                e->op = op;
+                e->lhs = move(a);
+                e->rhs = move(b);
+                return e;
+            }
+
+            Type* t = intType;
+            bool pa = isPointer(a->type), pb = isPointer(b->type);
+            switch (op) {
+                case ADD:
+                    if (pa && pb) throw CompileError(line, "invalid operands to binary +");
+                    if (pa) t = decay(a->type);
+                    else if (pb) t = decay(b->type);
+                    else if (a->type->kind == TYPE_DOUBLE || b->type->kind == TYPE_DOUBLE) t = doubleType;
+                    break;
+                case SUB:
+                    if (pa && !pb) t = decay(a->type);
+                    else if (pb && !pa) throw CompileError(line, "invalid operands to binary -");
+                    else if (!pa && (a->type->kind == TYPE_DOUBLE || b->type->kind == TYPE_DOUBLE)) t = doubleType;
+                    break;
+                case MUL: case DIV:
+                    if (pa || pb) throw CompileError(line, "invalid operands to binary operator");
+                    if (a->type->kind == TYPE_DOUBLE || b->type->kind == TYPE_DOUBLE) t = doubleType;
+                    break;
+                case MOD: case BIT_AND: case BIT_OR: case BIT_XOR: case SHL: case SHR:
+                    if (!isIntegral(a->type) || !isIntegral(b->type)) {
+                        throw CompileError(line, "invalid operands to integer operator");
+                    }
+                    break;
+                default:  // comparisons
+                    break;
+            }
+
+            if (a->kind == EX_NUM && b->kind == EX_NUM && !isPointer(t)) {
+                double x = a->num, y = b->num, r = 0;
+                // Integer operators fold with the VM's own helpers, so a
+                // constant comes out as it would at run time
+                int64_t i = doubleToInt(x), j = doubleToInt(y);
+                bool integral = isIntegral(t);
+                switch (op) {
+                    case ADD: r = x + y; break;
+                    case SUB: r = x - y; break;
+                    case MUL: r = x * y; break;
+                    case DIV:
+                        if (y == 0) goto nofold;
+                        r = integral ? (double)intDiv(i, j) : x / y;
+                        break;
+                    case MOD:
+                        if (y == 0) goto nofold;
+                        r = (double)intMod(i, j);
+                        break;
+                    case BIT_AND: r = (double)(i & j); break;
+                    case BIT_OR: r = (double)(i | j); break;
+                    case BIT_XOR: r = (double)(i ^ j); break;
+                    case SHL: r = (double)(int64_t)((uint64_t)i << (j & 63)); break;
+                    case SHR: r = (double)(i >> (j & 63)); break;
+                    case EQ: r = x == y; break;
+                    case NEQ: r = x != y; break;
+                    case LT: r = x < y; break;
+                    case GT: r = x > y; break;
+                    case LTE: r = x <= y; break;
+                    case GTE: r = x >= y; break;
+                    default: goto nofold;
+                }
+                return number(r, t, line);
+            }
+        nofold:
+            auto e = make(EX_BINARY, line, t);
+            e->op = op;
+            e->lhs = move(a);
+            e->rhs = move(b);
+            return e;
+        }
+
+        unique_ptr<Expr> parseUnary() {
+            int line = cur().line;
+            if (accept("-")) {
+                auto a = parseUnary();
+                if (!isArithmetic(a->type)) throw CompileError(line, "invalid operand to unary -");
+                if (a->kind == EX_NUM) { a->num = -a->num; return a; }
+                auto e = make(EX_UNARY, line, a->type->kind == TYPE_CHAR ? intType : a->type);
+                e->op = SUB;
+                e->lhs = move(a);
+                return e;
+            }
+            if (accept("+")) return parseUnary();
+            if (accept("!")) {
+                auto a = parseUnary();
+                if (a->kind == EX_NUM) return number(a->num == 0, intType, line);
+                auto e = make(EX_UNARY, line, intType);
+                e->op = LOGICAL_NOT;
+                e->lhs = move(a);
+                return e;
+            }
+            if (accept("~")) {
+                auto a = parseUnary();
+                if (!isIntegral(a->type)) throw CompileError(line, "invalid operand to unary ~");
+                if (a->kind == EX_NUM) return number((double)~doubleToInt(a->num), intType, line);
+                auto e = make(EX_UNARY, line, intType);
+                e->op = BIT_NOT;
+                e->lhs = move(a);
+                return e;
+            }
+            if (accept("*")) {
+                auto a = parseUnary();
+                return deref(move(a), line);
+            }
+            if (accept("&")) {
+                auto a = parseUnary();
+                if (a->kind == EX_DEREF) {
+                    // &*p == p
+                    auto inner = move(a->lhs);
+                    return inner;
+                }
+                if (a->kind != EX_VAR) throw CompileError(line, "cannot take the address of an rvalue");
+                auto e = make(EX_ADDR, line, pointerTo(a->type));
+                e->lhs = move(a);
+                return e;
+            }
+            if (is("++") || is("--")) {
+                bool inc = toks[p++].text == "++";
+                auto a = parseUnary();
+                return incdec(move(a), inc, true, line);
+            }
+            if (isWord("sizeof")) {
+                p++;
+                int size;
+                if (is("(") && isTypeAt(p + 1)) {
+                    p++;
+                    Type* t = parseArraySuffix(parsePointers(parseBaseType()));
+                    expect(")");
+                    size = sizeOf(t);
+                } else {
+                    auto a = parseUnary();
+                    size = sizeOf(a->type);
+                }
+                return number(size, intType, line);
+            }
+            if (is("(") && isTypeAt(p + 1)) {
+                p++;
+                Type* t = parsePointers(parseBaseType());
+                expect(")");
+                auto a = parseUnary();
+                if (a->kind == EX_NUM && isIntegral(t)) return number((double)doubleToInt(a->num), t, line);
+                if (a->kind == EX_NUM && t->kind == TYPE_DOUBLE) { a->type = t; return a; }
+                auto e = make(EX_CAST, line, t);
+                e->lhs = move(a);
+                return e;
+            }
+            return parsePostfix();
         }
 
-        vector<string> execute() {
-            vector<string> results;
-            output.str("");
+        bool isTypeAt(size_t at) {
+            size_t save = p;
+            p = at;
+            bool r = isTypeStart();
+            p = save;
+            return r;
+        }
 
-            // Split by statements (semicolons)
-            vector<string> statements;
-            string current;
-            bool inString = false;
-            bool inComment = false;
+        unique_ptr<Expr> deref(unique_ptr<Expr> a, int line) {
+            if (!isPointer(a->type)) throw CompileError(line, "indirection requires pointer operand");
+            Type* t = a->type->base;
+            if (t->kind == TYPE_VOID) throw CompileError(line, "dereferencing 'void *' pointer");
+            auto e = make(EX_DEREF, line, t);
+            e->lhs = move(a);
+            return e;
+        }
 
-            for (size_t i = 0; i < source.length(); i++) {
-                char c = source[i];
+        unique_ptr<Expr> incdec(unique_ptr<Expr> a, bool inc, bool prefix, int line) {
+            if (!isLvalue(a.get())) throw CompileError(line, "expression is not assignable");
+            auto e = make(EX_INCDEC, line, a->type);
+            e->increment = inc;
+            e->prefix = prefix;
+            e->lhs = move(a);
+            return e;
+        }
 
-                // Handle strings
-                if (c == '"' && (i == 0 || source[i-1] != '\\')) {
-                    inString = !inString;
+        unique_ptr<Expr> parsePostfix() {
+            auto e = parsePrimary();
+            while (true) {
+                int line = cur().line;
+                if (accept("[")) {
+                    auto idx = parseExpression();
+                    expect("]");
+                    e = deref(binary(ADD, move(e), move(idx), line), line);
+                } else if (is("++") || is("--")) {
+                    bool inc = toks[p++].text == "++";
+                    e = incdec(move(e), inc, false, line);
+                } else if (is("(")) {
+                    throw CompileError(line, "called object is not a function");
+                } else {
+                    return e;
                 }
+            }
+        }
 
-                // Skip comments
-                if (!inString && c == '/' && i + 1 < source.length() && source[i+1] == '/') {
-                    inComment = true;
+        // The Function called `id`, created on first mention
+        Function& function(SymbolId id) {
+            if (Function** fn = functionIndex.find(id)) return **fn;
+            string name = nameOf(id);
+            Function& fn = functions[name];
+            fn.name = name;
+            functionIndex.insert(id, &fn);
+            return fn;
+        }
+
+        unique_ptr<Expr> parseCall(SymbolId id, int line) {
+            string name = nameOf(id);
+            auto e = make(EX_CALL, line, intType);
+            e->name = name;
+            expect("(");
+            if (!is(")")) {
+                do {
+                    e->args.push_back(parseAssignment());
+                } while (accept(","));
+            }
+            expect(")");
+
+            if (Function** fn = functionIndex.find(id)) {
+                e->type = (*fn)->returnType;
+                if (e->args.size() != (*fn)->params.size()) {
+                    throw CompileError(line, "wrong number of arguments to '" + name + "'");
+                }
+            } else if (isBuiltin(name) || name == "exit") {
+                e->type = builtinType(name, e->args.size(), line);
+            } else {
+                // Implicit declaration: int name(...), must be defined later
+                Function& f = function(id);
+                f.returnType = intType;
+                f.line = line;
+                f.params.resize(e->args.size(), nullptr);
+            }
+            return e;
+        }
+
+        Type* builtinType(const string& name, size_t argc, int line) {
+            int id = builtinIndex(name);
+            if (id >= 0) {
+                if ((int)argc != BUILTINS[id].argc()) {
+                    throw CompileError(line, "wrong number of arguments to '" + name + "'");
                 }
-                if (inComment && c == '\n') {
-                    inComment = false;
+                switch (BUILTINS[id].signature[0]) {
+                    case 'd': return doubleType;
+                    case 's': return pointerTo(charType);
+                    case 'p': return pointerTo(voidType);
+                    default: return intType;
+                }
+            }
+            if (name == "printf" || name == "puts" || name == "putchar") return intType;
+            if (name == "malloc" || name == "calloc" || name == "realloc") return pointerTo(voidType);
+            if (name == "free" || name == "exit") return voidType;
+            throw CompileError(line, "built-in '" + name + "' is not supported yet");
+        }
+
+        unique_ptr<Expr> parsePrimary() {
+            const Token& t = cur();
+            int line = t.line;
+            if (t.kind == TOK_NUMBER) {
+                p++;
+                return number(t.number, t.isFloat ? doubleType : intType, line);
+            }
+            if (t.kind == TOK_CHAR) {
+                p++;
+                return number(t.number, intType, line);
+            }
+            if (t.kind == TOK_STRING) {
+                p++;
+                auto e = make(EX_STR, line, pointerTo(charType));
+                e->num = (double)internString(t.text);
+                e->name = t.text;
+                return e;
+            }
+            if (t.kind == TOK_IDENT) {
+                SymbolId id = t.sym;
+                p++;
+                if (is("(")) return parseCall(id, line);
+                Symbol* sym = lookup(id);
+                if (!sym) throw CompileError(line, "use of undeclared identifier '" + nameOf(id) + "'");
+                auto e = make(EX_VAR, line, &sym->type);
+                e->sym = sym;
+                return e;
+            }
+            if (accept("(")) {
+                auto e = parseExpression();
+                expect(")");
+                return e;
+            }
+            if (t.kind == TOK_EOF) throw CompileError(line, "unexpected end of input");
+            throw CompileError(line, "unexpected '" + spelling(t) + "'");
+        }
+
+        // ---------- Statements ----------
+        unique_ptr<Stmt> stmt(StmtKind k, int line) { return make_unique<Stmt>(k, line); }
+
+        unique_ptr<Stmt> exprStmt(unique_ptr<Expr> e) {
+            auto s = stmt(ST_EXPR, e->line);
+            s->expr = move(e);
+            return s;
+        }
+
+        unique_ptr<Expr> varRef(Symbol* sym, int line) {
+            auto e = make(EX_VAR, line, &sym->type);
+            e->sym = sym;
+            return e;
+        }
+
+        unique_ptr<Expr> assign(unique_ptr<Expr> lhs, unique_ptr<Expr> rhs, int line) {
+            auto e = make(EX_ASSIGN, line, lhs->type);
+            e->lhs = move(lhs);
+            e->rhs = move(rhs);
+            return e;
+        }
+
+        unique_ptr<Expr> element(Symbol* sym, int index, int line) {
+            return deref(binary(ADD, varRef(sym, line), number(index, intType, line), line), line);
+        }
+
+        // Element count of the initializer at the cursor (-1 if not a list)
+        int initializerLength() {
+            if (cur().kind == TOK_STRING) return (int)cur().text.size() + 1;
+            if (!is("{")) return -1;
+            int depth = 0, count = 0;
+            bool pending = false;
+            for (size_t i = p; toks[i].kind != TOK_EOF; i++) {
+                const Token& t = toks[i];
+                if (t.kind == TOK_PUNCT && (t.text == "{" || t.text == "(" || t.text == "[")) {
+                    if (depth++ == 0) continue;
+                } else if (t.kind == TOK_PUNCT && (t.text == "}" || t.text == ")" || t.text == "]")) {
+                    if (--depth == 0) return count + (pending ? 1 : 0);
+                } else if (depth == 1 && t.kind == TOK_PUNCT && t.text == ",") {
+                    count++;
+                    pending = false;
                     continue;
                 }
-                if (inComment) continue;
+                pending = true;
+            }
+            return -1;
+        }
 
-                if (c == '\n') {
-                    lineNum++;
-                    if (!current.empty()) {
-                        statements.push_back(current);
-                        current.clear();
+        // Lowers an initializer into assignments appended to `out`
+        void parseInitializer(Symbol* sym, Type* type, vector<unique_ptr<Stmt>>& out, int line) {
+            if (type->kind == TYPE_ARRAY) {
+                if (type->base->kind == TYPE_CHAR && cur().kind == TOK_STRING) {
+                    string s = toks[p++].text;
+                    if (type->arraySize < 0) type->arraySize = (int)s.size() + 1;
+                    for (int i = 0; i < type->arraySize; i++) {
+                        double c = i < (int)s.size() ? (double)(int8_t)s[i] : 0;
+                        out.push_back(exprStmt(assign(element(sym, i, line), number(c, intType, line), line)));
                     }
-                } else if (c == ';' && !inString) {
-                    current += c;
-                    statements.push_back(current);
-                    current.clear();
+                    return;
+                }
+                expect("{");
+                vector<unique_ptr<Expr>> values;
+                if (!is("}")) {
+                    do {
+                        if (is("}")) break;
+                        values.push_back(parseAssignment());
+                    } while (accept(","));
+                }
+                expect("}");
+                if (type->arraySize < 0) type->arraySize = (int)values.size();
+                if ((int)values.size() > type->arraySize) throw CompileError(line, "excess elements in array initializer");
+                if (type->base->kind == TYPE_ARRAY) throw CompileError(line, "nested array initializers are not supported");
+                for (int i = 0; i < type->arraySize; i++) {
+                    auto v = i < (int)values.size() ? move(values[i]) : number(0, intType, line);
+                    out.push_back(exprStmt(assign(element(sym, i, line), move(v), line)));
+                }
+                return;
+            }
+            auto v = parseAssignment();
+            out.push_back(exprStmt(assign(varRef(sym, line), move(v), line)));
+        }
+
+        // Parses "type declarator [= init], ..." and returns the initializers
+        unique_ptr<Stmt> parseDeclaration() {
+            int line = cur().line;
+            Type* base = parseBaseType();
+            auto block = stmt(ST_BLOCK, line);
+            if (accept(";")) return block;
+            do {
+                Type* t = parsePointers(base);
+                int nameLine = cur().line;
+                SymbolId id = expectIdent();
+                string name = nameOf(id);
+                t = parseArraySuffix(t);
+                if (t->kind == TYPE_VOID) throw CompileError(nameLine, "variable '" + name + "' declared void");
+                if (innerDimensionMissing(t)) throw CompileError(nameLine, "array size missing in '" + name + "'");
+
+                if (accept("=")) {
+                    // Unsized arrays take their size from the initializer
+                    if (t->kind == TYPE_ARRAY && t->arraySize < 0) t->arraySize = initializerLength();
+                    if (t->kind == TYPE_ARRAY && t->arraySize < 0) {
+                        throw CompileError(nameLine, "array size missing in '" + name + "'");
+                    }
+                    Symbol* sym = declare(id, t, nameLine);
+                    parseInitializer(sym, &sym->type, block->stmts, nameLine);
+                } else {
+                    if (t->kind == TYPE_ARRAY && t->arraySize < 0) {
+                        throw CompileError(nameLine, "array size missing in '" + name + "'");
+                    }
+                    declare(id, t, nameLine);
+                }
+            } while (accept(","));
+            expect(";");
+            return block;
+        }
+
+        unique_ptr<Stmt> parseBlock() {
+            int line = cur().line;
+            expect("{");
+            scopes.emplace_back();
+            auto block = stmt(ST_BLOCK, line);
+            while (!is("}")) {
+                if (cur().kind == TOK_EOF) throw CompileError(line, "expected '}' at end of input");
+                block->stmts.push_back(parseStatement());
+            }
+            p++;
+            scopes.pop_back();
+            return block;
+        }
+
+        unique_ptr<Stmt> parseStatement() {
+            int line = cur().line;
+            if (is("{")) return parseBlock();
+            if (accept(";")) return stmt(ST_EMPTY, line);
+            if (isTypeStart()) return parseDeclaration();
+
+            if (accept("if")) {
+                auto s = stmt(ST_IF, line);
+                expect("(");
+                s->expr = parseExpression();
+                expect(")");
+                s->body = parseStatement();
+                if (accept("else")) s->elseBody = parseStatement();
+                return s;
+            }
+            if (accept("while")) {
+                auto s = stmt(ST_WHILE, line);
+                expect("(");
+                s->expr = parseExpression();
+                expect(")");
+                s->body = parseStatement();
+                return s;
+            }
+            if (accept("do")) {
+                auto s = stmt(ST_DO, line);
+                s->body = parseStatement();
+                expect("while");
+                expect("(");
+                s->expr = parseExpression();
+                expect(")");
+                expect(";");
+                return s;
+            }
+            if (accept("for")) {
+                auto s = stmt(ST_FOR, line);
+                scopes.emplace_back();
+                expect("(");
+                if (isTypeStart()) s->init = parseDeclaration();
+                else if (!accept(";")) { s->init = exprStmt(parseExpression()); expect(";"); }
+                if (!is(";")) s->expr = parseExpression();
+                expect(";");
+                if (!is(")")) s->step = parseExpression();
+                expect(")");
+                s->body = parseStatement();
+                scopes.pop_back();
+                return s;
+            }
+            if (accept("switch")) {
+                auto s = stmt(ST_SWITCH, line);
+                expect("(");
+                s->expr = parseExpression();
+                expect(")");
+                s->tempSlot = frameOffset;
+                frameOffset += 8;
+                if (frameOffset > currentFn->frameSize) currentFn->frameSize = frameOffset;
+                s->body = parseStatement();
+                return s;
+            }
+            if (accept("case")) {
+                auto s = stmt(ST_CASE, line);
+                auto v = parseConditional();
+                if (v->kind != EX_NUM) throw CompileError(line, "case label must be a constant");
+                s->caseValue = v->num;
+                expect(":");
+                return s;
+            }
+            if (accept("default")) {
+                expect(":");
+                return stmt(ST_DEFAULT, line);
+            }
+            if (accept("break")) { expect(";"); return stmt(ST_BREAK, line); }
+            if (accept("continue")) { expect(";"); return stmt(ST_CONTINUE, line); }
+            if (accept("return")) {
+                auto s = stmt(ST_RETURN, line);
+                if (!is(";")) s->expr = parseExpression();
+                expect(";");
+                if (s->expr && currentFn->returnType->kind == TYPE_VOID) {
+                    throw CompileError(line, "void function '" + currentFn->name + "' should not return a value");
+                }
+                return s;
+            }
+
+            auto s = exprStmt(parseExpression());
+            expect(";");
+            return s;
+        }
+
+        void parseFunction(Type* returnType, SymbolId id, int line) {
+            Function& fn = function(id);
+            if (fn.defined) throw CompileError(line, "redefinition of '" + fn.name + "'");
+            fn.returnType = returnType;
+            fn.line = line;
+            fn.params.clear();
+
+            currentFn = &fn;
+            frameOffset = 0;
+            fn.frameSize = 0;
+            scopes.emplace_back();
+
+            expect("(");
+            if (isWord("void") && toks[p + 1].kind == TOK_PUNCT && toks[p + 1].text == ")") p++;
+            if (!is(")")) {
+                do {
+                    int pline = cur().line;
+                    Type* t = parsePointers(parseBaseType());
+                    SymbolId pname = cur().kind == TOK_IDENT ? expectIdent() : NO_SYMBOL;
+                    if (accept("[")) {
+                        while (!accept("]")) p++;
+                        t = pointerTo(t);
+                    }
+                    if (pname == NO_SYMBOL) pname = symbols.intern("$arg" + to_string(fn.params.size()));
+                    fn.params.push_back(declare(pname, t, pline));
+                } while (accept(","));
+            }
+            expect(")");
+
+            if (accept(";")) {
+                // Prototype only
+                scopes.pop_back();
+                currentFn = nullptr;
+                return;
+            }
+
+            fn.defined = true;
+            fn.body = parseBlock();
+            scopes.pop_back();
+            currentFn = nullptr;
+        }
+
+    public:
+        Parser(const string& source, Program& program, map<string, Function>& fns)
+            : prog(program), functions(fns) {
+            toks = Lexer(source, symbols).tokenize();
+            for (const BinOp& op : BINARY_OPS) binaryOps.insert(symbols.intern(op.text), &op);
+            for (const auto& op : ASSIGN_OPS) assignOps.insert(symbols.intern(op.first), op.second);
+            intType = makeType(TYPE_INT);
+            charType = makeType(TYPE_CHAR);
+            doubleType = makeType(TYPE_DOUBLE);
+            voidType = makeType(TYPE_VOID);
+            scopes.emplace_back();
+            // Address 0 stays unused so NULL never points at an object
+            prog.dataSegment.assign(8, 0);
+        }
+
+        void parseProgram() {
+            while (cur().kind != TOK_EOF) {
+                if (accept(";")) continue;
+                int line = cur().line;
+                size_t start = p;
+                Type* t = parsePointers(parseBaseType());
+                if (cur().kind == TOK_IDENT && toks[p + 1].kind == TOK_PUNCT && toks[p + 1].text == "(") {
+                    parseFunction(t, expectIdent(), line);
+                    continue;
+                }
+
+                // Global variable(s); initializers run before main()
+                p = start;
+                auto decl = parseDeclaration();
+                for (auto& s : decl->stmts) globalInits.push_back(move(s));
+            }
+        }
+    };
+
+    // ============== CODE GENERATOR ==============
+    class CodeGen {
+        Program& prog;
+        map<string, Function>& functions;
+        Parser& parser;
+
+        struct LoopContext {
+            vector<size_t> breaks;
+            vector<size_t> continues;
+            bool isSwitch;
+        };
+        vector<LoopContext> loops;
+        const Function* currentFn = nullptr;
+        size_t bodyStart = 0;       // First instruction after the ENTER
+        bool tailCalls = false;     // The frame may be reused by self tail calls
+        int line = 0;               // Source line of the code being emitted
+
+        // Attributes what is emitted while it lives to line `l`
+        struct AtLine {
+            int& line;
+            int saved;
+            AtLine(int& current, int l) : line(current), saved(current) { if (l > 0) current = l; }
+            ~AtLine() { line = saved; }
+        };
+
+        size_t emit(OpCode op, double imm = 0) {
+            prog.instructions.emplace_back(op, imm);
+            prog.instructions.back().line = line;
+            return prog.instructions.size() - 1;
+        }
+        size_t emit(OpCode op, double imm, const string& str) {
+            prog.instructions.emplace_back(op, imm, str);
+            prog.instructions.back().line = line;
+            return prog.instructions.size() - 1;
+        }
+        size_t here() { return prog.instructions.size(); }
+        void patch(size_t at, size_t target) { prog.instructions[at].immediate = (double)target; }
+
+        void load(const Type* t) {
+            if (t->kind == TYPE_ARRAY) return;  // Arrays evaluate to their address
+            emit(t->kind == TYPE_CHAR ? LOAD_BYTE : LOAD);
+        }
+        void store(const Type* t, bool keep) {
+            emit(t->kind == TYPE_CHAR ? STORE_BYTE : STORE, keep ? 1 : 0);
+        }
+
+        // Emits a conversion of the value on top of the stack
+        void convert(const Type* from, const Type* to) {
+            if (from->kind == TYPE_DOUBLE && to->kind != TYPE_DOUBLE) emit(DOUBLE_TO_INT);
+            else if (from->kind != TYPE_DOUBLE && to->kind == TYPE_DOUBLE) emit(INT_TO_DOUBLE);
+        }
+
+        // The integer form of an arithmetic or comparison opcode; the
+        // parser's opcodes are the double forms
+        static OpCode intOp(OpCode op) {
+            switch (op) {
+                case ADD: return IADD;
+                case SUB: return ISUB;
+                case MUL: return IMUL;
+                case DIV: return IDIV;
+                case MOD: return IMOD;
+                case EQ: return IEQ;
+                case NEQ: return INEQ;
+                case LT: return ILT;
+                case GT: return IGT;
+                case LTE: return ILTE;
+                case GTE: return IGTE;
+                default: return op;
+            }
+        }
+
+        // Evaluates e as a condition: an integer that is non-zero when true
+        void genCond(const Expr* e) {
+            genExpr(e);
+            if (e->type->kind == TYPE_DOUBLE) {
+                emit(PUSH_CONST, 0.0);
+                emit(NEQ);
+            }
+        }
+
+        void genAddr(const Expr* e) {
+            if (e->kind == EX_VAR) {
+                if (e->sym->isGlobal) emit(PUSH_IMM, e->sym->address);
+                else emit(ADDR_OF, e->sym->address);
+            } else if (e->kind == EX_DEREF) {
+                genExpr(e->lhs.get());
+            } else {
+                throw CompileError(e->line, "expression is not an lvalue");
+            }
+        }
+
+        // Scales the integer on top of the stack by the pointee size
+        void scale(const Type* ptr) {
+            int size = sizeOf(ptr->base);
+            if (size != 1) {
+                emit(PUSH_IMM, size);
+                emit(IMUL);
+            }
+        }
+
+        void genBinary(const Expr* e) {
+            const Type* ta = e->lhs->type;
+            const Type* tb = e->rhs->type;
+            bool pa = isPointer(ta), pb = isPointer(tb);
+            // Mixed int/double operands are both widened to double
+            bool dbl = ta->kind == TYPE_DOUBLE || tb->kind == TYPE_DOUBLE;
+
+            genExpr(e->lhs.get());
+            if (pb && !pa) scale(tb);
+            if (dbl && ta->kind != TYPE_DOUBLE) emit(INT_TO_DOUBLE);
+            genExpr(e->rhs.get());
+            if (pa && !pb && (e->op == ADD || e->op == SUB)) scale(ta);
+            if (dbl && tb->kind != TYPE_DOUBLE) emit(INT_TO_DOUBLE);
+            emit(dbl ? e->op : intOp(e->op));
+
+            if (e->op == SUB && pa && pb) {
+                // Pointer difference counts elements
+                int size = sizeOf(ta->base);
+                if (size != 1) {
+                    emit(PUSH_IMM, size);
+                    emit(IDIV);
+                }
+            }
+        }
+
+        void expectArgs(const Expr* e, size_t count) {
+            if (e->args.size() != count) {
+                throw CompileError(e->line, "wrong number of arguments to '" + e->name + "'");
+            }
+        }
+
+        // Evaluates e converted to an integer (sizes, counts)
+        void genInteger(const Expr* e) {
+            genExpr(e);
+            if (e->type->kind == TYPE_DOUBLE) emit(DOUBLE_TO_INT);
+        }
+
+        void genCall(const Expr* e, bool discard) {
+            const string& name = e->name;
+            if (name == "printf") {
+                genPrintf(e);
+                if (!discard) emit(PUSH_IMM, 0);
+                return;
+            }
+            if (name == "puts") {
+                genExpr(e->args[0].get());
+                emit(PRINT_STR);
+                emit(PUSH_IMM, '\n');
+                emit(PRINT_CHAR);
+                if (!discard) emit(PUSH_IMM, 0);
+                return;
+            }
+            if (name == "putchar") {
+                genExpr(e->args[0].get());
+                if (!discard) emit(DUP);
+                emit(PRINT_CHAR);
+                return;
+            }
+            if (name == "malloc") {
+                expectArgs(e, 1);
+                genInteger(e->args[0].get());
+                emit(ALLOC);
+                if (discard) emit(POP);
+                return;
+            }
+            if (name == "calloc") {
+                expectArgs(e, 2);
+                genInteger(e->args[0].get());
+                genInteger(e->args[1].get());
+                emit(IMUL);
+                emit(ALLOC, 1);
+                if (discard) emit(POP);
+                return;
+            }
+            if (name == "realloc") {
+                expectArgs(e, 2);
+                genExpr(e->args[0].get());
+                genInteger(e->args[1].get());
+                emit(REALLOC);
+                if (discard) emit(POP);
+                return;
+            }
+            if (name == "free") {
+                expectArgs(e, 1);
+                genExpr(e->args[0].get());
+                emit(FREE);
+                if (!discard) emit(PUSH_IMM, 0);
+                return;
+            }
+            if (name == "exit") {
+                if (!e->args.empty()) genDiscard(e->args[0].get());
+                emit(HALT);
+                if (!discard) emit(PUSH_IMM, 0);
+                return;
+            }
+
+            auto fn = functions.find(name);
+            int builtin = builtinIndex(name);
+            if (builtin >= 0 && (fn == functions.end() || !fn->second.defined)) {
+                // Arguments convert to the parameter types of the signature
+                const char* params = BUILTINS[builtin].signature + 2;
+                for (size_t i = 0; i < e->args.size(); i++) {
+                    const Expr* arg = e->args[i].get();
+                    genExpr(arg);
+                    bool isDouble = arg->type->kind == TYPE_DOUBLE;
+                    if (params[i] == 'd' && !isDouble) emit(INT_TO_DOUBLE);
+                    else if (params[i] != 'd' && isDouble) emit(DOUBLE_TO_INT);
+                }
+                emit(CALL_BUILTIN, builtin);
+                if (discard) emit(POP);
+                return;
+            }
+            if (fn == functions.end() || !fn->second.defined) {
+                throw CompileError(e->line, "undefined reference to '" + name + "'");
+            }
+            const Function& f = fn->second;
+            if (f.params.size() != e->args.size()) {
+                throw CompileError(e->line, "wrong number of arguments to '" + name + "'");
+            }
+            for (size_t i = 0; i < e->args.size(); i++) {
+                genExpr(e->args[i].get());
+                convert(e->args[i]->type, &f.params[i]->type);
+            }
+            emit(CALL, (double)e->args.size(), name);
+            if (discard) emit(POP);
+        }
+
+        // Splits a literal format string into text runs and one PRINT_FMT per
+        // conversion, so no format parsing happens at run time
+        void genPrintf(const Expr* e) {
+            if (e->args.empty()) throw CompileError(e->line, "too few arguments to 'printf'");
+            const Expr* fmtExpr = e->args[0].get();
+            if (fmtExpr->kind != EX_STR) {
+                genExpr(fmtExpr);
+                emit(PRINT_STR);
+                return;
+            }
+
+            const string& fmt = fmtExpr->name;
+            size_t argIndex = 1;
+            string text;
+            auto flushText = [&]() {
+                if (text.empty()) return;
+                if (text.size() == 1) {
+                    emit(PUSH_IMM, (double)(int8_t)text[0]);
+                    emit(PRINT_CHAR);
                 } else {
-                    current += c;
+                    emit(PUSH_STR, (double)parser.internString(text));
+                    emit(PRINT_STR);
                 }
+                text.clear();
+            };
+
+            for (size_t i = 0; i < fmt.size(); i++) {
+                if (fmt[i] != '%') { text += fmt[i]; continue; }
+                if (i + 1 < fmt.size() && fmt[i + 1] == '%') { text += '%'; i++; continue; }
+
+                size_t start = i;
+                i = printfConversion(fmt, start);
+                if (i == string::npos) {
+                    throw CompileError(e->line, "invalid conversion in printf format string");
+                }
+                if (argIndex >= e->args.size()) {
+                    throw CompileError(e->line, "too few arguments for printf format string");
+                }
+                flushText();
+                string spec = fmt.substr(start, i - start + 1);
+                const Expr* arg = e->args[argIndex++].get();
+                genExpr(arg);
+                char conv = fmt[i];
+                bool isDouble = arg->type->kind == TYPE_DOUBLE;
+                if (strchr("diouxXcsp", conv) && isDouble) emit(DOUBLE_TO_INT);
+                else if (strchr("fFeEgGaA", conv) && !isDouble) emit(INT_TO_DOUBLE);
+                emit(PRINT_FMT, 0, spec);
+            }
+            flushText();
+            for (; argIndex < e->args.size(); argIndex++) {
+                // Extra arguments are still evaluated for their side effects
+                genDiscard(e->args[argIndex].get());
+            }
+        }
+
+        void genAssign(const Expr* e, bool discard) {
+            const Expr* lhs = e->lhs.get();
+            genAddr(lhs);
+            if (e->op == NOOP) {
+                genExpr(e->rhs.get());
+                convert(e->rhs->type, lhs->type);
+            } else {
+                // x op= y computes in the wider of the two types, then
+                // converts back to the type of x
+                bool dl = lhs->type->kind == TYPE_DOUBLE, dr = e->rhs->type->kind == TYPE_DOUBLE;
+                emit(DUP);
+                load(lhs->type);
+                if (dr && !dl) emit(INT_TO_DOUBLE);
+                genExpr(e->rhs.get());
+                if (isPointer(lhs->type) && (e->op == ADD || e->op == SUB)) scale(lhs->type);
+                if (dl && !dr) emit(INT_TO_DOUBLE);
+                emit(dl || dr ? e->op : intOp(e->op));
+                if (dr && !dl) emit(DOUBLE_TO_INT);
+            }
+            store(lhs->type, !discard);
+        }
+
+        void genIncDec(const Expr* e, bool discard) {
+            const Type* t = e->lhs->type;
+            bool dbl = t->kind == TYPE_DOUBLE;
+            double step = isPointer(t) ? sizeOf(t->base) : 1;
+            OpCode add = dbl ? ADD : IADD, sub = dbl ? SUB : ISUB;
+            genAddr(e->lhs.get());
+            emit(DUP);
+            load(t);
+            emit(dbl ? PUSH_CONST : PUSH_IMM, step);
+            emit(e->increment ? add : sub);
+            store(t, !discard);
+            if (!discard && !e->prefix) {
+                // Recover the old value from the stored one
+                emit(dbl ? PUSH_CONST : PUSH_IMM, step);
+                emit(e->increment ? sub : add);
+            }
+        }
+
+        void genLogical(const Expr* e) {
+            // Short-circuit: a && b -> a ? (b != 0) : 0
+            bool isAnd = e->op == LOGICAL_AND;
+            genCond(e->lhs.get());
+            size_t j1 = emit(isAnd ? JMP_IF_NOT : JMP_IF);
+            genCond(e->rhs.get());
+            size_t j2 = emit(isAnd ? JMP_IF_NOT : JMP_IF);
+            emit(PUSH_IMM, isAnd ? 1 : 0);
+            size_t jEnd = emit(JMP);
+            patch(j1, here());
+            patch(j2, here());
+            emit(PUSH_IMM, isAnd ? 0 : 1);
+            patch(jEnd, here());
+        }
+
+        // Evaluates e for side effects only
+        void genDiscard(const Expr* e) {
+            switch (e->kind) {
+                case EX_ASSIGN: genAssign(e, true); return;
+                case EX_INCDEC: genIncDec(e, true); return;
+                case EX_CALL: genCall(e, true); return;
+                case EX_COMMA:
+                    genDiscard(e->lhs.get());
+                    genDiscard(e->rhs.get());
+                    return;
+                case EX_NUM: case EX_STR: case EX_VAR: return;
+                default:
+                    genExpr(e);
+                    emit(POP);
+                    return;
             }
+        }
 
-            // Execute each statement
-            for (const auto& stmt : statements) {
-                if (!stmt.empty()) {
-                    executeStatement(stmt);
+        void genExpr(const Expr* e) {
+            AtLine at(line, e->line);
+            switch (e->kind) {
+                case EX_NUM: emit(e->type->kind == TYPE_DOUBLE ? PUSH_CONST : PUSH_IMM, e->num); break;
+                case EX_STR: emit(PUSH_STR, e->num); break;
+                case EX_VAR:
+                    genAddr(e);
+                    load(e->type);
+                    break;
+                case EX_UNARY: {
+                    bool dbl = e->lhs->type->kind == TYPE_DOUBLE;
+                    genExpr(e->lhs.get());
+                    if (e->op == SUB) {
+                        emit(dbl ? PUSH_CONST : PUSH_IMM, -1);
+                        emit(dbl ? MUL : IMUL);
+                    } else if (e->op == LOGICAL_NOT && dbl) {
+                        emit(PUSH_CONST, 0.0);
+                        emit(EQ);
+                    } else {
+                        emit(e->op);
+                    }
+                    break;
                 }
+                case EX_BINARY: genBinary(e); break;
+                case EX_LOGICAL: genLogical(e); break;
+                case EX_ASSIGN: genAssign(e, false); break;
+                case EX_COND: {
+                    genCond(e->cond.get());
+                    size_t jElse = emit(JMP_IF_NOT);
+                    genExpr(e->lhs.get());
+                    convert(e->lhs->type, e->type);
+                    size_t jEnd = emit(JMP);
+                    patch(jElse, here());
+                    genExpr(e->rhs.get());
+                    convert(e->rhs->type, e->type);
+                    patch(jEnd, here());
+                    break;
+                }
+                case EX_CALL: genCall(e, false); break;
+                case EX_DEREF:
+                    genExpr(e->lhs.get());
+                    load(e->type);
+                    break;
+                case EX_ADDR: genAddr(e->lhs.get()); break;
+                case EX_CAST:
+                    genExpr(e->lhs.get());
+                    convert(e->lhs->type, e->type);
+                    break;
+                case EX_INCDEC: genIncDec(e, false); break;
+                case EX_COMMA:
+                    genDiscard(e->lhs.get());
+                    genExpr(e->rhs.get());
+                    break;
             }
+        }
 
-            // Get output lines
-            string outputStr = output.str();
-            results.clear();
+        void genBreakOrContinue(const Stmt* s) {
+            bool isBreak = s->kind == ST_BREAK;
+            for (size_t i = loops.size(); i-- > 0;) {
+                if (!isBreak && loops[i].isSwitch) continue;
+                (isBreak ? loops[i].breaks : loops[i].continues).push_back(emit(JMP));
+                return;
+            }
+            throw CompileError(s->line, string("'") + (isBreak ? "break" : "continue") + "' statement not in loop");
+        }
 
-            // Split output by newlines
-            stringstream ss(outputStr);
-            string line;
-            while (getline(ss, line)) {
-                if (!line.empty()) {
-                    results.push_back(line);
+        void closeLoop(size_t continueTarget, size_t breakTarget) {
+            for (size_t at : loops.back().continues) patch(at, continueTarget);
+            for (size_t at : loops.back().breaks) patch(at, breakTarget);
+            loops.pop_back();
+        }
+
+        void collectCases(const Stmt* s, vector<const Stmt*>& out) {
+            if (!s) return;
+            if (s->kind == ST_CASE || s->kind == ST_DEFAULT) out.push_back(s);
+            if (s->kind == ST_SWITCH) return;  // Nested switch owns its labels
+            for (const auto& c : s->stmts) collectCases(c.get(), out);
+            collectCases(s->body.get(), out);
+            collectCases(s->elseBody.get(), out);
+            collectCases(s->init.get(), out);
+        }
+
+        map<const Stmt*, vector<size_t>> caseJumps;
+
+        void genStmt(const Stmt* s) {
+            AtLine at(line, s->line);
+            switch (s->kind) {
+                case ST_EMPTY: break;
+                case ST_EXPR: genDiscard(s->expr.get()); break;
+                case ST_BLOCK:
+                    for (const auto& c : s->stmts) genStmt(c.get());
+                    break;
+                case ST_IF: {
+                    genCond(s->expr.get());
+                    size_t jElse = emit(JMP_IF_NOT);
+                    genStmt(s->body.get());
+                    if (s->elseBody) {
+                        size_t jEnd = emit(JMP);
+                        patch(jElse, here());
+                        genStmt(s->elseBody.get());
+                        patch(jEnd, here());
+                    } else {
+                        patch(jElse, here());
+                    }
+                    break;
+                }
+                case ST_WHILE: {
+                    size_t top = here();
+                    genCond(s->expr.get());
+                    size_t jExit = emit(JMP_IF_NOT);
+                    loops.push_back({{}, {}, false});
+                    genStmt(s->body.get());
+                    emit(JMP, top);
+                    patch(jExit, here());
+                    closeLoop(top, here());
+                    break;
+                }
+                case ST_DO: {
+                    size_t top = here();
+                    loops.push_back({{}, {}, false});
+                    genStmt(s->body.get());
+                    size_t cont = here();
+                    genCond(s->expr.get());
+                    emit(JMP_IF, top);
+                    closeLoop(cont, here());
+                    break;
+                }
+                case ST_FOR: {
+                    if (s->init) genStmt(s->init.get());
+                    size_t top = here();
+                    size_t jExit = SIZE_MAX;
+                    if (s->expr) {
+                        genCond(s->expr.get());
+                        jExit = emit(JMP_IF_NOT);
+                    }
+                    loops.push_back({{}, {}, false});
+                    genStmt(s->body.get());
+                    size_t cont = here();
+                    if (s->step) genDiscard(s->step.get());
+                    emit(JMP, top);
+                    if (jExit != SIZE_MAX) patch(jExit, here());
+                    closeLoop(cont, here());
+                    break;
+                }
+                case ST_SWITCH: {
+                    // Scrutinee goes to a frame slot, then a compare chain
+                    emit(ADDR_OF, s->tempSlot);
+                    genExpr(s->expr.get());
+                    if (s->expr->type->kind == TYPE_DOUBLE) emit(DOUBLE_TO_INT);
+                    emit(STORE);
+                    vector<const Stmt*> cases;
+                    collectCases(s->body.get(), cases);
+                    const Stmt* def = nullptr;
+                    for (const Stmt* c : cases) {
+                        if (c->kind == ST_DEFAULT) { def = c; continue; }
+                        emit(ADDR_OF, s->tempSlot);
+                        emit(LOAD);
+                        emit(PUSH_IMM, c->caseValue);
+                        emit(IEQ);
+                        caseJumps[c].push_back(emit(JMP_IF));
+                    }
+                    size_t jDefault = emit(JMP);
+                    if (def) caseJumps[def].push_back(jDefault);
+                    loops.push_back({{}, {}, true});
+                    if (!def) loops.back().breaks.push_back(jDefault);
+                    genStmt(s->body.get());
+                    size_t end = here();
+                    for (size_t at : loops.back().breaks) patch(at, end);
+                    loops.pop_back();
+                    break;
+                }
+                case ST_CASE:
+                case ST_DEFAULT: {
+                    auto it = caseJumps.find(s);
+                    if (it == caseJumps.end()) {
+                        throw CompileError(s->line, "case label not within a switch statement");
+                    }
+                    for (size_t at : it->second) patch(at, here());
+                    break;
                 }
+                case ST_BREAK:
+                case ST_CONTINUE:
+                    genBreakOrContinue(s);
+                    break;
+                case ST_RETURN:
+                    if (s->expr && isSelfTailCall(s->expr.get())) {
+                        genTailCall(s->expr.get());
+                        break;
+                    }
+                    if (s->expr) {
+                        genExpr(s->expr.get());
+                        convert(s->expr->type, currentFn->returnType);
+                    } else {
+                        emit(PUSH_IMM, 0);
+                    }
+                    emit(LEAVE);
+                    emit(RET);
+                    break;
             }
+        }
 
-            if (results.empty()) {
-                results.push_back("Program finished successfully.");
+        // True if the address of a local escapes, including a local array
+        // decaying to a pointer. Such a frame must not be reused while the
+        // pointer may still be live.
+        static bool addressesLocal(const Expr* e) {
+            if (!e) return false;
+            if (e->kind == EX_VAR && !e->sym->isGlobal && e->sym->type.kind == TYPE_ARRAY) return true;
+            if (e->kind == EX_ADDR && !e->lhs->sym->isGlobal) return true;
+            if (addressesLocal(e->lhs.get()) || addressesLocal(e->rhs.get()) || addressesLocal(e->cond.get())) return true;
+            for (const auto& arg : e->args) {
+                if (addressesLocal(arg.get())) return true;
             }
+            return false;
+        }
 
-            return results;
+        static bool addressesLocal(const Stmt* s) {
+            if (!s) return false;
+            if (addressesLocal(s->expr.get()) || addressesLocal(s->step.get())) return true;
+            if (addressesLocal(s->init.get()) || addressesLocal(s->body.get()) || addressesLocal(s->elseBody.get())) return true;
+            for (const auto& st : s->stmts) {
+                if (addressesLocal(st.get())) return true;
+            }
+            return false;
+        }
+
+        bool isSelfTailCall(const Expr* e) const {
+            return tailCalls && e->kind == EX_CALL && e->name == currentFn->name &&
+                   !isBuiltin(e->name) && e->args.size() == currentFn->params.size();
+        }
+
+        // `return f(...)` inside f: every argument is evaluated before any
+        // parameter is overwritten, then control re-enters the body in the
+        // same frame instead of growing the call stack
+        void genTailCall(const Expr* e) {
+            const Function& f = *currentFn;
+            for (size_t i = 0; i < e->args.size(); i++) {
+                emit(ADDR_OF, f.params[i]->address);
+                genExpr(e->args[i].get());
+                convert(e->args[i]->type, &f.params[i]->type);
+            }
+            for (size_t i = e->args.size(); i-- > 0;) store(&f.params[i]->type, false);
+            emit(JMP, bodyStart);
         }
 
-        string getOutput() {
-            return output.str();
+        void genFunction(const Function& fn) {
+            AtLine at(line, fn.line);
+            currentFn = &fn;
+            tailCalls = !addressesLocal(fn.body.get());
+            prog.functions[fn.name] = here();
+            emit(ENTER, fn.frameSize);
+            bodyStart = here();
+            genStmt(fn.body.get());
+            // Falling off the end returns 0 (void functions always do)
+            emit(PUSH_IMM, 0);
+            emit(LEAVE);
+            emit(RET);
+            currentFn = nullptr;
+        }
+
+    public:
+        CodeGen(Program& program, map<string, Function>& fns, Parser& p)
+            : prog(program), functions(fns), parser(p) {}
+
+        void generate() {
+            auto mainFn = functions.find("main");
+            if (mainFn == functions.end() || !mainFn->second.defined) {
+                throw CompileError(1, "undefined reference to 'main'");
+            }
+            // Startup: global initializers, then main()
+            prog.entryPoint = 0;
+            for (const auto& s : parser.globalInits) genStmt(s.get());
+            emit(CALL, 0, "main");
+            emit(POP);
+            emit(HALT);
+
+            for (const auto& kv : functions) {
+                if (kv.second.defined) genFunction(kv.second);
+            }
         }
     };
 
-    // Factory function - keep the same interface
-    Program compileSource(const std::string& source) {
-        // Return empty program for now
+    Program compileSource(const std::string& source, const CompileOptions& options) {
         Program prog;
-        prog.entryPoint = 0;
+        map<string, Function> functions;
+        Parser parser(source, prog, functions);
+        parser.parseProgram();
+        CodeGen gen(prog, functions, parser);
+        gen.generate();
+        if (options.optLevel > 0) optimizeSSA(prog, options.optLevel, options.mode);
+        if (options.peephole) peepholeOptimize(prog);
+        packProgram(prog);
+        string error;
+        if (!verifyProgram(prog, &error)) {
+            throw runtime_error("bytecode verification failed: " + error);
+        }
+        if (options.mode == EXEC_REGISTER) lowerToRegisters(prog);
         return prog;
     }
-
-    // Direct execution function for the interpreter
-    vector<string> executeSource(const std::string& source) {
-        CInterpreter interp(source);
-        return interp.execute();
-    }
 }
@@ -0,0 +1,12 @@
+// OmniNative C compiler - source to a packed, verified OmniVM Program
+#pragma once
+#include "common.h"
+#include <string>
+
+namespace OmniNative {
+
+    // Compiles C source to a packed OmniVM program, lowered to register code
+    // in EXEC_REGISTER mode; throws CompileError
+    Program compileSource(const std::string& source, const CompileOptions& options = CompileOptions());
+
+}
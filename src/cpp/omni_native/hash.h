@@ -0,0 +1,19 @@
+// OmniNative hashing shared by the interner and program images
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+namespace OmniNative {
+
+    // FNV-1a, stable across builds and hosts
+    inline uint64_t fnv1a(const void* data, size_t size, uint64_t seed = 14695981039346656037ull) {
+        const uint8_t* p = (const uint8_t*)data;
+        uint64_t h = seed;
+        for (size_t i = 0; i < size; i++) {
+            h ^= p[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+}
@@ -0,0 +1,315 @@
+// OmniVM heap allocator
+#include "heap.h"
+#include <cstring>
+#include <algorithm>
+
+namespace OmniNative {
+
+    namespace {
+
+        const size_t HEADER = 8;
+        // Header flag bits; block sizes are multiples of 8
+        const uint64_t IN_USE = 1;
+        const uint64_t LARGE = 2;
+        const uint64_t PREV_FREE = 4;     // The block before is a free large block with a footer
+        const uint64_t FLAGS = 7;
+
+        size_t roundUp8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+    }
+
+    // Payload sizes; anything bigger is a large block
+    const size_t VmHeap::CLASS_SIZES[VmHeap::NUM_CLASSES] = {
+        8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+    };
+
+    // Smallest block worth splitting off: it must be large itself
+    static const size_t MIN_LARGE_BLOCK = 1024 + 2 * HEADER;
+
+    uint64_t VmHeap::word(size_t addr) const {
+        uint64_t v;
+        std::memcpy(&v, mem->data() + addr, sizeof(v));
+        return v;
+    }
+
+    void VmHeap::setWord(size_t addr, uint64_t v) {
+        std::memcpy(mem->data() + addr, &v, sizeof(v));
+    }
+
+    void VmHeap::reset(VmBytes& memory, size_t heapBase, size_t memoryLimit) {
+        mem = &memory;
+        base = top = roundUp8(heapBase);
+        limit = memoryLimit;
+        std::fill(smallFree, smallFree + NUM_CLASSES, 0);
+        largeFree = 0;
+        counters = HeapStats();
+        broken = false;
+    }
+
+    int VmHeap::sizeClass(size_t payload) {
+        for (int i = 0; i < NUM_CLASSES; i++) {
+            if (CLASS_SIZES[i] >= payload) return i;
+        }
+        return -1;
+    }
+
+    // Doubles VM memory (at least to `need`) so a malloc loop costs a
+    // logarithmic number of copies
+    bool VmHeap::grow(size_t need) {
+        if (need > limit) return false;
+        size_t size = std::max(need, std::min(limit, mem->size() * 2));
+        mem->resize(size);
+        return true;
+    }
+
+    size_t VmHeap::carve(size_t size, uint64_t flags) {
+        if (top + size > mem->size() && !grow(top + size)) return 0;
+        size_t block = top;
+        top += size;
+        setWord(block, size | flags);
+        return block;
+    }
+
+    void VmHeap::linkLarge(size_t block, size_t size) {
+        setWord(block, size | LARGE);
+        setWord(block + size - HEADER, size);
+        setWord(block + HEADER, largeFree);
+        setWord(block + 2 * HEADER, 0);
+        if (largeFree) setWord(largeFree + 2 * HEADER, block);
+        largeFree = block;
+        size_t next = block + size;
+        if (next < top) setWord(next, word(next) | PREV_FREE);
+        counters.freeBytes += size;
+    }
+
+    bool VmHeap::unlinkLarge(size_t block) {
+        size_t next = (size_t)word(block + HEADER);
+        size_t prev = (size_t)word(block + 2 * HEADER);
+        if ((next && !isFreeLarge(next)) || (prev && !isFreeLarge(prev))) {
+            broken = true;
+            return false;
+        }
+        if (prev) setWord(prev + HEADER, next);
+        else largeFree = next;
+        if (next) setWord(next + 2 * HEADER, prev);
+        counters.freeBytes -= blockSize(block);
+        return true;
+    }
+
+    // Best fit from the large free list, splitting off the remainder
+    size_t VmHeap::takeLarge(size_t size) {
+        size_t best = 0, bestSize = 0, steps = maxLargeBlocks();
+        for (size_t b = largeFree; b; b = (size_t)word(b + HEADER)) {
+            // A bad link, or one that loops back
+            if (!isFreeLarge(b) || steps-- == 0) {
+                broken = true;
+                return 0;
+            }
+            size_t s = blockSize(b);
+            if (s >= size && (!best || s < bestSize)) {
+                best = b;
+                bestSize = s;
+                if (s == size) break;
+            }
+        }
+        if (!best || !unlinkLarge(best)) return 0;
+        if (bestSize - size >= MIN_LARGE_BLOCK) {
+            setWord(best, size | IN_USE | LARGE);
+            linkLarge(best + size, bestSize - size);
+        } else {
+            setWord(best, bestSize | IN_USE | LARGE);
+            size_t next = best + bestSize;
+            if (next < top) setWord(next, word(next) & ~PREV_FREE);
+        }
+        return best;
+    }
+
+    // Block sizes are checked against the class table and the large
+    // minimum, since a program can overwrite a header as easily as a link
+    bool VmHeap::isLiveBlock(size_t block) const {
+        if (block < base || block > top || block % 8 || top - block < 2 * HEADER) return false;
+        uint64_t w = word(block);
+        size_t size = (size_t)(w & ~FLAGS);
+        if (!(w & IN_USE) || size > top - block) return false;
+        if (w & LARGE) return size >= MIN_LARGE_BLOCK;
+        int cls = size >= 2 * HEADER ? sizeClass(size - HEADER) : -1;
+        return cls >= 0 && CLASS_SIZES[cls] + HEADER == size;
+    }
+
+    // A free small block after a free large one also carries PREV_FREE
+    bool VmHeap::isFreeSmall(size_t block, size_t size) const {
+        return block >= base && block <= top && block % 8 == 0 && size <= top - block &&
+               (word(block) & ~PREV_FREE) == size;
+    }
+
+    bool VmHeap::isFreeLarge(size_t block) const {
+        if (block < base || block > top || block % 8 || top - block < MIN_LARGE_BLOCK) return false;
+        uint64_t w = word(block);
+        size_t size = (size_t)(w & ~FLAGS);
+        return (w & (IN_USE | LARGE)) == LARGE && size >= MIN_LARGE_BLOCK && size <= top - block;
+    }
+
+    // Free large blocks are disjoint, so a longer walk has met a cycle
+    size_t VmHeap::maxLargeBlocks() const {
+        return (top - base) / MIN_LARGE_BLOCK;
+    }
+
+    size_t VmHeap::allocate(int64_t request, bool zero) {
+        if (broken) return 0;
+        if (request < 0 || (uint64_t)request > limit) {
+            counters.failed++;
+            return 0;
+        }
+        size_t payload = std::max<size_t>((size_t)request, 1);
+        size_t block;
+        int cls = sizeClass(payload);
+        if (cls >= 0) {
+            size_t size = CLASS_SIZES[cls] + HEADER;
+            block = smallFree[cls];
+            if (block) {
+                size_t next = (size_t)word(block + HEADER);
+                if (next && !isFreeSmall(next, size)) {
+                    broken = true;
+                    return 0;
+                }
+                smallFree[cls] = next;
+                counters.freeBytes -= size;
+                setWord(block, size | IN_USE);
+            } else {
+                block = carve(size, IN_USE);
+            }
+        } else {
+            size_t size = roundUp8(payload) + HEADER;
+            block = takeLarge(size);
+            if (broken) return 0;
+            if (!block) block = carve(size, IN_USE | LARGE);
+        }
+        if (!block) {
+            counters.failed++;
+            return 0;
+        }
+
+        size_t got = blockSize(block) - HEADER;
+        if (zero) std::memset(mem->data() + block + HEADER, 0, got);
+        counters.allocations++;
+        counters.liveBlocks++;
+        counters.liveBytes += got;
+        counters.peakBytes = std::max(counters.peakBytes, counters.liveBytes);
+        return block + HEADER;
+    }
+
+    void VmHeap::releaseLarge(size_t block) {
+        size_t size = blockSize(block);
+        size_t next = block + size;
+        if (next < top && (word(next) & (IN_USE | LARGE)) == LARGE) {
+            if (!isFreeLarge(next) || !unlinkLarge(next)) {
+                broken = true;
+                return;
+            }
+            size += blockSize(next);
+        }
+        if (word(block) & PREV_FREE) {
+            // The footer must lead back to a free block of the same size
+            size_t prevSize = block >= base + MIN_LARGE_BLOCK ? (size_t)word(block - HEADER) : 0;
+            size_t prev = block - prevSize;
+            if (prevSize < MIN_LARGE_BLOCK || prevSize > block - base || !isFreeLarge(prev) ||
+                blockSize(prev) != prevSize || !unlinkLarge(prev)) {
+                broken = true;
+                return;
+            }
+            block = prev;
+            size += prevSize;
+        }
+        if (block + size == top) top = block;
+        else linkLarge(block, size);
+    }
+
+    void VmHeap::release(size_t addr) {
+        if (broken || addr < HEADER || !isLiveBlock(addr - HEADER)) return;
+        size_t block = addr - HEADER;
+        size_t size = blockSize(block);
+        counters.frees++;
+        counters.liveBlocks--;
+        counters.liveBytes -= size - HEADER;
+        if (word(block) & LARGE) {
+            releaseLarge(block);
+            return;
+        }
+        int cls = sizeClass(size - HEADER);
+        setWord(block, size);
+        setWord(block + HEADER, smallFree[cls]);
+        smallFree[cls] = block;
+        counters.freeBytes += size;
+    }
+
+    size_t VmHeap::reallocate(size_t addr, int64_t request) {
+        if (!addr) return allocate(request);
+        if (broken || addr < HEADER || !isLiveBlock(addr - HEADER) || request < 0) {
+            counters.failed++;
+            return 0;
+        }
+        if (request == 0) {
+            release(addr);
+            return 0;
+        }
+        size_t block = addr - HEADER;
+        size_t size = blockSize(block);
+        size_t payload = (size_t)request;
+        if (payload <= size - HEADER) return addr;
+
+        // A large block grows in place into the top of the heap or a free
+        // neighbour
+        if (word(block) & LARGE) {
+            size_t need = roundUp8(payload) + HEADER;
+            size_t next = block + size;
+            size_t grown = 0;
+            if (next == top && (next + need - size <= mem->size() || grow(block + need))) {
+                top = block + need;
+                grown = need;
+            } else if (next < top && (word(next) & (IN_USE | LARGE)) == LARGE) {
+                if (!isFreeLarge(next)) {
+                    broken = true;
+                    return 0;
+                }
+                size_t total = size + blockSize(next);
+                if (total >= need) {
+                    if (!unlinkLarge(next)) return 0;
+                    if (total - need >= MIN_LARGE_BLOCK) {
+                        grown = need;
+                        setWord(block, need | (word(block) & FLAGS));
+                        linkLarge(block + need, total - need);
+                    } else {
+                        grown = total;
+                        if (block + total < top) setWord(block + total, word(block + total) & ~PREV_FREE);
+                    }
+                }
+            }
+            if (grown) {
+                setWord(block, grown | (word(block) & FLAGS));
+                counters.liveBytes += grown - size;
+                counters.peakBytes = std::max(counters.peakBytes, counters.liveBytes);
+                return addr;
+            }
+        }
+
+        size_t moved = allocate(request);
+        if (!moved) return 0;
+        std::memmove(mem->data() + moved, mem->data() + addr, size - HEADER);
+        release(addr);
+        return moved;
+    }
+
+    HeapStats VmHeap::stats() const {
+        HeapStats s = counters;
+        s.heapBytes = top - base;
+        size_t steps = maxLargeBlocks();
+        for (size_t b = largeFree; b && isFreeLarge(b) && steps-- > 0; b = (size_t)word(b + HEADER)) {
+            s.largestFree = std::max(s.largestFree, blockSize(b));
+        }
+        for (int i = 0; i < NUM_CLASSES; i++) {
+            if (smallFree[i]) s.largestFree = std::max(s.largestFree, CLASS_SIZES[i] + HEADER);
+        }
+        return s;
+    }
+
+}
@@ -0,0 +1,84 @@
+// OmniVM heap - segregated size-class allocator inside VM linear memory
+#pragma once
+#include "memory.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace OmniNative {
+
+    struct HeapStats {
+        size_t liveBytes = 0;      // Payload bytes of allocated blocks
+        size_t peakBytes = 0;      // High-water mark of liveBytes
+        size_t liveBlocks = 0;
+        size_t allocations = 0;
+        size_t frees = 0;
+        size_t failed = 0;         // Requests answered with NULL
+        size_t heapBytes = 0;      // Heap span carved out of VM memory so far
+        size_t freeBytes = 0;      // Bytes sitting on free lists
+        size_t largestFree = 0;    // Largest single free block
+
+        // External fragmentation: the share of free memory that a single
+        // request could not use, 0 when all free space is one block
+        double fragmentation() const {
+            return freeBytes ? 1.0 - (double)largestFree / (double)freeBytes : 0.0;
+        }
+    };
+
+    // Blocks carry an 8-byte header just below the returned address. Small
+    // requests are rounded to one of a few size classes, each with its own
+    // LIFO free list, so malloc/free in a loop reuses the same blocks.
+    // Large blocks keep a footer while free and are coalesced with free
+    // neighbours; a free block that reaches the top of the heap shrinks it.
+    // The heap grows the VM memory geometrically up to `limit`. Links and
+    // sizes live in guest memory, so each is checked against [base, top)
+    // before the heap follows it.
+    class VmHeap {
+    public:
+        // Starts an empty heap at `base` inside `memory`
+        void reset(VmBytes& memory, size_t base, size_t limit);
+        // Carries on a copied heap in `memory`, which holds a copy of its blocks
+        void rebind(VmBytes& memory) { mem = &memory; }
+
+        // Returns 0 when the request cannot be satisfied
+        size_t allocate(int64_t size, bool zero = false);
+        // Ignores 0 and addresses that are not live blocks
+        void release(size_t addr);
+        size_t reallocate(size_t addr, int64_t size);
+
+        HeapStats stats() const;
+        // A free-list link or block size in guest memory was overwritten;
+        // the heap refuses further requests and the run should end
+        bool corrupted() const { return broken; }
+
+    private:
+        static const int NUM_CLASSES = 14;
+        static const size_t CLASS_SIZES[NUM_CLASSES];
+
+        VmBytes* mem = nullptr;
+        size_t base = 0;
+        size_t top = 0;            // First byte not yet carved into blocks
+        size_t limit = 0;
+        size_t smallFree[NUM_CLASSES] = {};
+        size_t largeFree = 0;      // Doubly linked through the payload
+        HeapStats counters;
+        bool broken = false;
+
+        uint64_t word(size_t addr) const;
+        void setWord(size_t addr, uint64_t v);
+        size_t blockSize(size_t block) const { return (size_t)(word(block) & ~(uint64_t)7); }
+
+        static int sizeClass(size_t payload);
+        bool grow(size_t need);
+        size_t carve(size_t size, uint64_t flags);
+        size_t takeLarge(size_t size);
+        void linkLarge(size_t block, size_t size);
+        bool unlinkLarge(size_t block);
+        void releaseLarge(size_t block);
+        bool isLiveBlock(size_t block) const;
+        bool isFreeSmall(size_t block, size_t size) const;
+        bool isFreeLarge(size_t block) const;
+        size_t maxLargeBlocks() const;
+    };
+
+}
@@ -0,0 +1,325 @@
+// OmniVM program images
+#include "image.h"
+#include "bytecode.h"
+#include "builtins.h"
+#include "vm.h"
+#include <cstring>
+#include <algorithm>
+
+namespace OmniNative {
+
+    namespace {
+
+        enum SectionId : uint32_t {
+            SEC_META = 1,       // entryPoint, maxStackDepth, nextGlobalAddr, nextStringAddr
+            SEC_SOURCE,
+            SEC_CODE,
+            SEC_CONSTANTS,
+            SEC_STRINGS,
+            SEC_CODE_OFFSETS,
+            SEC_REG_CODE,
+            SEC_REG_FUNCTIONS,
+            SEC_DATA,
+            SEC_FUNCTIONS,      // name, instruction index
+            SEC_GLOBALS,        // name, address, type kind, array size, flags
+            SEC_END,
+            // Optional
+            SEC_LINES = 32,
+            SEC_REG_LINES
+        };
+
+        const size_t HEADER_SIZE = 48;
+        const size_t SECTION_HEADER_SIZE = 16;
+
+        static_assert(sizeof(Slot) == 8 && sizeof(RegInstr) == 8 && sizeof(RegFunction) == 8,
+                      "image arrays are stored as raw memory");
+
+        uint32_t encodeOptions(const CompileOptions& o) {
+            return (uint32_t)o.mode | (o.peephole ? 1u << 8 : 0) | ((uint32_t)o.optLevel & 0xff) << 16;
+        }
+
+        class Writer {
+        public:
+            std::vector<uint8_t> out;
+
+            void raw(const void* p, size_t n) {
+                const uint8_t* b = (const uint8_t*)p;
+                out.insert(out.end(), b, b + n);
+            }
+            void u32(uint32_t v) { raw(&v, 4); }
+            void u64(uint64_t v) { raw(&v, 8); }
+            void str(const std::string& s) {
+                u32((uint32_t)s.size());
+                raw(s.data(), s.size());
+            }
+            template <typename T> void array(const std::vector<T>& v) { raw(v.data(), v.size() * sizeof(T)); }
+            void align() { out.resize((out.size() + 7) & ~(size_t)7, 0); }
+        };
+
+        // Bounds-checked reads within one section
+        class Reader {
+        public:
+            Reader(const uint8_t* d, size_t n) : data(d), size(n) {}
+
+            bool raw(void* p, size_t n) {
+                if (n > size - pos) return false;
+                std::memcpy(p, data + pos, n);
+                pos += n;
+                return true;
+            }
+            bool u32(uint32_t& v) { return raw(&v, 4); }
+            bool u64(uint64_t& v) { return raw(&v, 8); }
+            bool str(std::string& s) {
+                uint32_t n = 0;
+                if (!u32(n) || n > size - pos) return false;
+                s.assign((const char*)data + pos, n);
+                pos += n;
+                return true;
+            }
+            // The whole section as an array of T
+            template <typename T> bool array(std::vector<T>& v) {
+                if (size % sizeof(T)) return false;
+                v.resize(size / sizeof(T));
+                if (size) std::memcpy(v.data(), data, size);
+                pos = size;
+                return true;
+            }
+            // Next n bytes in place, or nullptr
+            const uint8_t* take(size_t n) {
+                if (n > size - pos) return nullptr;
+                pos += n;
+                return data + pos - n;
+            }
+            bool done() const { return pos == size; }
+
+        private:
+            const uint8_t* data;
+            size_t size;
+            size_t pos = 0;
+        };
+
+        bool isRegBranch(RegOpCode op) { return op >= R_JMP && op <= R_JFIGEK; }
+
+        // Register code comes from lowerToRegisters, which sizes each
+        // window past every register field; a loaded image only has to be
+        // unable to index outside its own arrays or windows
+        bool checkRegisterCode(const Program& prog) {
+            const std::vector<RegInstr>& code = prog.regCode;
+            std::vector<RegFunction> fns = prog.regFunctions;
+            if (fns.empty()) return false;
+            for (const RegFunction& fn : fns) {
+                if (fn.entry >= code.size() || fn.numRegs > 256) return false;
+            }
+            std::sort(fns.begin(), fns.end(), [](const RegFunction& a, const RegFunction& b) { return a.entry < b.entry; });
+            if (fns[0].entry != 0) return false;
+
+            size_t f = 0;
+            for (size_t i = 0; i < code.size(); i++) {
+                while (f + 1 < fns.size() && fns[f + 1].entry <= i) f++;
+                const RegInstr& in = code[i];
+                if (in.op >= R_OP_COUNT) return false;
+                if (std::max({in.a, in.b, in.c}) >= fns[f].numRegs) return false;
+                uint64_t x = (uint64_t)(uint32_t)in.x;
+                if (isRegBranch(in.op) && x >= code.size()) return false;
+                if (in.op >= R_JFIEQK && in.op <= R_JFIGEK && in.c >= prog.constants.size()) return false;
+                if (in.op == R_LOADK && x >= prog.constants.size()) return false;
+                if (in.op == R_PRINTF && x >= prog.strings.size()) return false;
+                if (in.op == R_CALL && x >= prog.regFunctions.size()) return false;
+                if (in.op == R_CALLB && x >= BUILTIN_COUNT) return false;
+                // An argument slot of the next call, inside the frame stack
+                if (in.op == R_ARG && (in.x < 0 || x >= VM_STACK_SIZE / sizeof(Slot))) return false;
+            }
+            return true;
+        }
+
+    }
+
+    uint64_t imageKey(const std::string& source, const CompileOptions& options) {
+        uint32_t opts = encodeOptions(options);
+        return fnv1a(&opts, sizeof(opts), fnv1a(source.data(), source.size()));
+    }
+
+    std::vector<uint8_t> saveImage(const Program& prog, const std::string& source, const CompileOptions& options) {
+        Writer body;
+        uint32_t sections = 0;
+        auto section = [&](SectionId id, const Writer& w) {
+            body.u32(id);
+            body.u32(0);
+            body.u64(w.out.size());
+            body.raw(w.out.data(), w.out.size());
+            body.align();
+            sections++;
+        };
+        auto rawSection = [&](SectionId id, const void* p, size_t n) {
+            Writer w;
+            w.raw(p, n);
+            section(id, w);
+        };
+
+        Writer meta;
+        meta.u32(prog.entryPoint);
+        meta.u32(prog.maxStackDepth);
+        meta.u32((uint32_t)prog.nextGlobalAddr);
+        meta.u32((uint32_t)prog.nextStringAddr);
+        section(SEC_META, meta);
+        rawSection(SEC_SOURCE, source.data(), source.size());
+        rawSection(SEC_CODE, prog.code.data(), prog.code.size());
+        rawSection(SEC_CONSTANTS, prog.constants.data(), prog.constants.size() * sizeof(Slot));
+        Writer strings;
+        strings.u32((uint32_t)prog.strings.size());
+        for (const std::string& s : prog.strings) strings.str(s);
+        section(SEC_STRINGS, strings);
+        rawSection(SEC_CODE_OFFSETS, prog.codeOffsets.data(), prog.codeOffsets.size() * sizeof(uint32_t));
+        rawSection(SEC_REG_CODE, prog.regCode.data(), prog.regCode.size() * sizeof(RegInstr));
+        rawSection(SEC_REG_FUNCTIONS, prog.regFunctions.data(), prog.regFunctions.size() * sizeof(RegFunction));
+        rawSection(SEC_DATA, prog.dataSegment.data(), prog.dataSegment.size());
+        Writer functions;
+        functions.u32((uint32_t)prog.functions.size());
+        for (const auto& fn : prog.functions) {
+            functions.str(fn.first);
+            functions.u64(fn.second);
+        }
+        section(SEC_FUNCTIONS, functions);
+        // Globals keep their top-level type only; element types belong to
+        // the compiler that produced them
+        Writer globals;
+        globals.u32((uint32_t)prog.globals.size());
+        for (const auto& g : prog.globals) {
+            const Symbol& sym = g.second;
+            globals.str(g.first);
+            globals.u32((uint32_t)sym.address);
+            globals.u32((uint32_t)sym.type.kind);
+            globals.u32((uint32_t)sym.type.arraySize);
+            globals.u32((sym.type.isConst ? 1u : 0) | (sym.isGlobal ? 2u : 0) | (sym.isFunction ? 4u : 0));
+        }
+        section(SEC_GLOBALS, globals);
+        rawSection(SEC_LINES, prog.lines.data(), prog.lines.size() * sizeof(uint32_t));
+        rawSection(SEC_REG_LINES, prog.regLines.data(), prog.regLines.size() * sizeof(uint32_t));
+
+        Writer image;
+        image.raw(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+        image.u32(IMAGE_VERSION);
+        image.u32(encodeOptions(options));
+        image.u64(imageKey(source, options));
+        image.u64(body.out.size());
+        image.u64(fnv1a(body.out.data(), body.out.size()));
+        image.u32(sections);
+        image.u32(0);
+        image.array(body.out);
+        return image.out;
+    }
+
+    bool loadImage(const uint8_t* data, size_t size, const std::string& source, const CompileOptions& options, Program& prog) {
+        if (size < HEADER_SIZE) return false;
+        Reader header(data, size);
+        char magic[sizeof(IMAGE_MAGIC)];
+        uint32_t version = 0, opts = 0, sections = 0, pad = 0;
+        uint64_t key = 0, payload = 0, checksum = 0;
+        if (!header.raw(magic, sizeof(magic)) || std::memcmp(magic, IMAGE_MAGIC, sizeof(magic)) != 0) return false;
+        if (!header.u32(version) || version != IMAGE_VERSION) return false;
+        if (!header.u32(opts) || opts != encodeOptions(options)) return false;
+        if (!header.u64(key) || key != imageKey(source, options)) return false;
+        if (!header.u64(payload) || payload != size - HEADER_SIZE) return false;
+        if (!header.u64(checksum) || !header.u32(sections) || !header.u32(pad) || pad != 0) return false;
+        const uint8_t* body = data + HEADER_SIZE;
+        if (fnv1a(body, (size_t)payload, 14695981039346656037ull) != checksum) return false;
+
+        prog = Program();
+        uint32_t seen = 0;
+        size_t pos = 0;
+        for (uint32_t s = 0; s < sections; s++) {
+            Reader head(body + pos, (size_t)payload - pos);
+            uint32_t id = 0, reserved = 0;
+            uint64_t length = 0;
+            if (!head.u32(id) || !head.u32(reserved) || !head.u64(length)) return false;
+            pos += SECTION_HEADER_SIZE;
+            if (length > payload - pos) return false;
+            Reader r(body + pos, (size_t)length);
+            pos += (size_t)std::min<uint64_t>((length + 7) & ~(uint64_t)7, payload - pos);
+
+            bool ok = true;
+            switch (id) {
+                case SEC_META: {
+                    uint32_t entry = 0, depth = 0, nextGlobal = 0, nextString = 0;
+                    ok = r.u32(entry) && r.u32(depth) && r.u32(nextGlobal) && r.u32(nextString);
+                    prog.entryPoint = entry;
+                    prog.nextGlobalAddr = (int)nextGlobal;
+                    prog.nextStringAddr = (int)nextString;
+                    break;
+                }
+                case SEC_SOURCE: {
+                    // The key is only a hash; the text settles it
+                    const uint8_t* text = r.take((size_t)length);
+                    ok = length == source.size() && std::memcmp(text, source.data(), source.size()) == 0;
+                    break;
+                }
+                case SEC_CODE: ok = r.array(prog.code); break;
+                case SEC_CONSTANTS: ok = r.array(prog.constants); break;
+                case SEC_STRINGS: {
+                    uint32_t count = 0;
+                    ok = r.u32(count) && count <= length;
+                    for (uint32_t i = 0; ok && i < count; i++) {
+                        std::string str;
+                        ok = r.str(str);
+                        prog.strings.push_back(str);
+                    }
+                    break;
+                }
+                case SEC_CODE_OFFSETS: ok = r.array(prog.codeOffsets); break;
+                case SEC_REG_CODE: ok = r.array(prog.regCode); break;
+                case SEC_REG_FUNCTIONS: ok = r.array(prog.regFunctions); break;
+                case SEC_DATA: ok = r.array(prog.dataSegment); break;
+                case SEC_FUNCTIONS: {
+                    uint32_t count = 0;
+                    ok = r.u32(count) && count <= length;
+                    for (uint32_t i = 0; ok && i < count; i++) {
+                        std::string name;
+                        uint64_t index = 0;
+                        ok = r.str(name) && r.u64(index);
+                        prog.functions[name] = (size_t)index;
+                    }
+                    break;
+                }
+                case SEC_GLOBALS: {
+                    uint32_t count = 0;
+                    ok = r.u32(count) && count <= length;
+                    for (uint32_t i = 0; ok && i < count; i++) {
+                        std::string name;
+                        uint32_t address = 0, kind = 0, arraySize = 0, flags = 0;
+                        ok = r.str(name) && r.u32(address) && r.u32(kind) && r.u32(arraySize) && r.u32(flags) && kind <= TYPE_FUNCTION;
+                        Symbol sym;
+                        sym.name = name;
+                        sym.type = Type{(TypeKind)kind, nullptr, (flags & 1) != 0, (int)arraySize};
+                        sym.address = (int)address;
+                        sym.isGlobal = (flags & 2) != 0;
+                        sym.isFunction = (flags & 4) != 0;
+                        prog.globals[name] = sym;
+                    }
+                    break;
+                }
+                case SEC_LINES: ok = r.array(prog.lines); break;
+                case SEC_REG_LINES: ok = r.array(prog.regLines); break;
+                default:
+                    continue;   // Newer section this reader does not know
+            }
+            if (!ok || !r.done()) return false;
+            if (id < SEC_END) seen |= 1u << id;
+        }
+        uint32_t all = ((1u << SEC_END) - 1) & ~1u;
+        if (seen != all) return false;
+        // Line tables are only for tools; a mismatched one is dropped
+        if (prog.lines.size() + 1 != prog.codeOffsets.size()) prog.lines.clear();
+        if (prog.regLines.size() != prog.regCode.size()) prog.regLines.clear();
+
+        // The VM hands these to snprintf, so they must be conversions the
+        // compiler would have accepted
+        for (const std::string& spec : prog.strings) {
+            if (!isPrintfSpec(spec)) return false;
+        }
+        std::string error;
+        if (!verifyProgram(prog, &error)) return false;
+        if (options.mode == EXEC_REGISTER) return checkRegisterCode(prog);
+        return prog.regCode.empty();
+    }
+
+}
@@ -0,0 +1,36 @@
+// OmniVM program images - versioned binary form of a compiled Program
+#pragma once
+#include "common.h"
+#include "hash.h"
+#include <vector>
+#include <string>
+
+namespace OmniNative {
+
+    const char IMAGE_MAGIC[8] = {'O', 'M', 'N', 'I', 'I', 'M', 'G', 0};
+    const uint32_t IMAGE_VERSION = 1;
+
+    // Layout (little-endian): a 48-byte header
+    //   magic[8], version u32, options u32 (mode | peephole << 8 | optLevel << 16),
+    //   key u64, payload size u64, payload FNV-1a u64, section count u32, pad u32
+    // then sections, each a 16-byte header (id u32, pad u32, size u64) and
+    // its bytes padded to 8, so every array starts 8-byte aligned and can be
+    // read straight out of a mapped file. Sections hold the packed code,
+    // pools, code offsets, register code, data segment, the function and
+    // global tables, a few scalars, the source text the image was compiled
+    // from and, optionally, the line tables. Unknown sections are skipped.
+
+    // Cache key of a source compiled with `options`
+    uint64_t imageKey(const std::string& source, const CompileOptions& options);
+
+    // Serializes everything the VM needs to run `prog` (not the compiler's
+    // Instruction list) together with the source it came from
+    std::vector<uint8_t> saveImage(const Program& prog, const std::string& source, const CompileOptions& options);
+
+    // Rebuilds a runnable Program. The image must match `source` and
+    // `options` exactly; its stack code is verified again and its register
+    // code bounds-checked. Returns false (leaving `prog` unspecified) for a
+    // foreign, stale, truncated or corrupt image.
+    bool loadImage(const uint8_t* data, size_t size, const std::string& source, const CompileOptions& options, Program& prog);
+
+}
@@ -0,0 +1,635 @@
+// OmniVM baseline JIT
+#include "jit.h"
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <initializer_list>
+#if OMNI_JIT
+#include <sys/mman.h>
+#endif
+
+namespace OmniNative {
+
+#if OMNI_JIT
+
+    namespace {
+
+        enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+        // Pinned while native code runs: RBP the JitState, RBX the register
+        // window, R12 memory, R13 the last address a slot load may use,
+        // R14 fp, R15 the instruction count. All callee-saved, so helper
+        // calls keep them.
+        const int SLOT_LIMIT = R13;
+
+        enum Cond { CC_B = 2, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_P = 10, CC_NP, CC_L, CC_GE, CC_LE, CC_G, CC_ALWAYS = -1 };
+        Cond negate(Cond c) { return (Cond)(c ^ 1); }
+
+        double jitFmod(double a, double b) { return b != 0 ? std::fmod(a, b) : 0; }
+        int64_t jitDoubleToInt(double v) { return doubleToInt(v); }
+
+        // Just the encodings the templates use. Memory operands are
+        // [base + disp8/32] or [base + index]; `prefix` is a mandatory
+        // SSE prefix, which goes before REX.
+        class Assembler {
+        public:
+            std::vector<uint8_t> bytes;
+
+            size_t size() const { return bytes.size(); }
+            void byte(uint8_t b) { bytes.push_back(b); }
+            void dword(uint32_t v) {
+                for (int i = 0; i < 4; i++) byte((uint8_t)(v >> (8 * i)));
+            }
+            void qword(uint64_t v) {
+                for (int i = 0; i < 8; i++) byte((uint8_t)(v >> (8 * i)));
+            }
+            void patch(size_t at, size_t target) {
+                int32_t rel = (int32_t)((int64_t)target - (int64_t)(at + 4));
+                std::memcpy(&bytes[at], &rel, 4);
+            }
+
+            void mem(int reg, int base, int32_t disp, bool w, std::initializer_list<uint8_t> op, uint8_t prefix = 0) {
+                if (prefix) byte(prefix);
+                rex(w, reg, 0, base);
+                for (uint8_t b : op) byte(b);
+                bool small = disp >= -128 && disp <= 127;
+                byte((uint8_t)((small ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7)));
+                if ((base & 7) == RSP) byte(0x24);
+                if (small) byte((uint8_t)disp);
+                else dword((uint32_t)disp);
+            }
+
+            // base must not be RBP/R13, index not RSP
+            void indexed(int reg, int base, int index, bool w, std::initializer_list<uint8_t> op) {
+                rex(w, reg, index, base);
+                for (uint8_t b : op) byte(b);
+                byte((uint8_t)(0x04 | ((reg & 7) << 3)));
+                byte((uint8_t)(((index & 7) << 3) | (base & 7)));
+            }
+
+            void direct(int reg, int rm, bool w, std::initializer_list<uint8_t> op, uint8_t prefix = 0) {
+                if (prefix) byte(prefix);
+                rex(w, reg, 0, rm);
+                for (uint8_t b : op) byte(b);
+                byte((uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+            }
+
+            void push(int r) {
+                if (r >= 8) byte(0x41);
+                byte((uint8_t)(0x50 + (r & 7)));
+            }
+            void pop(int r) {
+                if (r >= 8) byte(0x41);
+                byte((uint8_t)(0x58 + (r & 7)));
+            }
+            void movImm64(int r, uint64_t v) {
+                rex(true, 0, 0, r);
+                byte((uint8_t)(0xB8 + (r & 7)));
+                qword(v);
+            }
+            void call(const void* fn) {
+                movImm64(RAX, (uint64_t)(uintptr_t)fn);
+                byte(0xFF);
+                byte(0xD0);
+            }
+            void zero(int r) { direct(r, r, false, {0x31}); }   // xor r32, r32
+
+            // rel32 jump or jcc; returns the position of the displacement
+            size_t jump(Cond c) {
+                if (c == CC_ALWAYS) {
+                    byte(0xE9);
+                } else {
+                    byte(0x0F);
+                    byte((uint8_t)(0x80 + c));
+                }
+                size_t at = size();
+                dword(0);
+                return at;
+            }
+            void setcc(Cond c, int r) {
+                if (r >= 4) rex(false, 0, 0, r, true);
+                byte(0x0F);
+                byte((uint8_t)(0x90 + c));
+                byte((uint8_t)(0xC0 | (r & 7)));
+            }
+
+        private:
+            void rex(bool w, int reg, int index, int base, bool force = false) {
+                uint8_t v = (uint8_t)(0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+                if (v != 0x40 || force) byte(v);
+            }
+        };
+
+        bool isBranch(RegOpCode op) { return op >= R_JMP && op <= R_JFIGEK; }
+
+        // Whether the templates cover an instruction; everything else
+        // returns to the interpreter
+        bool supported(RegOpCode op) {
+            switch (op) {
+                case R_HALT: case R_ALLOC: case R_REALLOC: case R_FREE:
+                case R_ARG: case R_CALL: case R_CALLB: case R_RET: case R_ENTER:
+                case R_PRINT: case R_PRINTC: case R_PRINTS: case R_PRINTF:
+                    return false;
+                default:
+                    return op < R_OP_COUNT;
+            }
+        }
+
+        class LoopCompiler {
+        public:
+            LoopCompiler(const Program& p, uint32_t h, uint32_t l) : prog(p), header(h), last(l) {}
+
+            std::vector<uint8_t> compile() {
+                findLeaders();
+                prologue();
+                labels.assign(last - header + 2, 0);
+                for (uint32_t i = header; i <= last; i++) {
+                    labels[i - header] = x64.size();
+                    const RegInstr& in = prog.regCode[i];
+                    if (!supported(in.op)) {
+                        exitTo(CC_ALWAYS, i, 0);
+                        continue;
+                    }
+                    if (leader[i - header]) countBlock(i);
+                    instruction(i, in);
+                }
+                exitTo(CC_ALWAYS, last + 1, 0);   // Fell out of the loop
+
+                for (const auto& j : jumps) x64.patch(j.first, labels[j.second - header]);
+                for (const auto& e : exits) {
+                    size_t stub = x64.size();
+                    if (e.first.second) {
+                        x64.direct(5, R15, true, {0x83});  // sub r15, excess
+                        x64.byte((uint8_t)e.first.second);
+                    }
+                    x64.byte(0xB8);                         // mov eax, resume
+                    x64.dword(e.first.first);
+                    size_t out = x64.jump(CC_ALWAYS);
+                    epilogueJumps.push_back(out);
+                    for (size_t at : e.second) x64.patch(at, stub);
+                }
+                size_t epi = x64.size();
+                epilogue();
+                for (size_t at : epilogueJumps) x64.patch(at, epi);
+                return x64.bytes;
+            }
+
+        private:
+            const Program& prog;
+            uint32_t header, last;
+            Assembler x64;
+            std::vector<uint8_t> leader;
+            std::vector<size_t> labels;                       // Instruction - header -> code offset
+            std::vector<std::pair<size_t, uint32_t>> jumps;   // Displacement -> instruction
+            std::map<std::pair<uint32_t, int>, std::vector<size_t>> exits;  // (resume, excess) -> displacements
+            std::vector<size_t> epilogueJumps;
+
+            static int32_t slot(int r) { return r * (int32_t)sizeof(Slot); }
+            bool inLoop(uint32_t t) const { return t >= header && t <= last; }
+
+            // Instructions are counted a block at a time, on entry. Branches
+            // end blocks and unhandled instructions are blocks of their own,
+            // so an exit only ever has to take back the branch it stops at.
+            void findLeaders() {
+                leader.assign(last - header + 2, 0);
+                leader[0] = 1;
+                for (uint32_t i = header; i <= last; i++) {
+                    const RegInstr& in = prog.regCode[i];
+                    if (!supported(in.op)) {
+                        leader[i - header] = 1;
+                        leader[i - header + 1] = 1;
+                    } else if (isBranch(in.op)) {
+                        leader[i - header + 1] = 1;
+                        if (inLoop((uint32_t)in.x)) leader[in.x - header] = 1;
+                    }
+                }
+            }
+
+            void countBlock(uint32_t i) {
+                int n = 1;
+                while (i + n <= last && !leader[i + n - header]) n++;
+                x64.direct(0, R15, true, {0x81});   // add r15, n
+                x64.dword((uint32_t)n);
+            }
+
+            void prologue() {
+                for (int r : {RBP, RBX, R12, R13, R14, R15}) x64.push(r);
+                x64.direct(5, RSP, true, {0x83});   // sub rsp, 8 (16-byte aligned calls)
+                x64.byte(8);
+                x64.direct(RDI, RBP, true, {0x89}); // mov rbp, rdi
+                x64.mem(RBX, RBP, offsetof(JitState, regs), true, {0x8B});
+                x64.mem(R12, RBP, offsetof(JitState, memory), true, {0x8B});
+                x64.mem(R13, RBP, offsetof(JitState, memorySize), true, {0x8B});
+                x64.direct(5, R13, true, {0x83});   // sub r13, 8
+                x64.byte(8);
+                x64.mem(R14, RBP, offsetof(JitState, fp), true, {0x8B});
+                x64.mem(R15, RBP, offsetof(JitState, executed), true, {0x8B});
+            }
+
+            void epilogue() {
+                x64.mem(R15, RBP, offsetof(JitState, executed), true, {0x89});
+                x64.direct(0, RSP, true, {0x83});   // add rsp, 8
+                x64.byte(8);
+                for (int r : {R15, R14, R13, R12, RBX, RBP}) x64.pop(r);
+                x64.byte(0xC3);
+            }
+
+            void exitTo(Cond c, uint32_t resume, int excess) {
+                exits[{resume, excess}].push_back(x64.jump(c));
+            }
+
+            // Jump when `c` holds from branch i to t. Backward jumps check
+            // the cycle budget first, as the interpreter does.
+            void branch(Cond c, uint32_t i, uint32_t t) {
+                if (!inLoop(t)) {
+                    exitTo(c, i, 1);
+                    return;
+                }
+                if (t > i) {
+                    jumps.push_back({x64.jump(c), t});
+                    return;
+                }
+                size_t skip = c == CC_ALWAYS ? 0 : x64.jump(negate(c));
+                x64.mem(R15, RBP, offsetof(JitState, maxCycles), true, {0x3B});  // cmp r15, maxCycles
+                exitTo(CC_A, i, 1);
+                jumps.push_back({x64.jump(CC_ALWAYS), t});
+                if (c != CC_ALWAYS) x64.patch(skip, x64.size());
+            }
+
+            void loadReg(int reg, int r) { x64.mem(reg, RBX, slot(r), true, {0x8B}); }
+            void storeReg(int r, int reg) { x64.mem(reg, RBX, slot(r), true, {0x89}); }
+            void loadDouble(int xmm, int r) { x64.mem(xmm, RBX, slot(r), false, {0x0F, 0x10}, 0xF2); }
+            void storeDouble(int r, int xmm) { x64.mem(xmm, RBX, slot(r), false, {0x0F, 0x11}, 0xF2); }
+
+            // rax = slot at address rax, 0 outside memory (loadSlot)
+            void loadSlotAtRax() {
+                x64.direct(SLOT_LIMIT, RAX, true, {0x39});   // cmp rax, r13
+                size_t outside = x64.jump(CC_A);
+                x64.indexed(RAX, R12, RAX, true, {0x8B});    // mov rax, [r12 + rax]
+                size_t done = x64.jump(CC_ALWAYS);
+                x64.patch(outside, x64.size());
+                x64.zero(RAX);
+                x64.patch(done, x64.size());
+            }
+
+            // Slot at address rax = register r (storeSlot)
+            void storeSlotAtRax(int r) {
+                x64.direct(SLOT_LIMIT, RAX, true, {0x39});
+                size_t outside = x64.jump(CC_A);
+                loadReg(RCX, r);
+                x64.indexed(RCX, R12, RAX, true, {0x89});    // mov [r12 + rax], rcx
+                x64.patch(outside, x64.size());
+            }
+
+            // rax = fp + x for locals, x for globals
+            void addressOf(const RegInstr& in) {
+                if (in.op == R_LOADL || in.op == R_STOREL) {
+                    x64.mem(RAX, R14, in.x, true, {0x8D});  // lea rax, [r14 + x]
+                } else {
+                    x64.direct(0, RAX, true, {0xC7});       // mov rax, x
+                    x64.dword((uint32_t)in.x);
+                }
+            }
+
+            void intOp(const RegInstr& in, std::initializer_list<uint8_t> op) {
+                loadReg(RAX, in.b);
+                x64.mem(RAX, RBX, slot(in.c), true, op);
+                storeReg(in.a, RAX);
+            }
+
+            void intCompare(const RegInstr& in, Cond c) {
+                x64.zero(RCX);
+                loadReg(RAX, in.b);
+                x64.mem(RAX, RBX, slot(in.c), true, {0x3B});
+                x64.setcc(c, RCX);
+                storeReg(in.a, RCX);
+            }
+
+            void doubleOp(const RegInstr& in, uint8_t op) {
+                loadDouble(0, in.b);
+                x64.mem(0, RBX, slot(in.c), false, {0x0F, op}, 0xF2);
+                storeDouble(in.a, 0);
+            }
+
+            // ucomisd x, y then setcc; `swap` compares c with b
+            void doubleCompare(const RegInstr& in, Cond c, bool swap) {
+                x64.zero(RCX);
+                loadDouble(0, swap ? in.c : in.b);
+                x64.mem(0, RBX, slot(swap ? in.b : in.c), false, {0x0F, 0x2E}, 0x66);
+                x64.setcc(c, RCX);
+                storeReg(in.a, RCX);
+            }
+
+            // Equality must also reject unordered operands (NaN)
+            void doubleEquality(const RegInstr& in, bool equal) {
+                x64.zero(RCX);
+                x64.zero(RDX);
+                loadDouble(0, in.b);
+                x64.mem(0, RBX, slot(in.c), false, {0x0F, 0x2E}, 0x66);
+                x64.setcc(equal ? CC_E : CC_NE, RCX);
+                x64.setcc(equal ? CC_NP : CC_P, RDX);
+                x64.direct(RDX, RCX, false, {(uint8_t)(equal ? 0x21 : 0x09)});  // and/or ecx, edx
+                storeReg(in.a, RCX);
+            }
+
+            // intDiv / intMod: a zero divisor gives 0, -1 negates (wrapping)
+            void divide(const RegInstr& in, bool remainder) {
+                loadReg(RCX, in.c);
+                loadReg(RAX, in.b);
+                x64.direct(RCX, RCX, true, {0x85});          // test rcx, rcx
+                size_t byZero = x64.jump(CC_E);
+                x64.direct(7, RCX, true, {0x83});            // cmp rcx, -1
+                x64.byte(0xFF);
+                size_t byMinusOne = x64.jump(CC_E);
+                x64.byte(0x48);                              // cqo
+                x64.byte(0x99);
+                x64.direct(7, RCX, true, {0xF7});            // idiv rcx
+                if (remainder) x64.direct(RDX, RAX, true, {0x89});  // mov rax, rdx
+                size_t done = x64.jump(CC_ALWAYS);
+                x64.patch(byMinusOne, x64.size());
+                if (remainder) x64.zero(RAX);
+                else x64.direct(3, RAX, true, {0xF7});       // neg rax
+                size_t done2 = x64.jump(CC_ALWAYS);
+                x64.patch(byZero, x64.size());
+                x64.zero(RAX);
+                x64.patch(done, x64.size());
+                x64.patch(done2, x64.size());
+                storeReg(in.a, RAX);
+            }
+
+            void fusedBranch(uint32_t i, const RegInstr& in, Cond holds, bool constant) {
+                loadReg(RAX, in.b);
+                if (constant) {
+                    x64.movImm64(RDX, (uint64_t)prog.constants[in.c].i);
+                    x64.direct(RDX, RAX, true, {0x39});      // cmp rax, rdx
+                } else {
+                    x64.mem(RAX, RBX, slot(in.c), true, {0x3B});
+                }
+                branch(negate(holds), i, (uint32_t)in.x);
+            }
+
+            void instruction(uint32_t i, const RegInstr& in) {
+                switch (in.op) {
+                    case R_MOV: loadReg(RAX, in.b); storeReg(in.a, RAX); break;
+                    case R_LOADI:
+                        x64.mem(0, RBX, slot(in.a), true, {0xC7});
+                        x64.dword((uint32_t)in.x);
+                        break;
+                    case R_LOADK:
+                        x64.movImm64(RAX, (uint64_t)prog.constants[in.x].i);
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_ADDR:
+                        x64.mem(RAX, R14, in.x, true, {0x8D});  // lea rax, [r14 + x]
+                        storeReg(in.a, RAX);
+                        break;
+
+                    case R_ADD: doubleOp(in, 0x58); break;
+                    case R_SUB: doubleOp(in, 0x5C); break;
+                    case R_MUL: doubleOp(in, 0x59); break;
+                    case R_DIV: {
+                        loadDouble(1, in.c);
+                        x64.direct(2, 2, false, {0x0F, 0x57}, 0x66);  // xorpd xmm2, xmm2
+                        x64.direct(1, 2, false, {0x0F, 0x2E}, 0x66);          // ucomisd xmm1, xmm2
+                        size_t nan = x64.jump(CC_P);
+                        size_t nonZero = x64.jump(CC_NE);
+                        x64.direct(0, 0, false, {0x0F, 0x57}, 0x66);          // xorpd xmm0, xmm0
+                        size_t done = x64.jump(CC_ALWAYS);
+                        x64.patch(nan, x64.size());
+                        x64.patch(nonZero, x64.size());
+                        loadDouble(0, in.b);
+                        x64.direct(0, 1, false, {0x0F, 0x5E}, 0xF2);          // divsd xmm0, xmm1
+                        x64.patch(done, x64.size());
+                        storeDouble(in.a, 0);
+                        break;
+                    }
+                    case R_MOD:
+                        loadDouble(0, in.b);
+                        loadDouble(1, in.c);
+                        x64.call((const void*)&jitFmod);
+                        storeDouble(in.a, 0);
+                        break;
+                    case R_EQ: doubleEquality(in, true); break;
+                    case R_NE: doubleEquality(in, false); break;
+                    case R_LT: doubleCompare(in, CC_A, true); break;
+                    case R_GT: doubleCompare(in, CC_A, false); break;
+                    case R_LE: doubleCompare(in, CC_AE, true); break;
+                    case R_GE: doubleCompare(in, CC_AE, false); break;
+
+                    case R_IADD: intOp(in, {0x03}); break;
+                    case R_ISUB: intOp(in, {0x2B}); break;
+                    case R_IMUL: intOp(in, {0x0F, 0xAF}); break;
+                    case R_IDIV: divide(in, false); break;
+                    case R_IMOD: divide(in, true); break;
+                    case R_AND: intOp(in, {0x23}); break;
+                    case R_OR: intOp(in, {0x0B}); break;
+                    case R_XOR: intOp(in, {0x33}); break;
+                    case R_SHL: case R_SHR:
+                        loadReg(RCX, in.c);
+                        loadReg(RAX, in.b);
+                        x64.direct(in.op == R_SHL ? 4 : 7, RAX, true, {0xD3});  // shl/sar rax, cl
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_IEQ: intCompare(in, CC_E); break;
+                    case R_INE: intCompare(in, CC_NE); break;
+                    case R_ILT: intCompare(in, CC_L); break;
+                    case R_IGT: intCompare(in, CC_G); break;
+                    case R_ILE: intCompare(in, CC_LE); break;
+                    case R_IGE: intCompare(in, CC_GE); break;
+                    case R_LAND: case R_LOR:
+                        x64.zero(RCX);
+                        x64.zero(RDX);
+                        x64.mem(7, RBX, slot(in.b), true, {0x83});  // cmp qword [b], 0
+                        x64.byte(0);
+                        x64.setcc(CC_NE, RCX);
+                        x64.mem(7, RBX, slot(in.c), true, {0x83});
+                        x64.byte(0);
+                        x64.setcc(CC_NE, RDX);
+                        x64.direct(RDX, RCX, false, {(uint8_t)(in.op == R_LAND ? 0x21 : 0x09)});
+                        storeReg(in.a, RCX);
+                        break;
+
+                    case R_IADDI:
+                        loadReg(RAX, in.b);
+                        x64.direct(0, RAX, true, {0x81});
+                        x64.dword((uint32_t)in.x);
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_IMULI:
+                        x64.mem(RAX, RBX, slot(in.b), true, {0x69});  // imul rax, [b], x
+                        x64.dword((uint32_t)in.x);
+                        storeReg(in.a, RAX);
+                        break;
+
+                    case R_NOT:
+                        loadReg(RAX, in.b);
+                        x64.direct(2, RAX, true, {0xF7});
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_LNOT:
+                        x64.zero(RCX);
+                        x64.mem(7, RBX, slot(in.b), true, {0x83});
+                        x64.byte(0);
+                        x64.setcc(CC_E, RCX);
+                        storeReg(in.a, RCX);
+                        break;
+                    case R_I2D:
+                        x64.mem(0, RBX, slot(in.b), true, {0x0F, 0x2A}, 0xF2);  // cvtsi2sd xmm0, [b]
+                        storeDouble(in.a, 0);
+                        break;
+                    case R_D2I:
+                        loadDouble(0, in.b);
+                        x64.call((const void*)&jitDoubleToInt);
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_SEXT8:
+                        x64.mem(RAX, RBX, slot(in.b), true, {0x0F, 0xBE});  // movsx rax, byte [b]
+                        storeReg(in.a, RAX);
+                        break;
+
+                    case R_LOAD:
+                        loadReg(RAX, in.b);
+                        loadSlotAtRax();
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_STORE:
+                        loadReg(RAX, in.b);
+                        storeSlotAtRax(in.c);
+                        break;
+                    case R_LOADB: case R_STOREB: {
+                        loadReg(RAX, in.b);
+                        x64.mem(RAX, RBP, offsetof(JitState, memorySize), true, {0x3B});  // cmp rax, size
+                        size_t outside = x64.jump(CC_AE);
+                        if (in.op == R_LOADB) {
+                            x64.indexed(RAX, R12, RAX, true, {0x0F, 0xBE});  // movsx rax, byte [r12 + rax]
+                            size_t done = x64.jump(CC_ALWAYS);
+                            x64.patch(outside, x64.size());
+                            x64.zero(RAX);
+                            x64.patch(done, x64.size());
+                            storeReg(in.a, RAX);
+                        } else {
+                            x64.mem(RCX, RBX, slot(in.c), false, {0x8A});    // mov cl, [c]
+                            x64.indexed(RCX, R12, RAX, false, {0x88});       // mov [r12 + rax], cl
+                            x64.patch(outside, x64.size());
+                        }
+                        break;
+                    }
+                    case R_LOADL: case R_LOADG:
+                        addressOf(in);
+                        loadSlotAtRax();
+                        storeReg(in.a, RAX);
+                        break;
+                    case R_STOREL: case R_STOREG:
+                        addressOf(in);
+                        storeSlotAtRax(in.b);
+                        break;
+
+                    case R_JMP: branch(CC_ALWAYS, i, (uint32_t)in.x); break;
+                    case R_JT: case R_JF:
+                        x64.mem(7, RBX, slot(in.b), true, {0x83});
+                        x64.byte(0);
+                        branch(in.op == R_JT ? CC_NE : CC_E, i, (uint32_t)in.x);
+                        break;
+                    case R_JFIEQ: fusedBranch(i, in, CC_E, false); break;
+                    case R_JFINE: fusedBranch(i, in, CC_NE, false); break;
+                    case R_JFILT: fusedBranch(i, in, CC_L, false); break;
+                    case R_JFIGT: fusedBranch(i, in, CC_G, false); break;
+                    case R_JFILE: fusedBranch(i, in, CC_LE, false); break;
+                    case R_JFIGE: fusedBranch(i, in, CC_GE, false); break;
+                    case R_JFIEQK: fusedBranch(i, in, CC_E, true); break;
+                    case R_JFINEK: fusedBranch(i, in, CC_NE, true); break;
+                    case R_JFILTK: fusedBranch(i, in, CC_L, true); break;
+                    case R_JFIGTK: fusedBranch(i, in, CC_G, true); break;
+                    case R_JFILEK: fusedBranch(i, in, CC_LE, true); break;
+                    case R_JFIGEK: fusedBranch(i, in, CC_GE, true); break;
+                    default: break;
+                }
+            }
+        };
+
+    }
+
+    JitCompiler::~JitCompiler() {
+        reset(0);
+    }
+
+    void JitCompiler::reset(size_t instructions) {
+        for (const auto& m : mappings) munmap(m.first, m.second);
+        mappings.clear();
+        loops.assign(instructions, nullptr);
+        attempted.assign(instructions, 0);
+        entryCounts.assign(instructions, 0);
+        nativeRuns.assign(instructions, 0);
+        counters = JitStats();
+    }
+
+    void JitCompiler::entered(uint32_t header, uint64_t instructions) {
+        counters.entries++;
+        if (entryCounts[header] >= JIT_PROBATION_ENTRIES) return;
+        nativeRuns[header] += instructions;
+        if (++entryCounts[header] < JIT_PROBATION_ENTRIES) return;
+        if (nativeRuns[header] < JIT_MIN_RUN * JIT_PROBATION_ENTRIES) {
+            loops[header] = nullptr;   // The mapping stays until reset()
+            counters.loopsAbandoned++;
+        }
+    }
+
+    void JitCompiler::compileLoop(const Program& prog, uint32_t header, uint32_t backEdge) {
+        attempted[header] = 1;
+        if (!supported(prog.regCode[header].op)) {
+            counters.loopsRejected++;
+            return;
+        }
+        // The loop body runs to the last jump back to the header within
+        // the function
+        size_t end = prog.regCode.size();
+        for (const RegFunction& fn : prog.regFunctions) {
+            if (fn.entry > header && fn.entry < end) end = fn.entry;
+        }
+        uint32_t last = backEdge;
+        for (size_t i = backEdge; i < end; i++) {
+            const RegInstr& in = prog.regCode[i];
+            if (isBranch(in.op) && (uint32_t)in.x == header) last = (uint32_t)i;
+        }
+
+        std::vector<uint8_t> code = LoopCompiler(prog, header, last).compile();
+        size_t page = 4096;
+        size_t size = (code.size() + page - 1) / page * page;
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            counters.loopsRejected++;
+            return;
+        }
+        std::memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, size);
+            counters.loopsRejected++;
+            return;
+        }
+        mappings.push_back({mem, size});
+        loops[header] = (JitLoop)mem;
+        counters.loopsCompiled++;
+        counters.codeBytes += code.size();
+    }
+
+#else
+
+    JitCompiler::~JitCompiler() {}
+
+    void JitCompiler::reset(size_t instructions) {
+        loops.assign(instructions, nullptr);
+        attempted.assign(instructions, 0);
+        counters = JitStats();
+    }
+
+    void JitCompiler::entered(uint32_t, uint64_t) {}
+
+    void JitCompiler::compileLoop(const Program&, uint32_t header, uint32_t) {
+        attempted[header] = 1;
+        counters.loopsRejected++;
+    }
+
+#endif
+
+}
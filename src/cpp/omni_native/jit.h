@@ -0,0 +1,82 @@
+// OmniVM baseline JIT - hot register-code loops to x86-64 machine code
+#pragma once
+#include "common.h"
+#include <vector>
+
+namespace OmniNative {
+
+    // Native code needs an x86-64 host that can map executable memory
+    #if defined(__x86_64__) && defined(__linux__)
+    #define OMNI_JIT 1
+    #else
+    #define OMNI_JIT 0
+    #endif
+
+    // Taken backward jumps to a loop header before the loop is compiled
+    const uint32_t JIT_HOT_LOOP_THRESHOLD = 1000;
+    // A compiled loop is dropped if, over this many entries, it averaged
+    // fewer than JIT_MIN_RUN instructions before handing back (a call or
+    // I/O every iteration): entering would cost more than it saves
+    const uint32_t JIT_PROBATION_ENTRIES = 256;
+    const uint64_t JIT_MIN_RUN = 32;
+
+    // What native code needs from the interpreter; `executed` is updated on
+    // the way out
+    struct JitState {
+        Slot* regs;             // Current register window
+        uint8_t* memory;
+        uint64_t memorySize;
+        uint64_t fp;
+        uint64_t executed;
+        uint64_t maxCycles;
+    };
+
+    // Runs the loop from its header and returns the regCode index at which
+    // the interpreter takes over: the first instruction the native code
+    // does not handle, a branch leaving the loop, or a back edge once the
+    // cycle budget is spent. Instructions are counted exactly as the
+    // interpreter counts them.
+    using JitLoop = uint32_t (*)(JitState*);
+
+    struct JitStats {
+        size_t loopsCompiled = 0;
+        size_t loopsRejected = 0;    // Header is an instruction the JIT does not handle
+        size_t loopsAbandoned = 0;   // Compiled, but kept handing back too soon
+        size_t entries = 0;          // Interpreter -> native transitions
+        size_t codeBytes = 0;
+    };
+
+    // Template compiler: every register instruction of the loop becomes a
+    // fixed x86-64 sequence over the register window in memory. Calls, I/O,
+    // allocation and returns are left to the interpreter (deoptimization is
+    // just returning their index). Compiled loops live until reset().
+    class JitCompiler {
+    public:
+        JitCompiler() = default;
+        ~JitCompiler();
+        JitCompiler(const JitCompiler&) = delete;
+        JitCompiler& operator=(const JitCompiler&) = delete;
+
+        // Drops all code; `instructions` is the size of the next program's regCode
+        void reset(size_t instructions);
+
+        // Compiles the loop from `header` to its last back edge, at or after
+        // `backEdge`; loop(header) stays nullptr if it cannot be compiled
+        void compileLoop(const Program& prog, uint32_t header, uint32_t backEdge);
+        JitLoop loop(uint32_t header) const { return loops[header]; }
+        bool tried(uint32_t header) const { return attempted[header] != 0; }
+
+        // Records a run of native code that executed `instructions`
+        void entered(uint32_t header, uint64_t instructions);
+        JitStats stats() const { return counters; }
+
+    private:
+        std::vector<JitLoop> loops;          // Header -> native code
+        std::vector<uint8_t> attempted;
+        std::vector<uint32_t> entryCounts;   // Entries while on probation
+        std::vector<uint64_t> nativeRuns;
+        std::vector<std::pair<void*, size_t>> mappings;
+        JitStats counters;
+    };
+
+}
@@ -1,38 +1,63 @@
 #include <iostream>
 #include <string>
-#include <emscripten.h>
 #include "common.h"
+#include "cache.h"
+#include "pool.h"
+#include "vm.h"
 
-// Forward declare executeSource from compiler.cpp
-namespace OmniNative {
-    std::vector<std::string> executeSource(const std::string& source);
-}
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
 
-extern "C" {
+namespace {
 
-    // Main API called by React
-    // Returns: Output String (each line is separate)
-    const char* compile_and_run(const char* source_code) {
-        static std::string output_cache;
-        static std::vector<std::string> results;
+    // Re-running an unchanged editor buffer skips the front-end
+    const size_t PROGRAM_CACHE_SIZE = 16;
+
+    OmniNative::ProgramCache& programs() {
+        static OmniNative::ProgramCache cache(PROGRAM_CACHE_SIZE);
+        return cache;
+    }
+
+    // Appends the unread output of `ring` to `out`, consuming it, with a
+    // "> " prompt before each line and no newline after the last
+    void appendPrompted(std::string& out, OmniNative::OutputRing& ring) {
+        bool lineEnded = false;
+        if (ring.unread() > 0) out += "> ";
+        for (std::string_view chunk; !(chunk = ring.front()).empty(); ring.consume(chunk.size())) {
+            size_t at = 0;
+            while (at < chunk.size()) {
+                if (lineEnded) out += "\n> ";
+                size_t end = chunk.find('\n', at);
+                lineEnded = end != std::string_view::npos;
+                if (!lineEnded) end = chunk.size();
+                out.append(chunk.data() + at, end - at);
+                at = end + 1;
+            }
+        }
+    }
+
+    // Compiles and runs `source_code`, formatting each output line (or the
+    // error) with a "> " prompt. The output is formatted straight from the
+    // VM's ring; the returned text is per thread.
+    const char* runWithOptions(const char* source_code, const OmniNative::CompileOptions& options) {
+        thread_local std::string output_cache;
 
         output_cache.clear();
-        results.clear();
 
         try {
-            // Use the interpreter directly
-            results = OmniNative::executeSource(source_code);
-
-            // Combine results with newlines
-            for (size_t i = 0; i < results.size(); i++) {
-                if (i > 0) output_cache += "\n";
-                output_cache += "> " + results[i];
-            }
+            // Compile to bytecode (or reuse it) and run it on the VM
+            auto prog = programs().get(source_code, options);
+            OmniNative::VmPool::Lease vm = OmniNative::sharedPool().acquire();
+            vm->run(*prog);
+            appendPrompted(output_cache, vm->outputRing());
 
             if (output_cache.empty()) {
-                output_cache = "> Program finished with no output.";
+                output_cache = "> Program finished successfully.";
             }
 
+        } catch (const OmniNative::CompileError& e) {
+            output_cache = std::string("> Compile Error: ") + e.what();
         } catch (const std::exception& e) {
             output_cache = std::string("> Runtime Error: ") + e.what();
         } catch (...) {
@@ -41,9 +66,159 @@ extern "C" {
 
         return output_cache.c_str();
     }
+
+    // Compiles and runs `source_code` with the profiler on; returns the
+    // profile, or the error formatted as runWithOptions does
+    const char* profileWithOptions(const char* source_code, const OmniNative::CompileOptions& options,
+                                   uint64_t sampleInterval, bool folded) {
+        thread_local std::string profile_cache;
+
+        try {
+            auto prog = programs().get(source_code, options);
+            OmniNative::VmPool::Lease vm = OmniNative::sharedPool().acquire();
+            vm->setProfiling(true, sampleInterval);
+            vm->run(*prog);
+            const OmniNative::Profile& profile = vm->getProfile();
+            profile_cache = folded ? profile.toFolded() : profile.toJson();
+        } catch (const OmniNative::CompileError& e) {
+            profile_cache = std::string("> Compile Error: ") + e.what();
+        } catch (const std::exception& e) {
+            profile_cache = std::string("> Runtime Error: ") + e.what();
+        } catch (...) {
+            profile_cache = "> Unknown Fatal Error";
+        }
+
+        return profile_cache.c_str();
+    }
+
+    // The run driven by vm_start / vm_step; holds on to its program
+    struct Session {
+        std::shared_ptr<const OmniNative::Program> program;
+        OmniNative::VirtualMachine vm;
+    };
+
+    Session& session() {
+        static Session s;
+        return s;
+    }
+
+}
+
+extern "C" {
+
+    // Main API called by React
+    // Returns: Output String (each line is separate)
+    const char* compile_and_run(const char* source_code) {
+        return runWithOptions(source_code, OmniNative::CompileOptions());
+    }
+
+    // Same, with the SSA optimizer at `opt_level` (0 = off, 1 = scalar
+    // optimizations, 2 = also loop optimizations; see ssa.h)
+    const char* compile_and_run_opts(const char* source_code, int opt_level) {
+        OmniNative::CompileOptions options;
+        options.optLevel = opt_level;
+        return runWithOptions(source_code, options);
+    }
+
+    // Runs the program under the profiler (see profiler.h) and returns
+    // per-opcode, per-function and per-line counts as JSON, or with
+    // `folded` set, "a;b;c count" lines for flamegraph tools. A nonzero
+    // `sample_interval` also samples the stack and line every that many
+    // instructions; folded output then lists the samples.
+    const char* compile_and_profile(const char* source_code, int opt_level, int sample_interval, int folded) {
+        OmniNative::CompileOptions options;
+        options.optLevel = opt_level;
+        return profileWithOptions(source_code, options, sample_interval > 0 ? (uint64_t)sample_interval : 0, folded != 0);
+    }
+
+    // Cooperative execution, so a long program does not block the page:
+    // vm_start compiles and loads a program (replacing any current run),
+    // then each vm_step runs about `budget_cycles` instructions. Both
+    // return 0 while running, 1 once finished, 2 on an error (compile
+    // errors included). vm_drain_output returns a copy of the raw output
+    // produced since the last read; vm_cancel stops the run.
+    int vm_start(const char* source_code, int opt_level) {
+        Session& s = session();
+        s.vm.cancel();
+        s.vm.clearOutput();
+        s.program.reset();
+        OmniNative::CompileOptions options;
+        options.optLevel = opt_level;
+        OmniNative::OutputRing& out = s.vm.outputRing();
+        try {
+            s.program = programs().get(source_code, options);
+        } catch (const OmniNative::CompileError& e) {
+            out << "Compile Error: " << std::string_view(e.what()) << "\n";
+            return OmniNative::RUN_ERROR;
+        } catch (const std::exception& e) {
+            out << "Runtime Error: " << std::string_view(e.what()) << "\n";
+            return OmniNative::RUN_ERROR;
+        }
+        s.vm.start(*s.program);
+        return s.vm.state();
+    }
+
+    int vm_step(int budget_cycles) {
+        Session& s = session();
+        if (!s.program) return OmniNative::RUN_ERROR;
+        return s.vm.step(budget_cycles > 0 ? (size_t)budget_cycles : 0);
+    }
+
+    const char* vm_drain_output() {
+        static std::string drained;
+        drained = session().vm.drainOutput();
+        return drained.c_str();
+    }
+
+    // The same output without copies: the VM appends to a ring of
+    // vm_output_capacity() bytes at vm_output_buffer(). The unread bytes
+    // run from the read cursor to the write cursor, each taken modulo the
+    // capacity, a power of two; read them from the heap in place and pass
+    // the count to vm_output_consume. vm_set_output sizes the ring and
+    // says what a full one does: 0 blocks (vm_step does nothing until
+    // there is room again), 1 drops new output, 2 overwrites the oldest
+    // unread output. It empties the ring, so call it before vm_start.
+    const char* vm_output_buffer() {
+        return session().vm.outputRing().data();
+    }
+
+    int vm_output_capacity() {
+        return (int)session().vm.outputRing().capacity();
+    }
+
+    unsigned vm_output_read_cursor() {
+        return session().vm.outputRing().readCursor();
+    }
+
+    unsigned vm_output_write_cursor() {
+        return session().vm.outputRing().writeCursor();
+    }
+
+    void vm_output_consume(int bytes) {
+        if (bytes > 0) session().vm.outputRing().consume((size_t)bytes);
+    }
+
+    // Bytes lost to the drop and overwrite policies this run
+    double vm_output_dropped() {
+        return (double)session().vm.outputRing().dropped();
+    }
+
+    void vm_set_output(int capacity, int policy) {
+        if (policy < OmniNative::OUTPUT_BLOCK || policy > OmniNative::OUTPUT_TRUNCATE) policy = OmniNative::OUTPUT_BLOCK;
+        session().vm.setOutputPolicy(capacity > 0 ? (size_t)capacity : OmniNative::VM_OUTPUT_CAPACITY,
+                                     (OmniNative::OutputPolicy)policy);
+    }
+
+    void vm_cancel() {
+        session().vm.cancel();
+    }
 }
 
+// Native builds link the functions above into a library (see
+// CMakeLists.txt); only the WASM module announces itself on load
+#ifdef __EMSCRIPTEN__
 int main() {
-    std::cout << "[OmniNative] C Interpreter Loaded. Ready for code..." << std::endl;
+    std::cout << "[OmniNative] C Compiler + VM Loaded. Ready for code..." << std::endl;
     return 0;
 }
+#endif
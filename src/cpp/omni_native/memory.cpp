@@ -0,0 +1,109 @@
+// OmniVM linear memory
+#include "memory.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if OMNI_LAZY_MEMORY
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace OmniNative {
+
+#if OMNI_LAZY_MEMORY
+
+    namespace {
+
+        size_t pageSize() {
+            static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            return page;
+        }
+
+        size_t pageRound(size_t bytes) {
+            return (bytes + pageSize() - 1) & ~(pageSize() - 1);
+        }
+
+    }
+
+    void* allocateZeroed(size_t bytes) {
+        void* block = mmap(nullptr, pageRound(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return block == MAP_FAILED ? nullptr : block;
+    }
+
+    void releaseZeroed(void* block, size_t bytes) {
+        munmap(block, pageRound(bytes));
+    }
+
+    // Fresh anonymous pages in place of whatever was mapped there (touched
+    // pages, or a MemoryImage) read as zero
+    void zeroPages(void* block, size_t bytes) {
+        void* fresh = mmap(block, pageRound(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (fresh == MAP_FAILED) std::memset(block, 0, bytes);
+    }
+
+#else
+
+    void* allocateZeroed(size_t bytes) {
+        return std::calloc(bytes ? bytes : 1, 1);
+    }
+
+    void releaseZeroed(void* block, size_t) {
+        std::free(block);
+    }
+
+    void zeroPages(void* block, size_t bytes) {
+        std::memset(block, 0, bytes);
+    }
+
+#endif
+
+#if OMNI_COW_MEMORY
+
+    // Only pages holding something are written; the rest of the file is a
+    // hole, which reads as zero and takes no memory
+    MemoryImage::MemoryImage(const void* block, size_t bytes) : length(bytes) {
+        fd = memfd_create("omni-image", MFD_CLOEXEC);
+        if (fd >= 0 && ftruncate(fd, (off_t)pageRound(bytes)) == 0) {
+            const uint8_t* src = static_cast<const uint8_t*>(block);
+            std::vector<uint8_t> zero(pageSize(), 0);
+            bool ok = true;
+            for (size_t at = 0; at < bytes && ok; at += pageSize()) {
+                size_t n = std::min(pageSize(), bytes - at);
+                if (std::memcmp(src + at, zero.data(), n) == 0) continue;
+                ok = pwrite(fd, src + at, n, (off_t)at) == (ssize_t)n;
+            }
+            if (ok) return;
+        }
+        if (fd >= 0) close(fd);
+        fd = -1;
+        this->bytes.assign(static_cast<const uint8_t*>(block), static_cast<const uint8_t*>(block) + bytes);
+    }
+
+    MemoryImage::~MemoryImage() {
+        if (fd >= 0) close(fd);
+    }
+
+    void MemoryImage::restore(void* block) const {
+        if (fd >= 0) {
+            size_t span = pageRound(length);
+            if (mmap(block, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) return;
+            if (pread(fd, block, span, 0) == (ssize_t)span) return;
+        }
+        std::memcpy(block, bytes.data(), bytes.size());
+    }
+
+#else
+
+    MemoryImage::MemoryImage(const void* block, size_t bytes)
+        : length(bytes), bytes(static_cast<const uint8_t*>(block), static_cast<const uint8_t*>(block) + bytes) {}
+
+    MemoryImage::~MemoryImage() {}
+
+    void MemoryImage::restore(void* block) const {
+        std::memcpy(block, bytes.data(), bytes.size());
+    }
+
+#endif
+
+}
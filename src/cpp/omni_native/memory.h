@@ -0,0 +1,101 @@
+// OmniVM linear memory - zero pages committed on first touch, and images
+// of it shared copy-on-write
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace OmniNative {
+
+    // Anonymous mappings hand out zero pages that the OS only commits when
+    // they are written, and can drop again in one call
+    #if defined(__unix__) && !defined(__EMSCRIPTEN__)
+    #define OMNI_LAZY_MEMORY 1
+    #else
+    #define OMNI_LAZY_MEMORY 0
+    #endif
+
+    // Memory files (memfd) that private mappings share copy-on-write
+    #if OMNI_LAZY_MEMORY && defined(__linux__)
+    #define OMNI_COW_MEMORY 1
+    #else
+    #define OMNI_COW_MEMORY 0
+    #endif
+
+    // Zero-filled blocks for ZeroPageAllocator: page-aligned anonymous
+    // mappings, or calloc without OMNI_LAZY_MEMORY
+    void* allocateZeroed(size_t bytes);
+    void releaseZeroed(void* block, size_t bytes);
+    // Sets `bytes` bytes at the start of a block from allocateZeroed back to
+    // zero. Mapped pages are returned to the OS, so the cost is the pages
+    // that were touched, not the size.
+    void zeroPages(void* block, size_t bytes);
+
+    // Allocator for VM memory and register files. Growing a vector does not
+    // write the new elements: they already are the zero bytes the block
+    // came with. That holds as long as elements past size() stay zero,
+    // which is why wipe() below zeroes a vector before shrinking it.
+    template <typename T>
+    struct ZeroPageAllocator {
+        using value_type = T;
+
+        ZeroPageAllocator() = default;
+        template <typename U>
+        ZeroPageAllocator(const ZeroPageAllocator<U>&) {}
+
+        T* allocate(size_t n) {
+            void* block = allocateZeroed(n * sizeof(T));
+            if (!block) throw std::bad_alloc();
+            return static_cast<T*>(block);
+        }
+        void deallocate(T* p, size_t n) { releaseZeroed(p, n * sizeof(T)); }
+
+        template <typename U>
+        void construct(U*) noexcept {}
+        template <typename U, typename... Args>
+        void construct(U* p, Args&&... args) { ::new ((void*)p) U(std::forward<Args>(args)...); }
+
+        template <typename U>
+        bool operator==(const ZeroPageAllocator<U>&) const { return true; }
+        template <typename U>
+        bool operator!=(const ZeroPageAllocator<U>&) const { return false; }
+    };
+
+    // VM linear memory
+    using VmBytes = std::vector<uint8_t, ZeroPageAllocator<uint8_t>>;
+
+    // A read-only copy of the start of a block from allocateZeroed, which
+    // any number of VMs can restore. With OMNI_COW_MEMORY it lives in a
+    // memory file that restore() maps over the block copy-on-write: nothing
+    // is copied, the pages stay shared until written, and wiping the block
+    // afterwards costs the pages that were written. Otherwise restore()
+    // copies the bytes.
+    class MemoryImage {
+    public:
+        MemoryImage(const void* block, size_t bytes);
+        ~MemoryImage();
+        MemoryImage(const MemoryImage&) = delete;
+        MemoryImage& operator=(const MemoryImage&) = delete;
+
+        size_t size() const { return length; }
+
+        // Sets the first size() bytes of `block` to the image, and the rest
+        // of the last page to zero; `block` must have room for that page
+        void restore(void* block) const;
+
+    private:
+        size_t length;
+        int fd = -1;
+        std::vector<uint8_t> bytes;    // Without a memory file
+    };
+
+    // Zeroes every element of `v` and shrinks it to `size` elements
+    template <typename T>
+    void wipe(std::vector<T, ZeroPageAllocator<T>>& v, size_t size) {
+        if (!v.empty()) zeroPages(v.data(), v.size() * sizeof(T));
+        if (v.size() > size) v.resize(size);
+    }
+
+}
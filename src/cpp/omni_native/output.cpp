@@ -0,0 +1,127 @@
+// OmniVM output ring
+#include "output.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace OmniNative {
+
+    namespace {
+
+        const size_t MIN_CAPACITY = 64;
+        // Keeps the unread length below the 2^32 the cursors wrap at
+        const size_t MAX_CAPACITY = (size_t)1 << 30;
+
+        size_t powerOfTwo(size_t bytes) {
+            size_t capacity = MIN_CAPACITY;
+            while (capacity < bytes && capacity < MAX_CAPACITY) capacity <<= 1;
+            return capacity;
+        }
+
+    }
+
+    OutputRing::OutputRing(size_t capacity, OutputPolicy policy) {
+        configure(capacity, policy);
+    }
+
+    void OutputRing::configure(size_t capacity, OutputPolicy policy) {
+        limit = powerOfTwo(capacity);
+        mode = policy;
+        clear();
+    }
+
+    void OutputRing::clear() {
+        if (storage.size() != limit) std::vector<char>(limit).swap(storage);
+        readPos = writePos = 0;
+        std::string().swap(held);
+        lost = 0;
+    }
+
+    void OutputRing::copyIn(const char* text, size_t length) {
+        size_t at = writePos & (storage.size() - 1);
+        size_t first = std::min(length, storage.size() - at);
+        std::memcpy(storage.data() + at, text, first);
+        std::memcpy(storage.data(), text + first, length - first);
+        writePos += (uint32_t)length;
+    }
+
+    // Unread bytes keep their cursors, so they move to where the larger
+    // mask puts them
+    bool OutputRing::grow(size_t needed) {
+        if (needed > MAX_CAPACITY) return false;
+        std::string pending = contents();
+        std::vector<char>(powerOfTwo(needed)).swap(storage);
+        writePos = readPos;
+        copyIn(pending.data(), pending.size());
+        return true;
+    }
+
+    void OutputRing::write(const char* text, size_t length) {
+        // Behind bytes already waiting, to keep the order
+        if (!held.empty()) {
+            held.append(text, length);
+            return;
+        }
+        size_t room = storage.size() - unread();
+        if (length > room) {
+            if (mode == OUTPUT_BLOCK && growable && grow(unread() + length)) {
+                // Fits now
+            } else if (mode == OUTPUT_BLOCK && !growable) {
+                held.assign(text + room, length - room);
+                length = room;
+            } else if (mode == OUTPUT_TRUNCATE) {
+                if (length > storage.size()) {
+                    lost += length - storage.size();
+                    text += length - storage.size();
+                    length = storage.size();
+                }
+                size_t evict = length - (storage.size() - unread());
+                readPos += (uint32_t)evict;
+                lost += evict;
+            } else {
+                // OUTPUT_DROP, or a growable ring at its largest
+                lost += length - room;
+                length = room;
+            }
+        }
+        copyIn(text, length);
+    }
+
+    OutputRing& OutputRing::operator<<(int64_t value) {
+        char digits[24];
+        int n = std::snprintf(digits, sizeof(digits), "%lld", (long long)value);
+        write(digits, (size_t)n);
+        return *this;
+    }
+
+    std::string_view OutputRing::front() const {
+        size_t at = readPos & (storage.size() - 1);
+        return std::string_view(storage.data() + at, std::min(unread(), storage.size() - at));
+    }
+
+    void OutputRing::consume(size_t length) {
+        readPos += (uint32_t)std::min(length, unread());
+        if (held.empty()) return;
+        size_t moved = std::min(held.size(), storage.size() - unread());
+        copyIn(held.data(), moved);
+        held.erase(0, moved);
+    }
+
+    std::string OutputRing::contents() const {
+        std::string text;
+        text.reserve(unread() + held.size());
+        std::string_view first = front();
+        text.append(first.data(), first.size());
+        text.append(storage.data(), unread() - first.size());
+        text += held;
+        return text;
+    }
+
+    std::string OutputRing::drain() {
+        std::string text = contents();
+        readPos = writePos;
+        std::string().swap(held);
+        return text;
+    }
+
+}
@@ -0,0 +1,81 @@
+// OmniVM output - a fixed-capacity ring the VM appends to and a host reads
+// in place
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace OmniNative {
+
+    // What a write does when the ring is full
+    enum OutputPolicy {
+        OUTPUT_BLOCK,       // Hold the rest back; the run pauses until the host reads
+        OUTPUT_DROP,        // Discard what does not fit
+        OUTPUT_TRUNCATE     // Discard the oldest unread bytes to make room
+    };
+
+    // Single-writer, single-reader byte ring. The cursors count the bytes
+    // written and read since the last clear() and wrap at 2^32. The
+    // capacity is a power of two, so `cursor & (capacity() - 1)` is an
+    // offset into data() and `writeCursor() - readCursor()` the unread
+    // length, across the wrap too.
+    class OutputRing {
+    public:
+        explicit OutputRing(size_t capacity = 0, OutputPolicy policy = OUTPUT_BLOCK);
+
+        // Empties the ring. The capacity is rounded up to a power of two.
+        void configure(size_t capacity, OutputPolicy policy);
+        void clear();
+
+        void write(const char* text, size_t length);
+        OutputRing& operator<<(std::string_view text) { write(text.data(), text.size()); return *this; }
+        OutputRing& operator<<(char c) { write(&c, 1); return *this; }
+        OutputRing& operator<<(int64_t value);
+
+        const char* data() const { return storage.data(); }
+        size_t capacity() const { return storage.size(); }
+        OutputPolicy policy() const { return mode; }
+        uint32_t readCursor() const { return readPos; }
+        uint32_t writeCursor() const { return writePos; }
+        size_t unread() const { return (uint32_t)(writePos - readPos); }
+
+        // The unread bytes up to the end of data(); the rest, if any, wrap
+        // to its start
+        std::string_view front() const;
+        // Marks `length` bytes read. Bytes a blocked write held back move
+        // into the room this makes.
+        void consume(size_t length);
+
+        // Copies of the unread bytes, held-back ones included; drain()
+        // also consumes them
+        std::string contents() const;
+        std::string drain();
+
+        // OUTPUT_BLOCK: a write did not fit, and the writer should pause
+        // until the host has read. Held-back bytes are never dropped, so
+        // how many there are depends on how soon the writer pauses.
+        bool blocked() const { return !held.empty(); }
+        // Bytes lost to OUTPUT_DROP and OUTPUT_TRUNCATE since clear()
+        uint64_t dropped() const { return lost; }
+
+        // For runs nobody reads until they end: while set, a blocking ring
+        // grows instead of holding bytes back
+        void setGrowable(bool grow) { growable = grow; }
+
+    private:
+        void copyIn(const char* text, size_t length);
+        bool grow(size_t needed);
+
+        std::vector<char> storage;
+        size_t limit = 0;               // Configured capacity; clear() undoes growth
+        OutputPolicy mode = OUTPUT_BLOCK;
+        uint32_t readPos = 0;
+        uint32_t writePos = 0;
+        std::string held;               // OUTPUT_BLOCK: written after the ring filled
+        uint64_t lost = 0;
+        bool growable = false;
+    };
+
+}
@@ -0,0 +1,160 @@
+// OmniVM peephole optimizer
+#include "peephole.h"
+#include "bytecode.h"
+#include <climits>
+#include <cstdint>
+
+namespace OmniNative {
+
+    namespace {
+
+        bool isIntCompareOp(OpCode op) { return op >= IEQ && op <= IGTE; }
+
+        // !(a cmp b) == a negate(cmp) b, exact for integers
+        OpCode negateCompare(OpCode op) {
+            switch (op) {
+                case IEQ: return INEQ;
+                case INEQ: return IEQ;
+                case ILT: return IGTE;
+                case IGTE: return ILT;
+                case IGT: return ILTE;
+                default: return IGT;  // ILTE
+            }
+        }
+
+        bool isSmallInteger(double v) { return v > INT32_MIN && v <= INT32_MAX; }
+
+        class Peephole {
+            Program& prog;
+            std::vector<Instruction>& ir;
+            PeepholeStats& stats;
+            std::vector<uint8_t> isTarget;
+
+            // Follows NOOPs and unconditional jumps to where control really
+            // goes. Returns SIZE_MAX if the chain passes through `via` or
+            // loops forever.
+            size_t resolve(size_t at, size_t via = SIZE_MAX) const {
+                for (size_t steps = 0; at < ir.size(); steps++) {
+                    if (at == via || steps > ir.size()) return SIZE_MAX;
+                    if (ir[at].op == NOOP) at++;
+                    else if (ir[at].op == JMP) at = (size_t)ir[at].immediate;
+                    else break;
+                }
+                return at;
+            }
+
+            void markTargets() {
+                isTarget.assign(ir.size() + 1, 0);
+                for (const Instruction& in : ir) {
+                    if (isJump(in.op) && (size_t)in.immediate <= ir.size()) isTarget[(size_t)in.immediate] = 1;
+                }
+                for (const auto& fn : prog.functions) isTarget[fn.second] = 1;
+                isTarget[prog.entryPoint] = 1;
+            }
+
+            void threadJumps() {
+                for (size_t i = 0; i < ir.size(); i++) {
+                    Instruction& in = ir[i];
+                    if (!isJump(in.op)) continue;
+                    size_t target = (size_t)in.immediate;
+                    size_t final = resolve(target);
+                    if (final < ir.size() && final != target) {
+                        in.immediate = (double)final;
+                        stats.jumpsThreaded++;
+                    }
+                    if (in.op == JMP && resolve(i + 1, i) == (size_t)in.immediate) {
+                        in = Instruction(NOOP);
+                        stats.jumpsRemoved++;
+                    }
+                }
+            }
+
+            // True if ir[i + 1 .. i + n - 1] exist and none is a jump target
+            bool run(size_t i, size_t n) const {
+                if (i + n > ir.size()) return false;
+                for (size_t k = 1; k < n; k++) {
+                    if (isTarget[i + k]) return false;
+                }
+                return true;
+            }
+
+        public:
+            explicit Peephole(Program& p) : prog(p), ir(p.instructions), stats(p.peephole) {}
+
+            void optimize() {
+                stats = PeepholeStats();
+                stats.instructionsBefore = ir.size();
+
+                markTargets();
+                threadJumps();
+                markTargets();
+
+                std::vector<Instruction> out;
+                out.reserve(ir.size());
+                std::vector<size_t> newIndex(ir.size() + 1);
+                size_t i = 0;
+                while (i < ir.size()) {
+                    newIndex[i] = out.size();
+                    const Instruction& in = ir[i];
+                    OpCode next = i + 1 < ir.size() ? ir[i + 1].op : HALT;
+                    size_t used = 1;
+
+                    if (in.op == NOOP) {
+                        stats.noopsRemoved++;
+                        used = 1;
+                    } else if (in.op == ADDR_OF && run(i, 3) && next == DUP && ir[i + 2].op == LOAD) {
+                        // Compound assignment reloads the lvalue it keeps the address of
+                        out.push_back(in);
+                        out.emplace_back(LOAD_LOCAL, in.immediate);
+                        stats.dupLoads++;
+                        used = 3;
+                    } else if (in.op == ADDR_OF && run(i, 2) && next == LOAD) {
+                        out.emplace_back(LOAD_LOCAL, in.immediate);
+                        stats.loadLocal++;
+                        used = 2;
+                    } else if (in.op == PUSH_IMM && run(i, 2) && (next == IADD || next == ISUB) && isSmallInteger(in.immediate)) {
+                        out.emplace_back(ADD_IMM, next == IADD ? in.immediate : -in.immediate);
+                        stats.addImm++;
+                        used = 2;
+                    } else if (isIntCompareOp(in.op) && run(i, 2) && (next == JMP_IF_NOT || next == JMP_IF)) {
+                        OpCode cmp = next == JMP_IF ? negateCompare(in.op) : in.op;
+                        out.emplace_back((OpCode)(JMP_IF_NOT_IEQ + (cmp - IEQ)), ir[i + 1].immediate);
+                        stats.fusedBranches++;
+                        used = 2;
+                    } else if (in.op == LOAD && run(i, 2) && next == IADD) {
+                        out.emplace_back(LOAD_ADD);
+                        stats.loadAdd++;
+                        used = 2;
+                    } else if ((in.op == STORE || in.op == STORE_BYTE) && in.immediate != 0 && run(i, 2) && next == POP) {
+                        out.emplace_back(in.op, 0);
+                        stats.storePops++;
+                        used = 2;
+                    } else {
+                        out.push_back(in);
+                    }
+                    // Fused instructions keep the line of the first one
+                    for (size_t k = newIndex[i]; k < out.size(); k++) out[k].line = in.line;
+
+                    for (size_t k = 1; k < used; k++) newIndex[i + k] = out.size();
+                    i += used;
+                }
+                newIndex[ir.size()] = out.size();
+
+                for (Instruction& in : out) {
+                    if (isJump(in.op)) in.immediate = (double)newIndex[(size_t)in.immediate];
+                }
+                for (auto& fn : prog.functions) fn.second = newIndex[fn.second];
+                prog.entryPoint = (uint32_t)newIndex[prog.entryPoint];
+
+                ir.swap(out);
+                stats.instructionsAfter = ir.size();
+            }
+        };
+
+    }
+
+    void peepholeOptimize(Program& prog) {
+        Peephole(prog).optimize();
+    }
+
+}
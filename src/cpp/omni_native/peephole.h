@@ -0,0 +1,14 @@
+// OmniVM peephole optimizer over Program::instructions
+#pragma once
+#include "common.h"
+
+namespace OmniNative {
+
+    // Threads jump chains, drops NOOPs and jumps to the next instruction,
+    // and fuses common pairs into superinstructions (ADD_IMM, LOAD_LOCAL,
+    // LOAD_ADD, JMP_IF_NOT_*). Jump targets, function entries and the entry
+    // point are remapped; counts are recorded in Program::peephole. Runs
+    // before packProgram.
+    void peepholeOptimize(Program& prog);
+
+}
@@ -0,0 +1,117 @@
+// OmniVM instance pool and batch runner
+#include "pool.h"
+#include "cache.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+
+#if OMNI_THREADS
+#include <thread>
+#endif
+
+namespace OmniNative {
+
+    VmPool::Lease VmPool::acquire() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!vms.empty()) {
+                std::unique_ptr<VirtualMachine> vm = std::move(vms.back());
+                vms.pop_back();
+                return Lease(this, std::move(vm));
+            }
+        }
+        return Lease(this, std::unique_ptr<VirtualMachine>(new VirtualMachine()));
+    }
+
+    size_t VmPool::idle() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return vms.size();
+    }
+
+    // Wiped outside the lock; the last returned is the next handed out,
+    // while its pages are still warm
+    void VmPool::release(std::unique_ptr<VirtualMachine> vm) {
+        vm->reset();
+        std::lock_guard<std::mutex> guard(mutex);
+        if (vms.size() < capacity) vms.push_back(std::move(vm));
+    }
+
+    VmPool& sharedPool() {
+        static VmPool pool;
+        return pool;
+    }
+
+    std::vector<BatchResult> runBatch(const std::vector<BatchJob>& jobs, size_t threads) {
+        std::vector<BatchResult> results(jobs.size());
+        ProgramCache programs(std::max(jobs.size(), (size_t)1));
+        VmPool& pool = sharedPool();
+        std::atomic<size_t> next(0);
+        // The first run of each program snapshots it at main(); later runs
+        // fork from there. Null when the startup code ends the run.
+        std::map<const Program*, std::shared_ptr<const VmSnapshot>> snapshots;
+        std::mutex snapshotMutex;
+
+        auto work = [&]() {
+            VmPool::Lease vm = pool.acquire();
+            for (size_t i = next++; i < jobs.size(); i = next++) {
+                BatchResult& result = results[i];
+                std::shared_ptr<const Program> prog;
+                try {
+                    prog = programs.get(jobs[i].source, jobs[i].options);
+                } catch (const CompileError& e) {
+                    result.state = RUN_ERROR;
+                    result.output = std::string("Compile Error: ") + e.what() + "\n";
+                    continue;
+                } catch (const std::exception& e) {
+                    result.state = RUN_ERROR;
+                    result.output = std::string("Runtime Error: ") + e.what() + "\n";
+                    continue;
+                }
+
+                auto started = std::chrono::steady_clock::now();
+                std::shared_ptr<const VmSnapshot> snap;
+                bool taken;
+                {
+                    std::lock_guard<std::mutex> guard(snapshotMutex);
+                    auto it = snapshots.find(prog.get());
+                    taken = it != snapshots.end();
+                    if (taken) snap = it->second;
+                }
+                if (snap) {
+                    vm->fork(*snap);
+                } else if (taken) {
+                    vm->start(*prog);
+                } else {
+                    snap = vm->snapshot(*prog);
+                    std::lock_guard<std::mutex> guard(snapshotMutex);
+                    snapshots.emplace(prog.get(), snap);
+                }
+                // The pooled VM's ring does not grow, so a run that fills it
+                // pauses until it is drained
+                do {
+                    vm->step(SIZE_MAX);
+                    result.output += vm->drainOutput();
+                } while (vm->state() == RUN_RUNNING);
+                result.millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+                result.state = vm->state();
+                result.dropped = vm->outputRing().dropped();
+                result.cycles = vm->getCycles();
+            }
+        };
+
+    #if OMNI_THREADS
+        if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+        threads = std::min(threads, std::max(jobs.size(), (size_t)1));
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; t++) workers.emplace_back(work);
+        work();
+        for (std::thread& w : workers) w.join();
+    #else
+        (void)threads;
+        work();
+    #endif
+        return results;
+    }
+
+}
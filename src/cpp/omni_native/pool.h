@@ -0,0 +1,76 @@
+// OmniVM instance pool and batch runner
+#pragma once
+#include "common.h"
+#include "vm.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace OmniNative {
+
+    // Worker threads for runBatch; without them batches run on the caller
+    #if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+    #define OMNI_THREADS 0
+    #else
+    #define OMNI_THREADS 1
+    #endif
+
+    // Idle VirtualMachines shared between threads. A returned VM is reset()
+    // first, so whoever takes it next gets what a new VM would give them
+    // without paying for its memory again.
+    class VmPool {
+    public:
+        // Keeps at most `capacity` idle VMs; more are freed on return
+        explicit VmPool(size_t capacity = 64) : capacity(capacity) {}
+
+        // A VM on loan; goes back to the pool when destroyed
+        class Lease {
+        public:
+            Lease(VmPool* pool, std::unique_ptr<VirtualMachine> vm) : pool(pool), vm(std::move(vm)) {}
+            Lease(Lease&&) = default;
+            Lease& operator=(Lease&&) = delete;
+            ~Lease() { if (vm) pool->release(std::move(vm)); }
+
+            VirtualMachine& operator*() const { return *vm; }
+            VirtualMachine* operator->() const { return vm.get(); }
+
+        private:
+            VmPool* pool;
+            std::unique_ptr<VirtualMachine> vm;
+        };
+
+        Lease acquire();
+        size_t idle() const;
+
+    private:
+        void release(std::unique_ptr<VirtualMachine> vm);
+
+        size_t capacity;
+        mutable std::mutex mutex;
+        std::vector<std::unique_ptr<VirtualMachine>> vms;
+    };
+
+    // The pool runBatch and the exported entry points draw from
+    VmPool& sharedPool();
+
+    struct BatchJob {
+        std::string source;
+        CompileOptions options;
+    };
+
+    struct BatchResult {
+        RunState state = RUN_FINISHED;   // RUN_ERROR for compile errors too
+        std::string output;              // Raw VM output, or "Compile Error: ..."
+        size_t cycles = 0;
+        uint64_t dropped = 0;            // Output bytes lost; 0 unless the ring hit its size limit
+        double millis = 0;               // Run time, compile excluded
+    };
+
+    // Runs every job on `threads` workers (0 = one per core), each with its
+    // own VM from sharedPool(). Jobs with the same source and options are
+    // compiled once, and run their global initializers once: later runs
+    // fork from a snapshot at main(). Results are in job order.
+    std::vector<BatchResult> runBatch(const std::vector<BatchJob>& jobs, size_t threads = 0);
+
+}
@@ -0,0 +1,253 @@
+// OmniVM profiler
+#include "profiler.h"
+#include <algorithm>
+
+namespace OmniNative {
+
+    namespace {
+
+        const char* const OP_NAMES[] = {
+            "HALT", "NOOP",
+            "PUSH_IMM", "PUSH_CONST", "PUSH_STR", "POP", "DUP",
+            "ADD", "SUB", "MUL", "DIV", "MOD",
+            "IADD", "ISUB", "IMUL", "IDIV", "IMOD",
+            "BIT_AND", "BIT_OR", "BIT_XOR", "BIT_NOT", "SHL", "SHR",
+            "EQ", "NEQ", "LT", "GT", "LTE", "GTE",
+            "IEQ", "INEQ", "ILT", "IGT", "ILTE", "IGTE",
+            "LOGICAL_AND", "LOGICAL_OR", "LOGICAL_NOT",
+            "LOAD", "STORE", "LOAD_BYTE", "STORE_BYTE", "ALLOC", "REALLOC", "FREE",
+            "ADDR_OF", "DEREF",
+            "JMP", "JMP_IF", "JMP_IF_NOT", "CALL", "CALL_BUILTIN", "RET", "ENTER", "LEAVE",
+            "PRINT", "PRINT_CHAR", "PRINT_STR", "PRINT_FMT",
+            "INT_TO_DOUBLE", "DOUBLE_TO_INT",
+            "ADD_IMM", "LOAD_LOCAL", "LOAD_ADD",
+            "JMP_IF_NOT_IEQ", "JMP_IF_NOT_INEQ", "JMP_IF_NOT_ILT", "JMP_IF_NOT_IGT", "JMP_IF_NOT_ILTE", "JMP_IF_NOT_IGTE",
+        };
+        static_assert(sizeof(OP_NAMES) / sizeof(OP_NAMES[0]) == OP_COUNT, "OP_NAMES out of date");
+
+        const char* const REG_OP_NAMES[] = {
+            "R_HALT", "R_MOV", "R_LOADI", "R_LOADK", "R_ADDR",
+            "R_ADD", "R_SUB", "R_MUL", "R_DIV", "R_MOD",
+            "R_EQ", "R_NE", "R_LT", "R_GT", "R_LE", "R_GE",
+            "R_IADD", "R_ISUB", "R_IMUL", "R_IDIV", "R_IMOD",
+            "R_AND", "R_OR", "R_XOR", "R_SHL", "R_SHR",
+            "R_IEQ", "R_INE", "R_ILT", "R_IGT", "R_ILE", "R_IGE",
+            "R_LAND", "R_LOR",
+            "R_IADDI", "R_IMULI",
+            "R_NOT", "R_LNOT", "R_I2D", "R_D2I", "R_SEXT8",
+            "R_LOAD", "R_STORE", "R_LOADB", "R_STOREB", "R_LOADL", "R_STOREL", "R_LOADG", "R_STOREG",
+            "R_ALLOC", "R_REALLOC", "R_FREE",
+            "R_JMP", "R_JT", "R_JF",
+            "R_JFIEQ", "R_JFINE", "R_JFILT", "R_JFIGT", "R_JFILE", "R_JFIGE",
+            "R_JFIEQK", "R_JFINEK", "R_JFILTK", "R_JFIGTK", "R_JFILEK", "R_JFIGEK",
+            "R_ARG", "R_CALL", "R_CALLB", "R_RET", "R_ENTER",
+            "R_PRINT", "R_PRINTC", "R_PRINTS", "R_PRINTF",
+        };
+        static_assert(sizeof(REG_OP_NAMES) / sizeof(REG_OP_NAMES[0]) == R_OP_COUNT, "REG_OP_NAMES out of date");
+
+        std::string quote(const std::string& s) {
+            std::string out = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\') out += '\\';
+                out += c;
+            }
+            return out + "\"";
+        }
+
+        template <typename Map, typename Key>
+        void jsonObject(std::string& out, const char* name, const Map& map, Key key) {
+            out += ",\n  ";
+            out += quote(name) + ": {";
+            bool first = true;
+            for (const auto& kv : map) {
+                out += first ? "\n    " : ",\n    ";
+                out += quote(key(kv.first)) + ": " + std::to_string(kv.second);
+                first = false;
+            }
+            out += first ? "}" : "\n  }";
+        }
+
+    }
+
+    void Profiler::begin(const Program& program, uint64_t sampleInterval) {
+        prog = &program;
+        registerCode = !program.regCode.empty();
+        budgetExhausted = false;
+        size_t size = registerCode ? program.regCode.size() : program.code.size();
+        hits.assign(size, 0);
+
+        // Functions in code order, as lowerToRegisters numbers them
+        std::vector<std::pair<size_t, std::string>> order;
+        for (const auto& fn : program.functions) order.push_back({fn.second, fn.first});
+        std::sort(order.begin(), order.end());
+        names.assign(1, "_start");
+        functionAt.assign(size + 1, -1);
+        for (const auto& fn : order) {
+            size_t id = names.size(), entry = size;
+            if (registerCode) {
+                if (id < program.regFunctions.size()) entry = program.regFunctions[id].entry;
+            } else if (fn.first < program.codeOffsets.size()) {
+                entry = program.codeOffsets[fn.first];
+            }
+            if (entry < size) functionAt[entry] = (int32_t)id;
+            names.push_back(fn.second);
+        }
+        inclusive.assign(names.size(), 0);
+        active.assign(names.size(), 0);
+
+        nodes.clear();
+        nodes.emplace_back(0, 0);
+        nodes[0].calls = 1;
+        frames.clear();
+        current = 0;
+        mark = 0;
+        interval = sampleInterval;
+        nextSample = interval ? interval : UINT64_MAX;
+        samples.clear();
+    }
+
+    void Profiler::charge(uint64_t executed) {
+        nodes[current].self += executed - mark;
+        mark = executed;
+    }
+
+    void Profiler::enter(size_t entry, uint64_t executed) {
+        charge(executed);
+        int32_t id = entry < functionAt.size() ? functionAt[entry] : -1;
+        uint32_t function = id < 0 ? 0 : (uint32_t)id;
+        // Direct recursion stays in the caller's node
+        if (frames.empty() || nodes[current].function != function) {
+            uint32_t child = 0;
+            for (uint32_t c : nodes[current].children) {
+                if (nodes[c].function == function) child = c;
+            }
+            if (!child) {
+                child = (uint32_t)nodes.size();
+                nodes[current].children.push_back(child);
+                nodes.emplace_back(function, current);
+            }
+            current = child;
+        }
+        nodes[current].calls++;
+        frames.push_back({current, executed, active[function]++ == 0});
+    }
+
+    void Profiler::leave(uint64_t executed) {
+        if (frames.empty()) return;
+        charge(executed);
+        Frame frame = frames.back();
+        frames.pop_back();
+        uint32_t function = nodes[frame.node].function;
+        active[function]--;
+        if (frame.outermost) inclusive[function] += executed - frame.entered;
+        current = frames.empty() ? 0 : frames.back().node;
+    }
+
+    uint32_t Profiler::lineAt(size_t at) const {
+        if (registerCode) return at < prog->regLines.size() ? prog->regLines[at] : 0;
+        // Instruction starting at code offset `at`
+        auto it = std::upper_bound(prog->codeOffsets.begin(), prog->codeOffsets.end(), (uint32_t)at);
+        size_t index = (size_t)(it - prog->codeOffsets.begin()) - 1;
+        return index < prog->lines.size() ? prog->lines[index] : 0;
+    }
+
+    void Profiler::sample(size_t at) {
+        samples[{current, lineAt(at)}]++;
+        nextSample += interval;
+    }
+
+    std::string Profiler::path(uint32_t node) const {
+        std::vector<uint32_t> chain;
+        for (uint32_t n = node; n != 0; n = nodes[n].parent) chain.push_back(n);
+        std::string out = names[0];
+        for (size_t i = chain.size(); i-- > 0;) out += ";" + names[nodes[chain[i]].function];
+        return out;
+    }
+
+    Profile Profiler::finish(uint64_t executed) {
+        charge(executed);
+        while (!frames.empty()) leave(executed);   // Stopped inside calls
+
+        Profile profile;
+        profile.registerCode = registerCode;
+        profile.budgetExhausted = budgetExhausted;
+        profile.cycles = executed;
+        profile.sampleInterval = interval;
+
+        uint64_t opCounts[256] = {};
+        for (size_t at = 0; at < hits.size(); at++) {
+            if (!hits[at]) continue;
+            opCounts[registerCode ? (size_t)prog->regCode[at].op : (size_t)prog->code[at]] += hits[at];
+            uint32_t line = lineAt(at);
+            if (line) profile.lines[line] += hits[at];
+        }
+        size_t opCount = registerCode ? (size_t)R_OP_COUNT : (size_t)OP_COUNT;
+        for (size_t op = 0; op < opCount; op++) {
+            if (opCounts[op]) profile.opcodes.push_back({registerCode ? REG_OP_NAMES[op] : OP_NAMES[op], opCounts[op]});
+        }
+        std::stable_sort(profile.opcodes.begin(), profile.opcodes.end(),
+                         [](const auto& a, const auto& b) { return a.second > b.second; });
+
+        std::vector<FunctionProfile> functions(names.size());
+        for (size_t f = 0; f < names.size(); f++) functions[f].name = names[f];
+        functions[0].inclusive = executed;
+        for (uint32_t n = 0; n < nodes.size(); n++) {
+            const Node& node = nodes[n];
+            functions[node.function].calls += node.calls;
+            functions[node.function].exclusive += node.self;
+            if (node.self) profile.stacks[path(n)] += node.self;
+        }
+        for (size_t f = 1; f < names.size(); f++) functions[f].inclusive = inclusive[f];
+        for (const FunctionProfile& fn : functions) {
+            if (fn.calls) profile.functions.push_back(fn);
+        }
+        std::stable_sort(profile.functions.begin(), profile.functions.end(),
+                         [](const FunctionProfile& a, const FunctionProfile& b) { return a.exclusive > b.exclusive; });
+
+        for (const auto& s : samples) {
+            std::string key = path(s.first.first);
+            if (s.first.second) key += ":" + std::to_string(s.first.second);
+            profile.samples[key] += s.second;
+        }
+        return profile;
+    }
+
+    std::string Profile::toJson() const {
+        std::string out = "{\n  \"code\": ";
+        out += registerCode ? "\"register\"" : "\"stack\"";
+        out += ",\n  \"cycles\": " + std::to_string(cycles);
+        out += ",\n  \"budgetExhausted\": ";
+        out += budgetExhausted ? "true" : "false";
+        out += ",\n  \"sampleInterval\": " + std::to_string(sampleInterval);
+
+        out += ",\n  \"opcodes\": {";
+        for (size_t i = 0; i < opcodes.size(); i++) {
+            out += i ? ",\n    " : "\n    ";
+            out += quote(opcodes[i].first) + ": " + std::to_string(opcodes[i].second);
+        }
+        out += opcodes.empty() ? "}" : "\n  }";
+
+        out += ",\n  \"functions\": [";
+        for (size_t i = 0; i < functions.size(); i++) {
+            const FunctionProfile& fn = functions[i];
+            out += i ? ",\n    " : "\n    ";
+            out += "{\"name\": " + quote(fn.name) + ", \"calls\": " + std::to_string(fn.calls) +
+                   ", \"inclusive\": " + std::to_string(fn.inclusive) + ", \"exclusive\": " + std::to_string(fn.exclusive) + "}";
+        }
+        out += functions.empty() ? "]" : "\n  ]";
+
+        jsonObject(out, "lines", lines, [](uint32_t line) { return std::to_string(line); });
+        jsonObject(out, "stacks", stacks, [](const std::string& s) { return s; });
+        jsonObject(out, "samples", samples, [](const std::string& s) { return s; });
+        return out + "\n}\n";
+    }
+
+    std::string Profile::toFolded() const {
+        std::string out;
+        for (const auto& kv : sampleInterval ? samples : stacks) {
+            out += kv.first + " " + std::to_string(kv.second) + "\n";
+        }
+        return out;
+    }
+
+}
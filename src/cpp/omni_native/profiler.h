@@ -0,0 +1,98 @@
+// OmniVM profiler - opcode, function and source-line counters for one run
+#pragma once
+#include "common.h"
+#include <vector>
+#include <map>
+#include <string>
+
+namespace OmniNative {
+
+    struct FunctionProfile {
+        std::string name;
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;   // Cycles in the function and its callees
+        uint64_t exclusive = 0;   // Cycles in its own code
+    };
+
+    // What a profiled run executed. Function "_start" is the startup code
+    // (global initializers and the call to main).
+    struct Profile {
+        bool registerCode = false;
+        bool budgetExhausted = false;      // Stopped by the cycle budget
+        uint64_t cycles = 0;
+        uint64_t sampleInterval = 0;
+        std::vector<std::pair<std::string, uint64_t>> opcodes;   // Executed per opcode, most first
+        std::vector<FunctionProfile> functions;                  // Most exclusive cycles first
+        std::map<uint32_t, uint64_t> lines;                      // Source line -> instructions executed
+        // "_start;main;f" -> exclusive cycles of f under that call chain;
+        // direct recursion is folded into one frame
+        std::map<std::string, uint64_t> stacks;
+        // "_start;main;f:12" -> samples taken on line 12 of f
+        std::map<std::string, uint64_t> samples;
+
+        std::string toJson() const;
+        // One "frame;frame;frame count" line per stack, as flamegraph.pl
+        // reads it: the samples when sampling, else the exact stacks
+        std::string toFolded() const;
+    };
+
+    // Collects a Profile while the VM runs with profiling on. The VM calls
+    // step() before each instruction and enter()/leave() around calls, with
+    // its instruction count; everything else is worked out in finish().
+    class Profiler {
+    public:
+        // `entry` positions are code offsets of the stack code or regCode
+        // indices of the register code, whichever the program runs
+        void begin(const Program& prog, uint64_t sampleInterval);
+
+        void step(size_t at, uint64_t executed) {
+            hits[at]++;
+            if (executed >= nextSample) sample(at);
+        }
+        // Takes back the step of an instruction that will be dispatched again
+        void unstep(size_t at) { hits[at]--; }
+        void enter(size_t entry, uint64_t executed);
+        void leave(uint64_t executed);
+        void exhausted() { budgetExhausted = true; }
+
+        Profile finish(uint64_t executed);
+
+    private:
+        // Calling context tree
+        struct Node {
+            Node(uint32_t fn, uint32_t caller) : function(fn), parent(caller) {}
+            uint32_t function;
+            uint32_t parent;
+            uint64_t calls = 0;
+            uint64_t self = 0;
+            std::vector<uint32_t> children;
+        };
+        struct Frame {
+            uint32_t node;
+            uint64_t entered;
+            bool outermost;     // First activation of its function on the stack
+        };
+
+        void sample(size_t at);
+        void charge(uint64_t executed);
+        uint32_t lineAt(size_t at) const;
+        std::string path(uint32_t node) const;
+
+        const Program* prog = nullptr;
+        bool registerCode = false;
+        bool budgetExhausted = false;
+        std::vector<uint64_t> hits;            // Per code position
+        std::vector<int32_t> functionAt;       // Entry position -> function, -1 elsewhere
+        std::vector<std::string> names;
+        std::vector<uint64_t> inclusive;
+        std::vector<uint32_t> active;          // Activations on the stack per function
+        std::vector<Node> nodes;
+        std::vector<Frame> frames;
+        uint32_t current = 0;
+        uint64_t mark = 0;                     // Cycles charged so far
+        uint64_t interval = 0;
+        uint64_t nextSample = UINT64_MAX;
+        std::map<std::pair<uint32_t, uint32_t>, uint64_t> samples;   // (node, line) -> count
+    };
+
+}
@@ -0,0 +1,915 @@
+// OmniVM register code generation and linear-scan register allocation
+#include "regcode.h"
+#include "bytecode.h"
+#include <map>
+#include <set>
+#include <algorithm>
+#include <climits>
+
+namespace OmniNative {
+
+    namespace {
+
+        const int NO_REG = -1;
+        const int SCRATCH0 = REG_ALLOCATABLE;
+        const int SCRATCH1 = REG_ALLOCATABLE + 1;
+
+        // Register instruction over virtual registers
+        struct VInstr {
+            RegOpCode op;
+            int dst = NO_REG;
+            int src1 = NO_REG;
+            int src2 = NO_REG;
+            int32_t x = 0;
+            uint8_t k = 0;     // Constant index of K-form branches
+            int label = -1;    // Branch target as a stack instruction index
+            int line = 0;      // Source line
+        };
+
+        bool isBranch(RegOpCode op) { return op == R_JMP || (op >= R_JT && op <= R_JFIGEK); }
+        bool endsFlow(RegOpCode op) { return op == R_JMP || op == R_RET || op == R_HALT; }
+        // Only integer compares fuse into branches
+        bool isCompare(RegOpCode op) { return op >= R_IEQ && op <= R_IGE; }
+
+        bool fitsInt32(int64_t v) { return v >= INT32_MIN && v <= INT32_MAX; }
+
+        RegOpCode binaryOp(OpCode op) {
+            switch (op) {
+                case ADD: return R_ADD;
+                case SUB: return R_SUB;
+                case MUL: return R_MUL;
+                case DIV: return R_DIV;
+                case MOD: return R_MOD;
+                case IADD: return R_IADD;
+                case ISUB: return R_ISUB;
+                case IMUL: return R_IMUL;
+                case IDIV: return R_IDIV;
+                case IMOD: return R_IMOD;
+                case BIT_AND: return R_AND;
+                case BIT_OR: return R_OR;
+                case BIT_XOR: return R_XOR;
+                case SHL: return R_SHL;
+                case SHR: return R_SHR;
+                case EQ: return R_EQ;
+                case NEQ: return R_NE;
+                case LT: return R_LT;
+                case GT: return R_GT;
+                case LTE: return R_LE;
+                case GTE: return R_GE;
+                case IEQ: return R_IEQ;
+                case INEQ: return R_INE;
+                case ILT: return R_ILT;
+                case IGT: return R_IGT;
+                case ILTE: return R_ILE;
+                case IGTE: return R_IGE;
+                case LOGICAL_AND: return R_LAND;
+                default: return R_LOR;
+            }
+        }
+
+        // b cmp c == c mirror(cmp) b
+        RegOpCode mirrorCompare(RegOpCode op) {
+            switch (op) {
+                case R_ILT: return R_IGT;
+                case R_IGT: return R_ILT;
+                case R_ILE: return R_IGE;
+                case R_IGE: return R_ILE;
+                default: return op;
+            }
+        }
+
+        // !(b cmp c) == b negate(cmp) c, exact for integers
+        RegOpCode negateCompare(RegOpCode op) {
+            switch (op) {
+                case R_IEQ: return R_INE;
+                case R_INE: return R_IEQ;
+                case R_ILT: return R_IGE;
+                case R_IGE: return R_ILT;
+                case R_IGT: return R_ILE;
+                default: return R_IGT;  // R_ILE
+            }
+        }
+
+        // Symbolic operand stack entry. Constants and local addresses stay
+        // unmaterialised until an instruction needs them in a register.
+        struct Value {
+            enum Kind { REG, CONST, LOCAL_ADDR } kind;
+            int reg;
+            Slot num;
+            bool isDouble;
+            int offset;
+
+            static Value inReg(int r) { return {REG, r, intSlot(0), false, 0}; }
+            static Value constInt(int64_t v) { return {CONST, NO_REG, intSlot(v), false, 0}; }
+            static Value constDouble(double v) { return {CONST, NO_REG, doubleSlot(v), true, 0}; }
+            static Value localAddr(int off) { return {LOCAL_ADDR, NO_REG, intSlot(0), false, off}; }
+
+            bool isIntConst() const { return kind == CONST && !isDouble; }
+        };
+
+        // Raised when a promoted local turns out to need a real address
+        struct Escape { int offset; };
+
+        // Pools shared by every function of the program
+        struct Pools {
+            Program& prog;
+            std::map<uint64_t, uint32_t> constantIndex;
+            std::map<std::string, uint32_t> stringIndex;
+            std::map<std::string, uint32_t> functionIndex;
+
+            explicit Pools(Program& p) : prog(p) {
+                for (size_t i = 0; i < prog.constants.size(); i++) constantIndex.emplace((uint64_t)prog.constants[i].i, (uint32_t)i);
+                for (size_t i = 0; i < prog.strings.size(); i++) stringIndex.emplace(prog.strings[i], (uint32_t)i);
+            }
+
+            // Keyed by bit pattern, so an int and a double may share an entry
+            uint32_t constant(Slot v) {
+                auto it = constantIndex.find((uint64_t)v.i);
+                if (it != constantIndex.end()) return it->second;
+                uint32_t idx = (uint32_t)prog.constants.size();
+                prog.constants.push_back(v);
+                constantIndex[(uint64_t)v.i] = idx;
+                return idx;
+            }
+
+            uint32_t string(const std::string& s) {
+                auto it = stringIndex.find(s);
+                if (it != stringIndex.end()) return it->second;
+                uint32_t idx = (uint32_t)prog.strings.size();
+                prog.strings.push_back(s);
+                stringIndex[s] = idx;
+                return idx;
+            }
+        };
+
+        // Lowers the stack instructions [begin, end) of one function
+        class FunctionLowering {
+            Pools& pools;
+            const std::vector<Instruction>& ir;
+            size_t begin, end;
+            bool isEntry;
+
+            std::vector<int> depth;        // Stack depth before each instruction, -1 if unreachable
+            std::vector<uint8_t> leader;   // Basic block starts
+            int maxDepth = 0;              // Virtual registers [0, maxDepth) hold stack slots at block edges
+
+            std::set<int> escaped;         // Frame offsets that must stay in memory
+            std::map<int, int> localReg;   // Promoted frame offset -> virtual register
+            std::vector<uint8_t> isTemp;
+            std::vector<VInstr> code;
+            std::vector<Value> stack;
+            std::vector<int> labelPos;     // Stack instruction -> position in `code`
+            int nextReg = 0;
+            int frameSize = 0;
+            int line = 0;                  // Of the stack instruction being lowered
+
+            // ---- Stack shape ----
+
+            void computeDepths() {
+                depth.assign(end - begin, -1);
+                leader.assign(end - begin, 0);
+                std::vector<size_t> worklist{begin};
+                depth[0] = 0;
+                leader[0] = 1;
+                auto reach = [&](size_t at, int d) {
+                    if (at < begin || at >= end || depth[at - begin] >= 0) return;
+                    depth[at - begin] = d;
+                    worklist.push_back(at);
+                };
+                while (!worklist.empty()) {
+                    size_t i = worklist.back();
+                    worklist.pop_back();
+                    const Instruction& in = ir[i];
+                    int next = depth[i - begin] + stackEffect(in.op, (uint64_t)in.immediate, (uint64_t)in.immediate).delta;
+                    maxDepth = std::max(maxDepth, depth[i - begin]);
+                    if (isJump(in.op)) {
+                        size_t target = (size_t)in.immediate;
+                        if (target >= begin && target < end) leader[target - begin] = 1;
+                        reach(target, next);
+                        if (in.op != JMP) reach(i + 1, next);
+                        if (i + 1 < end) leader[i + 1 - begin] = 1;
+                        continue;
+                    }
+                    switch (in.op) {
+                        case RET: case HALT:
+                            if (i + 1 < end) leader[i + 1 - begin] = 1;
+                            break;
+                        default:
+                            reach(i + 1, next);
+                            break;
+                    }
+                }
+                maxDepth++;
+            }
+
+            // ---- Emission helpers ----
+
+            int newTemp() {
+                isTemp.push_back(1);
+                return nextReg++;
+            }
+
+            void emitOp(RegOpCode op, int dst, int src1 = NO_REG, int src2 = NO_REG, int32_t x = 0) {
+                VInstr in;
+                in.op = op;
+                in.dst = dst;
+                in.src1 = src1;
+                in.src2 = src2;
+                in.x = x;
+                in.line = line;
+                code.push_back(in);
+            }
+
+            bool promoted(int offset) const { return !escaped.count(offset); }
+
+            int local(int offset) {
+                auto it = localReg.find(offset);
+                if (it != localReg.end()) return it->second;
+                isTemp.push_back(0);
+                localReg[offset] = nextReg;
+                return nextReg++;
+            }
+
+            void loadConst(int dst, const Value& v) {
+                if (!v.isDouble && fitsInt32(v.num.i)) emitOp(R_LOADI, dst, NO_REG, NO_REG, (int32_t)v.num.i);
+                else emitOp(R_LOADK, dst, NO_REG, NO_REG, (int32_t)pools.constant(v.num));
+            }
+
+            void materializeInto(const Value& v, int dst) {
+                switch (v.kind) {
+                    case Value::REG:
+                        if (v.reg != dst) emitOp(R_MOV, dst, v.reg);
+                        break;
+                    case Value::CONST:
+                        loadConst(dst, v);
+                        break;
+                    case Value::LOCAL_ADDR:
+                        if (promoted(v.offset)) throw Escape{v.offset};
+                        emitOp(R_ADDR, dst, NO_REG, NO_REG, v.offset);
+                        break;
+                }
+            }
+
+            int reg(const Value& v) {
+                if (v.kind == Value::REG) return v.reg;
+                int t = newTemp();
+                materializeInto(v, t);
+                return t;
+            }
+
+            Value pop() {
+                Value v = stack.back();
+                stack.pop_back();
+                return v;
+            }
+
+            bool onStack(int r) const {
+                for (const Value& v : stack) {
+                    if (v.kind == Value::REG && v.reg == r) return true;
+                }
+                return false;
+            }
+
+            // Stack entries read `r` lazily; copy them out before `r` is
+            // overwritten by an instruction emitted at `insertAt`
+            void protect(int r, size_t insertAt) {
+                if (!onStack(r)) return;
+                int t = newTemp();
+                VInstr mov;
+                mov.op = R_MOV;
+                mov.dst = t;
+                mov.src1 = r;
+                code.insert(code.begin() + insertAt, mov);
+                for (Value& v : stack) {
+                    if (v.kind == Value::REG && v.reg == r) v.reg = t;
+                }
+            }
+
+            // Stores `v` into the promoted local register `r`, retargeting
+            // the instruction that computed `v` when possible
+            void assignLocal(int r, const Value& v) {
+                if (v.kind == Value::REG && isTemp[v.reg] && !code.empty() && code.back().dst == v.reg && !onStack(v.reg)) {
+                    protect(r, code.size() - 1);
+                    code.back().dst = r;
+                    return;
+                }
+                protect(r, code.size());
+                materializeInto(v, r);
+            }
+
+            // Moves every stack entry into its slot register, as expected at
+            // block boundaries
+            void flush() {
+                int n = (int)stack.size();
+                auto settled = [&](int i) { return stack[i].kind == Value::REG && stack[i].reg == i; };
+                for (int i = 0; i < n; i++) {
+                    int r = stack[i].kind == Value::REG ? stack[i].reg : NO_REG;
+                    if (r != NO_REG && r != i && r < n && !settled(r)) {
+                        int t = newTemp();
+                        emitOp(R_MOV, t, r);
+                        stack[i].reg = t;
+                    }
+                }
+                for (int i = 0; i < n; i++) {
+                    if (!settled(i)) materializeInto(stack[i], i);
+                    stack[i] = Value::inReg(i);
+                }
+            }
+
+            // Registers a flush would overwrite
+            bool flushWrites(int r) const {
+                return r >= 0 && r < (int)stack.size() && !(stack[r].kind == Value::REG && stack[r].reg == r);
+            }
+
+            void branch(RegOpCode op, int src1, int src2, size_t target, uint8_t k = 0) {
+                VInstr in;
+                in.op = op;
+                in.src1 = src1;
+                in.src2 = src2;
+                in.k = k;
+                in.label = (int)target;
+                in.line = line;
+                code.push_back(in);
+            }
+
+            // JMP_IF / JMP_IF_NOT; a compare feeding it directly becomes one
+            // fused compare-and-branch
+            void conditional(bool jumpIfTrue, size_t target) {
+                Value cond = pop();
+                if (cond.kind == Value::CONST) {
+                    flush();
+                    if ((cond.num.i != 0) == jumpIfTrue) branch(R_JMP, NO_REG, NO_REG, target);
+                    return;
+                }
+                if (cond.kind == Value::REG && isTemp[cond.reg] && !code.empty() && code.back().dst == cond.reg &&
+                    isCompare(code.back().op) && !onStack(cond.reg)) {
+                    VInstr cmp = code.back();
+                    RegOpCode op = jumpIfTrue ? negateCompare(cmp.op) : cmp.op;
+                    if (!flushWrites(cmp.src1) && !flushWrites(cmp.src2)) {
+                        code.pop_back();
+                        int a = cmp.src1, b = cmp.src2;
+                        int k = -1;
+                        // A constant operand loaded just for the compare moves into the branch
+                        if (!code.empty() && (code.back().op == R_LOADI || code.back().op == R_LOADK) && isTemp[code.back().dst] &&
+                            (code.back().dst == a || code.back().dst == b) && a != b && !onStack(code.back().dst)) {
+                            const VInstr& load = code.back();
+                            Slot v = load.op == R_LOADI ? intSlot(load.x) : pools.prog.constants[load.x];
+                            uint32_t idx = pools.constant(v);
+                            if (idx < 256) {
+                                if (load.dst == a) {
+                                    std::swap(a, b);
+                                    op = mirrorCompare(op);
+                                }
+                                k = (int)idx;
+                                code.pop_back();
+                            }
+                        }
+                        flush();
+                        if (k >= 0) branch((RegOpCode)(R_JFIEQK + (op - R_IEQ)), a, NO_REG, target, (uint8_t)k);
+                        else branch((RegOpCode)(R_JFIEQ + (op - R_IEQ)), a, b, target);
+                        return;
+                    }
+                }
+                int c = reg(cond);
+                flush();
+                branch(jumpIfTrue ? R_JT : R_JF, c, NO_REG, target);
+            }
+
+            void binary(OpCode op) {
+                Value b = pop();
+                Value a = pop();
+                int t;
+                if ((op == IADD || op == IMUL) && a.isIntConst() && fitsInt32(a.num.i) && b.kind != Value::CONST) {
+                    std::swap(a, b);
+                }
+                if ((op == IADD || op == ISUB || op == IMUL) && b.isIntConst() && fitsInt32(b.num.i) &&
+                    (op != ISUB || b.num.i != INT32_MIN)) {
+                    int ra = reg(a);
+                    t = newTemp();
+                    int32_t x = (int32_t)b.num.i;
+                    emitOp(op == IMUL ? R_IMULI : R_IADDI, t, ra, NO_REG, op == ISUB ? -x : x);
+                } else {
+                    int ra = reg(a);
+                    int rb = reg(b);
+                    t = newTemp();
+                    emitOp(binaryOp(op), t, ra, rb);
+                }
+                stack.push_back(Value::inReg(t));
+            }
+
+            void unary(RegOpCode op) {
+                int ra = reg(pop());
+                int t = newTemp();
+                emitOp(op, t, ra);
+                stack.push_back(Value::inReg(t));
+            }
+
+            void lowerLoad(bool byte) {
+                Value addr = pop();
+                int t;
+                if (!byte && addr.kind == Value::LOCAL_ADDR && promoted(addr.offset)) {
+                    stack.push_back(Value::inReg(local(addr.offset)));
+                    return;
+                }
+                if (!byte && addr.kind == Value::LOCAL_ADDR) {
+                    t = newTemp();
+                    emitOp(R_LOADL, t, NO_REG, NO_REG, addr.offset);
+                } else if (!byte && addr.kind == Value::CONST && fitsInt32(addr.num.i) && addr.num.i >= 0) {
+                    t = newTemp();
+                    emitOp(R_LOADG, t, NO_REG, NO_REG, (int32_t)addr.num.i);
+                } else {
+                    int ra = reg(addr);
+                    t = newTemp();
+                    emitOp(byte ? R_LOADB : R_LOAD, t, ra);
+                }
+                stack.push_back(Value::inReg(t));
+            }
+
+            void lowerStore(bool byte, bool keep) {
+                Value v = pop();
+                Value addr = pop();
+                if (byte) {
+                    int ra = reg(addr);
+                    int rv = reg(v);
+                    emitOp(R_STOREB, NO_REG, ra, rv);
+                    if (keep) {
+                        int t = newTemp();
+                        emitOp(R_SEXT8, t, rv);
+                        stack.push_back(Value::inReg(t));
+                    }
+                    return;
+                }
+                if (addr.kind == Value::LOCAL_ADDR && promoted(addr.offset)) {
+                    int r = local(addr.offset);
+                    assignLocal(r, v);
+                    if (keep) stack.push_back(Value::inReg(r));
+                    return;
+                }
+                int rv = reg(v);
+                if (addr.kind == Value::LOCAL_ADDR) {
+                    emitOp(R_STOREL, NO_REG, rv, NO_REG, addr.offset);
+                } else if (addr.kind == Value::CONST && fitsInt32(addr.num.i) && addr.num.i >= 0) {
+                    emitOp(R_STOREG, NO_REG, rv, NO_REG, (int32_t)addr.num.i);
+                } else {
+                    emitOp(R_STORE, NO_REG, reg(addr), rv);
+                }
+                if (keep) stack.push_back(Value::inReg(rv));
+            }
+
+            // Returns false when control cannot fall through to the next instruction
+            bool lower(const Instruction& in) {
+                switch (in.op) {
+                    case HALT:
+                        emitOp(R_HALT, NO_REG);
+                        return false;
+                    case NOOP: case LEAVE:
+                        // LEAVE is folded into R_RET
+                        return true;
+                    case PUSH_IMM: case PUSH_STR:
+                        stack.push_back(Value::constInt(doubleToInt(in.immediate)));
+                        return true;
+                    case PUSH_CONST:
+                        stack.push_back(Value::constDouble(in.immediate));
+                        return true;
+                    case POP:
+                        stack.pop_back();
+                        return true;
+                    case DUP:
+                        stack.push_back(stack.back());
+                        return true;
+                    case ADD: case SUB: case MUL: case DIV: case MOD:
+                    case IADD: case ISUB: case IMUL: case IDIV: case IMOD:
+                    case BIT_AND: case BIT_OR: case BIT_XOR: case SHL: case SHR:
+                    case EQ: case NEQ: case LT: case GT: case LTE: case GTE:
+                    case IEQ: case INEQ: case ILT: case IGT: case ILTE: case IGTE:
+                    case LOGICAL_AND: case LOGICAL_OR:
+                        binary(in.op);
+                        return true;
+                    case BIT_NOT: unary(R_NOT); return true;
+                    case LOGICAL_NOT: unary(R_LNOT); return true;
+                    case INT_TO_DOUBLE:
+                        if (stack.back().kind == Value::CONST) {
+                            stack.back() = Value::constDouble((double)stack.back().num.i);
+                            return true;
+                        }
+                        unary(R_I2D);
+                        return true;
+                    case DOUBLE_TO_INT:
+                        if (stack.back().kind == Value::CONST) {
+                            stack.back() = Value::constInt(doubleToInt(stack.back().num.d));
+                            return true;
+                        }
+                        unary(R_D2I);
+                        return true;
+                    case LOAD: case DEREF: lowerLoad(false); return true;
+                    case LOAD_BYTE: lowerLoad(true); return true;
+                    case STORE: lowerStore(false, in.immediate != 0); return true;
+                    case STORE_BYTE: lowerStore(true, in.immediate != 0); return true;
+                    case ALLOC: {
+                        int size = reg(pop());
+                        int t = newTemp();
+                        emitOp(R_ALLOC, t, size, NO_REG, in.immediate != 0 ? 1 : 0);
+                        stack.push_back(Value::inReg(t));
+                        return true;
+                    }
+                    case REALLOC: {
+                        Value size = pop();
+                        int ra = reg(pop());
+                        int rb = reg(size);
+                        int t = newTemp();
+                        emitOp(R_REALLOC, t, ra, rb);
+                        stack.push_back(Value::inReg(t));
+                        return true;
+                    }
+                    case FREE:
+                        emitOp(R_FREE, NO_REG, reg(pop()));
+                        return true;
+                    case ADDR_OF:
+                        stack.push_back(Value::localAddr((int)in.immediate));
+                        return true;
+                    case JMP:
+                        flush();
+                        branch(R_JMP, NO_REG, NO_REG, (size_t)in.immediate);
+                        return false;
+                    case JMP_IF: conditional(true, (size_t)in.immediate); return true;
+                    case JMP_IF_NOT: conditional(false, (size_t)in.immediate); return true;
+                    // Superinstructions are taken apart again; the pieces
+                    // recombine into register forms
+                    case ADD_IMM:
+                        stack.push_back(Value::constInt(doubleToInt(in.immediate)));
+                        binary(IADD);
+                        return true;
+                    case LOAD_LOCAL:
+                        stack.push_back(Value::localAddr((int)in.immediate));
+                        lowerLoad(false);
+                        return true;
+                    case LOAD_ADD:
+                        lowerLoad(false);
+                        binary(IADD);
+                        return true;
+                    case JMP_IF_NOT_IEQ: case JMP_IF_NOT_INEQ: case JMP_IF_NOT_ILT:
+                    case JMP_IF_NOT_IGT: case JMP_IF_NOT_ILTE: case JMP_IF_NOT_IGTE:
+                        binary(fusedCompare(in.op));
+                        conditional(false, (size_t)in.immediate);
+                        return true;
+                    case CALL: {
+                        size_t argc = (size_t)in.immediate;
+                        std::vector<Value> args(stack.end() - argc, stack.end());
+                        stack.resize(stack.size() - argc);
+                        for (size_t i = 0; i < argc; i++) {
+                            emitOp(R_ARG, NO_REG, reg(args[i]), NO_REG, (int32_t)i);
+                        }
+                        int t = newTemp();
+                        emitOp(R_CALL, t, NO_REG, NO_REG, (int32_t)pools.functionIndex.at(in.strValue));
+                        stack.push_back(Value::inReg(t));
+                        return true;
+                    }
+                    case CALL_BUILTIN: {
+                        int id = (int)in.immediate;
+                        size_t argc = (size_t)BUILTINS[id].argc();
+                        std::vector<Value> args(stack.end() - argc, stack.end());
+                        stack.resize(stack.size() - argc);
+                        for (size_t i = 0; i < argc; i++) {
+                            emitOp(R_ARG, NO_REG, reg(args[i]), NO_REG, (int32_t)i);
+                        }
+                        int t = newTemp();
+                        emitOp(R_CALLB, t, NO_REG, NO_REG, id);
+                        stack.push_back(Value::inReg(t));
+                        return true;
+                    }
+                    case RET:
+                        emitOp(R_RET, NO_REG, reg(pop()));
+                        return false;
+                    case ENTER:
+                        frameSize = (int)in.immediate;
+                        emitOp(R_ENTER, NO_REG, NO_REG, NO_REG, frameSize);
+                        return true;
+                    case PRINT: emitOp(R_PRINT, NO_REG, reg(pop())); return true;
+                    case PRINT_CHAR: emitOp(R_PRINTC, NO_REG, reg(pop())); return true;
+                    case PRINT_STR: emitOp(R_PRINTS, NO_REG, reg(pop())); return true;
+                    case PRINT_FMT: {
+                        int r = reg(pop());
+                        emitOp(R_PRINTF, NO_REG, r, NO_REG, (int32_t)pools.string(in.strValue));
+                        return true;
+                    }
+                    default:
+                        throw std::runtime_error("register lowering: unsupported opcode");
+                }
+            }
+
+            void translate() {
+                code.clear();
+                stack.clear();
+                localReg.clear();
+                labelPos.assign(end - begin, -1);
+                line = ir[begin].line;
+                nextReg = maxDepth;
+                isTemp.assign(maxDepth, 0);
+                if (isEntry) {
+                    // The startup code has no ENTER; give it one for spill slots
+                    frameSize = 0;
+                    emitOp(R_ENTER, NO_REG);
+                }
+
+                bool live = false;
+                for (size_t i = begin; i < end; i++) {
+                    int d = depth[i - begin];
+                    if (d < 0) {
+                        live = false;
+                        continue;
+                    }
+                    if (leader[i - begin]) {
+                        if (live) flush();
+                        stack.clear();
+                        for (int s = 0; s < d; s++) stack.push_back(Value::inReg(s));
+                        labelPos[i - begin] = (int)code.size();
+                    }
+                    line = ir[i].line;
+                    live = lower(ir[i]);
+                }
+            }
+
+            // ---- Liveness and allocation ----
+
+            struct Block { int first, last; std::vector<int> succ; };
+
+            std::vector<Block> buildBlocks() const {
+                std::vector<uint8_t> starts(code.size() + 1, 0);
+                starts[0] = 1;
+                for (int pos : labelPos) {
+                    if (pos >= 0) starts[pos] = 1;
+                }
+                for (size_t p = 0; p < code.size(); p++) {
+                    if (isBranch(code[p].op) || endsFlow(code[p].op)) starts[p + 1] = 1;
+                }
+                std::vector<int> blockAt(code.size() + 1, -1);
+                std::vector<Block> blocks;
+                for (size_t p = 0; p < code.size(); p++) {
+                    if (starts[p]) blocks.push_back({(int)p, (int)p, {}});
+                    blocks.back().last = (int)p;
+                    blockAt[p] = (int)blocks.size() - 1;
+                }
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    const VInstr& in = code[blocks[b].last];
+                    if (isBranch(in.op)) blocks[b].succ.push_back(blockAt[labelPos[in.label - begin]]);
+                    if (!endsFlow(in.op) && b + 1 < blocks.size()) blocks[b].succ.push_back((int)b + 1);
+                }
+                return blocks;
+            }
+
+            // Live intervals [start, end] over positions in `code`, with
+            // holes ignored as in classic linear scan. Returns the virtual
+            // registers live on entry.
+            std::vector<int> intervals(std::vector<int>& start, std::vector<int>& stop) const {
+                std::vector<Block> blocks = buildBlocks();
+                size_t words = (nextReg + 63) / 64;
+                typedef std::vector<uint64_t> Set;
+                auto has = [](const Set& s, int r) { return (s[r >> 6] >> (r & 63)) & 1; };
+                auto add = [](Set& s, int r) { s[r >> 6] |= 1ull << (r & 63); };
+                auto del = [](Set& s, int r) { s[r >> 6] &= ~(1ull << (r & 63)); };
+
+                std::vector<Set> use(blocks.size(), Set(words)), def(blocks.size(), Set(words));
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    for (int p = blocks[b].first; p <= blocks[b].last; p++) {
+                        const VInstr& in = code[p];
+                        for (int r : {in.src1, in.src2}) {
+                            if (r != NO_REG && !has(def[b], r)) add(use[b], r);
+                        }
+                        if (in.dst != NO_REG) add(def[b], in.dst);
+                    }
+                }
+
+                std::vector<Set> liveIn(blocks.size(), Set(words)), liveOut(blocks.size(), Set(words));
+                for (bool changed = true; changed;) {
+                    changed = false;
+                    for (size_t b = blocks.size(); b-- > 0;) {
+                        Set out(words);
+                        for (int s : blocks[b].succ) {
+                            for (size_t w = 0; w < words; w++) out[w] |= liveIn[s][w];
+                        }
+                        Set in(words);
+                        for (size_t w = 0; w < words; w++) in[w] = use[b][w] | (out[w] & ~def[b][w]);
+                        if (in != liveIn[b] || out != liveOut[b]) {
+                            liveIn[b] = in;
+                            liveOut[b] = out;
+                            changed = true;
+                        }
+                    }
+                }
+
+                start.assign(nextReg, INT_MAX);
+                stop.assign(nextReg, -1);
+                auto extend = [&](int r, int p) {
+                    start[r] = std::min(start[r], p);
+                    stop[r] = std::max(stop[r], p);
+                };
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    Set live = liveOut[b];
+                    for (int r = 0; r < nextReg; r++) {
+                        if (has(live, r)) extend(r, blocks[b].last);
+                    }
+                    for (int p = blocks[b].last; p >= blocks[b].first; p--) {
+                        const VInstr& in = code[p];
+                        if (in.dst != NO_REG) {
+                            extend(in.dst, p);
+                            del(live, in.dst);
+                        }
+                        for (int r : {in.src1, in.src2}) {
+                            if (r != NO_REG) {
+                                extend(r, p);
+                                add(live, r);
+                            }
+                        }
+                    }
+                    for (int r = 0; r < nextReg; r++) {
+                        if (has(live, r)) extend(r, blocks[b].first);
+                    }
+                }
+
+                std::vector<int> entryLive;
+                if (!blocks.empty()) {
+                    for (int r = 0; r < nextReg; r++) {
+                        if (has(liveIn[0], r)) entryLive.push_back(r);
+                    }
+                }
+                return entryLive;
+            }
+
+            // Promoted locals read before any write (parameters, or
+            // uninitialised variables) start from their frame slot
+            void loadLiveInLocals() {
+                std::vector<int> start, stop;
+                std::vector<int> entryLive = intervals(start, stop);
+                std::vector<VInstr> loads;
+                for (int r : entryLive) {
+                    for (const auto& kv : localReg) {
+                        if (kv.second != r) continue;
+                        VInstr in;
+                        in.op = R_LOADL;
+                        in.dst = r;
+                        in.x = kv.first;
+                        in.line = code[0].line;
+                        loads.push_back(in);
+                    }
+                }
+                if (loads.empty()) return;
+                // After ENTER, which is always the first instruction
+                code.insert(code.begin() + 1, loads.begin(), loads.end());
+                for (int& pos : labelPos) {
+                    if (pos >= 1) pos += (int)loads.size();
+                }
+            }
+
+            // Poletto-Sarkar linear scan: walk intervals by start point and
+            // spill whichever active interval ends last when out of registers
+            int allocate(std::vector<int>& phys, std::vector<int>& spillSlot) {
+                std::vector<int> start, stop;
+                intervals(start, stop);
+
+                std::vector<int> order;
+                for (int r = 0; r < nextReg; r++) {
+                    if (stop[r] >= 0) order.push_back(r);
+                }
+                std::sort(order.begin(), order.end(), [&](int a, int b) {
+                    return start[a] != start[b] ? start[a] < start[b] : a < b;
+                });
+
+                phys.assign(nextReg, NO_REG);
+                spillSlot.assign(nextReg, -1);
+                int spills = 0;
+                std::vector<int> active;  // Sorted by end point
+                std::vector<int> freeRegs;
+                for (int r = REG_ALLOCATABLE; r-- > 0;) freeRegs.push_back(r);
+
+                auto activate = [&](int r) {
+                    auto at = std::upper_bound(active.begin(), active.end(), r, [&](int a, int b) { return stop[a] < stop[b]; });
+                    active.insert(at, r);
+                };
+
+                for (int r : order) {
+                    // Intervals ending before this one starts free their registers
+                    while (!active.empty() && stop[active.front()] < start[r]) {
+                        freeRegs.push_back(phys[active.front()]);
+                        active.erase(active.begin());
+                    }
+                    if (!freeRegs.empty()) {
+                        phys[r] = freeRegs.back();
+                        freeRegs.pop_back();
+                        activate(r);
+                        continue;
+                    }
+                    int victim = active.back();
+                    if (stop[victim] > stop[r]) {
+                        phys[r] = phys[victim];
+                        phys[victim] = NO_REG;
+                        spillSlot[victim] = spills++;
+                        active.pop_back();
+                        activate(r);
+                    } else {
+                        spillSlot[r] = spills++;
+                    }
+                }
+                return spills;
+            }
+
+        public:
+            FunctionLowering(Pools& p, const std::vector<Instruction>& code, size_t b, size_t e, bool entry)
+                : pools(p), ir(code), begin(b), end(e), isEntry(entry) {}
+
+            void run(std::vector<RegInstr>& out, std::vector<uint32_t>& lines, RegFunction& fn) {
+                computeDepths();
+                for (;;) {
+                    try {
+                        translate();
+                        break;
+                    } catch (const Escape& e) {
+                        escaped.insert(e.offset);
+                    }
+                }
+                loadLiveInLocals();
+
+                std::vector<int> phys, spillSlot;
+                int spills = allocate(phys, spillSlot);
+                // Spill slots go after the frame the compiler laid out
+                auto slotOffset = [&](int r) { return (int32_t)(frameSize + 8 * spillSlot[r]); };
+
+                uint32_t base = (uint32_t)out.size();
+                std::vector<uint32_t> newPos(code.size() + 1);
+                int maxReg = -1;
+                for (size_t p = 0; p < code.size(); p++) {
+                    newPos[p] = (uint32_t)(out.size() - base);
+                    const VInstr& in = code[p];
+                    RegInstr enc{in.op, 0, 0, 0, in.x};
+                    if (in.src1 != NO_REG) {
+                        if (spillSlot[in.src1] >= 0) {
+                            out.push_back({R_LOADL, (uint8_t)SCRATCH0, 0, 0, slotOffset(in.src1)});
+                            enc.b = SCRATCH0;
+                        } else {
+                            enc.b = (uint8_t)phys[in.src1];
+                        }
+                    }
+                    if (in.src2 != NO_REG) {
+                        if (in.src2 == in.src1) {
+                            enc.c = enc.b;
+                        } else if (spillSlot[in.src2] >= 0) {
+                            out.push_back({R_LOADL, (uint8_t)SCRATCH1, 0, 0, slotOffset(in.src2)});
+                            enc.c = SCRATCH1;
+                        } else {
+                            enc.c = (uint8_t)phys[in.src2];
+                        }
+                    } else if (in.op >= R_JFIEQK && in.op <= R_JFIGEK) {
+                        enc.c = in.k;
+                    }
+                    bool spillDst = in.dst != NO_REG && spillSlot[in.dst] >= 0;
+                    if (in.dst != NO_REG) enc.a = spillDst ? SCRATCH0 : (uint8_t)phys[in.dst];
+                    if (in.op == R_ENTER) enc.x = frameSize + 8 * spills;
+                    maxReg = std::max({maxReg, (int)enc.a, (int)enc.b, (int)enc.c});
+                    out.push_back(enc);
+                    if (spillDst) out.push_back({R_STOREL, 0, (uint8_t)SCRATCH0, 0, slotOffset(in.dst)});
+                }
+                newPos[code.size()] = (uint32_t)(out.size() - base);
+
+                // Spill reloads and stores share their instruction's line
+                lines.resize(out.size());
+                for (size_t p = 0; p < code.size(); p++) {
+                    for (uint32_t k = newPos[p]; k < newPos[p + 1]; k++) lines[base + k] = (uint32_t)code[p].line;
+                }
+
+                for (size_t p = 0; p < code.size(); p++) {
+                    if (!isBranch(code[p].op)) continue;
+                    uint32_t at = base + newPos[p + 1] - 1;
+                    // Reloads come before the branch, so it is the last one emitted for p
+                    out[at].x = (int32_t)(base + newPos[labelPos[code[p].label - begin]]);
+                }
+
+                fn.entry = base;
+                fn.numRegs = spills > 0 ? REG_WINDOW_SIZE : (uint32_t)(maxReg + 1);
+            }
+        };
+
+    }
+
+    void lowerToRegisters(Program& prog) {
+        Pools pools(prog);
+        prog.regCode.clear();
+        prog.regFunctions.clear();
+        prog.regLines.clear();
+
+        // Functions are laid out back to back after the startup code
+        std::vector<std::pair<size_t, std::string>> starts;
+        for (const auto& fn : prog.functions) starts.push_back({fn.second, fn.first});
+        std::sort(starts.begin(), starts.end());
+        for (size_t i = 0; i < starts.size(); i++) pools.functionIndex[starts[i].second] = (uint32_t)i + 1;
+
+        prog.regFunctions.resize(starts.size() + 1);
+        size_t entryEnd = starts.empty() ? prog.instructions.size() : starts[0].first;
+        FunctionLowering(pools, prog.instructions, prog.entryPoint, entryEnd, true)
+            .run(prog.regCode, prog.regLines, prog.regFunctions[0]);
+        for (size_t i = 0; i < starts.size(); i++) {
+            size_t fnEnd = i + 1 < starts.size() ? starts[i + 1].first : prog.instructions.size();
+            FunctionLowering(pools, prog.instructions, starts[i].first, fnEnd, false)
+                .run(prog.regCode, prog.regLines, prog.regFunctions[i + 1]);
+        }
+    }
+
+}
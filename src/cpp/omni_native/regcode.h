@@ -0,0 +1,18 @@
+// OmniVM register code - stack bytecode lowered to three-address form
+#pragma once
+#include "common.h"
+
+namespace OmniNative {
+
+    // Registers per frame; the top two are scratch for spill reloads
+    const int REG_WINDOW_SIZE = 64;
+    const int REG_ALLOCATABLE = REG_WINDOW_SIZE - 2;
+
+    // Lowers a verified program to Program::regCode and its line table
+    // Program::regLines. Operand stack slots and scalar locals whose address
+    // never escapes become virtual registers, which a linear-scan allocator
+    // maps onto the frame's register window, spilling to extra frame slots
+    // when it runs out.
+    void lowerToRegisters(Program& prog);
+
+}
@@ -0,0 +1,1808 @@
+// OmniVM SSA middle-end
+#include "ssa.h"
+#include "bytecode.h"
+#include "builtins.h"
+#include <map>
+#include <tuple>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstring>
+
+namespace OmniNative {
+
+    namespace {
+
+        const int NONE = -1;
+
+        // How a node interacts with VM memory and output. PURE nodes may be
+        // folded, shared, moved or dropped; READS nodes are shared only
+        // between the same two writes; WRITES nodes run exactly as written.
+        enum Effect : uint8_t { PURE, READS, WRITES };
+
+        enum NodeKind : uint8_t {
+            N_OP,       // A stack instruction over SSA operands
+            N_CONST,
+            N_PHI,
+            N_ENTRY     // A promoted local's value on entry (parameters)
+        };
+
+        struct Node {
+            NodeKind kind = N_OP;
+            Instruction ins{NOOP};
+            Effect effect = PURE;
+            bool hasValue = true;
+            int block = NONE;
+            std::vector<int> args;      // Phi operands are parallel to Block::preds
+            Slot value = intSlot(0);    // N_CONST
+            bool isDouble = false;      // N_CONST: emitted as PUSH_CONST
+            int local = 0;              // N_ENTRY frame offset
+            int replacedBy = NONE;
+            bool dead = false;
+        };
+
+        struct Block {
+            int start = 0;               // First stack instruction
+            int order = 0;               // Places blocks added later around `start`
+            size_t last = 0;             // Last stack instruction
+            std::vector<int> preds, succs;   // Branches: succs = {taken, fall through}
+            std::vector<int> phis;
+            std::vector<int> body;       // Non-phi nodes in execution order
+            OpCode term = JMP;           // JMP, JMP_IF, JMP_IF_NOT, RET or HALT
+            int value = NONE;            // Branch condition or return value
+            bool dead = false;
+        };
+
+        struct Loop {
+            int header;
+            std::vector<int> blocks;     // In reverse postorder
+            std::vector<uint8_t> member;
+
+            // Blocks added since the loop was found are outside it
+            bool contains(int b) const { return (size_t)b < member.size() && member[b]; }
+        };
+
+        // Operand stack entry while translating: an SSA value or the address
+        // of a promoted local
+        struct StackValue { int node; int local; };
+
+        // Thrown when a promoted local's address is used as a value;
+        // translation restarts with the local kept in memory
+        struct Escape { int offset; };
+        // Thrown for code the IR does not model; the function is left as is
+        struct Unsupported {};
+
+        bool isCommutative(OpCode op) {
+            switch (op) {
+                case ADD: case MUL: case IADD: case IMUL: case BIT_AND: case BIT_OR: case BIT_XOR:
+                case EQ: case NEQ: case IEQ: case INEQ: case LOGICAL_AND: case LOGICAL_OR:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        Effect builtinEffect(int id) {
+            if (id >= BI_SIN && id <= BI_CEIL) return PURE;
+            switch (id) {
+                case BI_STRLEN: case BI_STRCMP: case BI_STRNCMP: case BI_STRCHR: case BI_MEMCMP:
+                case BI_ATOI: case BI_ATOF:
+                    return READS;
+                default:
+                    return WRITES;
+            }
+        }
+
+        // PUSH_IMM carries its operand as a double
+        bool fitsImmediate(int64_t v) { return doubleToInt((double)v) == v; }
+
+        int64_t wrapAdd(int64_t a, int64_t b) { return (int64_t)((uint64_t)a + (uint64_t)b); }
+        int64_t wrapMul(int64_t a, int64_t b) { return (int64_t)((uint64_t)a * (uint64_t)b); }
+
+        // Evaluates a PURE op on constants exactly as the VM does
+        bool evaluate(const Instruction& in, const Slot* v, Slot& out, bool& isDouble) {
+            int64_t a = v[0].i, b = v[1].i;
+            double x = v[0].d, y = v[1].d;
+            isDouble = false;
+            switch (in.op) {
+                case ADD: out = doubleSlot(x + y); isDouble = true; return true;
+                case SUB: out = doubleSlot(x - y); isDouble = true; return true;
+                case MUL: out = doubleSlot(x * y); isDouble = true; return true;
+                case DIV: out = doubleSlot(y != 0 ? x / y : 0); isDouble = true; return true;
+                case MOD: out = doubleSlot(y != 0 ? std::fmod(x, y) : 0); isDouble = true; return true;
+                case IADD: out = intSlot(wrapAdd(a, b)); return true;
+                case ISUB: out = intSlot((int64_t)((uint64_t)a - (uint64_t)b)); return true;
+                case IMUL: out = intSlot(wrapMul(a, b)); return true;
+                case IDIV: out = intSlot(intDiv(a, b)); return true;
+                case IMOD: out = intSlot(intMod(a, b)); return true;
+                case BIT_AND: out = intSlot(a & b); return true;
+                case BIT_OR: out = intSlot(a | b); return true;
+                case BIT_XOR: out = intSlot(a ^ b); return true;
+                case BIT_NOT: out = intSlot(~a); return true;
+                case SHL: out = intSlot((int64_t)((uint64_t)a << (b & 63))); return true;
+                case SHR: out = intSlot(a >> (b & 63)); return true;
+                case EQ: out = intSlot(x == y); return true;
+                case NEQ: out = intSlot(x != y); return true;
+                case LT: out = intSlot(x < y); return true;
+                case GT: out = intSlot(x > y); return true;
+                case LTE: out = intSlot(x <= y); return true;
+                case GTE: out = intSlot(x >= y); return true;
+                case IEQ: out = intSlot(a == b); return true;
+                case INEQ: out = intSlot(a != b); return true;
+                case ILT: out = intSlot(a < b); return true;
+                case IGT: out = intSlot(a > b); return true;
+                case ILTE: out = intSlot(a <= b); return true;
+                case IGTE: out = intSlot(a >= b); return true;
+                case LOGICAL_AND: out = intSlot(a != 0 && b != 0); return true;
+                case LOGICAL_OR: out = intSlot(a != 0 || b != 0); return true;
+                case LOGICAL_NOT: out = intSlot(a == 0); return true;
+                case INT_TO_DOUBLE: out = doubleSlot((double)a); isDouble = true; return true;
+                case DOUBLE_TO_INT: out = intSlot(doubleToInt(x)); return true;
+                case CALL_BUILTIN: {
+                    // Only the math functions are PURE; they never touch memory
+                    static VmBytes noMemory;
+                    int id = (int)in.immediate;
+                    out = callBuiltin(id, noMemory, v);
+                    isDouble = BUILTINS[id].signature[0] == 'd';
+                    return true;
+                }
+                default:
+                    return false;
+            }
+        }
+
+        // Fixed-size set of small integers for liveness
+        class BitSet {
+            std::vector<uint64_t> words;
+        public:
+            explicit BitSet(size_t n = 0) : words((n + 63) / 64, 0) {}
+            void set(int i) { words[i >> 6] |= (uint64_t)1 << (i & 63); }
+            void reset(int i) { words[i >> 6] &= ~((uint64_t)1 << (i & 63)); }
+            // Adds `o`; returns true if anything was new
+            bool merge(const BitSet& o) {
+                bool changed = false;
+                for (size_t k = 0; k < words.size(); k++) {
+                    uint64_t w = words[k] | o.words[k];
+                    changed |= w != words[k];
+                    words[k] = w;
+                }
+                return changed;
+            }
+            template <typename F> void forEach(F f) const {
+                for (size_t k = 0; k < words.size(); k++) {
+                    for (uint64_t w = words[k]; w; w &= w - 1) f((int)(k * 64 + __builtin_ctzll(w)));
+                }
+            }
+        };
+
+        class SsaFunction {
+            const std::vector<Instruction>& ir;
+            size_t begin, end;
+            int level;
+            bool stackTarget;            // Output runs as stack code, not lowered to registers
+            int params;                  // Arguments in the first frame slots
+            OptimizerStats& stats;
+            int frameSize = 0;
+            int layoutOrder = 0;         // Source of Block::order for new blocks
+
+            std::vector<Node> nodes;
+            std::vector<Block> blocks;
+            std::map<std::pair<int64_t, bool>, int> constants;
+            std::map<int, int> entryValues;
+            std::set<int> escaped;
+            std::set<int> promoted;
+            std::vector<int> blockAt;        // Instruction - begin -> leading block
+            std::vector<int> depth;          // Instruction - begin -> eval stack depth
+
+            // Construction state (Braun et al., "Simple and Efficient
+            // Construction of Static Single Assignment Form"). Variables are
+            // promoted frame offsets (>= 0) and eval stack slots (< 0).
+            std::vector<std::unordered_map<int, int>> currentDef;
+            std::vector<std::map<int, int>> incompletePhis;
+            std::vector<uint8_t> sealed, filled;
+            std::vector<StackValue> stack;
+            int cur = NONE;
+
+            std::vector<int> idom, rpoIndex;
+
+            static int stackVar(int k) { return -1 - k; }
+
+            // ---- Nodes ----
+
+            int addNode(Node n) {
+                nodes.push_back(std::move(n));
+                return (int)nodes.size() - 1;
+            }
+
+            int constant(Slot v, bool isDouble) {
+                auto key = std::make_pair(v.i, isDouble);
+                auto it = constants.find(key);
+                if (it != constants.end()) return it->second;
+                Node n;
+                n.kind = N_CONST;
+                n.value = v;
+                n.isDouble = isDouble;
+                int id = addNode(n);
+                constants[key] = id;
+                return id;
+            }
+
+            int constInt(int64_t v) { return constant(intSlot(v), false); }
+
+            bool isConst(int n) const { return nodes[n].kind == N_CONST; }
+            bool isConstInt(int n, int64_t v) const { return isConst(n) && nodes[n].value.i == v; }
+
+            int entryValue(int local) {
+                auto it = entryValues.find(local);
+                if (it != entryValues.end()) return it->second;
+                Node n;
+                n.kind = N_ENTRY;
+                n.local = local;
+                n.block = 0;
+                int id = addNode(n);
+                entryValues[local] = id;
+                return id;
+            }
+
+            int newPhi(int b) {
+                Node n;
+                n.kind = N_PHI;
+                n.block = b;
+                int id = addNode(n);
+                blocks[b].phis.push_back(id);
+                return id;
+            }
+
+            int addOp(const Instruction& in, Effect effect, std::vector<int> args, bool hasValue = true) {
+                Node n;
+                n.ins = in;
+                n.effect = effect;
+                n.hasValue = hasValue;
+                n.block = cur;
+                n.args = std::move(args);
+                int id = addNode(n);
+                blocks[cur].body.push_back(id);
+                return id;
+            }
+
+            int resolve(int n) {
+                int r = n;
+                while (nodes[r].replacedBy != NONE) r = nodes[r].replacedBy;
+                while (nodes[n].replacedBy != NONE) {
+                    int next = nodes[n].replacedBy;
+                    nodes[n].replacedBy = r;
+                    n = next;
+                }
+                return r;
+            }
+
+            void replace(int n, int with) {
+                nodes[n].replacedBy = with;
+                nodes[n].dead = true;
+            }
+
+            // ---- CFG ----
+
+            bool modeled(const Instruction& in, size_t i) const {
+                switch (in.op) {
+                    case ADD_IMM: case LOAD_LOCAL: case LOAD_ADD:
+                    case JMP_IF_NOT_IEQ: case JMP_IF_NOT_INEQ: case JMP_IF_NOT_ILT:
+                    case JMP_IF_NOT_IGT: case JMP_IF_NOT_ILTE: case JMP_IF_NOT_IGTE:
+                        return false;
+                    case ENTER: return i == begin;
+                    case LEAVE: return i + 1 < end && ir[i + 1].op == RET;
+                    case CALL_BUILTIN: return (size_t)in.immediate < BUILTIN_COUNT;
+                    default: return in.op < OP_COUNT;
+                }
+            }
+
+            void discoverBlocks() {
+                size_t n = end - begin;
+                depth.assign(n, -1);
+                std::vector<uint8_t> leader(n, 0);
+                std::vector<size_t> worklist{begin};
+                depth[0] = 0;
+                leader[0] = 1;
+                auto reach = [&](size_t at, int d) {
+                    if (at <= begin || at >= end) throw Unsupported();
+                    if (depth[at - begin] >= 0) return;
+                    depth[at - begin] = d;
+                    worklist.push_back(at);
+                };
+                while (!worklist.empty()) {
+                    size_t i = worklist.back();
+                    worklist.pop_back();
+                    const Instruction& in = ir[i];
+                    if (!modeled(in, i)) throw Unsupported();
+                    int next = depth[i - begin] + stackEffect(in.op, (uint64_t)in.immediate, (uint64_t)in.immediate).delta;
+                    if (isJump(in.op)) {
+                        size_t target = (size_t)in.immediate;
+                        reach(target, next);
+                        leader[target - begin] = 1;
+                        if (in.op != JMP) reach(i + 1, next);
+                        if (i + 1 < end) leader[i + 1 - begin] = 1;
+                    } else if (in.op == RET || in.op == HALT) {
+                        if (i + 1 < end) leader[i + 1 - begin] = 1;
+                    } else {
+                        reach(i + 1, next);
+                    }
+                }
+
+                blockAt.assign(n, NONE);
+                for (size_t i = 0; i < n; i++) {
+                    if (!leader[i] || depth[i] < 0) continue;
+                    blockAt[i] = (int)blocks.size();
+                    Block b;
+                    b.start = (int)(begin + i);
+                    blocks.push_back(b);
+                }
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    size_t i = (size_t)blocks[b].start;
+                    while (!isJump(ir[i].op) && ir[i].op != RET && ir[i].op != HALT && !leader[i + 1 - begin]) i++;
+                    Block& blk = blocks[b];
+                    blk.last = i;
+                    OpCode op = ir[i].op;
+                    if (isJump(op)) {
+                        int taken = blockAt[(size_t)ir[i].immediate - begin];
+                        blk.succs.push_back(taken);
+                        if (op != JMP) {
+                            int fall = blockAt[i + 1 - begin];
+                            // Both ways to the same block: the condition is just dropped
+                            if (fall != taken) {
+                                blk.succs.push_back(fall);
+                                blk.term = op;
+                            }
+                        }
+                    } else if (op == RET || op == HALT) {
+                        blk.term = op;
+                    } else {
+                        blk.succs.push_back(blockAt[i + 1 - begin]);
+                    }
+                }
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    for (int s : blocks[b].succs) blocks[s].preds.push_back((int)b);
+                }
+            }
+
+            std::vector<int> reversePostorder() const {
+                std::vector<int> order;
+                std::vector<uint8_t> seen(blocks.size(), 0);
+                std::vector<std::pair<int, size_t>> work{{0, 0}};
+                seen[0] = 1;
+                while (!work.empty()) {
+                    auto& top = work.back();
+                    const Block& b = blocks[top.first];
+                    if (top.second < b.succs.size()) {
+                        int s = b.succs[top.second++];
+                        if (!seen[s] && !blocks[s].dead) {
+                            seen[s] = 1;
+                            work.push_back({s, 0});
+                        }
+                    } else {
+                        order.push_back(top.first);
+                        work.pop_back();
+                    }
+                }
+                std::reverse(order.begin(), order.end());
+                return order;
+            }
+
+            // ---- SSA construction ----
+
+            void writeVariable(int var, int b, int value) { currentDef[b][var] = value; }
+
+            int readVariable(int var, int b) {
+                auto it = currentDef[b].find(var);
+                if (it != currentDef[b].end()) return resolve(it->second);
+                int v;
+                if (!sealed[b]) {
+                    v = newPhi(b);
+                    incompletePhis[b][var] = v;
+                } else if (blocks[b].preds.size() == 1) {
+                    v = readVariable(var, blocks[b].preds[0]);
+                } else if (blocks[b].preds.empty()) {
+                    v = var >= 0 ? entryValue(var) : constInt(0);
+                } else {
+                    v = newPhi(b);
+                    writeVariable(var, b, v);
+                    v = addPhiOperands(var, v);
+                }
+                writeVariable(var, b, v);
+                return v;
+            }
+
+            int addPhiOperands(int var, int phi) {
+                int b = nodes[phi].block;
+                for (int p : blocks[b].preds) {
+                    int v = readVariable(var, p);
+                    nodes[phi].args.push_back(v);
+                }
+                return removeTrivialPhi(phi);
+            }
+
+            // A phi whose operands are all one value (or itself) is that value
+            int removeTrivialPhi(int phi) {
+                int same = NONE;
+                for (int a : nodes[phi].args) {
+                    a = resolve(a);
+                    if (a == same || a == phi) continue;
+                    if (same != NONE) return phi;
+                    same = a;
+                }
+                if (same == NONE) same = constInt(0);   // Never assigned on any path
+                replace(phi, same);
+                return same;
+            }
+
+            void seal(int b) {
+                for (const auto& kv : incompletePhis[b]) addPhiOperands(kv.first, kv.second);
+                incompletePhis[b].clear();
+                sealed[b] = 1;
+            }
+
+            bool predsFilled(int b) const {
+                for (int p : blocks[b].preds) {
+                    if (!filled[p]) return false;
+                }
+                return true;
+            }
+
+            void push(int node) { stack.push_back({node, NONE}); }
+
+            StackValue pop() {
+                StackValue v = stack.back();
+                stack.pop_back();
+                return v;
+            }
+
+            int value(const StackValue& v) {
+                if (v.local != NONE) throw Escape{v.local};
+                return v.node;
+            }
+
+            int popValue() { return value(pop()); }
+
+            std::vector<int> popValues(int n) {
+                std::vector<int> args(n);
+                for (int k = n; k-- > 0;) args[k] = popValue();
+                return args;
+            }
+
+            void lower(const Instruction& in) {
+                switch (in.op) {
+                    case NOOP: case ENTER: case LEAVE: case JMP:
+                        break;
+                    case PUSH_IMM: case PUSH_STR:
+                        push(constInt(doubleToInt(in.immediate)));
+                        break;
+                    case PUSH_CONST:
+                        push(constant(doubleSlot(in.immediate), true));
+                        break;
+                    case POP:
+                        stack.pop_back();
+                        break;
+                    case DUP:
+                        stack.push_back(stack.back());
+                        break;
+                    case ADDR_OF: {
+                        int k = (int)in.immediate;
+                        if (escaped.count(k)) push(addOp(in, PURE, {}));
+                        else stack.push_back({NONE, k});
+                        break;
+                    }
+                    case LOAD: case DEREF: {
+                        StackValue a = pop();
+                        if (a.local != NONE) {
+                            promoted.insert(a.local);
+                            push(readVariable(a.local, cur));
+                        } else {
+                            push(addOp(in, READS, {a.node}));
+                        }
+                        break;
+                    }
+                    case STORE: {
+                        int v = popValue();
+                        StackValue a = pop();
+                        if (a.local != NONE) {
+                            promoted.insert(a.local);
+                            writeVariable(a.local, cur, v);
+                        } else {
+                            addOp(Instruction(STORE, 0), WRITES, {a.node, v}, false);
+                        }
+                        if (in.immediate != 0) push(v);
+                        break;
+                    }
+                    case LOAD_BYTE:
+                        push(addOp(in, READS, {popValue()}));
+                        break;
+                    case STORE_BYTE: {
+                        std::vector<int> args = popValues(2);
+                        int n = addOp(in, WRITES, args, in.immediate != 0);
+                        if (in.immediate != 0) push(n);
+                        break;
+                    }
+                    case ALLOC:
+                        push(addOp(in, WRITES, {popValue()}));
+                        break;
+                    case REALLOC:
+                        push(addOp(in, WRITES, popValues(2)));
+                        break;
+                    case FREE: case PRINT: case PRINT_CHAR: case PRINT_STR: case PRINT_FMT:
+                        addOp(in, WRITES, {popValue()}, false);
+                        break;
+                    case CALL:
+                        push(addOp(in, WRITES, popValues((int)in.immediate)));
+                        break;
+                    case CALL_BUILTIN: {
+                        int id = (int)in.immediate;
+                        push(addOp(in, builtinEffect(id), popValues(BUILTINS[id].argc())));
+                        break;
+                    }
+                    case BIT_NOT: case LOGICAL_NOT: case INT_TO_DOUBLE: case DOUBLE_TO_INT:
+                        push(addOp(in, PURE, {popValue()}));
+                        break;
+                    case JMP_IF: case JMP_IF_NOT: {
+                        StackValue c = pop();
+                        if (blocks[cur].succs.size() == 2) blocks[cur].value = value(c);
+                        break;
+                    }
+                    case RET:
+                        blocks[cur].value = popValue();
+                        break;
+                    case HALT:
+                        break;
+                    default: {
+                        StackEffect e = stackEffect(in.op, 0, 0);
+                        if (e.needs != 2 || e.delta != -1) throw Unsupported();
+                        push(addOp(in, PURE, popValues(2)));
+                        break;
+                    }
+                }
+            }
+
+            void translate() {
+                nodes.clear();
+                constants.clear();
+                entryValues.clear();
+                promoted.clear();
+                for (Block& b : blocks) {
+                    b.phis.clear();
+                    b.body.clear();
+                    b.value = NONE;
+                }
+                currentDef.assign(blocks.size(), {});
+                incompletePhis.assign(blocks.size(), {});
+                sealed.assign(blocks.size(), 0);
+                filled.assign(blocks.size(), 0);
+
+                for (int b : reversePostorder()) {
+                    if (!sealed[b] && predsFilled(b)) seal(b);
+                    cur = b;
+                    stack.clear();
+                    const Block& blk = blocks[b];
+                    int entryDepth = depth[blk.start - begin];
+                    for (int k = 0; k < entryDepth; k++) push(readVariable(stackVar(k), b));
+                    for (size_t i = (size_t)blk.start; i <= blk.last; i++) lower(ir[i]);
+                    // Values left on the stack flow to the successors as variables
+                    if (!blocks[b].succs.empty()) {
+                        for (size_t k = 0; k < stack.size(); k++) writeVariable(stackVar((int)k), b, value(stack[k]));
+                    }
+                    filled[b] = 1;
+                    for (int s : blocks[b].succs) {
+                        if (!sealed[s] && predsFilled(s)) seal(s);
+                    }
+                }
+            }
+
+            // ---- Cleanup ----
+
+            void compact() {
+                for (Block& b : blocks) {
+                    auto dead = [&](int n) { return nodes[n].dead; };
+                    b.phis.erase(std::remove_if(b.phis.begin(), b.phis.end(), dead), b.phis.end());
+                    b.body.erase(std::remove_if(b.body.begin(), b.body.end(), dead), b.body.end());
+                }
+            }
+
+            int predIndex(int b, int pred) const {
+                const std::vector<int>& preds = blocks[b].preds;
+                return (int)(std::find(preds.begin(), preds.end(), pred) - preds.begin());
+            }
+
+            void removeEdge(int from, int to) {
+                Block& f = blocks[from];
+                f.succs.erase(std::find(f.succs.begin(), f.succs.end(), to));
+                Block& t = blocks[to];
+                int k = predIndex(to, from);
+                t.preds.erase(t.preds.begin() + k);
+                for (int phi : t.phis) nodes[phi].args.erase(nodes[phi].args.begin() + k);
+            }
+
+            void removeUnreachable() {
+                std::vector<uint8_t> reached(blocks.size(), 0);
+                for (int b : reversePostorder()) reached[b] = 1;
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    if (reached[b] || blocks[b].dead) continue;
+                    std::vector<int> succs = blocks[b].succs;
+                    for (int s : succs) removeEdge((int)b, s);
+                    for (int n : blocks[b].phis) nodes[n].dead = true;
+                    for (int n : blocks[b].body) nodes[n].dead = true;
+                    blocks[b].dead = true;
+                }
+            }
+
+            // Folds n if its operands make the result known
+            bool simplifyNode(int n) {
+                for (int& a : nodes[n].args) a = resolve(a);
+                const Node& x = nodes[n];
+                if (x.effect != PURE || x.ins.op == ADDR_OF) return false;
+
+                bool allConst = true;
+                Slot v[BUILTIN_MAX_ARGS] = {};
+                for (size_t k = 0; k < x.args.size(); k++) {
+                    if (!isConst(x.args[k])) allConst = false;
+                    else v[k] = nodes[x.args[k]].value;
+                }
+                if (allConst) {
+                    Slot out;
+                    bool isDouble;
+                    if (!evaluate(x.ins, v, out, isDouble) || (!isDouble && !fitsImmediate(out.i))) return false;
+                    replace(n, constant(out, isDouble));
+                    stats.constantsFolded++;
+                    return true;
+                }
+
+                // Integer identities; operands are raw slot bits either way
+                if (x.args.size() != 2) return false;
+                int a = x.args[0], b = x.args[1];
+                int result = NONE;
+                switch (x.ins.op) {
+                    case IADD: case BIT_OR: case BIT_XOR:
+                        if (isConstInt(b, 0)) result = a;
+                        else if (isConstInt(a, 0)) result = b;
+                        break;
+                    case ISUB: case SHL: case SHR:
+                        if (isConstInt(b, 0)) result = a;
+                        break;
+                    case IMUL:
+                        if (isConstInt(b, 1)) result = a;
+                        else if (isConstInt(a, 1)) result = b;
+                        else if (isConstInt(a, 0) || isConstInt(b, 0)) result = constInt(0);
+                        break;
+                    case IDIV:
+                        if (isConstInt(b, 1)) result = a;
+                        break;
+                    case BIT_AND:
+                        if (isConstInt(b, -1)) result = a;
+                        else if (isConstInt(a, -1)) result = b;
+                        else if (isConstInt(a, 0) || isConstInt(b, 0)) result = constInt(0);
+                        break;
+                    default:
+                        break;
+                }
+                if (result == NONE) return false;
+                replace(n, result);
+                stats.constantsFolded++;
+                return true;
+            }
+
+            // Constant folding, trivial phis and constant branches, to a fixpoint
+            void simplify() {
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (int b : reversePostorder()) {
+                        for (int phi : blocks[b].phis) {
+                            if (nodes[phi].dead) continue;
+                            if (removeTrivialPhi(phi) != phi) changed = true;
+                        }
+                        for (int n : blocks[b].body) {
+                            if (!nodes[n].dead && simplifyNode(n)) changed = true;
+                        }
+                        Block& blk = blocks[b];
+                        if (blk.value == NONE) continue;
+                        blk.value = resolve(blk.value);
+                        if ((blk.term == JMP_IF || blk.term == JMP_IF_NOT) && isConst(blk.value)) {
+                            bool truth = nodes[blk.value].value.i != 0;
+                            bool taken = truth == (blk.term == JMP_IF);
+                            int drop = blk.succs[taken ? 1 : 0];
+                            blk.term = JMP;
+                            blk.value = NONE;
+                            removeEdge(b, drop);
+                            stats.branchesFolded++;
+                            changed = true;
+                        }
+                    }
+                    removeUnreachable();
+                    compact();
+                }
+                normalize();
+            }
+
+            void normalize() {
+                for (Block& b : blocks) {
+                    if (b.dead) continue;
+                    for (int n : b.phis) {
+                        for (int& a : nodes[n].args) a = resolve(a);
+                    }
+                    for (int n : b.body) {
+                        for (int& a : nodes[n].args) a = resolve(a);
+                    }
+                    if (b.value != NONE) b.value = resolve(b.value);
+                }
+            }
+
+            // Mark and sweep from writes and terminators
+            void eliminateDeadCode() {
+                std::vector<uint8_t> live(nodes.size(), 0);
+                std::vector<int> work;
+                auto mark = [&](int n) {
+                    if (!live[n]) {
+                        live[n] = 1;
+                        work.push_back(n);
+                    }
+                };
+                for (const Block& b : blocks) {
+                    if (b.dead) continue;
+                    for (int n : b.body) {
+                        if (nodes[n].effect == WRITES) mark(n);
+                    }
+                    if (b.value != NONE) mark(b.value);
+                }
+                while (!work.empty()) {
+                    int n = work.back();
+                    work.pop_back();
+                    for (int a : nodes[n].args) mark(a);
+                }
+                for (Block& b : blocks) {
+                    if (b.dead) continue;
+                    for (int n : b.phis) {
+                        if (!live[n]) nodes[n].dead = true;
+                    }
+                    for (int n : b.body) {
+                        if (!live[n]) {
+                            nodes[n].dead = true;
+                            stats.deadRemoved++;
+                        }
+                    }
+                }
+                compact();
+            }
+
+            // ---- Dominators and loops ----
+
+            // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+            std::vector<int> computeDominators() {
+                std::vector<int> rpo = reversePostorder();
+                idom.assign(blocks.size(), NONE);
+                rpoIndex.assign(blocks.size(), -1);
+                for (size_t k = 0; k < rpo.size(); k++) rpoIndex[rpo[k]] = (int)k;
+                idom[0] = 0;
+                auto intersect = [&](int a, int b) {
+                    while (a != b) {
+                        while (rpoIndex[a] > rpoIndex[b]) a = idom[a];
+                        while (rpoIndex[b] > rpoIndex[a]) b = idom[b];
+                    }
+                    return a;
+                };
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (size_t k = 1; k < rpo.size(); k++) {
+                        int b = rpo[k], d = NONE;
+                        for (int p : blocks[b].preds) {
+                            if (idom[p] == NONE) continue;
+                            d = d == NONE ? p : intersect(p, d);
+                        }
+                        if (d != idom[b]) {
+                            idom[b] = d;
+                            changed = true;
+                        }
+                    }
+                }
+                return rpo;
+            }
+
+            bool dominates(int a, int b) const {
+                while (b != a && b != 0) b = idom[b];
+                return b == a;
+            }
+
+            // Natural loops, innermost first
+            std::vector<Loop> findLoops() {
+                std::vector<int> rpo = computeDominators();
+                std::map<int, std::vector<int>> latches;
+                for (int b : rpo) {
+                    for (int s : blocks[b].succs) {
+                        if (dominates(s, b)) latches[s].push_back(b);
+                    }
+                }
+                std::vector<Loop> loops;
+                for (const auto& kv : latches) {
+                    Loop loop;
+                    loop.header = kv.first;
+                    loop.member.assign(blocks.size(), 0);
+                    loop.member[kv.first] = 1;
+                    std::vector<int> work;
+                    for (int l : kv.second) {
+                        if (!loop.member[l]) {
+                            loop.member[l] = 1;
+                            work.push_back(l);
+                        }
+                    }
+                    while (!work.empty()) {
+                        int b = work.back();
+                        work.pop_back();
+                        for (int p : blocks[b].preds) {
+                            if (!loop.member[p]) {
+                                loop.member[p] = 1;
+                                work.push_back(p);
+                            }
+                        }
+                    }
+                    for (int b : rpo) {
+                        if (loop.member[b]) loop.blocks.push_back(b);
+                    }
+                    loops.push_back(std::move(loop));
+                }
+                std::stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+                    return a.blocks.size() < b.blocks.size();
+                });
+                return loops;
+            }
+
+            // The single block entering the loop from outside, if it only
+            // leads to the header
+            int preheader(const Loop& loop) const {
+                int found = NONE;
+                for (int p : blocks[loop.header].preds) {
+                    if (loop.contains(p)) continue;
+                    if (found != NONE) return NONE;
+                    found = p;
+                }
+                return found != NONE && blocks[found].succs.size() == 1 ? found : NONE;
+            }
+
+            int newBlock(int start) {
+                Block b;
+                b.start = start;
+                b.order = ++layoutOrder;
+                blocks.push_back(b);
+                return (int)blocks.size() - 1;
+            }
+
+            // Routes the edges entering the loop from outside through a new
+            // block in front of the header
+            void insertPreheader(const Loop& loop) {
+                int h = loop.header;
+                int pre = newBlock(blocks[h].start);
+                blocks[pre].order = -blocks[pre].order;   // Laid out just before the header
+                blocks[pre].succs.push_back(h);
+
+                std::vector<size_t> inside, outside;
+                for (size_t k = 0; k < blocks[h].preds.size(); k++) {
+                    (loop.contains(blocks[h].preds[k]) ? inside : outside).push_back(k);
+                }
+                for (size_t k : outside) {
+                    int p = blocks[h].preds[k];
+                    blocks[pre].preds.push_back(p);
+                    for (int& s : blocks[p].succs) {
+                        if (s == h) s = pre;
+                    }
+                }
+                for (int phi : blocks[h].phis) {
+                    std::vector<int> entering;
+                    for (size_t k : outside) entering.push_back(nodes[phi].args[k]);
+                    int v = entering[0];
+                    if (std::any_of(entering.begin(), entering.end(), [&](int a) { return a != v; })) {
+                        v = newPhi(pre);
+                        nodes[v].args = entering;
+                    }
+                    std::vector<int> args;
+                    for (size_t k : inside) args.push_back(nodes[phi].args[k]);
+                    args.push_back(v);
+                    nodes[phi].args = args;
+                }
+                std::vector<int> preds;
+                for (size_t k : inside) preds.push_back(blocks[h].preds[k]);
+                preds.push_back(pre);
+                blocks[h].preds = preds;
+            }
+
+            std::vector<Loop> loopsWithPreheaders() {
+                std::vector<Loop> loops = findLoops();
+                bool added = false;
+                for (const Loop& loop : loops) {
+                    if (preheader(loop) == NONE) {
+                        insertPreheader(loop);
+                        added = true;
+                    }
+                }
+                return added ? findLoops() : loops;
+            }
+
+            // ---- Loop optimizations ----
+
+            bool invariantIn(const Loop& loop, int n) const {
+                const Node& x = nodes[n];
+                return x.kind == N_CONST || x.kind == N_ENTRY || !loop.contains(x.block);
+            }
+
+            void hoistInvariants() {
+                for (const Loop& loop : loopsWithPreheaders()) {
+                    int pre = preheader(loop);
+                    bool moved = true;
+                    while (moved) {
+                        moved = false;
+                        for (int b : loop.blocks) {
+                            std::vector<int>& body = blocks[b].body;
+                            for (size_t k = 0; k < body.size();) {
+                                int n = body[k];
+                                const Node& x = nodes[n];
+                                bool invariant = x.effect == PURE &&
+                                    std::all_of(x.args.begin(), x.args.end(), [&](int a) { return invariantIn(loop, a); });
+                                if (!invariant) {
+                                    k++;
+                                    continue;
+                                }
+                                body.erase(body.begin() + k);
+                                blocks[pre].body.push_back(n);
+                                nodes[n].block = pre;
+                                stats.invariantsHoisted++;
+                                moved = true;
+                            }
+                        }
+                    }
+                }
+            }
+
+            struct Induction {
+                int init;        // Value entering from the preheader
+                int64_t step;    // Added once per iteration
+                int update;      // The header phi plus step
+            };
+
+            int insertAfter(int anchor, const Instruction& in, std::vector<int> args) {
+                Node n;
+                n.ins = in;
+                n.block = nodes[anchor].block;
+                n.args = std::move(args);
+                int id = addNode(n);
+                std::vector<int>& body = blocks[n.block].body;
+                body.insert(std::find(body.begin(), body.end(), anchor) + 1, id);
+                return id;
+            }
+
+            int appendTo(int b, const Instruction& in, std::vector<int> args) {
+                Node n;
+                n.ins = in;
+                n.block = b;
+                n.args = std::move(args);
+                int id = addNode(n);
+                blocks[b].body.push_back(id);
+                return id;
+            }
+
+            // iv * scale + offset for a basic induction variable iv
+            struct Affine {
+                int iv = NONE;
+                int64_t scale = 1;
+                int64_t offset = 0;
+            };
+
+            bool affine(int n, const std::map<int, Induction>& ivs, Affine& f) const {
+                if (ivs.count(n)) {
+                    f = Affine();
+                    f.iv = n;
+                    return true;
+                }
+                const Node& x = nodes[n];
+                if (x.kind != N_OP || x.args.size() != 2) return false;
+                int a = x.args[0], c = x.args[1];
+                if ((x.ins.op == IADD || x.ins.op == IMUL) && isConst(a)) std::swap(a, c);
+                if (!isConst(c) || !affine(a, ivs, f)) return false;
+                int64_t k = nodes[c].value.i;
+                switch (x.ins.op) {
+                    case IADD: f.offset = wrapAdd(f.offset, k); return true;
+                    case ISUB: f.offset = (int64_t)((uint64_t)f.offset - (uint64_t)k); return true;
+                    case SHL:
+                        k = (int64_t)((uint64_t)1 << (k & 63));
+                        // Fall through
+                    case IMUL:
+                        f.scale = wrapMul(f.scale, k);
+                        f.offset = wrapMul(f.offset, k);
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            // A new header phi starting at `init` and advancing by `step`
+            // right after `after` does
+            int addInduction(const Loop& loop, int pre, int init, int64_t step, int after, std::set<int>& updates) {
+                int h = loop.header;
+                int phi = newPhi(h);
+                int update = insertAfter(after, Instruction(IADD), {phi, constInt(step)});
+                for (int p : blocks[h].preds) nodes[phi].args.push_back(p == pre ? init : update);
+                updates.insert(update);
+                stats.strengthReduced++;
+                return phi;
+            }
+
+            // For each basic induction variable i = phi(init, i + c), address
+            // arithmetic base + i * k + d with a loop-invariant base gets an
+            // induction variable of its own, p = phi(base + init * k + d,
+            // p + c * k), so a[i] in a loop costs one add per iteration
+            // instead of a multiply and an add per access. Products that do
+            // not feed an address are left alone: on the stack VM a value
+            // carried around the loop costs more than the multiply.
+            void reduceStrength() {
+                for (const Loop& loop : loopsWithPreheaders()) {
+                    int pre = preheader(loop), h = loop.header;
+                    std::map<int, Induction> ivs;
+                    std::set<int> updates;
+                    for (int phi : blocks[h].phis) {
+                        int init = NONE, update = NONE;
+                        bool ok = true;
+                        for (size_t k = 0; k < blocks[h].preds.size(); k++) {
+                            int a = nodes[phi].args[k];
+                            if (blocks[h].preds[k] == pre) init = a;
+                            else if (update == NONE || update == a) update = a;
+                            else ok = false;
+                        }
+                        if (!ok || init == NONE || update == NONE || nodes[update].kind != N_OP) continue;
+                        const Node& u = nodes[update];
+                        int64_t step;
+                        if (u.ins.op == IADD && u.args[0] == phi && isConst(u.args[1])) step = nodes[u.args[1]].value.i;
+                        else if (u.ins.op == IADD && u.args[1] == phi && isConst(u.args[0])) step = nodes[u.args[0]].value.i;
+                        else if (u.ins.op == ISUB && u.args[0] == phi && isConst(u.args[1])) step = -(int64_t)(uint64_t)nodes[u.args[1]].value.i;
+                        else continue;
+                        ivs[phi] = {init, step, update};
+                        updates.insert(update);
+                    }
+                    if (ivs.empty()) continue;
+
+                    std::map<std::tuple<int, int64_t, int64_t, int>, int> pointers;
+                    for (int b : loop.blocks) {
+                        std::vector<int> body = blocks[b].body;
+                        for (int n : body) {
+                            if (nodes[n].dead || updates.count(n) || nodes[n].ins.op != IADD) continue;
+                            int base = nodes[n].args[0], index = nodes[n].args[1];
+                            Affine f;
+                            if (!affine(index, ivs, f)) {
+                                std::swap(base, index);
+                                if (!affine(index, ivs, f)) continue;
+                            }
+                            if (isConst(base) || !invariantIn(loop, base)) continue;
+                            const Induction& iv = ivs[f.iv];
+                            int64_t step = wrapMul(iv.step, f.scale);
+                            if (!fitsImmediate(f.scale) || !fitsImmediate(f.offset) || !fitsImmediate(step)) continue;
+
+                            auto key = std::make_tuple(f.iv, f.scale, f.offset, base);
+                            auto it = pointers.find(key);
+                            if (it == pointers.end()) {
+                                int init = iv.init;
+                                if (f.scale != 1) init = appendTo(pre, Instruction(IMUL), {init, constInt(f.scale)});
+                                if (f.offset != 0) init = appendTo(pre, Instruction(IADD), {init, constInt(f.offset)});
+                                init = appendTo(pre, Instruction(IADD), {base, init});
+                                it = pointers.emplace(key, addInduction(loop, pre, init, step, iv.update, updates)).first;
+                            }
+                            replace(n, it->second);
+                        }
+                    }
+                    compact();
+                    normalize();
+                }
+            }
+
+            // Shares PURE values (and reads not separated by a write) with
+            // an identical one in a dominating position. In stack code a
+            // shared value costs a slot store and a load per use, more than
+            // redoing a single op over constants and locals in the same
+            // block, so such copies stay (expressions over them still match).
+            void eliminateCommonSubexpressions() {
+                computeDominators();
+                std::vector<std::vector<int>> children(blocks.size());
+                for (size_t b = 1; b < blocks.size(); b++) {
+                    if (!blocks[b].dead && idom[b] != NONE) children[idom[b]].push_back((int)b);
+                }
+                std::map<std::vector<int64_t>, int> available;
+                std::vector<int> same(nodes.size());
+                for (size_t n = 0; n < nodes.size(); n++) same[n] = (int)n;
+                auto cheap = [&](int n) {
+                    const Node& x = nodes[n];
+                    return x.effect == PURE && std::all_of(x.args.begin(), x.args.end(), [&](int a) { return nodes[a].kind != N_OP; });
+                };
+                std::vector<std::pair<int, size_t>> work{{0, 0}};
+                std::vector<std::vector<std::vector<int64_t>>> added(1);
+                auto enter = [&](int b) {
+                    std::vector<std::vector<int64_t>> keys;
+                    int64_t version = 0;
+                    for (int n : blocks[b].body) {
+                        Node& x = nodes[n];
+                        for (int& a : x.args) a = resolve(a);
+                        if (x.effect == WRITES) {
+                            version++;
+                            continue;
+                        }
+                        std::vector<int64_t> key{x.ins.op};
+                        int64_t bits;
+                        std::memcpy(&bits, &x.ins.immediate, sizeof(bits));
+                        key.push_back(bits);
+                        if (x.effect == READS) {
+                            key.push_back(b);
+                            key.push_back(version);
+                        }
+                        std::vector<int> args = x.args;
+                        for (int& a : args) a = same[a];
+                        if (isCommutative(x.ins.op) && args[0] > args[1]) std::swap(args[0], args[1]);
+                        key.insert(key.end(), args.begin(), args.end());
+                        auto it = available.find(key);
+                        if (it != available.end() && stackTarget && cheap(n) && nodes[it->second].block == b) {
+                            same[n] = it->second;   // Still counts as equal for its users
+                        } else if (it != available.end()) {
+                            replace(n, it->second);
+                            stats.subexpressionsReused++;
+                        } else {
+                            available.emplace(key, n);
+                            keys.push_back(key);
+                        }
+                    }
+                    return keys;
+                };
+                added[0] = enter(0);
+                while (!work.empty()) {
+                    auto& top = work.back();
+                    if (top.second < children[top.first].size()) {
+                        int c = children[top.first][top.second++];
+                        work.push_back({c, 0});
+                        added.push_back(enter(c));
+                    } else {
+                        for (const auto& key : added.back()) available.erase(key);
+                        added.pop_back();
+                        work.pop_back();
+                    }
+                }
+                compact();
+                normalize();
+            }
+
+            // ---- Back to stack code ----
+
+            void splitCriticalEdges() {
+                size_t count = blocks.size();
+                for (size_t b = 0; b < count; b++) {
+                    if (blocks[b].dead || blocks[b].succs.size() != 2) continue;
+                    for (size_t k = 0; k < 2; k++) {
+                        int s = blocks[b].succs[k];
+                        if (blocks[s].phis.empty()) continue;
+                        int mid = newBlock(blocks[b].start);
+                        blocks[mid].preds.push_back((int)b);
+                        blocks[mid].succs.push_back(s);
+                        blocks[b].succs[k] = mid;
+                        for (int& p : blocks[s].preds) {
+                            if (p == (int)b) p = mid;
+                        }
+                    }
+                }
+            }
+
+            std::vector<int> uses;
+            std::vector<uint8_t> inlined;
+            std::vector<int> slotOf;         // Node -> frame offset, or NONE
+            std::vector<uint8_t> carried;    // Phis passed on the eval stack
+            std::vector<uint8_t> duplicated; // Stores that DUP their address for a load
+            std::vector<int> dupUser;        // Node whose first operand is that DUP
+
+            // Expression trees: a value used once, later in its own block,
+            // is computed right where it is used instead of going through a
+            // frame slot, as long as that keeps memory effects in order
+            void buildTrees(int b) {
+                const std::vector<int>& body = blocks[b].body;
+                std::unordered_map<int, int> pos;
+                for (size_t k = 0; k < body.size(); k++) pos[body[k]] = (int)k;
+                std::vector<uint8_t> demoted(nodes.size(), 0), inTree(nodes.size(), 0);
+
+                auto candidate = [&](int a) {
+                    const Node& x = nodes[a];
+                    return x.kind == N_OP && x.block == b && uses[a] == 1 && !demoted[a];
+                };
+                for (int r = (int)body.size(); r >= 0; r--) {
+                    int root = r < (int)body.size() ? body[r] : NONE;
+                    if (root != NONE && inlined[root]) continue;
+                    std::vector<int> rootArgs;
+                    if (root != NONE) {
+                        rootArgs = nodes[root].args;
+                    } else if (blocks[b].value != NONE) {
+                        rootArgs.push_back(blocks[b].value);
+                    } else if (blocks[b].term == JMP) {
+                        // Operands of the phi copies are computed within the copy
+                        int s = blocks[b].succs[0];
+                        for (int phi : blocks[s].phis) rootArgs.push_back(nodes[phi].args[predIndex(s, b)]);
+                    }
+
+                    for (;;) {
+                        std::vector<int> tree;
+                        // Collect in evaluation order (operands left to right)
+                        std::function<void(int)> collect = [&](int a) {
+                            if (!candidate(a)) return;
+                            for (int x : nodes[a].args) collect(x);
+                            tree.push_back(a);
+                        };
+                        for (int a : rootArgs) collect(a);
+
+                        std::vector<int> memory;
+                        for (int t : tree) {
+                            if (nodes[t].effect != PURE) memory.push_back(t);
+                        }
+                        bool ordered = true;
+                        for (size_t k = 1; k < memory.size(); k++) {
+                            if (pos[memory[k]] <= pos[memory[k - 1]]) ordered = false;
+                        }
+                        if (ordered && !memory.empty()) {
+                            for (int t : tree) inTree[t] = 1;
+                            for (int k = pos[memory[0]] + 1; k < r && ordered; k++) {
+                                if (!inTree[body[k]] && nodes[body[k]].effect != PURE) ordered = false;
+                            }
+                            for (int t : tree) inTree[t] = 0;
+                        }
+                        if (ordered) {
+                            for (int t : tree) inlined[t] = 1;
+                            break;
+                        }
+                        int first = *std::min_element(memory.begin(), memory.end(), [&](int x, int y) { return pos[x] < pos[y]; });
+                        demoted[first] = 1;
+                    }
+                }
+
+                // Read-modify-write (a[i] += x): an address used only by the
+                // store and by the first load its value evaluates is computed
+                // once and DUPed, as the compiler does, rather than kept
+                for (int n : body) {
+                    const Node& st = nodes[n];
+                    if (inlined[n] || (st.ins.op != STORE && st.ins.op != STORE_BYTE)) continue;
+                    int addr = st.args[0];
+                    if (addr == st.args[1] || uses[addr] != 2 || inlined[addr] || !pureTree(addr)) continue;
+                    if (nodes[addr].kind != N_OP || nodes[addr].block != b) continue;
+                    int v = st.args[1];
+                    while (nodes[v].kind == N_OP && inlined[v] && !nodes[v].args.empty() && nodes[v].args[0] != addr) v = nodes[v].args[0];
+                    if (nodes[v].kind != N_OP || !inlined[v] || nodes[v].args.empty() || nodes[v].args[0] != addr) continue;
+                    inlined[addr] = 1;
+                    duplicated[n] = 1;
+                    dupUser[v] = n;
+                }
+            }
+
+            // Whether a value's code, inlined trees included, has no effects
+            bool pureTree(int v) const {
+                if (nodes[v].effect != PURE) return false;
+                for (int a : nodes[v].args) {
+                    if (nodes[a].kind == N_OP && inlined[a] && !pureTree(a)) return false;
+                }
+                return true;
+            }
+
+            // A join's only phi, used once as the first value the join
+            // pushes, stays on the eval stack the way the compiler had it:
+            // each predecessor pushes its operand just before the jump
+            void findCarried(const std::vector<int>& layout) {
+                carried.assign(nodes.size(), 0);
+                for (int b : layout) {
+                    const Block& blk = blocks[b];
+                    if (blk.phis.size() != 1 || uses[blk.phis[0]] != 1) continue;
+                    int first = NONE;
+                    for (int n : blk.body) {
+                        if (!inlined[n]) {
+                            first = n;
+                            break;
+                        }
+                    }
+                    int v = blk.value;
+                    if (first != NONE) {
+                        // A value kept in a slot pushes the slot address first
+                        if (nodes[first].hasValue && uses[first] > 0) continue;
+                        v = nodes[first].args.empty() ? NONE : nodes[first].args[0];
+                    }
+                    while (v != NONE && nodes[v].kind == N_OP && inlined[v] && !nodes[v].args.empty()) v = nodes[v].args[0];
+                    if (v == blk.phis[0]) carried[v] = 1;
+                }
+            }
+
+            void pushValue(std::vector<Instruction>& code, int v) {
+                const Node& x = nodes[v];
+                if (carried[v]) return;
+                if (x.kind == N_CONST) {
+                    if (x.isDouble) code.emplace_back(PUSH_CONST, x.value.d);
+                    else code.emplace_back(PUSH_IMM, (double)x.value.i);
+                } else if (x.kind == N_ENTRY) {
+                    // Promoted locals are never written back, so the frame
+                    // still holds the entry value
+                    code.emplace_back(ADDR_OF, x.local);
+                    code.emplace_back(LOAD);
+                } else if (inlined[v]) {
+                    emitNode(code, v);
+                } else {
+                    code.emplace_back(ADDR_OF, slotOf[v]);
+                    code.emplace_back(LOAD);
+                }
+            }
+
+            // Slot traffic and copies emitted since `from` belong to `line`
+            static void attribute(std::vector<Instruction>& code, size_t from, int line) {
+                for (size_t k = from; k < code.size(); k++) {
+                    if (!code[k].line) code[k].line = line;
+                }
+            }
+
+            void emitNode(std::vector<Instruction>& code, int n) {
+                const std::vector<int>& args = nodes[n].args;
+                for (size_t k = 0; k < args.size(); k++) {
+                    if (k == 0 && dupUser[n] != NONE) continue;  // Already on the stack
+                    pushValue(code, args[k]);
+                    if (k == 0 && duplicated[n]) code.emplace_back(DUP);
+                }
+                Instruction in = nodes[n].ins;
+                if (in.op == STORE_BYTE) in.immediate = uses[n] > 0 ? 1 : 0;
+                code.push_back(in);
+            }
+
+            // Frame slots a value's code reads; whether it touches memory
+            void slotReads(int v, std::set<int>& slots, bool& memory) const {
+                const Node& x = nodes[v];
+                if (x.kind == N_OP && inlined[v]) {
+                    if (x.effect != PURE) memory = true;
+                    for (int a : x.args) slotReads(a, slots, memory);
+                } else if (slotOf[v] != NONE) {
+                    slots.insert(slotOf[v]);
+                }
+            }
+
+            // Phi copies {phi, operand} on one edge, with parallel semantics.
+            // Copies run one at a time while some copy's slot is not read
+            // by the others (operands that touch memory keep their order);
+            // whatever is left is pushed in full before anything is stored.
+            void emitCopies(std::vector<Instruction>& code, std::vector<std::pair<int, int>> moves) {
+                if (moves.size() == 1 && carried[moves[0].first]) {
+                    pushValue(code, moves[0].second);
+                    return;
+                }
+                std::vector<std::set<int>> reads(moves.size());
+                std::vector<uint8_t> memory(moves.size(), 0);
+                for (size_t m = 0; m < moves.size(); m++) {
+                    bool touches = false;
+                    slotReads(moves[m].second, reads[m], touches);
+                    memory[m] = touches;
+                }
+                std::vector<size_t> pending;
+                for (size_t m = 0; m < moves.size(); m++) pending.push_back(m);
+                while (!pending.empty()) {
+                    size_t pick = pending.size();
+                    bool memoryBefore = false;
+                    for (size_t i = 0; i < pending.size() && pick == pending.size(); i++) {
+                        size_t m = pending[i];
+                        bool free = !(memory[m] && memoryBefore);
+                        for (size_t j = 0; j < pending.size() && free; j++) {
+                            if (j != i && reads[pending[j]].count(slotOf[moves[m].first])) free = false;
+                        }
+                        if (free) pick = i;
+                        memoryBefore |= memory[m];
+                    }
+                    if (pick == pending.size()) break;
+                    const auto& mv = moves[pending[pick]];
+                    code.emplace_back(ADDR_OF, slotOf[mv.first]);
+                    pushValue(code, mv.second);
+                    code.emplace_back(STORE, 0);
+                    pending.erase(pending.begin() + pick);
+                }
+                for (size_t m : pending) {
+                    code.emplace_back(ADDR_OF, slotOf[moves[m].first]);
+                    pushValue(code, moves[m].second);
+                }
+                for (size_t m = 0; m < pending.size(); m++) code.emplace_back(STORE, 0);
+            }
+
+            // Live ranges of values kept in frame slots, then a greedy
+            // colouring; a phi shares its operands' slot where they do not
+            // interfere, which turns the copy into nothing. Promoted
+            // parameters start out in their own slots, which are reused once
+            // the parameter is dead. Returns the number of slots added after
+            // the frame.
+            int assignSlots(const std::vector<int>& layout) {
+                std::vector<int> index(nodes.size(), NONE), values;
+                std::vector<int> slots;                 // Colour -> frame offset, parameters first
+                std::vector<int> fixed;                 // Value -> colour it must have, or NONE
+                for (int k = 0; k < params; k++) {
+                    if (escaped.count(8 * k)) continue;
+                    auto it = entryValues.find(8 * k);
+                    if (it != entryValues.end() && uses[it->second] > 0) {
+                        index[it->second] = (int)values.size();
+                        values.push_back(it->second);
+                        fixed.push_back((int)slots.size());
+                    }
+                    slots.push_back(8 * k);
+                }
+                size_t entries = values.size();
+                for (int b : layout) {
+                    for (int phi : blocks[b].phis) {
+                        if (carried[phi]) continue;
+                        index[phi] = (int)values.size();
+                        values.push_back(phi);
+                    }
+                    for (int n : blocks[b].body) {
+                        if (!inlined[n] && nodes[n].hasValue && uses[n] > 0) {
+                            index[n] = (int)values.size();
+                            values.push_back(n);
+                        }
+                    }
+                }
+                size_t count = values.size();
+                if (count == 0) return 0;
+                fixed.resize(count, NONE);
+
+                // Uses and defs of each step of a block, in order
+                struct Step { std::vector<int> uses, defs; };
+                std::function<void(int, std::vector<int>&)> reads = [&](int v, std::vector<int>& out) {
+                    if (nodes[v].kind == N_OP && inlined[v]) {
+                        for (int a : nodes[v].args) reads(a, out);
+                    } else if (index[v] != NONE) {
+                        out.push_back(index[v]);
+                    }
+                };
+                std::vector<std::vector<Step>> steps(blocks.size());
+                Step start;
+                for (size_t v = 0; v < entries; v++) start.defs.push_back((int)v);
+                steps[0].push_back(start);
+                for (int b : layout) {
+                    std::vector<Step>& list = steps[b];
+                    for (int n : blocks[b].body) {
+                        if (inlined[n]) continue;
+                        Step s;
+                        for (int a : nodes[n].args) reads(a, s.uses);
+                        if (index[n] != NONE) s.defs.push_back(index[n]);
+                        list.push_back(s);
+                    }
+                    Step last;
+                    if (blocks[b].succs.size() == 1) {
+                        int s = blocks[b].succs[0];
+                        int k = predIndex(s, b);
+                        for (int phi : blocks[s].phis) {
+                            reads(nodes[phi].args[k], last.uses);
+                            if (!carried[phi]) last.defs.push_back(index[phi]);
+                        }
+                    }
+                    if (blocks[b].value != NONE) reads(blocks[b].value, last.uses);
+                    list.push_back(last);
+                }
+
+                std::vector<BitSet> liveIn(blocks.size(), BitSet(count)), liveOut(blocks.size(), BitSet(count));
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (auto it = layout.rbegin(); it != layout.rend(); ++it) {
+                        int b = *it;
+                        for (int s : blocks[b].succs) liveOut[b].merge(liveIn[s]);
+                        BitSet live = liveOut[b];
+                        for (auto st = steps[b].rbegin(); st != steps[b].rend(); ++st) {
+                            for (int d : st->defs) live.reset(d);
+                            for (int u : st->uses) live.set(u);
+                        }
+                        if (liveIn[b].merge(live)) changed = true;
+                    }
+                }
+
+                std::vector<std::vector<int>> adjacent(count);
+                auto interfere = [&](int a, int b) {
+                    if (a == b) return;
+                    adjacent[a].push_back(b);
+                    adjacent[b].push_back(a);
+                };
+                for (int b : layout) {
+                    BitSet live = liveOut[b];
+                    for (auto st = steps[b].rbegin(); st != steps[b].rend(); ++st) {
+                        for (size_t i = 0; i < st->defs.size(); i++) {
+                            int d = st->defs[i];
+                            live.forEach([&](int l) { interfere(d, l); });
+                            for (size_t j = 0; j < i; j++) interfere(d, st->defs[j]);
+                        }
+                        for (int d : st->defs) live.reset(d);
+                        for (int u : st->uses) live.set(u);
+                    }
+                }
+
+                std::vector<int> leader(count);
+                std::vector<std::vector<int>> members(count);
+                for (size_t v = 0; v < count; v++) {
+                    leader[v] = (int)v;
+                    members[v].push_back((int)v);
+                }
+                auto conflict = [&](int a, int b) {
+                    if (fixed[a] != NONE && fixed[b] != NONE) return true;
+                    for (int m : members[a]) {
+                        for (int x : adjacent[m]) {
+                            if (leader[x] == b) return true;
+                        }
+                    }
+                    return false;
+                };
+                for (int b : layout) {
+                    for (int phi : blocks[b].phis) {
+                        for (int a : nodes[phi].args) {
+                            if (index[phi] == NONE || index[a] == NONE) continue;
+                            int x = leader[index[phi]], y = leader[index[a]];
+                            if (x == y || conflict(x, y)) continue;
+                            if (fixed[y] != NONE) std::swap(x, y);
+                            for (int m : members[y]) {
+                                leader[m] = x;
+                                members[x].push_back(m);
+                            }
+                            members[y].clear();
+                        }
+                    }
+                }
+
+                std::vector<int> color(count, NONE);
+                int colors = (int)slots.size();
+                for (size_t v = 0; v < entries; v++) color[leader[v]] = fixed[v];
+                for (size_t v = 0; v < count; v++) {
+                    if ((int)v != leader[v] || color[v] != NONE) continue;
+                    std::vector<uint8_t> taken(colors + 1, 0);
+                    for (int m : members[v]) {
+                        for (int x : adjacent[m]) {
+                            int c = color[leader[x]];
+                            if (c != NONE) taken[c] = 1;
+                        }
+                    }
+                    int c = 0;
+                    while (taken[c]) c++;
+                    color[v] = c;
+                    colors = std::max(colors, c + 1);
+                }
+                int added = colors - (int)slots.size();
+                for (int k = 0; k < added; k++) slots.push_back(frameSize + 8 * k);
+                for (size_t v = 0; v < count; v++) slotOf[values[v]] = slots[color[leader[v]]];
+                return added;
+            }
+
+            void emit(std::vector<Instruction>& code) {
+                splitCriticalEdges();
+                std::vector<int> layout;
+                for (int b : reversePostorder()) layout.push_back(b);
+                std::sort(layout.begin() + 1, layout.end(), [&](int a, int b) {
+                    if (blocks[a].start != blocks[b].start) return blocks[a].start < blocks[b].start;
+                    return blocks[a].order < blocks[b].order;
+                });
+
+                uses.assign(nodes.size(), 0);
+                for (int b : layout) {
+                    for (int phi : blocks[b].phis) {
+                        for (int a : nodes[phi].args) uses[a]++;
+                    }
+                    for (int n : blocks[b].body) {
+                        for (int a : nodes[n].args) uses[a]++;
+                    }
+                    if (blocks[b].value != NONE) uses[blocks[b].value]++;
+                }
+                inlined.assign(nodes.size(), 0);
+                duplicated.assign(nodes.size(), 0);
+                dupUser.assign(nodes.size(), NONE);
+                for (int b : layout) {
+                    // Local addresses are cheaper to recompute than to keep
+                    for (int n : blocks[b].body) {
+                        if (nodes[n].ins.op == ADDR_OF) inlined[n] = 1;
+                    }
+                }
+                for (int b : layout) buildTrees(b);
+                findCarried(layout);
+                slotOf.assign(nodes.size(), NONE);
+                int slots = assignSlots(layout);
+
+                // Phi copies per block; a block that comes down to a bare
+                // jump is left out and jumps go straight on to its target
+                std::vector<std::vector<std::pair<int, int>>> moves(blocks.size());
+                std::vector<uint8_t> empty(blocks.size(), 0);
+                for (size_t li = 0; li < layout.size(); li++) {
+                    int b = layout[li];
+                    if (blocks[b].term != JMP) continue;
+                    int s = blocks[b].succs[0];
+                    int k = predIndex(s, b);
+                    for (int phi : blocks[s].phis) {
+                        int a = nodes[phi].args[k];
+                        if (carried[phi] || slotOf[a] != slotOf[phi] || inlined[a]) moves[b].push_back({phi, a});
+                    }
+                    bool bare = li > 0 && moves[b].empty();
+                    for (int n : blocks[b].body) {
+                        if (!inlined[n]) bare = false;
+                    }
+                    empty[b] = bare;
+                }
+                auto resolve = [&](int b) {
+                    for (size_t i = 0; empty[b] && i < blocks.size(); i++) b = blocks[b].succs[0];
+                    return b;
+                };
+                for (int b : layout) {
+                    if (empty[b] && empty[resolve(b)]) empty[b] = 0;  // A loop of empty blocks
+                }
+                std::vector<int> order;
+                for (int b : layout) {
+                    if (!empty[b]) order.push_back(b);
+                }
+
+                code.emplace_back(ENTER, frameSize + 8 * slots);
+                std::vector<size_t> blockPos(blocks.size());
+                std::vector<std::pair<size_t, int>> fixups;
+                for (size_t li = 0; li < order.size(); li++) {
+                    int b = order[li];
+                    int next = li + 1 < order.size() ? order[li + 1] : NONE;
+                    const Block& blk = blocks[b];
+                    blockPos[b] = code.size();
+                    for (int n : blk.body) {
+                        if (inlined[n]) continue;
+                        size_t from = code.size();
+                        if (slotOf[n] != NONE) {
+                            code.emplace_back(ADDR_OF, slotOf[n]);
+                            emitNode(code, n);
+                            code.emplace_back(STORE, 0);
+                        } else {
+                            emitNode(code, n);
+                            if (nodes[n].hasValue && nodes[n].ins.op != STORE_BYTE) code.emplace_back(POP);
+                        }
+                        attribute(code, from, nodes[n].ins.line);
+                    }
+                    size_t termFrom = code.size();
+                    switch (blk.term) {
+                        case JMP: {
+                            int s = resolve(blk.succs[0]);
+                            emitCopies(code, moves[b]);
+                            if (s != next) {
+                                fixups.push_back({code.size(), s});
+                                code.emplace_back(JMP);
+                            }
+                            break;
+                        }
+                        case JMP_IF: case JMP_IF_NOT: {
+                            pushValue(code, blk.value);
+                            int taken = resolve(blk.succs[0]), fall = resolve(blk.succs[1]);
+                            OpCode op = blk.term;
+                            if (taken == fall) {
+                                code.emplace_back(POP);
+                            } else {
+                                if (taken == next) {
+                                    std::swap(taken, fall);
+                                    op = op == JMP_IF ? JMP_IF_NOT : JMP_IF;
+                                }
+                                fixups.push_back({code.size(), taken});
+                                code.emplace_back(op);
+                            }
+                            if (fall != next) {
+                                fixups.push_back({code.size(), fall});
+                                code.emplace_back(JMP);
+                            }
+                            break;
+                        }
+                        case RET:
+                            pushValue(code, blk.value);
+                            code.emplace_back(LEAVE);
+                            code.emplace_back(RET);
+                            break;
+                        default:
+                            code.emplace_back(HALT);
+                            break;
+                    }
+                    // Blocks made by the optimizer have no instructions of their own
+                    if (blk.last >= begin && blk.last < end) attribute(code, termFrom, ir[blk.last].line);
+                }
+                for (const auto& f : fixups) code[f.first].immediate = (double)blockPos[f.second];
+            }
+
+        public:
+            SsaFunction(const std::vector<Instruction>& code, size_t b, size_t e, int optLevel, ExecMode target, int argc,
+                        OptimizerStats& s)
+                : ir(code), begin(b), end(e), level(optLevel), stackTarget(target == EXEC_STACK), params(argc), stats(s) {}
+
+            // Fills `code` (jump targets relative to its start); false if
+            // the function has to stay as it is
+            bool run(std::vector<Instruction>& code) {
+                if (ir[begin].op != ENTER) return false;
+                frameSize = (int)ir[begin].immediate;
+                try {
+                    discoverBlocks();
+                    for (;;) {
+                        try {
+                            translate();
+                            break;
+                        } catch (const Escape& e) {
+                            escaped.insert(e.offset);
+                        }
+                    }
+                } catch (const Unsupported&) {
+                    return false;
+                }
+                compact();
+                stats.localsPromoted += promoted.size();
+
+                simplify();
+                eliminateCommonSubexpressions();
+                eliminateDeadCode();
+                if (level >= 2) {
+                    hoistInvariants();
+                    reduceStrength();
+                    simplify();
+                    eliminateCommonSubexpressions();
+                    eliminateDeadCode();
+                }
+                emit(code);
+                return true;
+            }
+        };
+
+    }
+
+    void optimizeSSA(Program& prog, int level, ExecMode target) {
+        std::vector<Instruction>& ir = prog.instructions;
+        OptimizerStats& stats = prog.optimizer;
+        stats = OptimizerStats();
+        stats.instructionsBefore = ir.size();
+        if (level <= 0) {
+            stats.instructionsAfter = ir.size();
+            return;
+        }
+
+        std::vector<size_t> starts;
+        for (const auto& fn : prog.functions) starts.push_back(fn.second);
+        std::sort(starts.begin(), starts.end());
+        starts.push_back(ir.size());
+        // Parameter counts, from the calls (the front-end checks they agree)
+        std::map<size_t, int> arity;
+        for (const Instruction& in : ir) {
+            auto fn = in.op == CALL ? prog.functions.find(in.strValue) : prog.functions.end();
+            if (fn != prog.functions.end()) arity[fn->second] = (int)in.immediate;
+        }
+
+        std::vector<Instruction> out;
+        out.reserve(ir.size());
+        std::vector<size_t> newIndex(ir.size() + 1, 0);
+        std::vector<size_t> copiedJumps;
+        auto copy = [&](size_t from, size_t to) {
+            for (size_t i = from; i < to; i++) {
+                newIndex[i] = out.size();
+                if (isJump(ir[i].op)) copiedJumps.push_back(out.size());
+                out.push_back(ir[i]);
+            }
+        };
+        copy(0, starts[0]);   // Startup code
+        for (size_t f = 0; f + 1 < starts.size(); f++) {
+            size_t begin = starts[f], end = starts[f + 1];
+            std::vector<Instruction> code;
+            if (begin < end && SsaFunction(ir, begin, end, level, target, arity[begin], stats).run(code)) {
+                // Whatever is still unattributed (the ENTER, blocks the
+                // optimizer made) takes the line before it
+                int line = ir[begin].line;
+                for (Instruction& in : code) {
+                    if (in.line) line = in.line;
+                    else in.line = line;
+                }
+                size_t base = out.size();
+                newIndex[begin] = base;
+                for (Instruction& in : code) {
+                    if (isJump(in.op)) in.immediate += (double)base;
+                    out.push_back(std::move(in));
+                }
+                stats.functionsOptimized++;
+            } else {
+                copy(begin, end);
+                stats.functionsSkipped++;
+            }
+        }
+        newIndex[ir.size()] = out.size();
+
+        for (size_t at : copiedJumps) out[at].immediate = (double)newIndex[(size_t)out[at].immediate];
+        for (auto& fn : prog.functions) fn.second = newIndex[fn.second];
+        prog.entryPoint = (uint32_t)newIndex[prog.entryPoint];
+
+        ir.swap(out);
+        stats.instructionsAfter = ir.size();
+    }
+
+}
@@ -0,0 +1,23 @@
+// OmniVM SSA middle-end over Program::instructions
+#pragma once
+#include "common.h"
+
+namespace OmniNative {
+
+    // Rebuilds each function's stack code in SSA form (scalar locals whose
+    // address never escapes and values left on the stack across jumps
+    // become SSA values), optimizes it and translates it back to stack code
+    // that keeps long-lived values in extra frame slots.
+    //   level 1: constant propagation and folding, branch folding, common
+    //            subexpression elimination, dead code elimination
+    //   level 2: level 1 plus loop-invariant code motion and strength
+    //            reduction of induction address arithmetic (a[i] becomes
+    //            a pointer bumped once per iteration)
+    // Functions using anything the IR does not model are left untouched.
+    // `target` is the mode the program will run in; for EXEC_STACK values
+    // cheaper to recompute than to keep in a slot are not shared.
+    // Counts are recorded in Program::optimizer. Runs before the peephole
+    // pass.
+    void optimizeSSA(Program& prog, int level, ExecMode target);
+
+}
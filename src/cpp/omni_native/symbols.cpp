@@ -0,0 +1,68 @@
+// OmniNative symbols
+#include "symbols.h"
+#include "hash.h"
+#include <algorithm>
+#include <cstring>
+
+namespace OmniNative {
+
+    namespace {
+
+        const size_t ARENA_CHUNK = 64 * 1024;
+
+        uint32_t hashName(std::string_view name) {
+            return (uint32_t)fnv1a(name.data(), name.size());
+        }
+
+    }
+
+    Interner::Interner(const char* const* reserved) {
+        rehash(256);
+        for (; reserved && *reserved; reserved++) intern(*reserved);
+    }
+
+    // Slot holding `name`, or the empty slot where it belongs
+    size_t Interner::probe(std::string_view name, uint32_t hash) const {
+        size_t mask = table.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            SymbolId id = table[i];
+            if (id == NO_SYMBOL || (hashes[id] == hash && names[id] == name)) return i;
+        }
+    }
+
+    void Interner::rehash(size_t capacity) {
+        table.assign(capacity, NO_SYMBOL);
+        for (SymbolId id = 0; id < names.size(); id++) {
+            size_t i = hashes[id] & (capacity - 1);
+            while (table[i] != NO_SYMBOL) i = (i + 1) & (capacity - 1);
+            table[i] = id;
+        }
+    }
+
+    SymbolId Interner::intern(std::string_view name) {
+        uint32_t hash = hashName(name);
+        size_t i = probe(name, hash);
+        if (table[i] != NO_SYMBOL) return table[i];
+
+        if (chunkUsed + name.size() > chunkSize) {
+            chunkSize = std::max(ARENA_CHUNK, name.size());
+            arena.emplace_back(new char[chunkSize]);
+            chunkUsed = 0;
+        }
+        char* copy = arena.back().get() + chunkUsed;
+        if (!name.empty()) std::memcpy(copy, name.data(), name.size());
+        chunkUsed += name.size();
+
+        SymbolId id = (SymbolId)names.size();
+        names.push_back(std::string_view(copy, name.size()));
+        hashes.push_back(hash);
+        table[i] = id;
+        if (names.size() * 2 > table.size()) rehash(table.size() * 2);
+        return id;
+    }
+
+    SymbolId Interner::find(std::string_view name) const {
+        return table[probe(name, hashName(name))];
+    }
+
+}
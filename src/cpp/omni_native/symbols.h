@@ -0,0 +1,94 @@
+// OmniNative symbols - interned names and hash tables keyed by them
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace OmniNative {
+
+    using SymbolId = uint32_t;
+    const SymbolId NO_SYMBOL = UINT32_MAX;
+
+    // Gives each distinct name a dense id: 0, 1, 2, ... in order of first
+    // sight. Names are copied once into an arena and never move, so the
+    // views name() returns live as long as the interner.
+    class Interner {
+    public:
+        // The null-terminated `reserved` names get the first ids, in order
+        explicit Interner(const char* const* reserved = nullptr);
+
+        SymbolId intern(std::string_view name);
+        // NO_SYMBOL if `name` was never interned
+        SymbolId find(std::string_view name) const;
+        std::string_view name(SymbolId id) const { return names[id]; }
+        size_t size() const { return names.size(); }
+
+    private:
+        size_t probe(std::string_view name, uint32_t hash) const;
+        void rehash(size_t capacity);
+
+        std::vector<std::string_view> names;
+        std::vector<uint32_t> hashes;        // Per id
+        std::vector<SymbolId> table;         // Open addressing; NO_SYMBOL = empty
+        std::vector<std::unique_ptr<char[]>> arena;
+        size_t chunkUsed = 0;
+        size_t chunkSize = 0;
+    };
+
+    // Open-addressing map from SymbolId to V with linear probing. Keys are
+    // only ever added: a scope is dropped as a whole.
+    template <typename V>
+    class FlatMap {
+    public:
+        V* find(SymbolId key) {
+            if (entries.empty()) return nullptr;
+            for (size_t i = slot(key);; i = (i + 1) & (entries.size() - 1)) {
+                if (entries[i].key == key) return &entries[i].value;
+                if (entries[i].key == NO_SYMBOL) return nullptr;
+            }
+        }
+        const V* find(SymbolId key) const { return const_cast<FlatMap*>(this)->find(key); }
+
+        // False, leaving the map as it was, when `key` is already there
+        bool insert(SymbolId key, const V& value) {
+            if ((count + 1) * 4 > entries.size() * 3) grow();
+            size_t i = slot(key);
+            for (; entries[i].key != NO_SYMBOL; i = (i + 1) & (entries.size() - 1)) {
+                if (entries[i].key == key) return false;
+            }
+            entries[i] = {key, value};
+            count++;
+            return true;
+        }
+
+        size_t size() const { return count; }
+
+    private:
+        struct Entry {
+            SymbolId key = NO_SYMBOL;
+            V value = V();
+        };
+
+        // Fibonacci hashing spreads the dense ids over the table
+        size_t slot(SymbolId key) const {
+            return (size_t)((key * 2654435769u) >> 8) & (entries.size() - 1);
+        }
+
+        void grow() {
+            std::vector<Entry> old;
+            old.swap(entries);
+            entries.resize(old.empty() ? 8 : old.size() * 2);
+            count = 0;
+            for (const Entry& e : old) {
+                if (e.key != NO_SYMBOL) insert(e.key, e.value);
+            }
+        }
+
+        std::vector<Entry> entries;
+        size_t count = 0;
+    };
+
+}
@@ -1,5 +1,7 @@
 // OmniNative Virtual Machine - Real C Execution
-#include "common.h"
+#include "vm.h"
+#include "bytecode.h"
+#include "builtins.h"
 #include <iostream>
 #include <vector>
 #include <stack>
@@ -11,386 +13,1176 @@
 
 namespace OmniNative {
 
-    class VirtualMachine {
-    private:
-        // Stack-based VM with memory
-        std::vector<uint8_t> memory;
-        std::stack<double> evalStack;
-        std::stack<size_t> callStack;
-        std::stack<size_t> loopStack;  // For break/continue
+    VirtualMachine::VirtualMachine() {
+        memory.resize(VM_MEMORY_SIZE);
+        evalStack.resize(VM_EVAL_STACK_SLOTS + 1);
+    }
 
-        size_t ip = 0;  // Instruction pointer
-        size_t heapPtr = 4096;  // Heap starts after static data
+    void VirtualMachine::wipeMemory() {
+        if (!dirty) return;
+        wipe(memory, VM_MEMORY_SIZE);
+        wipe(regFile, VM_REG_FILE_SLOTS);
+        dirty = false;
+    }
 
-        std::stringstream output;
-        size_t maxCycles = 10000000;  // Infinite loop protection
-        size_t cycles = 0;
+    void VirtualMachine::reset() {
+        running = nullptr;
+        runState = RUN_FINISHED;
+        wipeMemory();
+        output.configure(VM_OUTPUT_CAPACITY, OUTPUT_BLOCK);
+        cycles = 0;
+        heap = VmHeap();
+        jit.reset(0);
+        jitEnabled = OMNI_JIT;
+        profiling = false;
+        sampleInterval = 0;
+        profile = Profile();
+    }
 
-        // Helper macros
-        #define BINARY_OP(op) \
-            do { \
-                if (evalStack.size() >= 2) { \
-                    double b = evalStack.top(); evalStack.pop(); \
-                    double a = evalStack.top(); evalStack.pop(); \
-                    evalStack.push(a op b); \
-                } \
-            } while(0)
+    // Memory access helpers
+    Slot VirtualMachine::loadSlot(size_t addr) {
+        Slot val;
+        val.i = 0;
+        if (slotInBounds(addr)) {
+            std::memcpy(&val, &memory[addr], sizeof(Slot));
+        }
+        return val;
+    }
 
-        #define BINARY_OP_FUNC(op, func) \
-            do { \
-                if (evalStack.size() >= 2) { \
-                    double b = evalStack.top(); evalStack.pop(); \
-                    double a = evalStack.top(); evalStack.pop(); \
-                    evalStack.push(func(a, b)); \
-                } \
-            } while(0)
+    void VirtualMachine::storeSlot(size_t addr, Slot val) {
+        if (slotInBounds(addr)) {
+            std::memcpy(&memory[addr], &val, sizeof(Slot));
+        }
+    }
 
-        #define COMPARE_OP(op) \
-            do { \
-                if (evalStack.size() >= 2) { \
-                    double b = evalStack.top(); evalStack.pop(); \
-                    double a = evalStack.top(); evalStack.pop(); \
-                    evalStack.push((a op b) ? 1.0 : 0.0); \
-                } \
-            } while(0)
+    uint8_t VirtualMachine::loadByte(size_t addr) {
+        if (addr < memory.size()) return memory[addr];
+        return 0;
+    }
+
+    void VirtualMachine::storeByte(size_t addr, uint8_t val) {
+        if (addr < memory.size()) memory[addr] = val;
+    }
+
+    // Formats one printf conversion. `spec` was validated by the compiler
+    // ("%[flags][width][.precision][length]conv"), so it is safe to hand to
+    // snprintf once the length modifier is normalised for the value type.
+    // The compiler converts the argument so integer conversions get an int
+    // slot and floating ones a double.
+    void VirtualMachine::printFormatted(const std::string& spec, Slot val) {
+        char conv = spec.back();
+        std::string flags;
+        for (size_t i = 0; i + 1 < spec.size(); i++) {
+            char c = spec[i];
+            if (c != 'l' && c != 'h' && c != 'z' && c != 'j' && c != 't' && c != 'L') flags += c;
+        }
+
+        std::string text;
+        std::string str;
+        auto format = [&](const std::string& fmt, auto arg) {
+            int len = std::snprintf(nullptr, 0, fmt.c_str(), arg);
+            if (len <= 0) return;
+            std::vector<char> buf(len + 1);
+            std::snprintf(buf.data(), buf.size(), fmt.c_str(), arg);
+            text.assign(buf.data(), len);
+        };
+
+        switch (conv) {
+            case 'd': case 'i':
+                format(flags + "lld", (long long)val.i);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                format(flags + "ll" + conv, (unsigned long long)val.i);
+                break;
+            case 'c':
+                format(flags + "c", (int)(char)val.i);
+                break;
+            case 's': {
+                size_t addr = (size_t)val.i;
+                while (addr < memory.size() && memory[addr] != 0) str += (char)memory[addr++];
+                format(flags + "s", str.c_str());
+                break;
+            }
+            case 'p':
+                format(flags + "llx", (unsigned long long)val.i);
+                text = "0x" + text;
+                break;
+            default:
+                format(flags + conv, val.d);
+                break;
+        }
+        output << text;
+    }
+
+    // Operand stack with the top cached in a local: `tos` is the top value
+    // and `s` points at the slot beneath it. Slot 0 is a sentinel so an empty
+    // stack needs no special case. The verifier guarantees no underflow and
+    // bounds each function's depth, so only CALL checks for headroom.
+    #define PUSH(v) do { *++s = tos; tos = (v); } while (0)
+    #define DROP() (tos = *s--)
+
+    #define BINARY_OP(op) \
+        do { tos.d = (s--)->d op tos.d; } while (0)
+
+    #define COMPARE_OP(op) \
+        do { tos.i = ((s--)->d op tos.d) ? 1 : 0; } while (0)
+
+    #define INT_OP(op) \
+        do { tos.i = (s--)->i op tos.i; } while (0)
+
+    // Two's complement wrap-around, computed unsigned to stay defined
+    #define WRAP_OP(op) \
+        do { tos.i = (int64_t)((uint64_t)(s--)->i op (uint64_t)tos.i); } while (0)
+
+    #define INT_COMPARE_OP(op) \
+        do { tos.i = ((s--)->i op tos.i) ? 1 : 0; } while (0)
+
+    // Compiled out of the runs that do not profile
+    #define PROFILE_STEP(at) do { if (PROFILE) profiler.step(at, executed); } while (0)
+    #define PROFILE_ENTER(entry) do { if (PROFILE) profiler.enter(entry, executed); } while (0)
+    #define PROFILE_LEAVE() do { if (PROFILE) profiler.leave(executed); } while (0)
+
+    #if OMNI_THREADED_DISPATCH
+        #define VM_CASE(name) op_##name
+        #define VM_NEXT() do { executed++; PROFILE_STEP(ip); goto *dispatch[code[ip++]]; } while (0)
+    #else
+        #define VM_CASE(name) case name
+        #define VM_NEXT() do { executed++; goto next; } while (0)
+    #endif
+
+    // Taken backward jumps and calls are the only way to run unbounded, so
+    // the cycle budget is only checked there. `limit` is the end of the
+    // current slice (see step()), at most maxCycles; a slice that runs out
+    // pauses, the whole run running out is an error. This is the check for
+    // a backward jump that has been taken: the interpreter pauses after it.
+    #define CHECK_BUDGET() \
+        do { if (executed >= limit) goto budget_taken; } while (0)
+
+    // A write that filled a blocking output ring ends the slice at the
+    // next budget check
+    #define CHECK_OUTPUT() \
+        do { if (output.blocked()) limit = executed; } while (0)
+
+    // Loads the data segment into wiped memory, then places the frame stack
+    // and heap after it
+    void VirtualMachine::load(const Program& prog) {
+        wipeMemory();
+        dirty = true;
+        size_t stackBase = (prog.dataSegment.size() + 7) & ~(size_t)7;
+        stackLimit = stackBase + VM_STACK_SIZE;
+        if (stackLimit + 4096 > memory.size()) {
+            memory.resize(stackLimit + 4096);
+        }
+        std::memcpy(memory.data(), prog.dataSegment.data(), prog.dataSegment.size());
+        fp = sp = stackBase;
+        heap.reset(memory, stackLimit, VM_MAX_MEMORY_SIZE);
+        callStack.clear();
+        regFrames.clear();
+    }
+
+    // Compare the top two values and jump unless the comparison holds
+    #define FUSED_BRANCH(op) \
+        do { \
+            size_t at = ip - 1; \
+            uint32_t target = readTarget(code, ip); \
+            bool holds = s->i op tos.i; \
+            tos = *(s - 1); \
+            s -= 2; \
+            if (!holds) { \
+                ip = target; \
+                if (ip <= at) CHECK_BUDGET(); \
+            } \
+        } while (0)
+
+    void VirtualMachine::run(const Program& prog) {
+        output.setGrowable(true);
+        start(prog);
+        step(SIZE_MAX);
+        output.setGrowable(false);
+    }
+
+    void VirtualMachine::start(const Program& prog) {
+        cycles = 0;
+        running = nullptr;
+        if (!prog.verified) {
+            output << "[ERROR] Program failed bytecode verification\n";
+            runState = RUN_ERROR;
+            return;
+        }
+        load(prog);
+        running = &prog;
+        runState = RUN_RUNNING;
+        if (profiling) profiler.begin(prog, sampleInterval);
+        if (prog.regCode.empty()) {
+            ip = prog.codeOffsets[prog.entryPoint];
+            evalTop = 0;
+            savedTos = intSlot(0);
+        } else {
+            if (regFile.size() < VM_REG_FILE_SLOTS) regFile.resize(VM_REG_FILE_SLOTS);
+            regBase = 0;
+            regWindow = prog.regFunctions[0].numRegs;
+            regPc = prog.regFunctions[0].entry;
+            loopCounts.assign(prog.regCode.size(), 0);
+            jit.reset(prog.regCode.size());
+        }
+    }
+
+    RunState VirtualMachine::step(size_t budget) {
+        if (runState != RUN_RUNNING || output.blocked()) return runState;
+        // At least one instruction, so a call at the resume point runs
+        budget = std::max(budget, (size_t)1);
+        size_t limit = budget < maxCycles - std::min(cycles, maxCycles) ? cycles + budget : maxCycles;
+        const Program& prog = *running;
+        if (prog.regCode.empty()) {
+            if (profiling) runStack<true>(prog, limit);
+            else runStack<false>(prog, limit);
+        } else {
+            if (profiling) runRegisters<true>(prog, limit);
+            else runRegisters<false>(prog, limit);
+        }
+        return runState;
+    }
+
+    // Paused on the top-level call to main()
+    bool VirtualMachine::atMainCall(const Program& prog) const {
+        auto main = prog.functions.find("main");
+        if (main == prog.functions.end()) return false;
+        if (prog.regCode.empty()) {
+            if (!callStack.empty() || prog.code[ip] != CALL) return false;
+            size_t at = ip + 1;
+            return readTarget(prog.code.data(), at) == prog.codeOffsets[main->second];
+        }
+        // regFunctions are numbered in code order after the startup code
+        size_t id = 1;
+        for (const auto& fn : prog.functions) {
+            if (fn.second < main->second) id++;
+        }
+        const RegInstr& in = prog.regCode[regPc];
+        return regFrames.empty() && in.op == R_CALL && (size_t)in.x == id;
+    }
+
+    std::shared_ptr<const VmSnapshot> VirtualMachine::snapshot(const Program& prog) {
+        start(prog);
+        // One-instruction slices pause at every call and backward jump
+        while (runState == RUN_RUNNING && !atMainCall(prog)) step(1);
+        if (runState != RUN_RUNNING) return nullptr;
+
+        auto snap = std::make_shared<VmSnapshot>();
+        snap->prog = &prog;
+        snap->memory.reset(new MemoryImage(memory.data(), memory.size()));
+        snap->memorySize = memory.size();
+        snap->heap = heap;
+        snap->output = output.contents();
+        snap->cycles = cycles;
+        snap->ip = ip;
+        snap->fp = fp;
+        snap->sp = sp;
+        snap->stackLimit = stackLimit;
+        if (prog.regCode.empty()) {
+            snap->evalStack.assign(evalStack.begin(), evalStack.begin() + evalTop);
+            snap->tos = savedTos;
+        } else {
+            snap->registers.reset(new MemoryImage(regFile.data(), regFile.size() * sizeof(Slot)));
+            snap->regPc = regPc;
+            snap->regWindow = regWindow;
+            snap->loopCounts = loopCounts;
+        }
+        return snap;
+    }
+
+    void VirtualMachine::fork(const VmSnapshot& snap) {
+        const Program& prog = *snap.prog;
+        wipeMemory();
+        dirty = true;
+        memory.resize(snap.memorySize);
+        snap.memory->restore(memory.data());
+        heap = snap.heap;
+        heap.rebind(memory);
+        clearOutput();
+        output << snap.output;
+        cycles = snap.cycles;
+        ip = snap.ip;
+        fp = snap.fp;
+        sp = snap.sp;
+        stackLimit = snap.stackLimit;
+        callStack.clear();
+        regFrames.clear();
+        if (prog.regCode.empty()) {
+            std::copy(snap.evalStack.begin(), snap.evalStack.end(), evalStack.begin());
+            evalTop = snap.evalStack.size();
+            savedTos = snap.tos;
+        } else {
+            if (regFile.size() < VM_REG_FILE_SLOTS) regFile.resize(VM_REG_FILE_SLOTS);
+            snap.registers->restore(regFile.data());
+            regBase = 0;
+            regWindow = snap.regWindow;
+            regPc = snap.regPc;
+            loopCounts = snap.loopCounts;
+            jit.reset(prog.regCode.size());
+        }
+        running = &prog;
+        runState = RUN_RUNNING;
+        if (profiling) profiler.begin(prog, sampleInterval);
+    }
+
+    void VirtualMachine::cancel() {
+        if (runState != RUN_RUNNING) return;
+        output << "[ERROR] Cancelled\n";
+        runState = RUN_ERROR;
+        running = nullptr;
+        if (profiling) profile = profiler.finish(cycles);
+    }
+
+    std::string VirtualMachine::drainOutput() {
+        return output.drain();
+    }
+
+    template <bool PROFILE>
+    void VirtualMachine::runStack(const Program& prog, size_t limit) {
+        const uint8_t* code = prog.code.data();
+        Slot* s = evalStack.data() + evalTop;
+        Slot* const stackEnd = evalStack.data() + evalStack.size() - 1;
+        Slot tos = savedTos;
+        size_t executed = cycles;
+
+    #if OMNI_THREADED_DISPATCH
+        void* dispatch[256];
+        for (void*& label : dispatch) label = &&op_invalid;
+        dispatch[HALT] = &&op_HALT;
+        dispatch[NOOP] = &&op_NOOP;
+        dispatch[PUSH_IMM] = &&op_PUSH_IMM;
+        dispatch[PUSH_CONST] = &&op_PUSH_CONST;
+        dispatch[PUSH_STR] = &&op_PUSH_STR;
+        dispatch[POP] = &&op_POP;
+        dispatch[DUP] = &&op_DUP;
+        dispatch[ADD] = &&op_ADD;
+        dispatch[SUB] = &&op_SUB;
+        dispatch[MUL] = &&op_MUL;
+        dispatch[DIV] = &&op_DIV;
+        dispatch[MOD] = &&op_MOD;
+        dispatch[IADD] = &&op_IADD;
+        dispatch[ISUB] = &&op_ISUB;
+        dispatch[IMUL] = &&op_IMUL;
+        dispatch[IDIV] = &&op_IDIV;
+        dispatch[IMOD] = &&op_IMOD;
+        dispatch[BIT_AND] = &&op_BIT_AND;
+        dispatch[BIT_OR] = &&op_BIT_OR;
+        dispatch[BIT_XOR] = &&op_BIT_XOR;
+        dispatch[BIT_NOT] = &&op_BIT_NOT;
+        dispatch[SHL] = &&op_SHL;
+        dispatch[SHR] = &&op_SHR;
+        dispatch[EQ] = &&op_EQ;
+        dispatch[NEQ] = &&op_NEQ;
+        dispatch[LT] = &&op_LT;
+        dispatch[GT] = &&op_GT;
+        dispatch[LTE] = &&op_LTE;
+        dispatch[GTE] = &&op_GTE;
+        dispatch[IEQ] = &&op_IEQ;
+        dispatch[INEQ] = &&op_INEQ;
+        dispatch[ILT] = &&op_ILT;
+        dispatch[IGT] = &&op_IGT;
+        dispatch[ILTE] = &&op_ILTE;
+        dispatch[IGTE] = &&op_IGTE;
+        dispatch[LOGICAL_AND] = &&op_LOGICAL_AND;
+        dispatch[LOGICAL_OR] = &&op_LOGICAL_OR;
+        dispatch[LOGICAL_NOT] = &&op_LOGICAL_NOT;
+        dispatch[LOAD] = &&op_LOAD;
+        dispatch[STORE] = &&op_STORE;
+        dispatch[LOAD_BYTE] = &&op_LOAD_BYTE;
+        dispatch[STORE_BYTE] = &&op_STORE_BYTE;
+        dispatch[ALLOC] = &&op_ALLOC;
+        dispatch[REALLOC] = &&op_REALLOC;
+        dispatch[FREE] = &&op_FREE;
+        dispatch[ADDR_OF] = &&op_ADDR_OF;
+        dispatch[DEREF] = &&op_DEREF;
+        dispatch[JMP] = &&op_JMP;
+        dispatch[JMP_IF] = &&op_JMP_IF;
+        dispatch[JMP_IF_NOT] = &&op_JMP_IF_NOT;
+        dispatch[CALL] = &&op_CALL;
+        dispatch[CALL_BUILTIN] = &&op_CALL_BUILTIN;
+        dispatch[RET] = &&op_RET;
+        dispatch[ENTER] = &&op_ENTER;
+        dispatch[LEAVE] = &&op_LEAVE;
+        dispatch[PRINT] = &&op_PRINT;
+        dispatch[PRINT_CHAR] = &&op_PRINT_CHAR;
+        dispatch[PRINT_STR] = &&op_PRINT_STR;
+        dispatch[PRINT_FMT] = &&op_PRINT_FMT;
+        dispatch[INT_TO_DOUBLE] = &&op_INT_TO_DOUBLE;
+        dispatch[DOUBLE_TO_INT] = &&op_DOUBLE_TO_INT;
+        dispatch[ADD_IMM] = &&op_ADD_IMM;
+        dispatch[LOAD_LOCAL] = &&op_LOAD_LOCAL;
+        dispatch[LOAD_ADD] = &&op_LOAD_ADD;
+        dispatch[JMP_IF_NOT_IEQ] = &&op_JMP_IF_NOT_IEQ;
+        dispatch[JMP_IF_NOT_INEQ] = &&op_JMP_IF_NOT_INEQ;
+        dispatch[JMP_IF_NOT_ILT] = &&op_JMP_IF_NOT_ILT;
+        dispatch[JMP_IF_NOT_IGT] = &&op_JMP_IF_NOT_IGT;
+        dispatch[JMP_IF_NOT_ILTE] = &&op_JMP_IF_NOT_ILTE;
+        dispatch[JMP_IF_NOT_IGTE] = &&op_JMP_IF_NOT_IGTE;
+
+        PROFILE_STEP(ip);
+        goto *dispatch[code[ip++]];
+    #else
+    next:
+        PROFILE_STEP(ip);
+        switch ((OpCode)code[ip++]) {
+    #endif
+
+        VM_CASE(HALT):
+            goto done;
+
+        VM_CASE(NOOP):
+            VM_NEXT();
+
+        // Stack operations
+        VM_CASE(PUSH_IMM):
+            PUSH(intSlot(readSVarint(code, ip)));
+            VM_NEXT();
+
+        VM_CASE(PUSH_CONST):
+            PUSH(prog.constants[readVarint(code, ip)]);
+            VM_NEXT();
+
+        VM_CASE(PUSH_STR):
+            // String is already in memory, just push address
+            PUSH(intSlot((int64_t)readVarint(code, ip)));
+            VM_NEXT();
+
+        VM_CASE(POP):
+            DROP();
+            VM_NEXT();
+
+        VM_CASE(DUP):
+            *++s = tos;
+            VM_NEXT();
+
+        // Arithmetic
+        VM_CASE(ADD): BINARY_OP(+); VM_NEXT();
+        VM_CASE(SUB): BINARY_OP(-); VM_NEXT();
+        VM_CASE(MUL): BINARY_OP(*); VM_NEXT();
+
+        VM_CASE(DIV): {
+            double a = (s--)->d;
+            tos.d = tos.d != 0 ? a / tos.d : 0;
+            VM_NEXT();
+        }
+
+        VM_CASE(MOD): {
+            double a = (s--)->d;
+            tos.d = tos.d != 0 ? std::fmod(a, tos.d) : 0;
+            VM_NEXT();
+        }
+
+        VM_CASE(IADD): WRAP_OP(+); VM_NEXT();
+        VM_CASE(ISUB): WRAP_OP(-); VM_NEXT();
+        VM_CASE(IMUL): WRAP_OP(*); VM_NEXT();
+
+        VM_CASE(IDIV): {
+            int64_t a = (s--)->i;
+            tos.i = intDiv(a, tos.i);
+            VM_NEXT();
+        }
+
+        VM_CASE(IMOD): {
+            int64_t a = (s--)->i;
+            tos.i = intMod(a, tos.i);
+            VM_NEXT();
+        }
+
+        // Bitwise
+        VM_CASE(BIT_AND): INT_OP(&); VM_NEXT();
+        VM_CASE(BIT_OR): INT_OP(|); VM_NEXT();
+        VM_CASE(BIT_XOR): INT_OP(^); VM_NEXT();
+        VM_CASE(BIT_NOT): tos.i = ~tos.i; VM_NEXT();
+
+        VM_CASE(SHL): {
+            uint64_t a = (uint64_t)(s--)->i;
+            tos.i = (int64_t)(a << (tos.i & 63));
+            VM_NEXT();
+        }
+
+        VM_CASE(SHR): {
+            int64_t a = (s--)->i;
+            tos.i = a >> (tos.i & 63);
+            VM_NEXT();
+        }
+
+        // Logical
+        VM_CASE(LOGICAL_AND): {
+            int64_t a = (s--)->i;
+            tos.i = (a != 0 && tos.i != 0) ? 1 : 0;
+            VM_NEXT();
+        }
+        VM_CASE(LOGICAL_OR): {
+            int64_t a = (s--)->i;
+            tos.i = (a != 0 || tos.i != 0) ? 1 : 0;
+            VM_NEXT();
+        }
+        VM_CASE(LOGICAL_NOT): tos.i = tos.i == 0 ? 1 : 0; VM_NEXT();
+
+        // Comparison
+        VM_CASE(EQ): COMPARE_OP(==); VM_NEXT();
+        VM_CASE(NEQ): COMPARE_OP(!=); VM_NEXT();
+        VM_CASE(LT): COMPARE_OP(<); VM_NEXT();
+        VM_CASE(GT): COMPARE_OP(>); VM_NEXT();
+        VM_CASE(LTE): COMPARE_OP(<=); VM_NEXT();
+        VM_CASE(GTE): COMPARE_OP(>=); VM_NEXT();
+        VM_CASE(IEQ): INT_COMPARE_OP(==); VM_NEXT();
+        VM_CASE(INEQ): INT_COMPARE_OP(!=); VM_NEXT();
+        VM_CASE(ILT): INT_COMPARE_OP(<); VM_NEXT();
+        VM_CASE(IGT): INT_COMPARE_OP(>); VM_NEXT();
+        VM_CASE(ILTE): INT_COMPARE_OP(<=); VM_NEXT();
+        VM_CASE(IGTE): INT_COMPARE_OP(>=); VM_NEXT();
 
-    public:
-        VirtualMachine() {
-            memory.resize(1024 * 1024, 0);  // 1MB
+        // Memory operations
+        VM_CASE(LOAD):
+        VM_CASE(DEREF):
+            tos = loadSlot((size_t)tos.i);
+            VM_NEXT();
+
+        VM_CASE(STORE): {
+            bool keep = code[ip++] != 0;
+            Slot val = tos;
+            storeSlot((size_t)(s--)->i, val);
+            if (keep) tos = val;
+            else DROP();
+            VM_NEXT();
         }
 
-        std::string getOutput() {
-            return output.str();
+        VM_CASE(LOAD_BYTE):
+            tos.i = (int8_t)loadByte((size_t)tos.i);
+            VM_NEXT();
+
+        VM_CASE(STORE_BYTE): {
+            bool keep = code[ip++] != 0;
+            uint8_t byte = (uint8_t)tos.i;
+            storeByte((size_t)(s--)->i, byte);
+            if (keep) tos.i = (int8_t)byte;
+            else DROP();
+            VM_NEXT();
+        }
+
+        VM_CASE(ALLOC):
+            tos.i = (int64_t)heap.allocate(tos.i, code[ip++] != 0);
+            if (heap.corrupted()) goto heap_corrupted;
+            VM_NEXT();
+
+        VM_CASE(REALLOC): {
+            size_t addr = (size_t)(s--)->i;
+            tos.i = (int64_t)heap.reallocate(addr, tos.i);
+            if (heap.corrupted()) goto heap_corrupted;
+            VM_NEXT();
         }
 
-        void clearOutput() {
-            output.str("");
-            output.clear();
+        VM_CASE(FREE):
+            heap.release((size_t)tos.i);
+            if (heap.corrupted()) goto heap_corrupted;
+            DROP();
+            VM_NEXT();
+
+        // Address operations
+        VM_CASE(ADDR_OF):
+            PUSH(intSlot((int64_t)(fp + readVarint(code, ip))));
+            VM_NEXT();
+
+        // Control flow
+        VM_CASE(JMP): {
+            size_t at = ip - 1;
+            ip = readTarget(code, ip);
+            if (ip <= at) CHECK_BUDGET();
+            VM_NEXT();
         }
 
-        // Memory access helpers
-        double loadDouble(size_t addr) {
-            if (addr + sizeof(double) <= memory.size()) {
-                double val;
-                std::memcpy(&val, &memory[addr], sizeof(double));
-                return val;
+        VM_CASE(JMP_IF): {
+            size_t at = ip - 1;
+            uint32_t target = readTarget(code, ip);
+            int64_t cond = tos.i;
+            DROP();
+            if (cond != 0) {
+                ip = target;
+                if (ip <= at) CHECK_BUDGET();
             }
-            return 0;
+            VM_NEXT();
         }
 
-        void storeDouble(size_t addr, double val) {
-            if (addr + sizeof(double) <= memory.size()) {
-                std::memcpy(&memory[addr], &val, sizeof(double));
+        VM_CASE(JMP_IF_NOT): {
+            size_t at = ip - 1;
+            uint32_t target = readTarget(code, ip);
+            int64_t cond = tos.i;
+            DROP();
+            if (cond == 0) {
+                ip = target;
+                if (ip <= at) CHECK_BUDGET();
             }
+            VM_NEXT();
         }
 
-        uint8_t loadByte(size_t addr) {
-            if (addr < memory.size()) return memory[addr];
-            return 0;
+        VM_CASE(CALL): {
+            // Arguments were pushed left to right; they become the first
+            // slots of the callee's frame. The target was linked at pack time.
+            if (executed >= limit) {
+                ip--;   // Runs again on resume
+                goto budget_call;
+            }
+            uint32_t target = readTarget(code, ip);
+            size_t argc = (size_t)readVarint(code, ip);
+            if (callStack.size() >= VM_MAX_CALL_DEPTH || sp + argc * sizeof(Slot) > stackLimit ||
+                s + prog.maxStackDepth >= stackEnd) {
+                output << "[ERROR] Stack overflow\n";
+                goto failed;
+            }
+            for (size_t i = argc; i-- > 0;) {
+                storeSlot(sp + i * sizeof(Slot), tos);
+                DROP();
+            }
+            callStack.push_back({ip, fp});
+            fp = sp;
+            ip = target;
+            PROFILE_ENTER(target);
+            VM_NEXT();
         }
 
-        void storeByte(size_t addr, uint8_t val) {
-            if (addr < memory.size()) memory[addr] = val;
+        VM_CASE(CALL_BUILTIN): {
+            // Arguments are the top argc values, in order, once tos is spilled
+            int id = (int)readVarint(code, ip);
+            int argc = BUILTINS[id].argc();
+            *++s = tos;
+            Slot result = callBuiltin(id, memory, s - argc + 1);
+            s -= argc;
+            tos = result;
+            VM_NEXT();
         }
 
-        void run(const Program& prog) {
-            ip = 0;
-            cycles = 0;
-            bool running = true;
+        VM_CASE(RET):
+            // The return value stays in tos
+            if (callStack.empty()) goto done;
+            ip = callStack.back().returnIp;
+            fp = callStack.back().savedFp;
+            callStack.pop_back();
+            PROFILE_LEAVE();
+            VM_NEXT();
 
-            // Load data segment
-            if (prog.dataSegment.size() > memory.size()) {
-                memory.resize(prog.dataSegment.size() + 4096);
+        VM_CASE(ENTER):
+            // Reserve the callee's frame (params + locals)
+            sp = fp + readVarint(code, ip);
+            if (sp > stackLimit) {
+                output << "[ERROR] Stack overflow\n";
+                goto failed;
             }
-            std::memcpy(memory.data(), prog.dataSegment.data(), prog.dataSegment.size());
-            heapPtr = prog.dataSegment.size() + 8;
-
-            while (running && cycles < maxCycles) {
-                if (ip >= prog.instructions.size()) break;
-
-                const Instruction& instr = prog.instructions[ip++];
-                cycles++;
-
-                switch (instr.op) {
-                    case HALT: running = false; break;
-                    case NOOP: break;
-
-                    // Stack operations
-                    case PUSH_IMM:
-                        evalStack.push(instr.immediate);
-                        break;
-
-                    case PUSH_STR: {
-                        // String is already in memory, just push address
-                        evalStack.push(instr.immediate);
-                        break;
-                    }
-
-                    case POP:
-                        if (!evalStack.empty()) evalStack.pop();
-                        break;
-
-                    case DUP:
-                        if (!evalStack.empty()) evalStack.push(evalStack.top());
-                        break;
-
-                    // Arithmetic
-                    case ADD: BINARY_OP(+); break;
-                    case SUB: BINARY_OP(-); break;
-                    case MUL: BINARY_OP(*); break;
-                    case DIV:
-                        if (!evalStack.empty()) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push(b != 0 ? a / b : 0);
-                        }
-                        break;
-
-                    case MOD:
-                        if (!evalStack.empty()) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push(b != 0 ? std::fmod(a, b) : 0);
-                        }
-                        break;
-
-                    // Bitwise
-                    case BIT_AND: {
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((double)((int64_t)a & (int64_t)b));
-                        }
-                        break;
-                    }
-                    case BIT_OR: {
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((double)((int64_t)a | (int64_t)b));
-                        }
-                        break;
-                    }
-                    case BIT_XOR: {
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((double)((int64_t)a ^ (int64_t)b));
-                        }
-                        break;
-                    }
-                    case BIT_NOT:
-                        if (!evalStack.empty()) {
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((double)~(int64_t)a);
-                        }
-                        break;
-                    case SHL:
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((double)((int64_t)a << (int)b));
-                        }
-                        break;
-                    case SHR:
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((double)((int64_t)a >> (int)b));
-                        }
-                        break;
-
-                    // Logical
-                    case LOGICAL_AND:
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((a != 0 && b != 0) ? 1.0 : 0.0);
-                        }
-                        break;
-                    case LOGICAL_OR:
-                        if (evalStack.size() >= 2) {
-                            double b = evalStack.top(); evalStack.pop();
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push((a != 0 || b != 0) ? 1.0 : 0.0);
-                        }
-                        break;
-                    case LOGICAL_NOT:
-                        if (!evalStack.empty()) {
-                            double a = evalStack.top(); evalStack.pop();
-                            evalStack.push(a == 0 ? 1.0 : 0.0);
-                        }
-                        break;
-
-                    // Comparison
-                    case EQ: COMPARE_OP(==); break;
-                    case NEQ: COMPARE_OP(!=); break;
-                    case LT: COMPARE_OP(<); break;
-                    case GT: COMPARE_OP(>); break;
-                    case LTE: COMPARE_OP(<=); break;
-                    case GTE: COMPARE_OP(>=); break;
-
-                    // Memory operations
-                    case LOAD: {
-                        if (!evalStack.empty()) {
-                            size_t addr = (size_t)evalStack.top();
-                            evalStack.pop();
-                            evalStack.push(loadDouble(addr));
-                        }
-                        break;
-                    }
-
-                    case STORE: {
-                        if (evalStack.size() >= 2) {
-                            double val = evalStack.top(); evalStack.pop();
-                            size_t addr = (size_t)evalStack.top();
-                            evalStack.pop();
-                            storeDouble(addr, val);
-                        }
-                        break;
-                    }
-
-                    case ALLOC: {
-                        if (!evalStack.empty()) {
-                            size_t size = (size_t)evalStack.top();
-                            evalStack.pop();
-                            evalStack.push((double)heapPtr);
-                            heapPtr += size;
-                            if (heapPtr > memory.size()) {
-                                memory.resize(heapPtr + 4096);
-                            }
-                        }
-                        break;
-                    }
-
-                    case FREE:
-                        // Simple stub - real implementation would need free list
-                        if (!evalStack.empty()) evalStack.pop();
-                        break;
-
-                    // Address operations
-                    case ADDR_OF: {
-                        // Push address of lvalue
-                        // For now, just use the value on stack as the address
-                        break;
-                    }
-
-                    case DEREF: {
-                        if (!evalStack.empty()) {
-                            size_t addr = (size_t)evalStack.top();
-                            evalStack.pop();
-                            evalStack.push(loadDouble(addr));
-                        }
-                        break;
-                    }
-
-                    // Control flow
-                    case JMP:
-                        ip = (size_t)instr.immediate;
-                        break;
-
-                    case JMP_IF: {
-                        if (!evalStack.empty()) {
-                            double cond = evalStack.top();
-                            evalStack.pop();
-                            if (cond != 0) ip = (size_t)instr.immediate;
-                        }
-                        break;
-                    }
-
-                    case JMP_IF_NOT: {
-                        if (!evalStack.empty()) {
-                            double cond = evalStack.top();
-                            evalStack.pop();
-                            if (cond == 0) ip = (size_t)instr.immediate;
-                        }
-                        break;
-                    }
-
-                    case CALL: {
-                        callStack.push(ip);
-                        // TODO: Handle function lookup by name
-                        break;
-                    }
-
-                    case RET: {
-                        if (callStack.empty()) {
-                            running = false;
-                        } else {
-                            ip = callStack.top();
-                            callStack.pop();
-                        }
-                        break;
-                    }
-
-                    case ENTER:
-                        // Setup stack frame
-                        // TODO: Implement proper stack frames
-                        break;
-
-                    case LEAVE:
-                        // Tear down stack frame
-                        break;
-
-                    // I/O
-                    case PRINT: {
-                        if (!evalStack.empty()) {
-                            double val = evalStack.top();
-                            evalStack.pop();
-                            // Check if it's an integer
-                            if (val == (int64_t)val) {
-                                output << (int64_t)val;
-                            } else {
-                                output << val;
-                            }
-                            output << "\n";
-                        }
-                        break;
-                    }
-
-                    case PRINT_CHAR: {
-                        if (!evalStack.empty()) {
-                            char c = (char)evalStack.top();
-                            evalStack.pop();
-                            output << c;
-                        }
-                        break;
-                    }
-
-                    case PRINT_STR: {
-                        if (!evalStack.empty()) {
-                            size_t addr = (size_t)evalStack.top();
-                            evalStack.pop();
-                            while (addr < memory.size() && memory[addr] != 0) {
-                                output << (char)memory[addr];
-                                addr++;
-                            }
-                        }
-                        break;
-                    }
-
-                    // Type conversions
-                    case INT_TO_DOUBLE:
-                        // Already using doubles for everything
-                        break;
-
-                    case DOUBLE_TO_INT:
-                        if (!evalStack.empty()) {
-                            double val = evalStack.top();
-                            evalStack.pop();
-                            evalStack.push((double)(int64_t)val);
-                        }
-                        break;
-
-                    default:
-                        break;
-                }
+            VM_NEXT();
+
+        VM_CASE(LEAVE):
+            // Tear down stack frame
+            sp = fp;
+            VM_NEXT();
+
+        // I/O
+        VM_CASE(PRINT):
+            output << tos.i << "\n";
+            DROP();
+            CHECK_OUTPUT();
+            VM_NEXT();
+
+        VM_CASE(PRINT_CHAR):
+            output << (char)tos.i;
+            DROP();
+            CHECK_OUTPUT();
+            VM_NEXT();
+
+        VM_CASE(PRINT_STR): {
+            size_t addr = (size_t)tos.i;
+            DROP();
+            size_t end = addr;
+            while (end < memory.size() && memory[end] != 0) end++;
+            if (end > addr) output.write((const char*)&memory[addr], end - addr);
+            CHECK_OUTPUT();
+            VM_NEXT();
+        }
+
+        VM_CASE(PRINT_FMT): {
+            const std::string& spec = prog.strings[readVarint(code, ip)];
+            Slot val = tos;
+            DROP();
+            printFormatted(spec, val);
+            CHECK_OUTPUT();
+            VM_NEXT();
+        }
+
+        // Type conversions
+        VM_CASE(INT_TO_DOUBLE):
+            tos.d = (double)tos.i;
+            VM_NEXT();
+
+        VM_CASE(DOUBLE_TO_INT):
+            tos.i = doubleToInt(tos.d);
+            VM_NEXT();
+
+        // Superinstructions
+        VM_CASE(ADD_IMM):
+            tos.i = (int64_t)((uint64_t)tos.i + (uint64_t)readSVarint(code, ip));
+            VM_NEXT();
+
+        VM_CASE(LOAD_LOCAL):
+            PUSH(loadSlot(fp + readVarint(code, ip)));
+            VM_NEXT();
+
+        VM_CASE(LOAD_ADD): {
+            uint64_t a = (uint64_t)(s--)->i;
+            tos.i = (int64_t)(a + (uint64_t)loadSlot((size_t)tos.i).i);
+            VM_NEXT();
+        }
+
+        VM_CASE(JMP_IF_NOT_IEQ): FUSED_BRANCH(==); VM_NEXT();
+        VM_CASE(JMP_IF_NOT_INEQ): FUSED_BRANCH(!=); VM_NEXT();
+        VM_CASE(JMP_IF_NOT_ILT): FUSED_BRANCH(<); VM_NEXT();
+        VM_CASE(JMP_IF_NOT_IGT): FUSED_BRANCH(>); VM_NEXT();
+        VM_CASE(JMP_IF_NOT_ILTE): FUSED_BRANCH(<=); VM_NEXT();
+        VM_CASE(JMP_IF_NOT_IGTE): FUSED_BRANCH(>=); VM_NEXT();
+
+    #if OMNI_THREADED_DISPATCH
+    op_invalid:
+    #else
+        default:
+            break;
+        }
+    #endif
+        // Unreachable for verified code
+        output << "[ERROR] Invalid opcode\n";
+        goto failed;
+
+    heap_corrupted:
+        // A program wrote over allocator metadata, e.g. through a freed pointer
+        output << "[ERROR] Heap corruption detected\n";
+        goto failed;
+
+    budget_taken:
+        if (executed >= maxCycles) goto out_of_budget;
+        executed++;     // The jump, as VM_NEXT would count it
+        goto paused;
+    budget_call:
+        if (executed >= maxCycles) goto out_of_budget;
+        if (PROFILE) profiler.unstep(ip);   // Dispatched again on resume
+    paused:
+        evalTop = (size_t)(s - evalStack.data());
+        savedTos = tos;
+        cycles = executed;
+        return;
+
+    out_of_budget:
+        output << "[ERROR] Infinite loop detected\n";
+        if (PROFILE) profiler.exhausted();
+    failed:
+        runState = RUN_ERROR;
+    done:
+        if (runState == RUN_RUNNING) runState = RUN_FINISHED;
+        running = nullptr;
+        cycles = executed;
+        if (PROFILE) profile = profiler.finish(executed);
+    }
+
+    #undef PUSH
+    #undef DROP
+    #undef BINARY_OP
+    #undef COMPARE_OP
+    #undef INT_OP
+    #undef WRAP_OP
+    #undef INT_COMPARE_OP
+    #undef FUSED_BRANCH
+    #undef VM_CASE
+    #undef VM_NEXT
+
+    // Register mode. `R` is the current register window and `window` its
+    // size; a call's window starts right after its caller's.
+    #define REG_BINARY(op) R[in->a].d = R[in->b].d op R[in->c].d
+    #define REG_COMPARE(op) R[in->a].i = (R[in->b].d op R[in->c].d) ? 1 : 0
+    #define REG_INT_OP(op) R[in->a].i = R[in->b].i op R[in->c].i
+    #define REG_WRAP_OP(op) R[in->a].i = (int64_t)((uint64_t)R[in->b].i op (uint64_t)R[in->c].i)
+    #define REG_INT_COMPARE(op) R[in->a].i = (R[in->b].i op R[in->c].i) ? 1 : 0
+
+    // Taken branches; only backward ones can loop
+    #define REG_JUMP() \
+        do { \
+            const RegInstr* target = code + in->x; \
+            if (target <= in) { \
+                if (executed >= limit) { \
+                    pc = target; \
+                    goto budget_taken; \
+                } \
+                if (!PROFILE) REG_TIER_UP(); \
+            } \
+            pc = target; \
+        } while (0)
+
+    // A backward jump makes its target hotter. Once it is hot the loop is
+    // compiled and entered; native code counts as if it were interpreted
+    // (the jump itself included) and says where to carry on.
+    #if OMNI_JIT
+        #define REG_TIER_UP() \
+            do { \
+                uint32_t header = (uint32_t)in->x; \
+                if (jitEnabled && ++loopCounts[header] >= JIT_HOT_LOOP_THRESHOLD) { \
+                    if (!jit.tried(header)) jit.compileLoop(prog, header, (uint32_t)(in - code)); \
+                    if (JitLoop native = jit.loop(header)) { \
+                        JitState state = {R, memory.data(), memory.size(), fp, executed + 1, limit}; \
+                        target = code + native(&state); \
+                        jit.entered(header, state.executed - executed - 1); \
+                        executed = state.executed - 1; \
+                    } \
+                } \
+            } while (0)
+    #else
+        #define REG_TIER_UP() do {} while (0)
+    #endif
+    #define REG_BRANCH_IF_NOT(op) do { if (!(R[in->b].i op R[in->c].i)) REG_JUMP(); } while (0)
+    #define REG_BRANCH_IF_NOT_K(op) do { if (!(R[in->b].i op K[in->c].i)) REG_JUMP(); } while (0)
+
+    #if OMNI_THREADED_DISPATCH
+        #define REG_CASE(name) rop_##name
+        #define REG_NEXT() do { executed++; PROFILE_STEP(pc - code); in = pc++; goto *dispatch[in->op]; } while (0)
+    #else
+        #define REG_CASE(name) case name
+        #define REG_NEXT() do { executed++; goto next; } while (0)
+    #endif
+
+    template <bool PROFILE>
+    void VirtualMachine::runRegisters(const Program& prog, size_t limit) {
+        const RegInstr* code = prog.regCode.data();
+        const Slot* K = prog.constants.data();
+        Slot* R = regFile.data() + regBase;
+        Slot* const regEnd = regFile.data() + regFile.size();
+        uint32_t window = regWindow;
+        const RegInstr* pc = code + regPc;
+        const RegInstr* in;
+        size_t executed = cycles;
+
+    #if OMNI_THREADED_DISPATCH
+        void* dispatch[256];
+        for (void*& label : dispatch) label = &&rop_invalid;
+        dispatch[R_HALT] = &&rop_R_HALT;
+        dispatch[R_MOV] = &&rop_R_MOV;
+        dispatch[R_LOADI] = &&rop_R_LOADI;
+        dispatch[R_LOADK] = &&rop_R_LOADK;
+        dispatch[R_ADDR] = &&rop_R_ADDR;
+        dispatch[R_ADD] = &&rop_R_ADD;
+        dispatch[R_SUB] = &&rop_R_SUB;
+        dispatch[R_MUL] = &&rop_R_MUL;
+        dispatch[R_DIV] = &&rop_R_DIV;
+        dispatch[R_MOD] = &&rop_R_MOD;
+        dispatch[R_EQ] = &&rop_R_EQ;
+        dispatch[R_NE] = &&rop_R_NE;
+        dispatch[R_LT] = &&rop_R_LT;
+        dispatch[R_GT] = &&rop_R_GT;
+        dispatch[R_LE] = &&rop_R_LE;
+        dispatch[R_GE] = &&rop_R_GE;
+        dispatch[R_IADD] = &&rop_R_IADD;
+        dispatch[R_ISUB] = &&rop_R_ISUB;
+        dispatch[R_IMUL] = &&rop_R_IMUL;
+        dispatch[R_IDIV] = &&rop_R_IDIV;
+        dispatch[R_IMOD] = &&rop_R_IMOD;
+        dispatch[R_AND] = &&rop_R_AND;
+        dispatch[R_OR] = &&rop_R_OR;
+        dispatch[R_XOR] = &&rop_R_XOR;
+        dispatch[R_SHL] = &&rop_R_SHL;
+        dispatch[R_SHR] = &&rop_R_SHR;
+        dispatch[R_IEQ] = &&rop_R_IEQ;
+        dispatch[R_INE] = &&rop_R_INE;
+        dispatch[R_ILT] = &&rop_R_ILT;
+        dispatch[R_IGT] = &&rop_R_IGT;
+        dispatch[R_ILE] = &&rop_R_ILE;
+        dispatch[R_IGE] = &&rop_R_IGE;
+        dispatch[R_LAND] = &&rop_R_LAND;
+        dispatch[R_LOR] = &&rop_R_LOR;
+        dispatch[R_IADDI] = &&rop_R_IADDI;
+        dispatch[R_IMULI] = &&rop_R_IMULI;
+        dispatch[R_NOT] = &&rop_R_NOT;
+        dispatch[R_LNOT] = &&rop_R_LNOT;
+        dispatch[R_I2D] = &&rop_R_I2D;
+        dispatch[R_D2I] = &&rop_R_D2I;
+        dispatch[R_SEXT8] = &&rop_R_SEXT8;
+        dispatch[R_LOAD] = &&rop_R_LOAD;
+        dispatch[R_STORE] = &&rop_R_STORE;
+        dispatch[R_LOADB] = &&rop_R_LOADB;
+        dispatch[R_STOREB] = &&rop_R_STOREB;
+        dispatch[R_LOADL] = &&rop_R_LOADL;
+        dispatch[R_STOREL] = &&rop_R_STOREL;
+        dispatch[R_LOADG] = &&rop_R_LOADG;
+        dispatch[R_STOREG] = &&rop_R_STOREG;
+        dispatch[R_ALLOC] = &&rop_R_ALLOC;
+        dispatch[R_REALLOC] = &&rop_R_REALLOC;
+        dispatch[R_FREE] = &&rop_R_FREE;
+        dispatch[R_JMP] = &&rop_R_JMP;
+        dispatch[R_JT] = &&rop_R_JT;
+        dispatch[R_JF] = &&rop_R_JF;
+        dispatch[R_JFIEQ] = &&rop_R_JFIEQ;
+        dispatch[R_JFINE] = &&rop_R_JFINE;
+        dispatch[R_JFILT] = &&rop_R_JFILT;
+        dispatch[R_JFIGT] = &&rop_R_JFIGT;
+        dispatch[R_JFILE] = &&rop_R_JFILE;
+        dispatch[R_JFIGE] = &&rop_R_JFIGE;
+        dispatch[R_JFIEQK] = &&rop_R_JFIEQK;
+        dispatch[R_JFINEK] = &&rop_R_JFINEK;
+        dispatch[R_JFILTK] = &&rop_R_JFILTK;
+        dispatch[R_JFIGTK] = &&rop_R_JFIGTK;
+        dispatch[R_JFILEK] = &&rop_R_JFILEK;
+        dispatch[R_JFIGEK] = &&rop_R_JFIGEK;
+        dispatch[R_ARG] = &&rop_R_ARG;
+        dispatch[R_CALL] = &&rop_R_CALL;
+        dispatch[R_CALLB] = &&rop_R_CALLB;
+        dispatch[R_RET] = &&rop_R_RET;
+        dispatch[R_ENTER] = &&rop_R_ENTER;
+        dispatch[R_PRINT] = &&rop_R_PRINT;
+        dispatch[R_PRINTC] = &&rop_R_PRINTC;
+        dispatch[R_PRINTS] = &&rop_R_PRINTS;
+        dispatch[R_PRINTF] = &&rop_R_PRINTF;
+
+        PROFILE_STEP(pc - code);
+        in = pc++;
+        goto *dispatch[in->op];
+    #else
+    next:
+        PROFILE_STEP(pc - code);
+        in = pc++;
+        switch (in->op) {
+    #endif
+
+        REG_CASE(R_HALT):
+            goto done;
+
+        REG_CASE(R_MOV): R[in->a] = R[in->b]; REG_NEXT();
+        REG_CASE(R_LOADI): R[in->a].i = in->x; REG_NEXT();
+        REG_CASE(R_LOADK): R[in->a] = K[in->x]; REG_NEXT();
+        REG_CASE(R_ADDR): R[in->a].i = (int64_t)(fp + in->x); REG_NEXT();
+
+        // Arithmetic
+        REG_CASE(R_ADD): REG_BINARY(+); REG_NEXT();
+        REG_CASE(R_SUB): REG_BINARY(-); REG_NEXT();
+        REG_CASE(R_MUL): REG_BINARY(*); REG_NEXT();
+
+        REG_CASE(R_DIV): {
+            double d = R[in->c].d;
+            R[in->a].d = d != 0 ? R[in->b].d / d : 0;
+            REG_NEXT();
+        }
+
+        REG_CASE(R_MOD): {
+            double d = R[in->c].d;
+            R[in->a].d = d != 0 ? std::fmod(R[in->b].d, d) : 0;
+            REG_NEXT();
+        }
+
+        REG_CASE(R_IADD): REG_WRAP_OP(+); REG_NEXT();
+        REG_CASE(R_ISUB): REG_WRAP_OP(-); REG_NEXT();
+        REG_CASE(R_IMUL): REG_WRAP_OP(*); REG_NEXT();
+        REG_CASE(R_IDIV): R[in->a].i = intDiv(R[in->b].i, R[in->c].i); REG_NEXT();
+        REG_CASE(R_IMOD): R[in->a].i = intMod(R[in->b].i, R[in->c].i); REG_NEXT();
+        REG_CASE(R_IADDI): R[in->a].i = (int64_t)((uint64_t)R[in->b].i + (uint64_t)(int64_t)in->x); REG_NEXT();
+        REG_CASE(R_IMULI): R[in->a].i = (int64_t)((uint64_t)R[in->b].i * (uint64_t)(int64_t)in->x); REG_NEXT();
+
+        // Bitwise
+        REG_CASE(R_AND): REG_INT_OP(&); REG_NEXT();
+        REG_CASE(R_OR): REG_INT_OP(|); REG_NEXT();
+        REG_CASE(R_XOR): REG_INT_OP(^); REG_NEXT();
+        REG_CASE(R_SHL): R[in->a].i = (int64_t)((uint64_t)R[in->b].i << (R[in->c].i & 63)); REG_NEXT();
+        REG_CASE(R_SHR): R[in->a].i = R[in->b].i >> (R[in->c].i & 63); REG_NEXT();
+        REG_CASE(R_NOT): R[in->a].i = ~R[in->b].i; REG_NEXT();
+
+        // Comparison and logical
+        REG_CASE(R_EQ): REG_COMPARE(==); REG_NEXT();
+        REG_CASE(R_NE): REG_COMPARE(!=); REG_NEXT();
+        REG_CASE(R_LT): REG_COMPARE(<); REG_NEXT();
+        REG_CASE(R_GT): REG_COMPARE(>); REG_NEXT();
+        REG_CASE(R_LE): REG_COMPARE(<=); REG_NEXT();
+        REG_CASE(R_GE): REG_COMPARE(>=); REG_NEXT();
+        REG_CASE(R_IEQ): REG_INT_COMPARE(==); REG_NEXT();
+        REG_CASE(R_INE): REG_INT_COMPARE(!=); REG_NEXT();
+        REG_CASE(R_ILT): REG_INT_COMPARE(<); REG_NEXT();
+        REG_CASE(R_IGT): REG_INT_COMPARE(>); REG_NEXT();
+        REG_CASE(R_ILE): REG_INT_COMPARE(<=); REG_NEXT();
+        REG_CASE(R_IGE): REG_INT_COMPARE(>=); REG_NEXT();
+        REG_CASE(R_LAND): R[in->a].i = (R[in->b].i != 0 && R[in->c].i != 0) ? 1 : 0; REG_NEXT();
+        REG_CASE(R_LOR): R[in->a].i = (R[in->b].i != 0 || R[in->c].i != 0) ? 1 : 0; REG_NEXT();
+        REG_CASE(R_LNOT): R[in->a].i = R[in->b].i == 0 ? 1 : 0; REG_NEXT();
+
+        // Type conversions
+        REG_CASE(R_I2D): R[in->a].d = (double)R[in->b].i; REG_NEXT();
+        REG_CASE(R_D2I): R[in->a].i = doubleToInt(R[in->b].d); REG_NEXT();
+        REG_CASE(R_SEXT8): R[in->a].i = (int8_t)(uint8_t)R[in->b].i; REG_NEXT();
+
+        // Memory
+        REG_CASE(R_LOAD): R[in->a] = loadSlot((size_t)R[in->b].i); REG_NEXT();
+        REG_CASE(R_STORE): storeSlot((size_t)R[in->b].i, R[in->c]); REG_NEXT();
+        REG_CASE(R_LOADB): R[in->a].i = (int8_t)loadByte((size_t)R[in->b].i); REG_NEXT();
+        REG_CASE(R_STOREB): storeByte((size_t)R[in->b].i, (uint8_t)R[in->c].i); REG_NEXT();
+        REG_CASE(R_LOADL): R[in->a] = loadSlot(fp + in->x); REG_NEXT();
+        REG_CASE(R_STOREL): storeSlot(fp + in->x, R[in->b]); REG_NEXT();
+        REG_CASE(R_LOADG): R[in->a] = loadSlot((size_t)in->x); REG_NEXT();
+        REG_CASE(R_STOREG): storeSlot((size_t)in->x, R[in->b]); REG_NEXT();
+
+        REG_CASE(R_ALLOC):
+            R[in->a].i = (int64_t)heap.allocate(R[in->b].i, in->x != 0);
+            if (heap.corrupted()) goto heap_corrupted;
+            REG_NEXT();
+        REG_CASE(R_REALLOC):
+            R[in->a].i = (int64_t)heap.reallocate((size_t)R[in->b].i, R[in->c].i);
+            if (heap.corrupted()) goto heap_corrupted;
+            REG_NEXT();
+        REG_CASE(R_FREE):
+            heap.release((size_t)R[in->b].i);
+            if (heap.corrupted()) goto heap_corrupted;
+            REG_NEXT();
+
+        // Control flow
+        REG_CASE(R_JMP): REG_JUMP(); REG_NEXT();
+        REG_CASE(R_JT): if (R[in->b].i != 0) REG_JUMP(); REG_NEXT();
+        REG_CASE(R_JF): if (R[in->b].i == 0) REG_JUMP(); REG_NEXT();
+        REG_CASE(R_JFIEQ): REG_BRANCH_IF_NOT(==); REG_NEXT();
+        REG_CASE(R_JFINE): REG_BRANCH_IF_NOT(!=); REG_NEXT();
+        REG_CASE(R_JFILT): REG_BRANCH_IF_NOT(<); REG_NEXT();
+        REG_CASE(R_JFIGT): REG_BRANCH_IF_NOT(>); REG_NEXT();
+        REG_CASE(R_JFILE): REG_BRANCH_IF_NOT(<=); REG_NEXT();
+        REG_CASE(R_JFIGE): REG_BRANCH_IF_NOT(>=); REG_NEXT();
+        REG_CASE(R_JFIEQK): REG_BRANCH_IF_NOT_K(==); REG_NEXT();
+        REG_CASE(R_JFINEK): REG_BRANCH_IF_NOT_K(!=); REG_NEXT();
+        REG_CASE(R_JFILTK): REG_BRANCH_IF_NOT_K(<); REG_NEXT();
+        REG_CASE(R_JFIGTK): REG_BRANCH_IF_NOT_K(>); REG_NEXT();
+        REG_CASE(R_JFILEK): REG_BRANCH_IF_NOT_K(<=); REG_NEXT();
+        REG_CASE(R_JFIGEK): REG_BRANCH_IF_NOT_K(>=); REG_NEXT();
+
+        REG_CASE(R_ARG): {
+            // Arguments go straight into the callee's frame slots
+            size_t addr = sp + (size_t)in->x * sizeof(Slot);
+            if (addr + sizeof(Slot) > stackLimit) {
+                output << "[ERROR] Stack overflow\n";
+                goto failed;
             }
+            storeSlot(addr, R[in->b]);
+            REG_NEXT();
+        }
+
+        REG_CASE(R_CALL): {
+            if (executed >= limit) {
+                pc = in;    // Runs again on resume
+                goto budget_call;
+            }
+            const RegFunction& fn = prog.regFunctions[in->x];
+            if (regFrames.size() >= VM_MAX_CALL_DEPTH || R + window + fn.numRegs > regEnd) {
+                output << "[ERROR] Stack overflow\n";
+                goto failed;
+            }
+            regFrames.push_back({pc, fp, R, window, in->a});
+            R += window;
+            window = fn.numRegs;
+            fp = sp;
+            pc = code + fn.entry;
+            PROFILE_ENTER(fn.entry);
+            REG_NEXT();
+        }
+
+        REG_CASE(R_CALLB): {
+            // R_ARG left the arguments at sp, as for R_CALL
+            Slot args[BUILTIN_MAX_ARGS];
+            int argc = BUILTINS[in->x].argc();
+            for (int i = 0; i < argc; i++) args[i] = loadSlot(sp + i * sizeof(Slot));
+            R[in->a] = callBuiltin(in->x, memory, args);
+            REG_NEXT();
+        }
+
+        REG_CASE(R_RET): {
+            Slot val = R[in->b];
+            sp = fp;
+            if (regFrames.empty()) goto done;
+            const RegFrame& frame = regFrames.back();
+            pc = frame.returnPc;
+            fp = frame.savedFp;
+            R = frame.savedRegs;
+            window = frame.savedWindow;
+            R[frame.dst] = val;
+            regFrames.pop_back();
+            PROFILE_LEAVE();
+            REG_NEXT();
+        }
 
-            if (cycles >= maxCycles) {
-                output << "[ERROR] Infinite loop detected\n";
+        REG_CASE(R_ENTER):
+            sp = fp + in->x;
+            if (sp > stackLimit) {
+                output << "[ERROR] Stack overflow\n";
+                goto failed;
             }
+            REG_NEXT();
+
+        // I/O
+        REG_CASE(R_PRINT): output << R[in->b].i << "\n"; CHECK_OUTPUT(); REG_NEXT();
+        REG_CASE(R_PRINTC): output << (char)R[in->b].i; CHECK_OUTPUT(); REG_NEXT();
+
+        REG_CASE(R_PRINTS): {
+            size_t addr = (size_t)R[in->b].i;
+            size_t end = addr;
+            while (end < memory.size() && memory[end] != 0) end++;
+            if (end > addr) output.write((const char*)&memory[addr], end - addr);
+            CHECK_OUTPUT();
+            REG_NEXT();
+        }
+
+        REG_CASE(R_PRINTF):
+            printFormatted(prog.strings[in->x], R[in->b]);
+            CHECK_OUTPUT();
+            REG_NEXT();
+
+    #if OMNI_THREADED_DISPATCH
+    rop_invalid:
+    #else
+        default:
+            break;
         }
-    };
+    #endif
+        output << "[ERROR] Invalid opcode\n";
+        goto failed;
+
+    heap_corrupted:
+        // A program wrote over allocator metadata, e.g. through a freed pointer
+        output << "[ERROR] Heap corruption detected\n";
+        goto failed;
+
+    budget_taken:
+        if (executed >= maxCycles) goto out_of_budget;
+        executed++;     // The jump, as REG_NEXT would count it
+        goto paused;
+    budget_call:
+        if (executed >= maxCycles) goto out_of_budget;
+        if (PROFILE) profiler.unstep(pc - code);
+    paused:
+        regPc = (size_t)(pc - code);
+        regBase = (size_t)(R - regFile.data());
+        regWindow = window;
+        cycles = executed;
+        return;
+
+    out_of_budget:
+        output << "[ERROR] Infinite loop detected\n";
+        if (PROFILE) profiler.exhausted();
+    failed:
+        runState = RUN_ERROR;
+    done:
+        if (runState == RUN_RUNNING) runState = RUN_FINISHED;
+        running = nullptr;
+        cycles = executed;
+        if (PROFILE) profile = profiler.finish(executed);
+    }
+
+    #undef REG_BINARY
+    #undef REG_COMPARE
+    #undef REG_INT_OP
+    #undef REG_WRAP_OP
+    #undef REG_INT_COMPARE
+    #undef REG_JUMP
+    #undef REG_TIER_UP
+    #undef REG_BRANCH_IF_NOT
+    #undef REG_BRANCH_IF_NOT_K
+    #undef REG_CASE
+    #undef REG_NEXT
+    #undef CHECK_BUDGET
+    #undef CHECK_OUTPUT
+    #undef PROFILE_STEP
+    #undef PROFILE_ENTER
+    #undef PROFILE_LEAVE
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,216 @@
+// OmniNative Virtual Machine - Real C Execution
+#pragma once
+#include "common.h"
+#include "heap.h"
+#include "memory.h"
+#include "output.h"
+#include "jit.h"
+#include "profiler.h"
+#include <memory>
+#include <vector>
+#include <stack>
+#include <string>
+
+namespace OmniNative {
+
+    // Linear memory layout: [data segment][call stack][heap ->]. Pages are
+    // committed as the program touches them (see memory.h).
+    const size_t VM_MEMORY_SIZE = 1024 * 1024;   // 1MB
+    const size_t VM_MAX_MEMORY_SIZE = 64 * 1024 * 1024;  // Heap growth stops here; malloc returns NULL
+    const size_t VM_STACK_SIZE = 256 * 1024;     // Frames for locals and params
+    const size_t VM_MAX_CALL_DEPTH = 100000;
+    const size_t VM_EVAL_STACK_SLOTS = 32 * 1024;  // Operand stack, shared by all frames
+    const size_t VM_REG_FILE_SLOTS = 256 * 1024;   // Register windows, allocated on first use
+    const size_t VM_OUTPUT_CAPACITY = 64 * 1024;   // Output ring (see output.h)
+
+    // Computed-goto dispatch where the compiler supports labels-as-values
+    #if defined(__GNUC__) || defined(__clang__)
+    #define OMNI_THREADED_DISPATCH 1
+    #else
+    #define OMNI_THREADED_DISPATCH 0
+    #endif
+
+    // Where a run started with VirtualMachine::start() stands
+    enum RunState {
+        RUN_RUNNING,    // Paused between slices
+        RUN_FINISHED,
+        RUN_ERROR       // Ended with an [ERROR] line in the output
+    };
+
+    // A run paused where the startup code calls main(), global
+    // initializers done; see VirtualMachine::snapshot(). Immutable, so any
+    // number of VMs on any threads can fork() from one.
+    class VmSnapshot {
+    private:
+        friend class VirtualMachine;
+
+        const Program* prog = nullptr;
+        std::unique_ptr<MemoryImage> memory;       // All of VM memory
+        size_t memorySize = 0;
+        std::unique_ptr<MemoryImage> registers;    // Register code: regFile
+        VmHeap heap;
+        std::string output;
+        size_t cycles = 0;
+        size_t ip = 0, fp = 0, sp = 0, stackLimit = 0;
+        std::vector<Slot> evalStack;               // Stack code: operands below tos
+        Slot tos = {0};
+        size_t regPc = 0;
+        uint32_t regWindow = 0;
+        std::vector<uint32_t> loopCounts;
+    };
+
+    class VirtualMachine {
+    private:
+        // Saved caller state for RET
+        struct Frame {
+            size_t returnIp;
+            size_t savedFp;
+        };
+
+        // Stack-based VM with memory
+        VmBytes memory;
+        std::vector<Slot, ZeroPageAllocator<Slot>> evalStack;  // Flat; bounds proven by the verifier
+        // Return links, kept out of linear memory so a stray store cannot
+        // redirect control flow. Capacity survives across runs, so calls
+        // stop allocating once the deepest recursion has been seen.
+        std::vector<Frame> callStack;
+        std::stack<size_t> loopStack;  // For break/continue
+
+        // Register mode: each call gets a window of regFile
+        struct RegFrame {
+            const RegInstr* returnPc;
+            size_t savedFp;
+            Slot* savedRegs;
+            uint32_t savedWindow;
+            uint8_t dst;
+        };
+        std::vector<Slot, ZeroPageAllocator<Slot>> regFile;
+        std::vector<RegFrame> regFrames;
+
+        // Tiering: taken backward jumps per loop header of the register
+        // code; hot loops run as native code (jit.h)
+        std::vector<uint32_t> loopCounts;
+        JitCompiler jit;
+        bool jitEnabled = OMNI_JIT;
+
+        // Profiled runs use a separate instantiation of each interpreter
+        bool profiling = false;
+        uint64_t sampleInterval = 0;
+        Profiler profiler;
+        Profile profile;
+
+        size_t ip = 0;  // Instruction pointer
+        size_t fp = 0;  // Frame pointer (base of current frame)
+        size_t sp = 0;  // Top of the frame stack
+        size_t stackLimit = 0;
+        VmHeap heap;            // malloc/free within memory, after the call stack
+
+        OutputRing output{VM_OUTPUT_CAPACITY};
+        size_t maxCycles = 10000000;  // Infinite loop protection
+        size_t cycles = 0;
+
+        // Between slices of a run: the interpreter's locals (ip, fp and sp
+        // are members already)
+        const Program* running = nullptr;
+        RunState runState = RUN_FINISHED;
+        size_t evalTop = 0;           // Stack code: operand stack depth
+        Slot savedTos = {0};
+        size_t regPc = 0;             // Register code: next instruction,
+        size_t regBase = 0;           // current window in regFile
+        uint32_t regWindow = 0;
+
+        // Memory or registers may hold values of an earlier run; start()
+        // wipes them so every run sees what a new VM would
+        bool dirty = false;
+
+        void wipeMemory();
+        bool atMainCall(const Program& prog) const;
+        void printFormatted(const std::string& spec, Slot val);
+        void load(const Program& prog);
+        template <bool PROFILE> void runStack(const Program& prog, size_t limit);
+        template <bool PROFILE> void runRegisters(const Program& prog, size_t limit);
+
+    public:
+        VirtualMachine();
+
+        std::string getOutput() { return output.contents(); }
+
+        // Instructions dispatched by the last run
+        size_t getCycles() const { return cycles; }
+
+        // Allocator counters for the last run
+        HeapStats getHeapStats() const { return heap.stats(); }
+
+        // Native loops for register code; on by default where supported.
+        // Output and cycle counts are the same either way.
+        void setJitEnabled(bool enabled) { jitEnabled = enabled && OMNI_JIT; }
+        JitStats getJitStats() const { return jit.stats(); }
+
+        // Records a Profile of each following run, sampling the call stack
+        // and line every `interval` instructions when it is nonzero.
+        // Profiled runs stay in the interpreter; output and cycle counts do
+        // not change.
+        void setProfiling(bool enabled, uint64_t interval = 0) {
+            profiling = enabled;
+            sampleInterval = interval;
+        }
+        // Profile of the last profiled run
+        const Profile& getProfile() const { return profile; }
+
+        // Returns the VM to the state of a new one, settings included,
+        // keeping its allocations. Costs about the pages the last run
+        // touched, so a VmPool (pool.h) recycles instances with it.
+        void reset();
+
+        void clearOutput() { output.clear(); }
+
+        // The ring runs append to, for hosts that read it in place. Under
+        // OUTPUT_BLOCK (the default) a slice that fills it ends at the next
+        // backward jump or call, and step() does nothing until the host
+        // has read; run() grows the ring instead, since nobody reads before
+        // it returns. Setting the capacity or policy empties the ring.
+        OutputRing& outputRing() { return output; }
+        void setOutputPolicy(size_t capacity, OutputPolicy policy) { output.configure(capacity, policy); }
+
+        // Memory access helpers. Out-of-bounds loads read 0 and stores are
+        // dropped; `addr + 8` would wrap for addresses near 2^64, so the
+        // check is written against the end instead.
+        bool slotInBounds(size_t addr) const {
+            return memory.size() >= sizeof(Slot) && addr <= memory.size() - sizeof(Slot);
+        }
+        Slot loadSlot(size_t addr);
+        void storeSlot(size_t addr, Slot val);
+        uint8_t loadByte(size_t addr);
+        void storeByte(size_t addr, uint8_t val);
+
+        // Runs a verified program (see verifyProgram in bytecode.h), on the
+        // register code when the program was lowered to it
+        void run(const Program& prog);
+
+        // The same run in slices: start() loads `prog`, which must outlive
+        // the run, and each step() executes about `budget` more
+        // instructions (it stops at the first backward jump or call past
+        // that), so a host can yield between slices. Output and cycle
+        // counts are the same as for run(). cancel() ends a run early.
+        void start(const Program& prog);
+        RunState step(size_t budget);
+        void cancel();
+        RunState state() const { return runState; }
+
+        // Runs the startup code of `prog` up to its call to main() and
+        // captures the VM there; the VM stays paused at that point, so step()
+        // carries on. Returns null if the run ended first (it has then
+        // finished or failed as run() would). The program must outlive the
+        // snapshot.
+        std::shared_ptr<const VmSnapshot> snapshot(const Program& prog);
+        // start() from a snapshot: memory is mapped copy-on-write from it
+        // (see MemoryImage), so forking and the wipe before the next run
+        // cost the pages the run writes, not the size of memory. Output
+        // and cycle counts are those of an unforked run.
+        void fork(const VmSnapshot& snap);
+
+        // Output produced since the last drain
+        std::string drainOutput();
+    };
+
+}
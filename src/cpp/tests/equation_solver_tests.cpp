@@ -0,0 +1,206 @@
+// OmniMath checks through the C API the site calls; exits 1 if any fails
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Fixed layouts shared with JS (equation_solver.cpp)
+namespace OmniMath {
+    struct SolveStats {
+        double residual;
+        double wallTimeMs;
+        int32_t iterations;
+        int32_t functionEvals;
+        int32_t derivativeEvals;
+        int32_t reason;
+        int32_t traceLength;
+        int32_t reserved;
+    };
+
+    struct IntegrateStats {
+        double errorEstimate;
+        int32_t segments;
+        int32_t functionEvals;
+        int32_t converged;
+        int32_t reserved;
+    };
+}
+
+extern "C" {
+    double solve_equation(const char* equation);
+    double solve_equation_stats(const char* equation, OmniMath::SolveStats* stats, double* trace, int traceCapacity);
+    int solve_sweep(const char* expression, const char* param, const double* values, int n, double* out);
+    double integrate_expression(const char* expression, double a, double b, double tolerance,
+                                OmniMath::IntegrateStats* stats);
+}
+
+namespace {
+
+    using OmniMath::IntegrateStats;
+    using OmniMath::SolveStats;
+
+    // ConvergenceReason
+    const int32_t CONVERGED = 0, ZERO_DERIVATIVE = 1, NAN_VALUE = 3;
+
+    // printf into a std::string, for failure messages
+    template <typename... Args>
+    std::string describe(const char* fmt, Args... args) {
+        char text[512];
+        std::snprintf(text, sizeof(text), fmt, args...);
+        return text;
+    }
+
+    // Each check returns what went wrong, or an empty string
+    struct Check {
+        const char* name;
+        std::string (*run)();
+    };
+
+    // Counters add up: every step costs one f and one derivative
+    // evaluation, plus the f(x) that ends the loop
+    std::string checkSolveStats() {
+        SolveStats st = {};
+        double trace[2 * 64];
+        double x = solve_equation_stats("x^2 = 2", &st, trace, 64);
+        if (std::abs(x - std::sqrt(2.0)) > 1e-7 || st.reason != CONVERGED || st.residual >= 1e-7) {
+            return describe("root %.17g, reason %d, residual %g", x, st.reason, st.residual);
+        }
+        if (x != solve_equation("x^2 = 2")) return describe("solve_equation gave %.17g", solve_equation("x^2 = 2"));
+        if (st.iterations < 1 || st.derivativeEvals != st.iterations || st.functionEvals != st.iterations + 1) {
+            return describe("%d iterations, %d f evals, %d derivatives", st.iterations, st.functionEvals, st.derivativeEvals);
+        }
+        if (st.traceLength != st.functionEvals || trace[0] != 1.0 || trace[2 * st.traceLength - 2] != x ||
+            std::abs(trace[2 * st.traceLength - 1]) != st.residual) {
+            return describe("trace of %d points ends at (%g, %g)", st.traceLength, trace[2 * st.traceLength - 2],
+                            trace[2 * st.traceLength - 1]);
+        }
+        if (st.wallTimeMs < 0) return describe("wall time %g", st.wallTimeMs);
+        return "";
+    }
+
+    // The trace stops at its capacity; the solve does not
+    std::string checkSolveTraceBounded() {
+        SolveStats st = {};
+        double trace[6] = {0, 0, 0, 0, -7, -7};
+        solve_equation_stats("x^3 - 2*x - 5", &st, trace, 2);
+        if (st.traceLength != 2 || trace[4] != -7 || trace[5] != -7) return describe("%d points traced", st.traceLength);
+        if (st.reason != CONVERGED || st.functionEvals <= 2) return describe("reason %d after %d evals", st.reason, st.functionEvals);
+        solve_equation_stats("x^3 - 2*x - 5", nullptr, nullptr, 8);   // Both are optional
+        return "";
+    }
+
+    std::string checkSolveFailureReasons() {
+        SolveStats st = {};
+        solve_equation_stats("x - x + 5", &st, nullptr, 0);
+        if (st.reason != ZERO_DERIVATIVE || st.iterations != 0) return describe("flat: reason %d, %d iterations", st.reason, st.iterations);
+        st = {};
+        solve_equation_stats("sqrt(x - 3)", &st, nullptr, 0);
+        if (st.reason != NAN_VALUE) return describe("sqrt(x - 3): reason %d", st.reason);
+        return "";
+    }
+
+    std::string checkIntegrateConverges() {
+        IntegrateStats st = {};
+        double r = integrate_expression("sqrt(x)", 0, 1, 1e-10, &st);
+        if (std::abs(r - 2.0 / 3.0) > 1e-9 || !st.converged || st.errorEstimate > 1e-9) {
+            return describe("result %.17g, error %g, converged %d", r, st.errorEstimate, st.converged);
+        }
+        return "";
+    }
+
+    // Enough values for several worker chunks; warm starts must stay on
+    // the positive root a cold start from 1 finds
+    std::string checkSweep() {
+        const int n = 3000;
+        std::vector<double> values(n), roots(n);
+        for (int i = 0; i < n; i++) values[i] = 1 + i * 0.25;
+        int converged = solve_sweep("x^2 = a", "a", values.data(), n, roots.data());
+        if (converged != n) return describe("%d of %d converged", converged, n);
+        for (int i = 0; i < n; i++) {
+            if (std::abs(roots[i] * roots[i] - values[i]) > 1e-6 || roots[i] <= 0) {
+                return describe("a = %g: root %.17g", values[i], roots[i]);
+            }
+        }
+        return "";
+    }
+
+    // Values without a root give NaN and do not derail the ones after them
+    std::string checkSweepFailures() {
+        const double values[] = {4, 9, -1, -4, 16, 25, 36};
+        double roots[7];
+        int converged = solve_sweep("x^2 = a", "a", values, 7, roots);
+        if (converged != 5) return describe("%d of 7 converged", converged);
+        for (int i = 0; i < 7; i++) {
+            bool none = values[i] < 0;
+            if (none ? !std::isnan(roots[i]) : std::abs(roots[i] - std::sqrt(values[i])) > 1e-6) {
+                return describe("a = %g: root %.17g", values[i], roots[i]);
+            }
+        }
+        if (solve_sweep("x^2 = a", "a", values, 0, roots) != 0) return "empty sweep converged";
+        return "";
+    }
+
+    // K15 is exact on a degree-5 polynomial: one segment, 15 evaluations
+    std::string checkIntegrateStats() {
+        IntegrateStats st = {};
+        double r = integrate_expression("x^5 - 3*x", 0, 2, 1e-10, &st);
+        if (std::abs(r - (64.0 / 6.0 - 6.0)) > 1e-12 || st.segments != 1 || st.functionEvals != 15 || !st.converged) {
+            return describe("result %.17g, %d segments, %d evals, converged %d", r, st.segments, st.functionEvals, st.converged);
+        }
+        // Swapped limits flip the sign; every split adds two segments of 15 evaluations
+        st = {};
+        double back = integrate_expression("exp(x)", 3, 0, 1e-12, &st);
+        if (std::abs(back + std::exp(3.0) - 1) > 1e-9 || st.functionEvals != 15 * (2 * st.segments - 1)) {
+            return describe("result %.17g, %d segments, %d evals", back, st.segments, st.functionEvals);
+        }
+        return "";
+    }
+
+    // inf <= max(tol, tol * inf) holds, which once reported convergence
+    std::string checkIntegrateDivergent() {
+        IntegrateStats st = {};
+        double r = integrate_expression("1/x", -1, 1, 1e-8, &st);
+        if (st.converged) return describe("result %g, error %g reported as converged", r, st.errorEstimate);
+        return "";
+    }
+
+    // Every segment ends up one ulp wide while the error stays above the
+    // tolerance; the loop has to notice nothing can be bisected any more
+    std::string checkIntegrateStopsWhenUnsplittable() {
+        double a = 1, b = a;
+        for (int i = 0; i < 8; i++) b = std::nextafter(b, 2.0);
+        IntegrateStats st = {};
+        integrate_expression("sin(100000000000000000000*x)", a, b, 1e-300, &st);
+        if (st.converged || st.segments > 8) return describe("%d segments, converged %d", st.segments, st.converged);
+        // Segments kept whole are not evaluated again
+        if (st.functionEvals != 15 * (2 * st.segments - 1)) return describe("%d evals for %d segments", st.functionEvals, st.segments);
+        return "";
+    }
+
+    const Check CHECKS[] = {
+        {"solve-stats", checkSolveStats},
+        {"solve-trace-bounded", checkSolveTraceBounded},
+        {"solve-failure-reasons", checkSolveFailureReasons},
+        {"sweep", checkSweep},
+        {"sweep-failures", checkSweepFailures},
+        {"integrate-converges", checkIntegrateConverges},
+        {"integrate-stats", checkIntegrateStats},
+        {"integrate-divergent", checkIntegrateDivergent},
+        {"integrate-stops-when-unsplittable", checkIntegrateStopsWhenUnsplittable},
+    };
+
+}
+
+int main() {
+    int failed = 0, total = 0;
+    for (const Check& check : CHECKS) {
+        total++;
+        std::string problem = check.run();
+        if (problem.empty()) continue;
+        failed++;
+        std::printf("FAIL %s: %s\n", check.name, problem.c_str());
+    }
+    std::printf("%d of %d checks passed\n", total - failed, total);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,691 @@
+// OmniNative regression cases: programs that once crashed the host,
+// miscompiled, or were accepted when they should not be, then checks of
+// features against plain runs. Each runs on the stack and register VMs;
+// exits 1 if any fails.
+#include "bytecode.h"
+#include "common.h"
+#include "compiler.h"
+#include "image.h"
+#include "jit.h"
+#include "pool.h"
+#include "vm.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+    using namespace OmniNative;
+
+    // `expected` is the exact output, or with `compileError` set, text the
+    // compile error must contain
+    struct Case {
+        const char* name;
+        const char* source;
+        const char* expected;
+        bool compileError = false;
+    };
+
+    const Case CASES[] = {
+        {"fold-matches-runtime", R"(
+int main() {
+    long m = -9223372036854775807 - 1;
+    long n = -1;
+    int s = 65;
+    double big = 1e30;
+    printf("%d\n", (-9223372036854775807 - 1) / -1 == m / n);
+    printf("%d\n", (-9223372036854775807 - 1) % -1 == m % n);
+    printf("%d\n", (1 << 65) == (1 << s));
+    printf("%d\n", (-8 >> 70) == (-8 >> (s + 5)));
+    printf("%d\n", (long)1e30 == (long)big);
+    return 0;
+}
+)", "1\n1\n1\n1\n1\n"},
+        {"slot-address-wraps", R"(
+int main() {
+    long *p = 0;
+    p = p - 1;
+    *p = 42;
+    printf("%d\n", *p);
+    long sum = 0;
+    for (int i = 0; i < 5000; i++) { p[0] = i; sum += p[0]; }
+    printf("%d\n", sum);
+    return 0;
+}
+)", "0\n0\n"},
+        {"heap-small-link-overwritten", R"(
+int main() {
+    long *p = malloc(8);
+    free(p);
+    p[0] = 1000000000000;
+    malloc(8);
+    malloc(8);
+    printf("unreachable\n");
+    return 0;
+}
+)", "[ERROR] Heap corruption detected\n"},
+        {"heap-large-link-overwritten", R"(
+int main() {
+    long *p = malloc(2000);
+    long *q = malloc(2000);
+    free(p);
+    p[0] = -4096;
+    p[-1] = 1 << 40;
+    malloc(4000);
+    printf("unreachable\n");
+    return 0;
+}
+)", "[ERROR] Heap corruption detected\n"},
+        {"heap-header-overwritten", R"(
+int main() {
+    long *p = malloc(8);
+    p[-1] = 1000000;
+    free(p);
+    long *q = malloc(8);
+    printf("%d\n", q != p);
+    return 0;
+}
+)", "1\n"},
+        {"builtins-match-libc", R"(
+char a[32];
+char b[32];
+int main() {
+    strcpy(a, "hello");
+    strncpy(b, "worldwide", 5);
+    b[5] = 0;
+    strcat(a, b);
+    printf("%s %d %s\n", a, strlen(a), b);
+    printf("%d %d %d %d\n", strcmp(a, b) < 0, strcmp(b, a) > 0, strncmp(a, "help", 3), strncmp(a, "help", 4) < 0);
+    printf("%d %d\n", strchr(a, 'w') - a, strchr(a, 'z') == 0);
+    memset(b, 'x', 3);
+    memcpy(b + 10, a, 6);
+    printf("%s %s %d\n", b, b + 10, memcmp(a, "hellp", 5) < 0);
+    memmove(a + 2, a, 5);
+    printf("%s\n", a);
+    printf("%.6f %.6f %.6f %.6f\n", sin(1.0), cos(1.0), tan(0.5), sqrt(2.0));
+    printf("%.6f %.6f %.6f %.6f\n", pow(2.0, 10.5), exp(1.5), log(10.0), log10(12345.0));
+    printf("%d %.2f %.1f %.1f %.1f %.1f\n", abs(-42), fabs(-2.5), floor(-2.5), ceil(-2.5), floor(2.5), ceil(2.5));
+    printf("%d %d %.3f\n", atoi("  -123abc"), atoi("77"), atof("3.25e2"));
+    printf("%s %s\n", itoa(255, a, 16), itoa(-10, b, 10));
+    return 0;
+}
+)",
+         "helloworld 10 world\n"
+         "1 1 0 1\n"
+         "5 1\n"
+         "xxxld hellow 1\n"
+         "hehellorld\n"
+         "0.841471 0.540302 0.546302 1.414214\n"
+         "1448.154688 4.481689 2.302585 4.091491\n"
+         "42 2.50 -3.0 -2.0 2.0 3.0\n"
+         "-123 77 325.000\n"
+         "ff -10\n"},
+        {"inner-dimension-missing-global", "int a[20][];\nint main() { return 0; }\n", "array size missing", true},
+        {"inner-dimension-missing-local", "int main() { int a[3][]; return 0; }\n", "array size missing", true},
+    };
+
+    bool runCase(const Case& c, ExecMode mode) {
+        const char* modeName = mode == EXEC_STACK ? "stack" : "register";
+        CompileOptions options;
+        options.mode = mode;
+        std::string got;
+        try {
+            Program prog = compileSource(c.source, options);
+            if (c.compileError) {
+                std::printf("FAIL %s (%s): compiled, expected error containing '%s'\n", c.name, modeName, c.expected);
+                return false;
+            }
+            VirtualMachine vm;
+            vm.run(prog);
+            got = vm.getOutput();
+        } catch (const CompileError& e) {
+            if (c.compileError && std::string(e.what()).find(c.expected) != std::string::npos) return true;
+            std::printf("FAIL %s (%s): compile error: %s\n", c.name, modeName, e.what());
+            return false;
+        } catch (const std::exception& e) {
+            std::printf("FAIL %s (%s): %s\n", c.name, modeName, e.what());
+            return false;
+        }
+        if (got == c.expected) return true;
+        std::printf("FAIL %s (%s): expected\n%sgot\n%s\n", c.name, modeName, c.expected, got.c_str());
+        return false;
+    }
+
+    // printf into a std::string, for failure messages
+    template <typename... Args>
+    std::string describe(const char* fmt, Args... args) {
+        char text[512];
+        std::snprintf(text, sizeof(text), fmt, args...);
+        return text;
+    }
+
+    // Checks beyond one program's output. Each returns what went wrong, or
+    // an empty string.
+    struct Check {
+        const char* name;
+        std::string (*run)(ExecMode mode);
+        bool perMode = true;    // Run once for each ExecMode
+    };
+
+    // Programs the feature checks run under different settings; between
+    // them they cover loops, recursion, doubles, arrays, the heap,
+    // built-ins and formatted output
+    struct Sample {
+        const char* name;
+        const char* source;
+    };
+
+    const Sample SAMPLES[] = {
+        {"recursion", R"(
+int fib(int n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+int gcd(int a, int b) { return b == 0 ? a : gcd(b, a % b); }
+int main() {
+    printf("%d %d\n", fib(18), gcd(1071, 462));
+    return 0;
+}
+)"},
+        {"matrix", R"(
+double a[24][24];
+double b[24][24];
+int main() {
+    for (int i = 0; i < 24; i++)
+        for (int j = 0; j < 24; j++) { a[i][j] = i + j * 0.5; b[i][j] = i - j; }
+    double trace = 0;
+    for (int i = 0; i < 24; i++) {
+        double sum = 0;
+        for (int k = 0; k < 24; k++) sum += a[i][k] * b[k][i];
+        trace += sum;
+    }
+    printf("%.3f\n", trace);
+    return 0;
+}
+)"},
+        {"sort-heap", R"(
+int main() {
+    int n = 500;
+    int* v = malloc(n * 8);
+    int seed = 7;
+    for (int i = 0; i < n; i++) { seed = (seed * 1103515245 + 12345) % 2147483647; v[i] = seed % 1000; }
+    for (int i = 1; i < n; i++) {
+        int x = v[i], j = i - 1;
+        while (j >= 0 && v[j] > x) { v[j + 1] = v[j]; j--; }
+        v[j + 1] = x;
+    }
+    long check = 0;
+    for (int i = 0; i < n; i++) check = check * 31 % 1000003 + v[i];
+    int* w = realloc(v, n * 16);
+    int* z = calloc(10, 8);
+    printf("%d %d %ld %d\n", w[0], w[n - 1], check, z[9]);
+    free(w);
+    free(z);
+    return 0;
+}
+)"},
+        {"strings", R"(
+char buf[64];
+int main() {
+    strcpy(buf, "omni");
+    strcat(buf, "native");
+    int vowels = 0;
+    for (int i = 0; buf[i]; i++) if (buf[i] == 'o' || buf[i] == 'a' || buf[i] == 'i' || buf[i] == 'e') vowels++;
+    printf("%s %d %d %d\n", buf, strlen(buf), vowels, strcmp(buf, "omni") > 0);
+    for (int i = 0; i < 40; i++) printf("%d:%.2f%c", i, sqrt(i), i % 8 == 7 ? '\n' : ' ');
+    return 0;
+}
+)"},
+    };
+
+    struct Outcome {
+        RunState state;
+        std::string output;
+        size_t cycles;
+    };
+
+    Outcome runSample(const Sample& sample, ExecMode mode, int optLevel = 0) {
+        CompileOptions options;
+        options.mode = mode;
+        options.optLevel = optLevel;
+        Program prog = compileSource(sample.source, options);
+        VirtualMachine vm;
+        vm.run(prog);
+        return {vm.state(), vm.getOutput(), vm.getCycles()};
+    }
+
+    // -O1 and -O2 print what -O0 prints; stack code, which keeps shared
+    // values in frame slots, must not get slower for it
+    std::string checkOptLevelsAgree(ExecMode mode) {
+        for (const Sample& sample : SAMPLES) {
+            Outcome base = runSample(sample, mode);
+            if (base.state != RUN_FINISHED) return describe("%s: -O0 run ended in state %d", sample.name, (int)base.state);
+            for (int level = 1; level <= 2; level++) {
+                Outcome opt = runSample(sample, mode, level);
+                if (opt.state != RUN_FINISHED || opt.output != base.output) {
+                    return describe("%s: -O%d printed\n%sinstead of\n%s", sample.name, level, opt.output.c_str(), base.output.c_str());
+                }
+                if (mode == EXEC_STACK && opt.cycles > base.cycles) {
+                    return describe("%s: -O%d took %zu cycles, -O0 %zu", sample.name, level, opt.cycles, base.cycles);
+                }
+            }
+        }
+        return "";
+    }
+
+    // Steps a started VM to the end, reading its output after every slice.
+    // A slice that neither runs nor frees output space counts as stalled.
+    Outcome finishSliced(VirtualMachine& vm, size_t budget, size_t& slices, bool& stalled) {
+        Outcome out{vm.state(), "", vm.getCycles()};
+        slices = 0;
+        stalled = false;
+        while (out.state == RUN_RUNNING && !stalled) {
+            size_t before = vm.getCycles();
+            out.state = vm.step(budget);
+            slices++;
+            std::string part = vm.drainOutput();
+            stalled = part.empty() && vm.getCycles() == before && out.state == RUN_RUNNING;
+            out.output += part;
+        }
+        out.cycles = vm.getCycles();
+        return out;
+    }
+
+    // Any budget gives run()'s output and cycle count, also when a small
+    // blocking ring makes slices end early
+    std::string checkSlicesMatchRun(ExecMode mode) {
+        for (const Sample& sample : SAMPLES) {
+            CompileOptions options;
+            options.mode = mode;
+            Program prog = compileSource(sample.source, options);
+            Outcome whole = runSample(sample, mode);
+            for (size_t budget : {(size_t)1, (size_t)97, (size_t)100000}) {
+                for (size_t ring : {(size_t)0, (size_t)64}) {
+                    VirtualMachine vm;
+                    if (ring) vm.setOutputPolicy(ring, OUTPUT_BLOCK);
+                    vm.start(prog);
+                    size_t slices;
+                    bool stalled;
+                    Outcome sliced = finishSliced(vm, budget, slices, stalled);
+                    if (stalled) return describe("%s, budget %zu: stalled after %zu slices", sample.name, budget, slices);
+                    if (sliced.state != whole.state || sliced.output != whole.output || sliced.cycles != whole.cycles) {
+                        return describe("%s, budget %zu, ring %zu: printed\n%sin %zu cycles instead of\n%sin %zu",
+                                        sample.name, budget, ring, sliced.output.c_str(), sliced.cycles,
+                                        whole.output.c_str(), whole.cycles);
+                    }
+                    if (budget == 1 && slices < 2) return describe("%s: one slice at budget 1", sample.name);
+                }
+            }
+        }
+        return "";
+    }
+
+    // Runs forked from one snapshot each match an unforked run, however
+    // much memory the ones before wrote and whether the VM ran one before;
+    // so does the snapshotted VM itself
+    std::string checkForksMatchRun(ExecMode mode) {
+        for (const Sample& sample : SAMPLES) {
+            CompileOptions options;
+            options.mode = mode;
+            Program prog = compileSource(sample.source, options);
+            Outcome whole = runSample(sample, mode);
+            VirtualMachine origin;
+            std::shared_ptr<const VmSnapshot> snap = origin.snapshot(prog);
+            if (!snap) return describe("%s: no snapshot", sample.name);
+            VirtualMachine reused;
+            for (int run = 0; run < 4; run++) {
+                VirtualMachine fresh;
+                VirtualMachine& vm = run == 0 ? fresh : run < 3 ? reused : origin;
+                if (run < 3) vm.fork(*snap);
+                size_t slices;
+                bool stalled;
+                Outcome forked = finishSliced(vm, 100000, slices, stalled);
+                if (stalled || forked.state != whole.state || forked.output != whole.output || forked.cycles != whole.cycles) {
+                    return describe("%s, run %d: printed\n%sin %zu cycles instead of\n%sin %zu", sample.name, run,
+                                    forked.output.c_str(), forked.cycles, whole.output.c_str(), whole.cycles);
+                }
+            }
+        }
+        return "";
+    }
+
+    // Every job's result is that of its own run(), duplicates (which fork
+    // from a shared snapshot) and compile errors included, on any number
+    // of threads
+    std::string checkBatchMatchesRun(ExecMode mode) {
+        std::vector<BatchJob> jobs;
+        std::vector<Outcome> expected;
+        for (int copy = 0; copy < 3; copy++) {
+            for (const Sample& sample : SAMPLES) {
+                BatchJob job;
+                job.source = sample.source;
+                job.options.mode = mode;
+                jobs.push_back(job);
+                expected.push_back(runSample(sample, mode));
+            }
+        }
+        BatchJob broken;
+        broken.source = "int main() { return undeclared; }\n";
+        broken.options.mode = mode;
+        jobs.push_back(broken);
+        for (size_t threads : {(size_t)1, (size_t)3, (size_t)0}) {
+            std::vector<BatchResult> results = runBatch(jobs, threads);
+            if (results.size() != jobs.size()) return describe("%zu results for %zu jobs", results.size(), jobs.size());
+            for (size_t i = 0; i < expected.size(); i++) {
+                const BatchResult& got = results[i];
+                if (got.state != expected[i].state || got.output != expected[i].output || got.cycles != expected[i].cycles) {
+                    return describe("%zu threads, job %zu: printed\n%sin %zu cycles instead of\n%sin %zu", threads, i,
+                                    got.output.c_str(), got.cycles, expected[i].output.c_str(), expected[i].cycles);
+                }
+            }
+            const BatchResult& failed = results.back();
+            if (failed.state != RUN_ERROR || failed.output.rfind("Compile Error:", 0) != 0) {
+                return describe("%zu threads, compile error: state %d, output %s", threads, (int)failed.state, failed.output.c_str());
+            }
+        }
+        return "";
+    }
+
+    // A VM back from a lease runs like a new one, whatever its last
+    // borrower changed; the pool keeps no more than its capacity
+    std::string checkPoolLeaseResets(ExecMode mode) {
+        const Sample& sample = SAMPLES[1];
+        CompileOptions options;
+        options.mode = mode;
+        Program prog = compileSource(sample.source, options);
+        VirtualMachine fresh;
+        fresh.run(prog);
+        VmPool pool(2);
+        {
+            VmPool::Lease lease = pool.acquire();
+            lease->setJitEnabled(false);
+            lease->setProfiling(true, 1);
+            lease->setOutputPolicy(16, OUTPUT_DROP);
+            lease->run(prog);
+        }
+        if (pool.idle() != 1) return describe("%zu idle after one lease", pool.idle());
+        {
+            VmPool::Lease lease = pool.acquire();
+            if (!lease->getOutput().empty() || lease->getCycles() != 0) return "returned VM kept its last run";
+            lease->run(prog);
+            if (lease->getOutput() != fresh.getOutput() || lease->getCycles() != fresh.getCycles()) {
+                return describe("printed\n%sin %zu cycles instead of\n%sin %zu", lease->getOutput().c_str(),
+                                lease->getCycles(), fresh.getOutput().c_str(), fresh.getCycles());
+            }
+            if (lease->getJitStats().loopsCompiled != fresh.getJitStats().loopsCompiled) return "JIT setting kept";
+            if (!lease->getProfile().samples.empty()) return "profiling setting kept";
+        }
+        {
+            VmPool::Lease a = pool.acquire(), b = pool.acquire(), c = pool.acquire();
+        }
+        if (pool.idle() != 2) return describe("%zu idle with capacity 2", pool.idle());
+        return "";
+    }
+
+    // Native loops change neither output nor cycle counts, at any level
+    std::string checkJitMatchesInterpreter(ExecMode) {
+        size_t compiled = 0;
+        for (const Sample& sample : SAMPLES) {
+            for (int level = 0; level <= 2; level++) {
+                CompileOptions options;
+                options.optLevel = level;
+                Program prog = compileSource(sample.source, options);
+                VirtualMachine native, interpreted;
+                native.setJitEnabled(true);
+                interpreted.setJitEnabled(false);
+                native.run(prog);
+                interpreted.run(prog);
+                compiled += native.getJitStats().loopsCompiled;
+                if (native.state() != interpreted.state() || native.getOutput() != interpreted.getOutput()) {
+                    return describe("%s -O%d: printed\n%sinstead of\n%s", sample.name, level, native.getOutput().c_str(),
+                                    interpreted.getOutput().c_str());
+                }
+                if (native.getCycles() != interpreted.getCycles()) {
+                    return describe("%s -O%d: %zu cycles, %zu interpreted", sample.name, level, native.getCycles(),
+                                    interpreted.getCycles());
+                }
+            }
+        }
+        if (OMNI_JIT && compiled == 0) return "no loop was compiled";
+        return "";
+    }
+
+    // Batch runs go through pooled VMs, whose output ring does not grow
+    std::string checkLargeBatchOutput(ExecMode mode) {
+        BatchJob job;
+        job.source = "int main() { for (int i = 0; i < 20000; i++) printf(\"line %d\\n\", i); return 0; }\n";
+        job.options.mode = mode;
+        std::string expected;
+        for (int i = 0; i < 20000; i++) expected += "line " + std::to_string(i) + "\n";
+        // One printf("%s") of a string several rings long
+        BatchJob big;
+        big.source = "char s[300002];\n"
+                     "int main() { for (int i = 0; i < 300001; i++) s[i] = 'a' + i % 26; printf(\"%s\", s); return 0; }\n";
+        big.options.mode = mode;
+        std::string bigExpected;
+        for (int i = 0; i < 300001; i++) bigExpected += (char)('a' + i % 26);
+        // The second job of each pair forks from the snapshot the first took
+        std::vector<BatchResult> results = runBatch({job, job, big, big}, 2);
+        for (size_t i = 0; i < results.size(); i++) {
+            const BatchResult& result = results[i];
+            const std::string& want = i < 2 ? expected : bigExpected;
+            if (result.state == RUN_FINISHED && result.output == want && result.dropped == 0) continue;
+            return describe("job %zu: state %d, %zu of %zu bytes, dropped %llu", i, (int)result.state,
+                            result.output.size(), want.size(), (unsigned long long)result.dropped);
+        }
+        return "";
+    }
+
+    // A blocking ring never loses bytes: a reader that consumes in place
+    // gets every one, in order, however much a single write holds back
+    std::string checkBlockedRingLossless(ExecMode) {
+        OutputRing ring(64, OUTPUT_BLOCK);
+        std::string written, got;
+        for (int i = 0; i < 1000; i++) {
+            std::string chunk(1 + (size_t)i * 7 % 500, (char)('a' + i % 26));
+            written += chunk;
+            ring.write(chunk.data(), chunk.size());
+            if (i % 3 == 0) continue;   // Let held bytes pile up between reads
+            while (ring.unread()) {
+                std::string_view part = ring.front();
+                got.append(part.data(), part.size());
+                ring.consume(part.size());
+            }
+        }
+        got += ring.drain();
+        if (got == written && ring.dropped() == 0) return "";
+        return describe("%zu of %zu bytes, dropped %llu", got.size(), written.size(), (unsigned long long)ring.dropped());
+    }
+
+    // The verifier, not the VM, has to catch an entry past the function table
+    std::string checkEntryPointOutOfRange(ExecMode mode) {
+        CompileOptions options;
+        options.mode = mode;
+        Program prog = compileSource("int main() { return 0; }\n", options);
+        prog.entryPoint = 100000;
+        std::string error;
+        if (verifyProgram(prog, &error)) return "verified";
+        VirtualMachine vm;
+        vm.run(prog);
+        if (vm.state() != RUN_ERROR) return "ran";
+        return "";
+    }
+
+    // Forged images: a saved image with one field changed and its payload
+    // checksum redone. The 48-byte header ends with the checksum at 32, and
+    // the META section (entry point first) leads the payload.
+    const size_t IMAGE_HEADER = 48;
+    const size_t IMAGE_CHECKSUM_AT = 32;
+    const size_t IMAGE_ENTRY_POINT_AT = IMAGE_HEADER + 16;
+
+    void reseal(std::vector<uint8_t>& image) {
+        uint64_t sum = fnv1a(image.data() + IMAGE_HEADER, image.size() - IMAGE_HEADER);
+        std::memcpy(image.data() + IMAGE_CHECKSUM_AT, &sum, sizeof(sum));
+    }
+
+    size_t findBytes(const std::vector<uint8_t>& image, const void* bytes, size_t length) {
+        for (size_t at = 0; at + length <= image.size(); at++) {
+            if (std::memcmp(image.data() + at, bytes, length) == 0) return at;
+        }
+        return std::string::npos;
+    }
+
+    // Saves `source`, lets `forge` edit the image, and expects loadImage to
+    // refuse the result while it accepted the original
+    template <typename Forge>
+    std::string checkForgedImage(ExecMode mode, const std::string& source, Forge forge) {
+        CompileOptions options;
+        options.mode = mode;
+        Program prog = compileSource(source, options);
+        std::vector<uint8_t> image = saveImage(prog, source, options);
+        Program loaded;
+        if (!loadImage(image.data(), image.size(), source, options, loaded)) return "original image rejected";
+        std::string problem = forge(prog, image);
+        if (!problem.empty()) return problem;
+        reseal(image);
+        if (loadImage(image.data(), image.size(), source, options, loaded)) return "forged image loaded";
+        return "";
+    }
+
+    // A loaded image runs as the program it was saved from, and saves back
+    // to the same bytes
+    std::string checkImageRoundTrip(ExecMode mode) {
+        for (const Sample& sample : SAMPLES) {
+            for (int level : {0, 2}) {
+                CompileOptions options;
+                options.mode = mode;
+                options.optLevel = level;
+                Program prog = compileSource(sample.source, options);
+                std::vector<uint8_t> image = saveImage(prog, sample.source, options);
+                Program loaded;
+                if (!loadImage(image.data(), image.size(), sample.source, options, loaded)) {
+                    return describe("%s -O%d: image rejected", sample.name, level);
+                }
+                if (saveImage(loaded, sample.source, options) != image) return describe("%s -O%d: saved differently", sample.name, level);
+                VirtualMachine original, restored;
+                original.run(prog);
+                restored.run(loaded);
+                if (restored.state() != original.state() || restored.getOutput() != original.getOutput() ||
+                    restored.getCycles() != original.getCycles()) {
+                    return describe("%s -O%d: printed\n%sin %zu cycles instead of\n%sin %zu", sample.name, level,
+                                    restored.getOutput().c_str(), restored.getCycles(), original.getOutput().c_str(),
+                                    original.getCycles());
+                }
+            }
+        }
+        return "";
+    }
+
+    // Images that are cut short, damaged in transit, or meant for another
+    // source or other options are refused
+    std::string checkImageRejectsDamage(ExecMode mode) {
+        const Sample& sample = SAMPLES[0];
+        CompileOptions options;
+        options.mode = mode;
+        Program prog = compileSource(sample.source, options);
+        const std::vector<uint8_t> image = saveImage(prog, sample.source, options);
+        Program loaded;
+        for (size_t size = 0; size < image.size(); size++) {
+            if (loadImage(image.data(), size, sample.source, options, loaded)) return describe("loaded %zu of %zu bytes", size, image.size());
+        }
+        std::vector<uint8_t> longer = image;
+        longer.push_back(0);
+        if (loadImage(longer.data(), longer.size(), sample.source, options, loaded)) return "loaded with a trailing byte";
+        for (size_t at = 0; at < image.size(); at++) {
+            std::vector<uint8_t> damaged = image;
+            damaged[at] ^= 0x40;
+            if (loadImage(damaged.data(), damaged.size(), sample.source, options, loaded)) return describe("loaded with byte %zu flipped", at);
+        }
+        std::string edited = std::string(sample.source) + "\n";
+        if (loadImage(image.data(), image.size(), edited, options, loaded)) return "loaded for another source";
+        CompileOptions other = options;
+        other.mode = mode == EXEC_STACK ? EXEC_REGISTER : EXEC_STACK;
+        if (loadImage(image.data(), image.size(), sample.source, other, loaded)) return "loaded for the other mode";
+        other = options;
+        other.optLevel = 2;
+        if (loadImage(image.data(), image.size(), sample.source, other, loaded)) return "loaded for another -O level";
+        return "";
+    }
+
+    // snprintf would write through "%n"
+    std::string checkImagePrintfSpec(ExecMode mode) {
+        return checkForgedImage(mode, "int main() { printf(\"%d\\n\", 42); return 0; }\n",
+                                [](const Program&, std::vector<uint8_t>& image) -> std::string {
+            const char stored[] = {2, 0, 0, 0, '%', 'd'};     // Length-prefixed in the strings section
+            size_t at = findBytes(image, stored, sizeof(stored));
+            if (at == std::string::npos) return "spec not found";
+            image[at + 5] = 'n';
+            return "";
+        });
+    }
+
+    std::string checkImageEntryPoint(ExecMode mode) {
+        return checkForgedImage(mode, "int main() { return 0; }\n", [](const Program&, std::vector<uint8_t>& image) {
+            uint32_t entry = 100000;
+            std::memcpy(image.data() + IMAGE_ENTRY_POINT_AT, &entry, sizeof(entry));
+            return std::string();
+        });
+    }
+
+    // R_ARG's slot index would put a store outside the frame stack
+    std::string checkImageArgSlot(ExecMode) {
+        const char* source = "long f(long a) { return a + 1; }\nint main() { printf(\"%d\\n\", f(1)); return 0; }\n";
+        return checkForgedImage(EXEC_REGISTER, source, [](const Program& prog, std::vector<uint8_t>& image) -> std::string {
+            size_t code = findBytes(image, prog.regCode.data(), prog.regCode.size() * sizeof(RegInstr));
+            if (code == std::string::npos) return "register code not found";
+            for (size_t i = 0; i < prog.regCode.size(); i++) {
+                if (prog.regCode[i].op != R_ARG) continue;
+                int32_t slot = -4096;
+                std::memcpy(image.data() + code + i * sizeof(RegInstr) + offsetof(RegInstr, x), &slot, sizeof(slot));
+                return "";
+            }
+            return "no R_ARG";
+        });
+    }
+
+    const Check CHECKS[] = {
+        {"batch-large-output", checkLargeBatchOutput},
+        {"blocked-ring-lossless", checkBlockedRingLossless, false},
+        {"entry-point-out-of-range", checkEntryPointOutOfRange},
+        {"image-round-trip", checkImageRoundTrip},
+        {"image-rejects-damage", checkImageRejectsDamage},
+        {"image-printf-spec-forged", checkImagePrintfSpec},
+        {"image-entry-point-forged", checkImageEntryPoint},
+        {"image-arg-slot-forged", checkImageArgSlot, false},
+        {"opt-levels-agree", checkOptLevelsAgree},
+        {"jit-matches-interpreter", checkJitMatchesInterpreter, false},
+        {"slices-match-run", checkSlicesMatchRun},
+        {"forks-match-run", checkForksMatchRun},
+        {"batch-matches-run", checkBatchMatchesRun},
+        {"pool-lease-resets", checkPoolLeaseResets},
+    };
+
+}
+
+int main() {
+    int failed = 0, total = 0;
+    for (const Case& c : CASES) {
+        for (ExecMode mode : {EXEC_STACK, EXEC_REGISTER}) {
+            total++;
+            if (!runCase(c, mode)) failed++;
+        }
+    }
+    for (const Check& check : CHECKS) {
+        for (ExecMode mode : {EXEC_STACK, EXEC_REGISTER}) {
+            if (!check.perMode && mode != EXEC_STACK) continue;
+            total++;
+            std::string problem;
+            try {
+                problem = check.run(mode);
+            } catch (const std::exception& e) {
+                problem = e.what();
+            }
+            if (problem.empty()) continue;
+            failed++;
+            if (check.perMode) std::printf("FAIL %s (%s): %s\n", check.name, mode == EXEC_STACK ? "stack" : "register", problem.c_str());
+            else std::printf("FAIL %s: %s\n", check.name, problem.c_str());
+        }
+    }
+    std::printf("%d of %d cases passed\n", total - failed, total);
+    return failed ? 1 : 0;
+}